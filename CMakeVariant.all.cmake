@@ -16,6 +16,7 @@ set(PRJ_LIB_VER_PATCH   0)
 
 
 # find external libs
+find_library(EXT_LIB_Z_PATH             "z")
 
 
 # add subdirectories
@@ -71,6 +72,10 @@ set_target_properties(${PRJ_LIB_NAME}_shared PROPERTIES
 set_private_defines(${PRJ_LIB_NAME})
 
 # link libraries
+if(STREAM_WS_DEFLATE)
+    target_link_libraries(${PRJ_LIB_NAME}_static ${EXT_LIB_Z_PATH})
+    target_link_libraries(${PRJ_LIB_NAME}_shared ${EXT_LIB_Z_PATH})
+endif()
 
 # install
 install(TARGETS ${PRJ_LIB_NAME}_static  DESTINATION "lib")
@@ -17,7 +17,9 @@ find_library(EXT_LIB_JSON_PATH          "json-c")
 find_library(EXT_LIB_SSL_PATH           "ssl")
 find_library(EXT_LIB_CRYPTO_PATH        "crypto")
 find_library(EXT_LIB_DL_PATH            "dl")
+find_library(EXT_LIB_PTHREAD_PATH       "pthread")
 find_library(EXT_LIB_CUNIT_PATH         "cunit")
+find_library(EXT_LIB_Z_PATH             "z")
 
 
 # add subdirectories
@@ -61,7 +63,11 @@ target_link_libraries(${PRJ_APP_NAME} ${EXT_LIB_JSON_PATH})
 target_link_libraries(${PRJ_APP_NAME} ${EXT_LIB_SSL_PATH})
 target_link_libraries(${PRJ_APP_NAME} ${EXT_LIB_CRYPTO_PATH})
 target_link_libraries(${PRJ_APP_NAME} ${EXT_LIB_DL_PATH})
+target_link_libraries(${PRJ_APP_NAME} ${EXT_LIB_PTHREAD_PATH})
 target_link_libraries(${PRJ_APP_NAME} ${EXT_LIB_CUNIT_PATH})
+if(STREAM_WS_DEFLATE)
+    target_link_libraries(${PRJ_APP_NAME} ${EXT_LIB_Z_PATH})
+endif()
 
 
 # install
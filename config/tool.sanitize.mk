@@ -1,7 +1,7 @@
 
 
 SANITIZE_OPTIONS        = -fsanitize=address -fsanitize=undefined
-SANITIZE_EXTRA_OPTIONS  = -fno-sanitize-recover -fno-omit-frame-pointer -fno-optimize-sibling-calls
+SANITIZE_EXTRA_OPTIONS  = -fno-sanitize-recover -fno-omit-frame-pointer -fno-optimize-sibling-calls -DXPOOL_DISABLED=1
 
 
 CMAKE_CFLAGS_OPTIONS   += $(SANITIZE_OPTIONS) $(SANITIZE_EXTRA_OPTIONS)
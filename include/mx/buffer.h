@@ -8,12 +8,32 @@
 
 
 
+#define BUFFER_INLINE_SIZE      32
+
+#ifndef BUFFER_GROWTH_MAX
+#define BUFFER_GROWTH_MAX       (1024*1024)     // Capacity doubles up to this step
+#endif
+
+
+
+/**
+ * Buffer
+ *
+ * Small payloads are kept in the inline storage, memory is allocated
+ * only when data does not fit there. Buffer must not be copied by value.
+ *
+ * In ring mode stored data may wrap around the end of allocated memory,
+ * so only buffer_contiguous_length() bytes are accessible through data.
+ *
+ */
 struct buffer
 {
     unsigned char *alloc;       // Pointer to allocated memory
     unsigned char *data;        // Pointer to data stored in buffer
     size_t length;              // Length of data stored in buffer
     size_t size;                // Allocated memory size
+    bool ring;                  // Data may wrap around
+    unsigned char inline_data[BUFFER_INLINE_SIZE];  // Storage for small payloads
 };
 
 
@@ -23,13 +43,16 @@ struct buffer* buffer_create(size_t size);
 struct buffer* buffer_delete(struct buffer *self);
 
 void buffer_init(struct buffer *self, size_t size);
+void buffer_init_ring(struct buffer *self, size_t size);
 void buffer_clean(struct buffer *self);
 void buffer_copy(struct buffer *self, struct buffer *other);
 
 void buffer_rewind(struct buffer *self);
 size_t buffer_resize(struct buffer *self, size_t size);
+void buffer_linearize(struct buffer *self);
 
 void buffer_append(struct buffer *self, const void *data, size_t len);
+void* buffer_reserve_tail(struct buffer *self, size_t len);
 size_t buffer_take(struct buffer *self, void *data, size_t len);
 
 
@@ -53,11 +76,34 @@ static inline size_t buffer_cut(struct buffer *self, size_t len)
 {
     self->data += len;
     self->length -= len;
+    if (self->ring && self->data >= self->alloc + self->size)
+        self->data -= self->size;
 
     return self->length;
 }
 
 
+/**
+ * Commit data written to the reserved tail
+ *
+ */
+static inline void buffer_commit(struct buffer *self, size_t len)
+{
+    self->length += len;
+}
+
+
+/**
+ * Return length of data accessible directly through data pointer
+ *
+ */
+static inline size_t buffer_contiguous_length(struct buffer *self)
+{
+    size_t tail = self->size - (size_t)(self->data - self->alloc);
+    return self->length < tail ? self->length : tail;
+}
+
+
 /**
  * Check if buffer is empty
  *
@@ -8,6 +8,7 @@
 
 #define STREAM_INCOMING_READY       (0x1 << 0)
 #define STREAM_OUTGOING_READY       (0x1 << 1)
+#define STREAM_TIMER_EXPIRED        (0x1 << 2)
 
 
 
@@ -32,8 +33,10 @@ struct idler* idler_delete(struct idler *self);
 void idler_add_stream(struct idler *self, struct stream *stream);
 void idler_remove_stream(struct idler *self, struct stream *stream);
 struct stream* idler_find_stream(struct idler *self, int fd);
+void idler_update_stream(struct idler *self, struct stream *stream);
 
 int idler_wait(struct idler *self, unsigned long time_ms);
+void idler_wakeup(struct idler *self);
 
 unsigned int idler_get_stream_status(struct idler *self, struct stream *stream);
 
@@ -0,0 +1,88 @@
+#ifndef __MX_IOBUF_H_
+#define __MX_IOBUF_H_
+
+
+#include "mx/queue.h"
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <sys/uio.h>
+
+
+
+#define IOBUF_HEADROOM          16      // Room for headers of lower protocol layers
+
+
+struct iobuf_block;
+
+
+struct iobuf_segment
+{
+    struct iobuf_block *block;  // Reference counted memory which holds the data
+    unsigned char *data;        // Pointer to data stored in segment
+    size_t length;              // Length of data stored in segment
+
+    TAILQ_ENTRY(iobuf_segment) _entry_;
+};
+
+
+/**
+ * Chain of segments
+ *
+ * Segments reference shared memory blocks, so that data may be passed between
+ * chains, split and shared without copying. Chains sharing blocks may be owned
+ * by different threads, single chain must be used by one thread at a time.
+ *
+ */
+struct iobuf
+{
+    TAILQ_HEAD(iobuf_segment_head, iobuf_segment) segments;
+    size_t length;              // Length of data stored in all segments
+    unsigned int count;         // Number of segments
+};
+
+
+
+struct iobuf* iobuf_new(void);
+struct iobuf* iobuf_delete(struct iobuf *self);
+
+void iobuf_init(struct iobuf *self);
+void iobuf_clean(struct iobuf *self);
+
+unsigned char* iobuf_reserve(struct iobuf *self, size_t headroom, size_t length);
+void iobuf_append(struct iobuf *self, const void *data, size_t length);
+void iobuf_prepend(struct iobuf *self, const void *data, size_t length);
+
+void iobuf_share(struct iobuf *self, const struct iobuf *other);
+void iobuf_move(struct iobuf *self, struct iobuf *other);
+void iobuf_split(struct iobuf *self, size_t length, struct iobuf *head);
+size_t iobuf_cut(struct iobuf *self, size_t length);
+
+unsigned char* iobuf_pullup(struct iobuf *self);
+size_t iobuf_peek(const struct iobuf *self, void *data, size_t length);
+int iobuf_get_iovec(const struct iobuf *self, struct iovec *iov, int count);
+
+
+
+/**
+ * Return length of data stored in chain
+ *
+ */
+static inline size_t iobuf_length(const struct iobuf *self)
+{
+    return self->length;
+}
+
+
+/**
+ * Check if chain is empty
+ *
+ */
+static inline bool iobuf_is_empty(const struct iobuf *self)
+{
+    return self->length == 0 ? true : false;
+}
+
+
+
+#endif /* __MX_IOBUF_H_ */
@@ -4,6 +4,7 @@
 
 
 #include <stddef.h>
+#include <pthread.h>
 
 
 void* xfree(void *ptr);
@@ -17,4 +18,43 @@ void* xmemdup(const void *ptr, size_t size);
 void* xmemdupz(const void *ptr, size_t size);
 
 
+
+/**
+ * Pool of fixed size objects
+ *
+ * Objects are carved from slabs which are freed with the pool only. Every
+ * thread keeps a small cache of released objects, so that allocation does
+ * not take the pool lock in the common case. Cache is given back to the pool
+ * when the thread exits.
+ *
+ */
+struct xpool
+{
+    size_t obj_size;
+    int id;                         // Thread cache slot, assigned on first use
+    unsigned int generation;        // Invalidates thread caches of deleted pool
+
+    pthread_mutex_t lock;
+    void *free;                     // Objects returned by threads
+    void *slabs;                    // Allocated memory chunks
+};
+
+
+// Objects hold free list link when released and keep 16 bytes alignment
+#define XPOOL_OBJ_SIZE(size)        ((((size) < sizeof(void*) ? sizeof(void*) : (size)) + 15) & ~(size_t)15)
+
+#define XPOOL_INITIALIZER(size)     { XPOOL_OBJ_SIZE(size), -1, 0, PTHREAD_MUTEX_INITIALIZER, NULL, NULL }
+
+
+
+struct xpool* xpool_new(size_t obj_size);
+struct xpool* xpool_delete(struct xpool *self);
+
+void xpool_init(struct xpool *self, size_t obj_size);
+void xpool_clean(struct xpool *self);
+
+void* xpool_alloc(struct xpool *self);
+void* xpool_free(struct xpool *self, void *ptr);
+
+
 #endif /* __MX_MEMORY_H_ */
@@ -215,6 +215,30 @@ size_t mqtt_eval_subscribe(const char *topic);
 size_t mqtt_format_subscribe(unsigned char *buffer, unsigned short id, const char *topic, unsigned char qos);
 
 
+/**
+ * SUBSCRIBE packet with many topic filters
+ *
+ * Parser only validates the packet, filters are decoded one by one with
+ * mqtt_subscribe_many_next() straight from the received buffer.
+ *
+ */
+struct mqtt_subscribe_many
+{
+    unsigned short id;
+    size_t count;                   // Number of topic filters
+
+    const unsigned char *data;      // Payload with topic filters
+    size_t length;
+    size_t offset;
+};
+
+ssize_t mqtt_parse_subscribe_many(struct mqtt_subscribe_many *payload, const unsigned char *buffer, size_t length);
+bool mqtt_subscribe_many_next(struct mqtt_subscribe_many *payload, struct mqtt_subscribe *entry);
+size_t mqtt_eval_subscribe_many(const char *const *topics, size_t count);
+size_t mqtt_format_subscribe_many(unsigned char *buffer, unsigned short id, const char *const *topics,
+                                                         const unsigned char *qos, size_t count);
+
+
 
 
 
@@ -238,6 +262,18 @@ ssize_t mqtt_parse_suback(struct mqtt_suback *payload, const unsigned char *buff
 size_t mqtt_format_suback(unsigned char *buffer, unsigned short id, unsigned char return_code);
 
 
+struct mqtt_suback_many
+{
+    unsigned short id;
+    const unsigned char *return_codes;  // One return code per topic filter
+    size_t count;
+};
+
+ssize_t mqtt_parse_suback_many(struct mqtt_suback_many *payload, const unsigned char *buffer, size_t length);
+size_t mqtt_eval_suback_many(size_t count);
+size_t mqtt_format_suback_many(unsigned char *buffer, unsigned short id, const unsigned char *return_codes, size_t count);
+
+
 
 
 
@@ -256,6 +292,22 @@ size_t mqtt_eval_unsubscribe(const char *topic);
 size_t mqtt_format_unsubscribe(unsigned char *buffer, unsigned short id, const char *topic);
 
 
+struct mqtt_unsubscribe_many
+{
+    unsigned short id;
+    size_t count;                   // Number of topic filters
+
+    const unsigned char *data;      // Payload with topic filters
+    size_t length;
+    size_t offset;
+};
+
+ssize_t mqtt_parse_unsubscribe_many(struct mqtt_unsubscribe_many *payload, const unsigned char *buffer, size_t length);
+bool mqtt_unsubscribe_many_next(struct mqtt_unsubscribe_many *payload, struct mqtt_unsubscribe *entry);
+size_t mqtt_eval_unsubscribe_many(const char *const *topics, size_t count);
+size_t mqtt_format_unsubscribe_many(unsigned char *buffer, unsigned short id, const char *const *topics, size_t count);
+
+
 
 
 
@@ -0,0 +1,142 @@
+#ifndef __MX_MQTT_SESSION_H_
+#define __MX_MQTT_SESSION_H_
+
+
+#include <stddef.h>
+#include <stdbool.h>
+
+
+
+enum mqtt_session_direction_e
+{
+    MQTT_SESSION_OUTGOING = 0,      // Sent message waiting for acknowledge
+    MQTT_SESSION_INBOUND,           // Received Publish QoS 2 waiting for Pubrel
+};
+
+
+struct mqtt_session_message
+{
+    unsigned char direction;
+    unsigned char type;
+    unsigned char flags;
+    unsigned short id;
+
+    const unsigned char *data;      // Entire frame for outgoing, body for inbound message
+    size_t length;
+};
+
+
+typedef void (*mqtt_session_message_fn)(void *arg, const struct mqtt_session_message *msg);
+typedef void (*mqtt_session_subscription_fn)(void *arg, const char *topic, unsigned short topic_len, unsigned char qos);
+
+
+
+struct mqtt_session_store;
+
+typedef void* (*mqtt_session_destructor_fn)(struct mqtt_session_store *self);
+typedef bool  (*mqtt_session_save_message_fn)(struct mqtt_session_store *self, const char *client_id,
+                                                                               const struct mqtt_session_message *msg);
+typedef bool  (*mqtt_session_remove_message_fn)(struct mqtt_session_store *self, const char *client_id,
+                                                                                 unsigned char direction, unsigned short id);
+typedef bool  (*mqtt_session_save_subscription_fn)(struct mqtt_session_store *self, const char *client_id,
+                                                   const char *topic, unsigned short topic_len, unsigned char qos);
+typedef bool  (*mqtt_session_remove_subscription_fn)(struct mqtt_session_store *self, const char *client_id,
+                                                     const char *topic, unsigned short topic_len);
+typedef bool  (*mqtt_session_clear_fn)(struct mqtt_session_store *self, const char *client_id);
+typedef bool  (*mqtt_session_load_fn)(struct mqtt_session_store *self, const char *client_id,
+                                      mqtt_session_message_fn message_handler,
+                                      mqtt_session_subscription_fn subscription_handler, void *arg);
+typedef int   (*mqtt_session_sync_fn)(struct mqtt_session_store *self);
+
+struct mqtt_session_store_vtable
+{
+    mqtt_session_destructor_fn destructor_fn;
+    mqtt_session_save_message_fn save_message_fn;               // Message with the same direction and id is replaced
+    mqtt_session_remove_message_fn remove_message_fn;
+    mqtt_session_save_subscription_fn save_subscription_fn;     // Subscription with the same topic is replaced
+    mqtt_session_remove_subscription_fn remove_subscription_fn;
+    mqtt_session_clear_fn clear_fn;
+    mqtt_session_load_fn load_fn;                               // Messages are given in order they were saved
+    mqtt_session_sync_fn sync_fn;
+};
+
+
+/**
+ * Session store interface
+ *
+ * Keeps QoS 1/2 state and subscriptions of clients, keyed by client id, so that
+ * session outlives the process. Implementations embed this structure first.
+ *
+ * Client stream saves subscriptions it requests. Stream does not know which
+ * subscriptions a broker grants, so brokers save them with
+ * mqtt_session_store_save_subscription() themselves.
+ *
+ */
+struct mqtt_session_store
+{
+    const struct mqtt_session_store_vtable *vtable;
+};
+
+
+static inline struct mqtt_session_store* mqtt_session_store_delete(struct mqtt_session_store *self) {
+    return self->vtable->destructor_fn(self);
+}
+
+static inline bool mqtt_session_store_save_message(struct mqtt_session_store *self, const char *client_id,
+                                                   const struct mqtt_session_message *msg) {
+    return self->vtable->save_message_fn(self, client_id, msg);
+}
+
+static inline bool mqtt_session_store_remove_message(struct mqtt_session_store *self, const char *client_id,
+                                                     unsigned char direction, unsigned short id) {
+    return self->vtable->remove_message_fn(self, client_id, direction, id);
+}
+
+static inline bool mqtt_session_store_save_subscription(struct mqtt_session_store *self, const char *client_id,
+                                                        const char *topic, unsigned short topic_len, unsigned char qos) {
+    return self->vtable->save_subscription_fn(self, client_id, topic, topic_len, qos);
+}
+
+static inline bool mqtt_session_store_remove_subscription(struct mqtt_session_store *self, const char *client_id,
+                                                          const char *topic, unsigned short topic_len) {
+    return self->vtable->remove_subscription_fn(self, client_id, topic, topic_len);
+}
+
+static inline bool mqtt_session_store_clear(struct mqtt_session_store *self, const char *client_id) {
+    return self->vtable->clear_fn(self, client_id);
+}
+
+static inline bool mqtt_session_store_load(struct mqtt_session_store *self, const char *client_id,
+                                           mqtt_session_message_fn message_handler,
+                                           mqtt_session_subscription_fn subscription_handler, void *arg) {
+    return self->vtable->load_fn(self, client_id, message_handler, subscription_handler, arg);
+}
+
+static inline int mqtt_session_store_sync(struct mqtt_session_store *self) {
+    return self->vtable->sync_fn(self);
+}
+
+
+
+
+
+/**
+ * Session store in memory-mapped append-only log
+ *
+ * Log is not thread safe, streams of different reactor loops must not share
+ * it without external locking.
+ *
+ */
+struct mqtt_session_log;
+
+
+struct mqtt_session_log* mqtt_session_log_new(const char *path);
+struct mqtt_session_log* mqtt_session_log_delete(struct mqtt_session_log *self);
+
+struct mqtt_session_store* mqtt_session_log_to_store(struct mqtt_session_log *self);
+
+bool mqtt_session_log_compact(struct mqtt_session_log *self);
+size_t mqtt_session_log_get_size(struct mqtt_session_log *self);
+
+
+#endif /* __MX_MQTT_SESSION_H_ */
@@ -0,0 +1,68 @@
+#ifndef __MX_MQTT_TRIE_H_
+#define __MX_MQTT_TRIE_H_
+
+
+#include "mx/mqtt.h"
+
+#include <stddef.h>
+#include <stdbool.h>
+
+
+
+#define MQTT_TOPIC_SEPARATOR        '/'
+#define MQTT_TOPIC_SINGLE_LEVEL     '+'
+#define MQTT_TOPIC_MULTI_LEVEL      '#'
+#define MQTT_TOPIC_SYSTEM           '$'
+
+
+
+typedef void (*mqtt_trie_match_fn)(void *subscriber, unsigned char qos, void *arg);
+
+
+struct mqtt_trie_node;
+
+
+/**
+ * Subscription index
+ *
+ * Topic filters are stored level by level, filters with common prefix share
+ * nodes. Matching cost depends on topic depth, not on number of subscriptions.
+ *
+ */
+struct mqtt_trie
+{
+    struct mqtt_trie_node *root;
+    size_t count;                   // Number of subscriptions
+};
+
+
+void mqtt_trie_init(struct mqtt_trie *self);
+void mqtt_trie_clean(struct mqtt_trie *self);
+
+struct mqtt_trie* mqtt_trie_new(void);
+struct mqtt_trie* mqtt_trie_delete(struct mqtt_trie *self);
+
+bool mqtt_trie_insert(struct mqtt_trie *self, const char *filter, unsigned short filter_len,
+                                              void *subscriber, unsigned char qos);
+bool mqtt_trie_remove(struct mqtt_trie *self, const char *filter, unsigned short filter_len, void *subscriber);
+size_t mqtt_trie_remove_subscriber(struct mqtt_trie *self, void *subscriber);
+
+size_t mqtt_trie_match(struct mqtt_trie *self, const char *topic, unsigned short topic_len,
+                                               mqtt_trie_match_fn handler, void *arg);
+
+
+static inline size_t mqtt_trie_match_publish(struct mqtt_trie *self, const struct mqtt_publish *publish,
+                                                                     mqtt_trie_match_fn handler, void *arg) {
+    return mqtt_trie_match(self, publish->topic, publish->topic_len, handler, arg);
+}
+
+static inline size_t mqtt_trie_get_count(struct mqtt_trie *self) {
+    return self->count;
+}
+
+
+bool mqtt_topic_filter_is_valid(const char *filter, unsigned short filter_len);
+bool mqtt_topic_name_is_valid(const char *topic, unsigned short topic_len);
+
+
+#endif /* __MX_MQTT_TRIE_H_ */
@@ -0,0 +1,40 @@
+#ifndef __MX_REACTOR_H_
+#define __MX_REACTOR_H_
+
+
+#include <stddef.h>
+#include <stdbool.h>
+
+
+
+struct reactor;
+struct idler;
+struct stream;
+
+
+typedef void (*reactor_on_accept_clbk)(void *object, struct idler *idler, int fd);
+typedef void (*reactor_on_stream_clbk)(void *object, struct idler *idler, struct stream *stream, unsigned int status);
+typedef void (*reactor_job_fn)(void *object, struct idler *idler);
+
+
+
+struct reactor* reactor_new(unsigned int loops);
+struct reactor* reactor_delete(struct reactor *self);
+
+unsigned int reactor_get_loops(struct reactor *self);
+struct idler* reactor_get_idler(struct reactor *self, unsigned int loop);
+
+void reactor_set_acceptor(struct reactor *self, void *object, reactor_on_accept_clbk handler);
+void reactor_set_handler(struct reactor *self, void *object, reactor_on_stream_clbk handler);
+
+int reactor_listen(struct reactor *self, const char *addr, unsigned int port);
+
+bool reactor_start(struct reactor *self);
+void reactor_stop(struct reactor *self);
+
+// Thread safe functions
+bool reactor_post(struct reactor *self, unsigned int loop, reactor_job_fn job, void *object);
+unsigned int reactor_dispatch(struct reactor *self, int fd);
+
+
+#endif /* __MX_REACTOR_H_ */
@@ -25,6 +25,8 @@ enum stream_status_e
 
 struct stream;
 struct observer;
+struct iobuf;
+struct buffer;
 
 
 typedef int (*stream_on_ready_clbk)(void *object, struct stream *stream);
@@ -42,6 +44,14 @@ int stream_get_status(struct stream *self);
 void stream_set_observer(struct stream *self, void *object, stream_on_ready_clbk handler);
 void stream_remove_observer(struct stream *self);
 
+void stream_set_inbound_watermarks(struct stream *self, size_t low, size_t high);
+void stream_set_outbound_watermarks(struct stream *self, size_t low, size_t high);
+bool stream_is_read_paused(struct stream *self);
+bool stream_is_writable(struct stream *self);
+size_t stream_get_outgoing_length(struct stream *self);
+
+void stream_set_ring_io(struct stream *self, bool enabled);
+
 bool stream_has_outgoing_data(struct stream *self);
 void stream_reset_outgoing_data(struct stream *self);
 int stream_handle_outgoing_data(struct stream *self);
@@ -50,13 +60,16 @@ int stream_handle_incoming_data(struct stream *self);
 
 // Virtual functions
 ssize_t stream_read(struct stream *self, void *buffer, size_t length);
+ssize_t stream_read_buffer(struct stream *self, struct buffer *buffer, size_t length);
 ssize_t stream_write(struct stream *self, const void *buffer, size_t length);
+ssize_t stream_write_iobuf(struct stream *self, struct iobuf *data);
 int     stream_flush(struct stream *self);
 int     stream_time(struct stream *self);
 
 // Non-virtual functions
 ssize_t stream_do_read(struct stream *self, void *buffer, size_t length);
 ssize_t stream_do_write(struct stream *self, const void *buffer, size_t length);
+ssize_t stream_do_write_iobuf(struct stream *self, struct iobuf *data);
 int     stream_do_flush(struct stream *self);
 int     stream_do_time(struct stream *self);
 
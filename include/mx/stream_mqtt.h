@@ -5,6 +5,7 @@
 
 #include "mx/stream.h"
 #include "mx/mqtt.h"
+#include "mx/mqtt_session.h"
 
 #include <stdbool.h>
 
@@ -14,6 +15,7 @@ struct stream_mqtt;
 
 
 typedef int (*stream_on_mqtt_msg_received_clbk)(void *object, struct stream_mqtt *stream, unsigned char type, unsigned char flags, void *msg);
+typedef void (*stream_on_mqtt_publish_ready_clbk)(void *object, struct stream_mqtt *stream);
 
 
 
@@ -36,18 +38,33 @@ static inline int stream_mqtt_get_status(struct stream_mqtt *self) {
 }
 
 void stream_mqtt_set_observer(struct stream_mqtt *self, void *object, stream_on_mqtt_msg_received_clbk handler);
+void stream_mqtt_set_many_observer(struct stream_mqtt *self, void *object, stream_on_mqtt_msg_received_clbk handler);
 void stream_mqtt_remove_observer(struct stream_mqtt *self);
 
+void stream_mqtt_set_publish_observer(struct stream_mqtt *self, void *object, stream_on_mqtt_publish_ready_clbk handler);
+void stream_mqtt_remove_publish_observer(struct stream_mqtt *self);
+
+void stream_mqtt_set_inflight_window(struct stream_mqtt *self, unsigned int window);
+bool stream_mqtt_can_publish(struct stream_mqtt *self);
+
+void stream_mqtt_set_session(struct stream_mqtt *self, struct mqtt_session_store *store, const char *client_id);
+bool stream_mqtt_restore_session(struct stream_mqtt *self, mqtt_session_subscription_fn subscription_handler, void *arg);
+
 
 
 ssize_t stream_mqtt_peek_frame(struct stream_mqtt *self);
 ssize_t stream_mqtt_read_frame(struct stream_mqtt *self, unsigned char *type, unsigned char *flags,
                                                       void *buffer, size_t length);
+ssize_t stream_mqtt_borrow_frame(struct stream_mqtt *self, unsigned char *type, unsigned char *flags,
+                                                         const void **data);
+void    stream_mqtt_release_frame(struct stream_mqtt *self);
 ssize_t stream_mqtt_write_frame(struct stream_mqtt *self, unsigned char type, unsigned char flags,
                                                       const void *buffer, size_t length);
 
 ssize_t stream_mqtt_write_frame_packet_id(struct stream_mqtt *self, unsigned char type, unsigned short id);
 
+unsigned short stream_mqtt_next_packet_id(struct stream_mqtt *self);
+
 
 
 ssize_t stream_mqtt_connect(struct stream_mqtt *self, bool clean_session, unsigned short keep_alive, const char *client_id,
@@ -78,10 +95,14 @@ static inline ssize_t stream_mqtt_pubcomp(struct stream_mqtt *self, unsigned sho
 
 
 ssize_t stream_mqtt_subscribe(struct stream_mqtt *self, unsigned short id, const char *topic, unsigned char qos);
+ssize_t stream_mqtt_subscribe_many(struct stream_mqtt *self, unsigned short id, const char *const *topics,
+                                                             const unsigned char *qos, size_t count);
 
 ssize_t stream_mqtt_suback(struct stream_mqtt *self, unsigned short id, unsigned char return_code);
+ssize_t stream_mqtt_suback_many(struct stream_mqtt *self, unsigned short id, const unsigned char *return_codes, size_t count);
 
 ssize_t stream_mqtt_unsubscribe(struct stream_mqtt *self, unsigned short id, const char *topic);
+ssize_t stream_mqtt_unsubscribe_many(struct stream_mqtt *self, unsigned short id, const char *const *topics, size_t count);
 
 static inline ssize_t stream_mqtt_unsuback(struct stream_mqtt *self, unsigned short id) {
     return stream_mqtt_write_frame_packet_id(self, MQTT_UNSUBACK, id);
@@ -37,8 +37,10 @@ static inline ssize_t stream_ws_write(struct stream_ws *self, const void *buffer
 // Non-virtual functions
 ssize_t stream_ws_do_read(struct stream_ws *self, void *buffer, size_t length);
 ssize_t stream_ws_do_write(struct stream_ws *self, const void *buffer, size_t length);
+ssize_t stream_ws_do_write_iobuf(struct stream_ws *self, struct iobuf *data);
 
 
+void stream_ws_set_deflate(struct stream_ws *self, const struct ws_deflate_params *params);
 void stream_ws_connect(struct stream_ws *self, const char *uri, const char *key, const char *header);
 void stream_ws_disconnect(struct stream_ws *self, unsigned short code);
 
@@ -46,8 +48,22 @@ void stream_ws_disconnect(struct stream_ws *self, unsigned short code);
 ssize_t stream_ws_peek_frame(struct stream_ws *self);
 ssize_t stream_ws_read_frame(struct stream_ws *self, unsigned char *fin, unsigned char *opcode,
                                                       void *buffer, size_t length);
+ssize_t stream_ws_read_chunk(struct stream_ws *self, unsigned char *fin, unsigned char *opcode,
+                                                     void *buffer, size_t length);
+ssize_t stream_ws_borrow_frame(struct stream_ws *self, unsigned char *fin, unsigned char *opcode,
+                                                       const void **data);
+void    stream_ws_release_frame(struct stream_ws *self);
 ssize_t stream_ws_write_frame(struct stream_ws *self, unsigned char fin, unsigned char opcode,
                                                       const unsigned char *mask,
                                                       const void *buffer, size_t length);
+ssize_t stream_ws_write_frame_iobuf(struct stream_ws *self, unsigned char fin, unsigned char opcode,
+                                                            const unsigned char *mask,
+                                                            struct iobuf *data);
+
+void    stream_ws_set_max_message_size(struct stream_ws *self, size_t size);
+void    stream_ws_set_fragment_size(struct stream_ws *self, size_t size);
+int     stream_ws_begin_message(struct stream_ws *self, unsigned char opcode);
+ssize_t stream_ws_write_fragment(struct stream_ws *self, const void *buffer, size_t length);
+ssize_t stream_ws_end_message(struct stream_ws *self, const void *buffer, size_t length);
 
 #endif /* __MX_STREAM_SSL_H_ */
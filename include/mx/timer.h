@@ -92,6 +92,19 @@ static inline time_t timer_remaining(struct timer *self)
 }
 
 
+static inline time_t timer_deadline(struct timer *self)
+{
+    if (self->interval == 0)
+        return 0;
+
+    time_t remaining = timer_remaining(self);
+    if (self->flags & (TIMER_SEC | TIMER_CHRONO))
+        remaining *= 1000;
+
+    return clock_get_milis() + remaining;
+}
+
+
 static inline bool timer_expired(struct timer *self)
 {
     if (self->interval == 0)
@@ -5,6 +5,7 @@
 
 #include <stddef.h>
 #include <stdbool.h>
+#include <sys/uio.h>
 
 
 #define WS_FIN_OPCODE_IDX       0
@@ -18,13 +19,16 @@
 #define WS_EXTLEN64_SIZE        8
 #define WS_MIN_HEADER_SIZE      (WS_FLAGS_SIZE)
 #define WS_MAX_HEADER_SIZE      (WS_FLAGS_SIZE + WS_EXTLEN64_SIZE + WS_MASK_SIZE)
+#define WS_MAX_CONTROL_PAYLOAD  125
 
 #define WS_EXTLEN16_MARK        126
 #define WS_EXTLEN64_MARK        127
 
 #define WS_FIN_FLAG             0x80
+#define WS_RSV1_FLAG            0x40
 #define WS_MASK_FLAG            0x80
 #define WS_OPCODE_MSK           0x0F
+#define WS_OPCODE_CONTROL_MSK   0x08
 #define WS_PAYLOAD_LEN_MSK      0x7F
 
 #define WS_OPCODE_CONTINUE      0x0
@@ -46,6 +50,10 @@
 #define WS_CLOSE_MESSAGE_TOO_BIG    1009
 #define WS_CLOSE_UNEXPECTED_ERROR   1011
 
+#define WS_DEFLATE_EXTENSION        "permessage-deflate"
+#define WS_DEFLATE_MIN_WINDOW_BITS  9
+#define WS_DEFLATE_MAX_WINDOW_BITS  15
+
 
 
 
@@ -55,6 +63,7 @@
 struct ws_frame
 {
     unsigned char fin_flag;
+    unsigned char rsv1_flag;
     unsigned char opcode;
     unsigned char mask_flag;
     size_t payload_length;
@@ -64,11 +73,87 @@ struct ws_frame
 };
 
 
+/**
+ * Parameters of permessage-deflate extension (RFC 7692)
+ *
+ * Window bits equal to 0 mean that parameter is not present.
+ *
+ */
+struct ws_deflate_params
+{
+    bool server_no_context_takeover;
+    bool client_no_context_takeover;
+    int server_max_window_bits;
+    int client_max_window_bits;
+    int mem_level;                  // zlib memory level of compressor, 1..9, not negotiated
+};
+
+
+enum ws_parser_event_e
+{
+    WS_PARSER_NONE,         // More data is needed
+    WS_PARSER_HEADER,       // Frame header parsed
+    WS_PARSER_PAYLOAD,      // Chunk of payload received
+    WS_PARSER_FRAME_END,    // Whole frame received
+    WS_PARSER_ERROR,        // Frame must not be accepted, see event close code
+};
+
+
+enum ws_parser_state_e
+{
+    WS_PARSER_ST_HEADER,
+    WS_PARSER_ST_PAYLOAD,
+    WS_PARSER_ST_END,
+    WS_PARSER_ST_ERROR,
+};
+
+
+struct ws_parser_event
+{
+    int type;
+    unsigned char *data;
+    size_t length;
+    unsigned short code;                        // Close code of WS_PARSER_ERROR
+};
+
+
+/**
+ * Incremental frame parser
+ *
+ * Header is collected internally, payload is handed out in chunks as it arrives.
+ *
+ */
+struct ws_parser
+{
+    int state;
+    struct ws_frame frame;                      // Header of the frame being parsed
+
+    unsigned char header[WS_MAX_HEADER_SIZE];
+    size_t header_length;                       // Header bytes collected so far
+    unsigned char mask[WS_MASK_SIZE];
+    size_t payload_received;                    // Payload bytes handed out so far
+    size_t max_payload;                         // Longer frames are refused, 0 if unlimited
+};
+
+
 
 void ws_apply_mask(unsigned char *data, size_t length, const unsigned char *mask);
+size_t ws_apply_mask_offset(unsigned char *data, size_t length, const unsigned char *mask, size_t offset);
+size_t ws_copy_mask(unsigned char *dst, const unsigned char *src, size_t length, const unsigned char *mask, size_t offset);
 
+bool ws_parse_frame_header(struct ws_frame *frame, const unsigned char *data, size_t length, size_t *header_length);
 bool ws_parse_frame(struct ws_frame *frame, const unsigned char *data, size_t length, size_t *frame_length);
+
+void ws_parser_init(struct ws_parser *self);
+size_t ws_parser_execute(struct ws_parser *self, unsigned char *data, size_t length, struct ws_parser_event *event);
+size_t ws_format_frame_header(unsigned char *buffer, unsigned char flags, const unsigned char *mask, size_t length);
 size_t ws_format_frame(unsigned char *buffer, unsigned char flags, const unsigned char *mask, const unsigned char *data, size_t length);
+int ws_format_frame_iovec(struct iovec *iov, unsigned char *header, unsigned char *scratch,
+                          unsigned char flags, const unsigned char *mask, const unsigned char *data, size_t length);
+
+void ws_deflate_params_init(struct ws_deflate_params *params);
+bool ws_deflate_parse_params(struct ws_deflate_params *params, const char *extensions);
+size_t ws_deflate_format_params(const struct ws_deflate_params *params, char *buffer, size_t length);
 
 bool ws_calculate_accept_key(char *reqkey, size_t reqkey_len, char *buffer, size_t length);
 
@@ -53,10 +53,28 @@ struct buffer* buffer_delete(struct buffer *self)
  */
 void buffer_init(struct buffer *self, size_t size)
 {
-    self->size = size;
-    self->alloc = xmalloc(self->size);
+    if (size <= BUFFER_INLINE_SIZE) {
+        self->size = BUFFER_INLINE_SIZE;
+        self->alloc = self->inline_data;
+    }
+    else {
+        self->size = size;
+        self->alloc = xmalloc(self->size);
+    }
     self->data = self->alloc;
     self->length = 0;
+    self->ring = false;
+}
+
+
+/**
+ * Initialize buffer in ring mode
+ *
+ */
+void buffer_init_ring(struct buffer *self, size_t size)
+{
+    buffer_init(self, size);
+    self->ring = true;
 }
 
 
@@ -66,23 +84,84 @@ void buffer_init(struct buffer *self, size_t size)
  */
 void buffer_clean(struct buffer *self)
 {
-    if (self->alloc)
-        self->alloc = xfree(self->alloc);
+    if (self->alloc != self->inline_data)
+        xfree(self->alloc);
 
+    self->alloc = NULL;
     self->data = NULL;
     self->size = 0;
     self->length = 0;
 }
 
 
+/**
+ * Copy stored data to the given memory, data is not removed from the buffer
+ *
+ */
+static void buffer_peek(struct buffer *self, void *data, size_t len)
+{
+    size_t first = MIN(len, buffer_contiguous_length(self));
+    memcpy(data, self->data, first);
+    if (first < len)
+        memcpy((unsigned char*)data + first, self->alloc, len - first);
+}
+
+
+/**
+ * Move data to newly allocated memory of given size
+ *
+ * Only stored data is copied, so data lands at the beginning.
+ *
+ */
+static void buffer_realloc(struct buffer *self, size_t size)
+{
+    unsigned char *alloc;
+    if (self->alloc == self->inline_data || self->ring) {
+        alloc = xmalloc(size);
+        buffer_peek(self, alloc, self->length);
+        if (self->alloc != self->inline_data)
+            xfree(self->alloc);
+    }
+    else {
+        if (self->alloc != self->data && self->length)
+            memmove(self->alloc, self->data, self->length);
+        alloc = xrealloc(self->alloc, size);
+    }
+
+    self->alloc = alloc;
+    self->data = alloc;
+    self->size = size;
+}
+
+
+/**
+ * Calculate new size for the buffer
+ *
+ * Capacity doubles, but never grows by more than BUFFER_GROWTH_MAX at once,
+ * so appending many small chunks causes reallocation only now and then.
+ *
+ */
+static size_t buffer_grow_size(size_t size, size_t expected_size)
+{
+    if (size < BUFFER_INITIAL_SIZE)
+        size = BUFFER_INITIAL_SIZE;
+
+    while (size < expected_size)
+        size += MIN(size, BUFFER_GROWTH_MAX);
+
+    return size;
+}
+
+
 /**
  * Copy buffer
  *
  */
 void buffer_copy(struct buffer *self, struct buffer *other)
 {
+    buffer_reset(self);
     buffer_resize(self, other->length);
-    memcpy(self->data, other->data, other->length);
+    buffer_peek(other, self->data, other->length);
     self->length = other->length;
 }
 
@@ -94,6 +173,10 @@ void buffer_copy(struct buffer *self, struct buffer *other)
 void buffer_rewind(struct buffer *self)
 {
     if (self->alloc != self->data) {
+        if (buffer_contiguous_length(self) < self->length) {
+            buffer_linearize(self);
+            return;
+        }
         if (self->length)
             memmove(self->alloc, self->data, self->length);
         self->data = self->alloc;
@@ -101,20 +184,47 @@ void buffer_rewind(struct buffer *self)
 }
 
 
+/**
+ * Make stored data contiguous
+ *
+ * Data in ring mode may wrap around, parsers which need the whole
+ * data accessible through data pointer should call it first.
+ *
+ */
+void buffer_linearize(struct buffer *self)
+{
+    if (buffer_contiguous_length(self) < self->length)
+        buffer_realloc(self, self->size);
+}
+
+
 /**
  * Make sure buffer is long enough to store given size of data
  *
+ * Data is moved to the beginning only if there is no room left at the end,
+ * which in linear mode keeps memmove cost amortized. Ring buffer only grows.
+ *
  */
 size_t buffer_resize(struct buffer *self, size_t size)
 {
-    buffer_rewind(self);
-
     size_t expected_size = self->length + size;
+
+    if (self->ring) {
+        if (self->size < expected_size)
+            buffer_realloc(self, buffer_grow_size(self->size, expected_size));
+        return self->size;
+    }
+
+    size_t tail = self->size - (size_t)(self->data - self->alloc) - self->length;
+    if (tail >= size)
+        return self->size;
+
     if (self->size < expected_size) {
         // Resizing needed
-        self->size = expected_size;
-        self->alloc = xrealloc(self->alloc, self->size);
-        self->data = self->alloc;
+        buffer_realloc(self, buffer_grow_size(self->size, expected_size));
+    }
+    else {
+        buffer_rewind(self);
     }
     return self->size;
 }
@@ -127,11 +237,49 @@ size_t buffer_resize(struct buffer *self, size_t size)
 void buffer_append(struct buffer *self, const void *data, size_t len)
 {
     buffer_resize(self, len);
-    memcpy(self->data + self->length, data, len);
+
+    unsigned char *tail = self->data + self->length;
+    if (self->ring) {
+        size_t offset = (size_t)(self->data - self->alloc) + self->length;
+        if (offset >= self->size)
+            offset -= self->size;
+        tail = self->alloc + offset;
+
+        size_t first = MIN(len, self->size - offset);
+        memcpy(tail, data, first);
+        if (first < len)
+            memcpy(self->alloc, (const unsigned char*)data + first, len - first);
+    }
+    else {
+        memcpy(tail, data, len);
+    }
     self->length += len;
 }
 
 
+/**
+ * Reserve room for given size of data at the end of the buffer
+ *
+ * Data may be written directly to the returned memory and then
+ * made part of the buffer with buffer_commit().
+ *
+ */
+void* buffer_reserve_tail(struct buffer *self, size_t len)
+{
+    buffer_resize(self, len);
+
+    if (self->ring) {
+        // Reserved memory must be contiguous
+        buffer_linearize(self);
+        size_t tail = self->size - (size_t)(self->data - self->alloc) - self->length;
+        if (tail < len)
+            buffer_rewind(self);
+    }
+
+    return self->data + self->length;
+}
+
+
 /**
  * Take data from the buffer
  *
@@ -140,7 +288,7 @@ size_t buffer_take(struct buffer *self, void *data, size_t len)
 {
     size_t chunk_len = MIN(self->length, len);
     if (chunk_len > 0) {
-        memcpy(data, self->data, chunk_len);
+        buffer_peek(self, data, chunk_len);
         buffer_cut(self, chunk_len);
     }
     return chunk_len;
@@ -12,6 +12,10 @@
 #define HTTP_WHITESPACE_CHARS   " \t"
 
 
+
+static struct xpool http_header_pool = XPOOL_INITIALIZER(sizeof(struct http_header));
+
+
 #define HTTP_REQ_LINE_FMT       "%s %s %s\r\n"      // METHOD   URI     VERSION
 #define HTTP_RESP_LINE_FMT      "%s %u %s\r\n"      // VERSION  STATUS  REASON
 #define HTTP_HEADER_LINE_FMT    "%s: %s\r\n"        // NAME: VALUE
@@ -107,7 +111,7 @@ const char* http_header_find(const char *headers, const char *name, const char *
 
 struct http_header* http_header_new(const char *name, const char *value)
 {
-    struct http_header *self = xmalloc(sizeof(struct http_header));
+    struct http_header *self = xpool_alloc(&http_header_pool);
 
     self->name = xstrdup(name);
     self->value = value ? xstrdup(value) : NULL;
@@ -123,7 +127,7 @@ struct http_header* http_header_delete(struct http_header *self)
     if (self->value)
         self->value = xfree(self->value);
 
-    return xfree(self);
+    return xpool_free(&http_header_pool, self);
 }
 
 
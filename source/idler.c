@@ -1,6 +1,4 @@
 
-
-
 #include "mx/idler.h"
 #include "mx/stream.h"
 
@@ -8,12 +6,20 @@
 #include "mx/memory.h"
 #include "mx/queue.h"
 #include "mx/misc.h"
+#include "mx/timer.h"
 
 #include "private_stream.h"
 
+#if IDLER_IO_URING
+  #include "private_uring.h"
+#endif
+
 #include <errno.h>
 #include <stdlib.h>
-#include <sys/select.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
 #include <time.h>
 
 #include <stdio.h>
@@ -22,19 +28,752 @@
 
 
 
+#define IDLER_INITIAL_EVENTS        16
+
+#if IDLER_IO_URING
+  #define IDLER_URING_ENTRIES       256
+  #define IDLER_URING_BUFFERS       64              // Provided buffers shared by ring streams
+  #define IDLER_URING_BUFFER_SIZE   16384
+  #define IDLER_URING_GROUP         0
+  #define IDLER_URING_IGNORE        ((__u64)-1)     // Completion of poll removal
+  #define IDLER_URING_WAKEUP        ((__u64)-2)     // Completion of wakeup event poll
+#endif
+
 
 
 
 struct idler
 {
-    fd_set read_fds;
-    fd_set write_fds;
+#if IDLER_IO_URING
+    struct uring ring;
+    unsigned int token;             // Last used request token
+    struct uring_buffers buffers;   // Receive buffers of ring streams
+    bool buffers_ready;
+    bool woken_up;                  // Wakeup event completed since the last wait
+#else
+    int epoll_fd;
+    struct epoll_event *events;     // Events reported by epoll
+#endif
+    int wakeup_fd;                  // Event used to interrupt wait from other threads
+
+    struct stream **ready;          // Streams reported by the last wait
+    int ready_size;
+    int ready_count;
+    int ready_idx;                  // Iterator position
+
+    struct stream **fds;            // Streams indexed by file descriptor
+    int fds_size;
+
+    struct stream **heap;           // Streams ordered by deadline, earliest first
+    unsigned int heap_count;
 
+    unsigned int streams_count;
     LIST_HEAD(stream_head, stream) streams;
 };
 
 
 
+/**
+ * Report stream with given status by the current wait
+ *
+ */
+static void idler_mark_ready(struct idler *self, struct stream *stream, unsigned int status)
+{
+    if (!stream->idler_status) {
+        // Registered streams never exceed ready list size, see idler_add_stream()
+        self->ready[self->ready_count++] = stream;
+    }
+    stream->idler_status |= status;
+}
+
+
+/**
+ * Translate poll events into stream status
+ *
+ */
+static unsigned int idler_events_status(unsigned int events)
+{
+    unsigned int status = 0;
+    if (events & POLLOUT)
+        status |= STREAM_OUTGOING_READY;
+    if (events & (POLLIN | POLLHUP | POLLERR))
+        status |= STREAM_INCOMING_READY;    // Error is reported by read
+
+    return status;
+}
+
+
+#if IDLER_IO_URING
+
+/**
+ * io_uring backend
+ *
+ * Streams are watched with one shot poll requests, re-armed before the next
+ * wait, which keeps level triggered semantics of epoll. Registration changes
+ * are only queued, they are submitted together with the wait by single
+ * io_uring_enter() call. Requests are identified by file descriptor and token,
+ * so that completions of removed streams are recognized and dropped.
+ *
+ * Streams which requested ring I/O, see stream_set_ring_io(), get receive
+ * requests selecting provided buffers and send requests of their queues
+ * instead of polls. Received data is copied into the stream and the buffer
+ * is given back immediately, so that few buffers serve all streams.
+ *
+ */
+
+static inline unsigned int idler_uring_token(struct idler *self)
+{
+    if (++self->token == 0)
+        self->token = 1;    // Zero means not armed
+
+    return self->token;
+}
+
+
+static inline __u64 idler_uring_data(struct stream *stream, unsigned int token)
+{
+    return ((__u64)token << 32) | (unsigned int)stream_get_fd(stream);
+}
+
+
+/**
+ * Return the stream which owns the descriptor
+ *
+ */
+static struct stream* idler_stream_base(struct stream *stream)
+{
+    while (stream->decorated)
+        stream = stream->decorated;
+
+    return stream;
+}
+
+
+/**
+ * Return ring I/O state of registered stream, NULL if not requested
+ *
+ */
+static inline struct stream_ring* idler_stream_ring(struct stream *stream)
+{
+    return idler_stream_base(stream)->ring;
+}
+
+
+static void idler_uring_poll_add(struct idler *self, int fd, unsigned int events, __u64 data)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(&self->ring);
+    if (!sqe) {
+        WARN("Idler could not register %d fd", fd);
+        return;
+    }
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = events;
+    sqe->user_data = data;
+}
+
+
+static void idler_uring_poll_remove(struct idler *self, __u64 data)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(&self->ring);
+    if (!sqe)
+        return;     // Completion is dropped anyway
+
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = data;
+    sqe->user_data = IDLER_URING_IGNORE;
+}
+
+
+static void idler_uring_cancel(struct idler *self, __u64 data)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(&self->ring);
+    if (!sqe)
+        return;
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = data;
+    sqe->user_data = IDLER_URING_IGNORE;
+}
+
+
+/**
+ * Submit receive request, kernel selects the buffer when data arrives
+ *
+ */
+static void idler_uring_recv(struct idler *self, struct stream *stream, struct stream_ring *ring)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(&self->ring);
+    if (!sqe) {
+        WARN("Idler could not receive from %d fd", stream_get_fd(stream));
+        return;
+    }
+
+    ring->read_token = idler_uring_token(self);
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = stream_get_fd(stream);
+    sqe->len = self->buffers.size;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = self->buffers.group;
+    sqe->user_data = idler_uring_data(stream, ring->read_token);
+}
+
+
+/**
+ * Submit send request of the queue of the stream which owns the descriptor
+ *
+ * Queued data is moved aside until the request completes, the stream keeps
+ * queuing new data meanwhile.
+ *
+ */
+static void idler_uring_send(struct idler *self, struct stream *stream, struct stream_ring *ring)
+{
+    struct stream *base = idler_stream_base(stream);
+    if (ring->write_token || ring->error || iobuf_is_empty(&base->outgoing))
+        return;
+
+    struct io_uring_sqe *sqe = uring_get_sqe(&self->ring);
+    if (!sqe) {
+        WARN("Idler could not send to %d fd", stream_get_fd(stream));
+        return;
+    }
+
+    int count = iobuf_get_iovec(&base->outgoing, ring->iov, STREAM_RING_IOV);
+    size_t length = 0;
+    for (int i = 0; i < count; i++)
+        length += ring->iov[i].iov_len;
+
+    // Vector still describes the same memory, segments only change the chain
+    iobuf_split(&base->outgoing, length, &ring->inflight);
+
+    memset(&ring->msg, 0, sizeof(ring->msg));
+    ring->msg.msg_iov = ring->iov;
+    ring->msg.msg_iovlen = count;
+    ring->write_token = idler_uring_token(self);
+
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = stream_get_fd(stream);
+    sqe->addr = (unsigned long)&ring->msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = idler_uring_data(stream, ring->write_token);
+}
+
+
+/**
+ * Submit ring requests the stream needs
+ *
+ * Data which was received but not read yet is reported again with
+ * 'level' set, like epoll does.
+ *
+ */
+static void idler_uring_ring_arm(struct idler *self, struct stream *stream, unsigned int events, bool level)
+{
+    struct stream_ring *ring = idler_stream_ring(stream);
+    if (!ring || !ring->active)
+        return;
+
+    if (events & POLLIN) {
+        if (!iobuf_is_empty(&ring->inbound) || ring->eof || ring->error) {
+            if (level)
+                idler_mark_ready(self, stream, STREAM_INCOMING_READY);
+        }
+        else if (!ring->read_token) {
+            idler_uring_recv(self, stream, ring);
+        }
+    }
+
+    idler_uring_send(self, stream, ring);
+}
+
+
+static void idler_backend_arm(struct idler *self, struct stream *stream, unsigned int events)
+{
+    struct stream_ring *ring = idler_stream_ring(stream);
+    if (ring && ring->active) {
+        // Ring requests read and write, poll only tells when decorators may push data
+        struct stream *base = idler_stream_base(stream);
+        if (ring->write_token || !iobuf_is_empty(&base->outgoing))
+            events = 0;
+        events &= POLLOUT;
+    }
+
+    if (!events) {
+        stream->idler_token = 0;
+        return;
+    }
+
+    stream->idler_token = idler_uring_token(self);
+    idler_uring_poll_add(self, stream_get_fd(stream), events, idler_uring_data(stream, stream->idler_token));
+}
+
+
+static void idler_uring_process(struct idler *self);
+
+
+/**
+ * Start ring I/O of registered stream
+ *
+ */
+static void idler_uring_ring_start(struct idler *self, struct stream *stream, unsigned int events)
+{
+    struct stream_ring *ring = idler_stream_ring(stream);
+
+    struct stat st;
+    if (!self->buffers_ready || (fstat(stream_get_fd(stream), &st) < 0) || !S_ISSOCK(st.st_mode)) {
+        WARN("Idler could not start ring I/O of %d fd", stream_get_fd(stream));
+        ring->enabled = false;
+        return;
+    }
+
+    ring->active = true;
+    idler_uring_ring_arm(self, stream, events, false);
+}
+
+
+/**
+ * Stop ring I/O of registered stream
+ *
+ * Pending requests reference the stream, they are cancelled and waited for.
+ * Data received meanwhile is kept and unsent data is returned to the queue.
+ *
+ */
+static void idler_uring_ring_stop(struct idler *self, struct stream *stream)
+{
+    struct stream_ring *ring = idler_stream_ring(stream);
+    ring->active = false;
+
+    if (ring->read_token)
+        idler_uring_cancel(self, idler_uring_data(stream, ring->read_token));
+    if (ring->write_token)
+        idler_uring_cancel(self, idler_uring_data(stream, ring->write_token));
+
+    while (ring->read_token || ring->write_token) {
+        int ret = uring_submit_and_wait(&self->ring, 1000);
+        if ((ret < 0) && (ret != -ETIME) && (ret != -EINTR)) {
+            ERROR("Idler could not cancel ring I/O of %d fd", stream_get_fd(stream));
+            break;
+        }
+
+        idler_uring_process(self);
+    }
+}
+
+
+/**
+ * Start or stop ring I/O on request and submit what is needed
+ *
+ */
+static void idler_backend_sync(struct idler *self, struct stream *stream)
+{
+    struct stream_ring *ring = idler_stream_ring(stream);
+    if (!ring)
+        return;
+
+    if (ring->enabled && !ring->active) {
+        idler_uring_ring_start(self, stream, stream->idler_events);
+    }
+    else if (!ring->enabled && ring->active) {
+        idler_uring_ring_stop(self, stream);
+
+        // Stream is not in ready list, poll is re-armed with all events now
+        if (stream->idler_token)
+            idler_uring_poll_remove(self, idler_uring_data(stream, stream->idler_token));
+        idler_backend_arm(self, stream, stream->idler_events);
+    }
+    else
+        idler_uring_ring_arm(self, stream, stream->idler_events, false);
+}
+
+
+static void idler_backend_init(struct idler *self)
+{
+    if (!uring_init(&self->ring, IDLER_URING_ENTRIES))
+        RESET("Could not create io_uring instance");
+    self->token = 0;
+    self->woken_up = false;
+
+    // Streams fall back to polls if kernel does not support buffer rings
+    self->buffers_ready = uring_buffers_init(&self->buffers, &self->ring, IDLER_URING_GROUP,
+                                             IDLER_URING_BUFFERS, IDLER_URING_BUFFER_SIZE);
+
+    idler_uring_poll_add(self, self->wakeup_fd, POLLIN, IDLER_URING_WAKEUP);
+}
+
+
+static void idler_backend_clean(struct idler *self)
+{
+    if (self->buffers_ready)
+        uring_buffers_clean(&self->buffers, &self->ring);
+    uring_clean(&self->ring);
+}
+
+
+static void idler_backend_resize(struct idler *self)
+{
+    UNUSED(self);
+}
+
+
+static void idler_backend_add(struct idler *self, struct stream *stream, unsigned int events)
+{
+    if (stream_get_fd(stream) < 0) {
+        WARN("Idler could not register %d fd", stream_get_fd(stream));
+        return;
+    }
+
+    struct stream_ring *ring = idler_stream_ring(stream);
+    if (ring && ring->enabled)
+        idler_uring_ring_start(self, stream, events);
+
+    idler_backend_arm(self, stream, events);
+}
+
+
+static bool idler_backend_modify(struct idler *self, struct stream *stream, unsigned int events)
+{
+    struct stream_ring *ring = idler_stream_ring(stream);
+    if (ring && ring->active) {
+        // Ring stream is not re-armed by the next wait unless it was reported
+        if (stream->idler_token)
+            idler_uring_poll_remove(self, idler_uring_data(stream, stream->idler_token));
+        idler_backend_arm(self, stream, events);
+        idler_uring_ring_arm(self, stream, events, true);
+        return true;
+    }
+
+    if (!stream->idler_token && stream->idler_status)
+        return true;    // Poll completed, it is re-armed with new events before next wait
+
+    if (stream->idler_token)
+        idler_uring_poll_remove(self, idler_uring_data(stream, stream->idler_token));
+    idler_backend_arm(self, stream, events);
+    return true;
+}
+
+
+static void idler_backend_remove(struct idler *self, struct stream *stream)
+{
+    struct stream_ring *ring = idler_stream_ring(stream);
+    if (ring && ring->active)
+        idler_uring_ring_stop(self, stream);
+
+    if (stream->idler_token)
+        idler_uring_poll_remove(self, idler_uring_data(stream, stream->idler_token));
+    stream->idler_token = 0;
+}
+
+
+static void idler_backend_rearm(struct idler *self, struct stream *stream)
+{
+    if (!stream->idler_token)
+        idler_backend_arm(self, stream, stream->idler_events);
+
+    idler_uring_ring_arm(self, stream, stream->idler_events, true);
+}
+
+
+/**
+ * Handle completed receive request
+ *
+ */
+static void idler_uring_recv_done(struct idler *self, struct stream *stream, struct stream_ring *ring,
+                                  int res, const unsigned char *data)
+{
+    ring->read_token = 0;
+
+    if (res == -ECANCELED)
+        return;     // Ring I/O stopped
+
+    if (res == -ENOBUFS) {
+        // All buffers were taken by this batch, they are given back already
+        if (ring->active)
+            idler_uring_recv(self, stream, ring);
+        return;
+    }
+
+    if (res > 0)
+        iobuf_append(&ring->inbound, data, res);
+    else if (res == 0)
+        ring->eof = true;
+    else
+        ring->error = -res;
+
+    idler_mark_ready(self, stream, STREAM_INCOMING_READY);
+}
+
+
+/**
+ * Handle completed send request
+ *
+ * Stream is reported as ready for output, so that decorators may push their
+ * data and writers paused by watermarks may continue.
+ *
+ */
+static void idler_uring_send_done(struct idler *self, struct stream *stream, struct stream_ring *ring, int res)
+{
+    struct stream *base = idler_stream_base(stream);
+    ring->write_token = 0;
+
+    if (ring->discard) {
+        iobuf_clean(&ring->inflight);
+        ring->discard = false;
+    }
+    else {
+        if (res > 0)
+            iobuf_cut(&ring->inflight, res);
+        else if ((res < 0) && (res != -ECANCELED))
+            ring->error = -res;
+
+        if (!iobuf_is_empty(&ring->inflight)) {
+            // Unsent data goes back in front of the queue
+            iobuf_move(&ring->inflight, &base->outgoing);
+            iobuf_move(&base->outgoing, &ring->inflight);
+        }
+    }
+
+    if (!ring->active)
+        return;     // Ring I/O stopped, queue is written by the stream again
+
+    idler_mark_ready(self, stream, ring->error ? (STREAM_INCOMING_READY | STREAM_OUTGOING_READY) : STREAM_OUTGOING_READY);
+
+    // Interest changes if queue drained, otherwise the rest is sent
+    idler_update_stream(self, stream);
+}
+
+
+/**
+ * Dispatch completion to the request owner
+ *
+ */
+static void idler_uring_complete(struct idler *self, __u64 data, int res, const unsigned char *buffer)
+{
+    if (data == IDLER_URING_IGNORE)
+        return;
+
+    if (data == IDLER_URING_WAKEUP) {
+        // Wakeup event, it is not reported by iterator
+        eventfd_t value;
+        eventfd_read(self->wakeup_fd, &value);
+        idler_uring_poll_add(self, self->wakeup_fd, POLLIN, IDLER_URING_WAKEUP);
+        self->woken_up = true;
+        return;
+    }
+
+    struct stream *stream = idler_find_stream(self, (int)(unsigned int)data);
+    if (!stream)
+        return;     // Stream removed
+
+    unsigned int token = data >> 32;
+    struct stream_ring *ring = idler_stream_ring(stream);
+    if (ring && ring->read_token && (ring->read_token == token)) {
+        idler_uring_recv_done(self, stream, ring, res, buffer);
+        return;
+    }
+    if (ring && ring->write_token && (ring->write_token == token)) {
+        idler_uring_send_done(self, stream, ring, res);
+        return;
+    }
+
+    if (stream->idler_token != token)
+        return;     // Request replaced
+
+    stream->idler_token = 0;
+    unsigned int status = (res < 0) ? STREAM_INCOMING_READY : idler_events_status(res);
+    if (!status) {
+        idler_backend_arm(self, stream, stream->idler_events);
+        return;
+    }
+
+    idler_mark_ready(self, stream, status);
+}
+
+
+/**
+ * Handle all available completions
+ *
+ */
+static void idler_uring_process(struct idler *self)
+{
+    struct io_uring_cqe *cqe;
+    while ((cqe = uring_peek_cqe(&self->ring))) {
+        __u64 data = cqe->user_data;
+        int res = cqe->res;
+        unsigned int flags = cqe->flags;
+        uring_cqe_seen(&self->ring);
+
+        if (!(flags & IORING_CQE_F_BUFFER)) {
+            idler_uring_complete(self, data, res, NULL);
+            continue;
+        }
+
+        // Data is copied by the owner, buffer is given back right away
+        unsigned short bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        idler_uring_complete(self, data, res, uring_buffers_get(&self->buffers, bid));
+        uring_buffers_put(&self->buffers, bid);
+    }
+}
+
+
+/**
+ * Submit queued requests and wait for completions
+ *
+ */
+static int idler_backend_wait(struct idler *self, unsigned long time_ms, bool *woken_up)
+{
+    int ret = uring_submit_and_wait(&self->ring, time_ms);
+    if (ret < 0 && ret != -ETIME) {
+        if (ret == -EINTR)
+            return IDLER_INTERRUPT;
+
+        return IDLER_ERROR;
+    }
+
+    idler_uring_process(self);
+
+    *woken_up = self->woken_up;
+    self->woken_up = false;
+
+    return IDLER_OPERATION;
+}
+
+#else
+
+/**
+ * epoll backend
+ *
+ * Streams stay registered with persistent interest sets, they are modified
+ * only when events change.
+ *
+ */
+
+static void idler_backend_init(struct idler *self)
+{
+    self->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (self->epoll_fd < 0)
+        RESET("Could not create epoll instance");
+
+    // Wakeup event is the only one registered without stream
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    epoll_ctl(self->epoll_fd, EPOLL_CTL_ADD, self->wakeup_fd, &ev);
+
+    self->events = xmalloc(self->ready_size * sizeof(struct epoll_event));
+}
+
+
+static void idler_backend_clean(struct idler *self)
+{
+    close(self->epoll_fd);
+    xfree(self->events);
+}
+
+
+static void idler_backend_resize(struct idler *self)
+{
+    self->events = xrealloc(self->events, self->ready_size * sizeof(struct epoll_event));
+}
+
+
+static void idler_backend_add(struct idler *self, struct stream *stream, unsigned int events)
+{
+    int fd = stream_get_fd(stream);
+    if (!events)
+        return;     // Registered once there is interest, see idler_backend_modify()
+
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = stream;
+
+    if (epoll_ctl(self->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+        WARN("Idler could not register %d fd, %s", fd, strerror(errno));
+}
+
+
+static bool idler_backend_modify(struct idler *self, struct stream *stream, unsigned int events)
+{
+    // Hang up and error are reported even without interest, stream which
+    // does not read would be reported by every wait, it is left out instead
+    int op = EPOLL_CTL_MOD;
+    if (!events)
+        op = EPOLL_CTL_DEL;
+    else if (!stream->idler_events)
+        op = EPOLL_CTL_ADD;
+
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = stream;
+
+    if (epoll_ctl(self->epoll_fd, op, stream_get_fd(stream), &ev) < 0) {
+        WARN("Idler could not modify events of %d fd, %s", stream_get_fd(stream), strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+
+static void idler_backend_remove(struct idler *self, struct stream *stream)
+{
+    // Descriptor may be already closed, in that case kernel removed it
+    epoll_ctl(self->epoll_fd, EPOLL_CTL_DEL, stream_get_fd(stream), NULL);
+}
+
+
+static void idler_backend_rearm(struct idler *self, struct stream *stream)
+{
+    UNUSED(self);
+    UNUSED(stream);
+}
+
+
+static void idler_backend_sync(struct idler *self, struct stream *stream)
+{
+    UNUSED(self);
+    UNUSED(stream);
+}
+
+
+/**
+ * Wait for events
+ *
+ */
+static int idler_backend_wait(struct idler *self, unsigned long time_ms, bool *woken_up)
+{
+    int ret = epoll_wait(self->epoll_fd, self->events, self->ready_size, time_ms);
+    if (ret < 0) {
+        if (errno == EINTR)
+            return IDLER_INTERRUPT;
+
+        return IDLER_ERROR;
+    }
+
+    for (int i = 0; i < ret; i++) {
+        struct stream *stream = self->events[i].data.ptr;
+
+        if (!stream) {
+            // Wakeup event, it is not reported by iterator
+            eventfd_t value;
+            eventfd_read(self->wakeup_fd, &value);
+            *woken_up = true;
+            continue;
+        }
+
+        idler_mark_ready(self, stream, idler_events_status(self->events[i].events));
+    }
+
+    return IDLER_OPERATION;
+}
+
+#endif
+
+
+
 /**
  * Constructor
  *
@@ -43,6 +782,24 @@ struct idler* idler_new(void)
 {
     struct idler *self = xmalloc(sizeof(struct idler));
 
+    self->wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (self->wakeup_fd < 0)
+        RESET("Could not create idler wakeup event");
+
+    self->ready_size = IDLER_INITIAL_EVENTS;
+    self->ready = xmalloc(self->ready_size * sizeof(struct stream*));
+    self->ready_count = 0;
+    self->ready_idx = 0;
+
+    idler_backend_init(self);
+
+    self->fds_size = 0;
+    self->fds = NULL;
+
+    self->heap = xmalloc(self->ready_size * sizeof(struct stream*));
+    self->heap_count = 0;
+
+    self->streams_count = 0;
     LIST_INIT(&self->streams);
 
     return self;
@@ -57,122 +814,368 @@ struct idler* idler_delete(struct idler *self)
 {
     struct stream *stream, *tmp;
     LIST_FOREACH_SAFE(stream, &self->streams, _entry_, tmp) {
-        LIST_REMOVE(stream, _entry_);
+        idler_remove_stream(self, stream);
     }
 
+    idler_backend_clean(self);
+    close(self->wakeup_fd);
+    xfree(self->ready);
+    xfree(self->fds);
+    xfree(self->heap);
     free(self);
     return NULL;
 }
 
 
+/**
+ * Events the idler should wait for on given stream
+ *
+ */
+static unsigned int idler_stream_events(struct stream *stream)
+{
+    unsigned int events = stream_is_read_paused(stream) ? 0 : POLLIN;
+    if (stream_has_outgoing_data(stream))
+        events |= POLLOUT;
+
+    return events;
+}
+
+
+/**
+ * Swap two deadline heap entries
+ *
+ */
+static void idler_heap_swap(struct idler *self, unsigned int a, unsigned int b)
+{
+    struct stream *tmp = self->heap[a];
+    self->heap[a] = self->heap[b];
+    self->heap[b] = tmp;
+
+    self->heap[a]->idler_heap_idx = a;
+    self->heap[b]->idler_heap_idx = b;
+}
+
+
+/**
+ * Restore deadline heap order around given position
+ *
+ */
+static void idler_heap_fix(struct idler *self, unsigned int idx)
+{
+    while (idx > 0) {
+        unsigned int parent = (idx - 1) / 2;
+        if (self->heap[parent]->idler_deadline <= self->heap[idx]->idler_deadline)
+            break;
+
+        idler_heap_swap(self, parent, idx);
+        idx = parent;
+    }
+
+    while (1) {
+        unsigned int smallest = idx;
+        unsigned int left = 2*idx + 1;
+        unsigned int right = 2*idx + 2;
+
+        if ((left < self->heap_count) && (self->heap[left]->idler_deadline < self->heap[smallest]->idler_deadline))
+            smallest = left;
+        if ((right < self->heap_count) && (self->heap[right]->idler_deadline < self->heap[smallest]->idler_deadline))
+            smallest = right;
+        if (smallest == idx)
+            break;
+
+        idler_heap_swap(self, smallest, idx);
+        idx = smallest;
+    }
+}
+
+
+/**
+ * Remove stream from deadline heap
+ *
+ */
+static void idler_heap_remove(struct idler *self, struct stream *stream)
+{
+    if (stream->idler_heap_idx < 0)
+        return;     // Not scheduled
+
+    unsigned int idx = stream->idler_heap_idx;
+    unsigned int last = --self->heap_count;
+    if (idx != last) {
+        idler_heap_swap(self, idx, last);
+        idler_heap_fix(self, idx);
+    }
+
+    stream->idler_heap_idx = -1;
+    stream->idler_deadline = 0;
+}
+
+
+/**
+ * Insert, move or remove stream in deadline heap
+ *
+ */
+static void idler_heap_update(struct idler *self, struct stream *stream)
+{
+    time_t deadline = stream_get_deadline(stream);
+    if (deadline == 0) {
+        idler_heap_remove(self, stream);
+        return;
+    }
+
+    if (stream->idler_heap_idx < 0) {
+        // Heap has room for every registered stream, see idler_add_stream()
+        stream->idler_heap_idx = self->heap_count++;
+        self->heap[stream->idler_heap_idx] = stream;
+    }
+    else if (stream->idler_deadline == deadline) {
+        return;     // Nothing changed
+    }
+
+    stream->idler_deadline = deadline;
+    idler_heap_fix(self, stream->idler_heap_idx);
+}
+
+
+/**
+ * Make sure file descriptor fits into the stream table
+ *
+ */
+static void idler_reserve_fd(struct idler *self, int fd)
+{
+    if (fd < self->fds_size)
+        return;
+
+    int size = self->fds_size ? self->fds_size : IDLER_INITIAL_EVENTS;
+    while (size <= fd)
+        size *= 2;
+
+    self->fds = xrealloc(self->fds, size * sizeof(struct stream*));
+    memset(self->fds + self->fds_size, 0, (size - self->fds_size) * sizeof(struct stream*));
+    self->fds_size = size;
+}
+
+
 void idler_add_stream(struct idler *self, struct stream *stream)
 {
+    int fd = stream_get_fd(stream);
+    unsigned int events = idler_stream_events(stream);
+
+    if (fd >= 0) {
+        idler_reserve_fd(self, fd);
+        self->fds[fd] = stream;
+    }
+
+    stream->idler = self;
+    stream->idler_events = events;
+    stream->idler_status = 0;
+
+    idler_backend_add(self, stream, events);
+
     LIST_INSERT_HEAD(&self->streams, stream, _entry_);
+    self->streams_count++;
+
+    if (self->streams_count + 1 > (unsigned int)self->ready_size) {
+        // Make sure all streams and wakeup event may be reported by single wait
+        self->ready_size *= 2;
+        self->ready = xrealloc(self->ready, self->ready_size * sizeof(struct stream*));
+        self->heap = xrealloc(self->heap, self->ready_size * sizeof(struct stream*));
+        idler_backend_resize(self);
+    }
+
+    idler_heap_update(self, stream);
 }
 
 
 void idler_remove_stream(struct idler *self, struct stream *stream)
 {
-    UNUSED(self);
+    int fd = stream_get_fd(stream);
+
+    idler_backend_remove(self, stream);
+
+    if ((fd >= 0) && (fd < self->fds_size) && (self->fds[fd] == stream))
+        self->fds[fd] = NULL;
+
+    // Forget reported events, iterator must not return removed stream and
+    // the next wait must not touch it, it may be deleted already
+    if (stream->idler_status) {
+        for (int i = 0; i < self->ready_count; i++) {
+            if (self->ready[i] == stream)
+                self->ready[i] = NULL;
+        }
+    }
+
+    idler_heap_remove(self, stream);
+
+    stream->idler = NULL;
+    stream->idler_events = 0;
+    stream->idler_status = 0;
+
     LIST_REMOVE(stream, _entry_);
+    self->streams_count--;
 }
 
 
 struct stream* idler_find_stream(struct idler *self, int fd)
 {
-    struct stream *tmp;
-    LIST_FOREACH(tmp, &self->streams, _entry_) {
-        if (stream_get_fd(tmp) == fd)
-            return tmp;
-    }
+    if ((fd < 0) || (fd >= self->fds_size))
+        return NULL;
 
-    return NULL;
+    return self->fds[fd];
 }
 
 
-static int idler_prepare(struct idler *self, fd_set *readfds, fd_set *writefds)
+/**
+ * Update events and deadline the idler waits for on given stream
+ *
+ * Streams call it whenever outgoing data is queued or drained, or timer
+ * deadline changes, so that nothing is recomputed on each wait.
+ *
+ */
+void idler_update_stream(struct idler *self, struct stream *stream)
 {
-    int max_fd = 0;
+    idler_heap_update(self, stream);
 
-    FD_ZERO(readfds);
-    FD_ZERO(writefds);
+    unsigned int events = idler_stream_events(stream);
+    if ((stream->idler_events != events) && idler_backend_modify(self, stream, events))
+        stream->idler_events = events;
 
-    struct stream *tmp;
-    LIST_FOREACH(tmp, &self->streams, _entry_) {
-        int fd = stream_get_fd(tmp);
-        if (fd > max_fd)
-            max_fd = fd;
+    // Ring I/O of queued data is submitted even if events did not change
+    idler_backend_sync(self, stream);
+}
 
-        FD_SET(fd, readfds);
 
-        if (stream_has_outgoing_data(tmp))
-            FD_SET(fd, writefds);
+static void idler_prepare(struct idler *self)
+{
+    int count = self->ready_count;
+    self->ready_count = 0;
+    self->ready_idx = 0;
+
+    // Reset status reported by previous wait, rearm may report stream again
+    // right away, list is rebuilt in place over already processed entries
+    for (int i = 0; i < count; i++) {
+        struct stream *stream = self->ready[i];
+        if (stream) {
+            stream->idler_status = 0;
+            idler_backend_rearm(self, stream);
+        }
     }
+}
 
-    return max_fd;
+
+/**
+ * Return monotonic time in milliseconds
+ *
+ * Used to measure wait duration only, clock is updated by the caller.
+ *
+ */
+static time_t idler_monotonic_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000 / 1000;
 }
 
 
+/**
+ * Report streams which deadline already passed
+ *
+ * Expired streams are taken out of the heap, they are scheduled again when
+ * time handler sets new deadline.
+ *
+ */
+static void idler_expire(struct idler *self, time_t now)
+{
+    while ((self->heap_count > 0) && (self->heap[0]->idler_deadline <= now)) {
+        struct stream *stream = self->heap[0];
+        idler_heap_remove(self, stream);
+        idler_mark_ready(self, stream, STREAM_TIMER_EXPIRED);
+    }
+}
+
+
+/**
+ * Wait for streams activity
+ *
+ * Wait lasts 'time_ms' at most and is shortened to the earliest stream deadline.
+ * Streams which deadline passed are reported with STREAM_TIMER_EXPIRED status,
+ * their time handler should be called then. Clock should be updated before wait,
+ * see clock_update_sys(). Time spent on waiting is taken into account when
+ * deadlines are checked, clock itself is left to the caller.
+ *
+ */
 int idler_wait(struct idler *self, unsigned long time_ms)
 {
-    struct timeval tv;
+    idler_prepare(self);
 
-    tv.tv_sec = time_ms/1000;
-    tv.tv_usec = (time_ms%1000)*1000;
+    time_t now = clock_get_milis();
+    if (self->ready_count > 0)
+        time_ms = 0;    // Data received earlier is still not read
+    if (self->heap_count > 0) {
+        time_t remaining = self->heap[0]->idler_deadline - now;
+        if (remaining < 0)
+            remaining = 0;
+        if ((unsigned long)remaining < time_ms)
+            time_ms = remaining;
+    }
 
-    int max_fd = idler_prepare(self, &self->read_fds, &self->write_fds);
+    bool woken_up = false;
+    time_t wait_start = idler_monotonic_ms();
+    int ret = idler_backend_wait(self, time_ms, &woken_up);
+    if (ret != IDLER_OPERATION)
+        return ret;
 
-    int ret = select(max_fd+1, &self->read_fds, &self->write_fds, NULL, &tv);
-    if (ret > 0)
-        return IDLER_OPERATION;
-    if (ret == 0)
-        return IDLER_TIMEOUT;
+    // Deadlines which passed while waiting are reported too
+    now = MAX(now + (idler_monotonic_ms() - wait_start), clock_get_milis());
+    idler_expire(self, now);
 
-    if (errno == EINTR)
+    if (self->ready_count > 0)
+        return IDLER_OPERATION;
+    if (woken_up)
         return IDLER_INTERRUPT;
 
-    return IDLER_ERROR;
+    return IDLER_TIMEOUT;
 }
 
 
-unsigned int idler_get_stream_status(struct idler *self, struct stream *stream)
+/**
+ * Interrupt wait
+ *
+ * The only idler function which may be called from other threads.
+ *
+ */
+void idler_wakeup(struct idler *self)
 {
-    unsigned int status = 0;
+    eventfd_write(self->wakeup_fd, 1);
+}
 
-    if (FD_ISSET(stream_get_fd(stream), &self->write_fds))
-        status |= STREAM_OUTGOING_READY;
-    if (FD_ISSET(stream_get_fd(stream), &self->read_fds))
-        status |= STREAM_INCOMING_READY;
 
-    return status;
+unsigned int idler_get_stream_status(struct idler *self, struct stream *stream)
+{
+    UNUSED(self);
+    return stream->idler_status;
 }
 
 
 /**
  * Stream iterator
  *
- * To start iteration pass NULL as 'prev' argument
+ * To start iteration pass NULL as 'prev' argument. Only streams reported
+ * by the last wait are visited.
  *
  */
 struct stream* idler_get_next_stream(struct idler *self, struct stream *prev, unsigned int *status)
 {
-    unsigned int current_status = 0;
-    struct stream *current = prev ? LIST_NEXT(prev, _entry_) : LIST_FIRST(&self->streams);
-
-    while (current) {
-        if (FD_ISSET(stream_get_fd(current), &self->write_fds))
-            current_status |= STREAM_OUTGOING_READY;
-        if (FD_ISSET(stream_get_fd(current), &self->read_fds))
-            current_status |= STREAM_INCOMING_READY;
+    if (!prev)
+        self->ready_idx = 0;
 
-        if (current_status) {
+    while (self->ready_idx < self->ready_count) {
+        struct stream *current = self->ready[self->ready_idx++];
+        if (current && current->idler_status) {
             // Stream needs attention
-            *status = current_status;
-            break;
+            *status = current->idler_status;
+            return current;
         }
-
-        current = LIST_NEXT(current, _entry_);
     }
 
-    return current;
+    return NULL;
 }
@@ -0,0 +1,415 @@
+#include "mx/iobuf.h"
+#include "mx/memory.h"
+#include "mx/misc.h"
+
+#include <string.h>
+
+
+#define IOBUF_BLOCK_SIZE        4096
+#define IOBUF_SMALL_SIZE        128     // Blocks up to this size are taken from pool
+
+
+
+struct iobuf_block
+{
+    unsigned int refs;          // Number of segments referencing the block, accessed atomically
+    size_t size;                // Allocated data size
+    unsigned char data[];
+};
+
+
+static struct xpool iobuf_segment_pool = XPOOL_INITIALIZER(sizeof(struct iobuf_segment));
+static struct xpool iobuf_small_pool = XPOOL_INITIALIZER(sizeof(struct iobuf_block) + IOBUF_SMALL_SIZE);
+
+
+
+/**
+ * Allocate block with given data size
+ *
+ * Small blocks, e.g. control frames, come from pool and get IOBUF_SMALL_SIZE
+ * bytes, so that size tells where the block belongs.
+ *
+ */
+static struct iobuf_block* iobuf_block_new(size_t size)
+{
+    struct iobuf_block *self;
+    if (size <= IOBUF_SMALL_SIZE) {
+        self = xpool_alloc(&iobuf_small_pool);
+        size = IOBUF_SMALL_SIZE;
+    }
+    else {
+        self = xmalloc(sizeof(struct iobuf_block) + size);
+    }
+
+    self->refs = 0;
+    self->size = size;
+    return self;
+}
+
+
+/**
+ * Free block
+ *
+ */
+static void iobuf_block_delete(struct iobuf_block *self)
+{
+    if (self->size == IOBUF_SMALL_SIZE)
+        xpool_free(&iobuf_small_pool, self);
+    else
+        xfree(self);
+}
+
+
+/**
+ * Create segment referencing part of the block
+ *
+ */
+static struct iobuf_segment* iobuf_segment_new(struct iobuf_block *block, unsigned char *data, size_t length)
+{
+    struct iobuf_segment *self = xpool_alloc(&iobuf_segment_pool);
+    self->block = block;
+    self->data = data;
+    self->length = length;
+
+    // Chains sharing the block may be owned by different threads
+    __atomic_add_fetch(&block->refs, 1, __ATOMIC_RELAXED);
+    return self;
+}
+
+
+/**
+ * Release segment, block is freed with the last reference
+ *
+ */
+static struct iobuf_segment* iobuf_segment_delete(struct iobuf_segment *self)
+{
+    if (__atomic_sub_fetch(&self->block->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        iobuf_block_delete(self->block);
+
+    return xpool_free(&iobuf_segment_pool, self);
+}
+
+
+/**
+ * Check if segment may be extended in place
+ *
+ */
+static inline bool iobuf_segment_is_exclusive(struct iobuf_segment *self)
+{
+    return __atomic_load_n(&self->block->refs, __ATOMIC_ACQUIRE) == 1;
+}
+
+
+
+/**
+ * Constructor
+ *
+ */
+struct iobuf* iobuf_new(void)
+{
+    struct iobuf *self = xmalloc(sizeof(struct iobuf));
+    iobuf_init(self);
+    return self;
+}
+
+
+/**
+ * Destructor
+ *
+ */
+struct iobuf* iobuf_delete(struct iobuf *self)
+{
+    iobuf_clean(self);
+    return xfree(self);
+}
+
+
+/**
+ * Initialize empty chain
+ *
+ */
+void iobuf_init(struct iobuf *self)
+{
+    TAILQ_INIT(&self->segments);
+    self->length = 0;
+    self->count = 0;
+}
+
+
+/**
+ * Clean chain
+ *
+ * Chain is empty afterwards and may be used again.
+ *
+ */
+void iobuf_clean(struct iobuf *self)
+{
+    struct iobuf_segment *segment, *tmp;
+    TAILQ_FOREACH_SAFE(segment, &self->segments, _entry_, tmp) {
+        TAILQ_REMOVE(&self->segments, segment, _entry_);
+        iobuf_segment_delete(segment);
+    }
+
+    self->length = 0;
+    self->count = 0;
+}
+
+
+/**
+ * Append new segment with uninitialized data
+ *
+ * Segment gets 'headroom' bytes in front of the data, so that header may be
+ * prepended later without copying. Returns pointer where 'length' bytes of
+ * data should be written.
+ *
+ */
+unsigned char* iobuf_reserve(struct iobuf *self, size_t headroom, size_t length)
+{
+    struct iobuf_block *block = iobuf_block_new(headroom + length);
+    struct iobuf_segment *segment = iobuf_segment_new(block, block->data + headroom, length);
+
+    TAILQ_INSERT_TAIL(&self->segments, segment, _entry_);
+    self->length += length;
+    self->count++;
+
+    return segment->data;
+}
+
+
+/**
+ * Append copy of data
+ *
+ * Free space of the last block is used first.
+ *
+ */
+void iobuf_append(struct iobuf *self, const void *data, size_t length)
+{
+    if (length == 0)
+        return;
+
+    struct iobuf_segment *last = TAILQ_LAST(&self->segments, iobuf_segment_head);
+    if (last && iobuf_segment_is_exclusive(last)) {
+        unsigned char *end = last->data + last->length;
+        size_t room = last->block->data + last->block->size - end;
+        size_t len = MIN(room, length);
+
+        memcpy(end, data, len);
+        last->length += len;
+        self->length += len;
+
+        data = (const unsigned char*)data + len;
+        length -= len;
+        if (length == 0)
+            return;
+    }
+
+    struct iobuf_block *block = iobuf_block_new(MAX(length, IOBUF_BLOCK_SIZE));
+    struct iobuf_segment *segment = iobuf_segment_new(block, block->data, length);
+    memcpy(segment->data, data, length);
+
+    TAILQ_INSERT_TAIL(&self->segments, segment, _entry_);
+    self->length += length;
+    self->count++;
+}
+
+
+/**
+ * Prepend copy of data, usually protocol header
+ *
+ * Headroom of the first block is used if available, otherwise header gets
+ * its own segment. Data which is already stored is never moved.
+ *
+ */
+void iobuf_prepend(struct iobuf *self, const void *data, size_t length)
+{
+    if (length == 0)
+        return;
+
+    struct iobuf_segment *first = TAILQ_FIRST(&self->segments);
+    if (first && iobuf_segment_is_exclusive(first) && ((size_t)(first->data - first->block->data) >= length)) {
+        first->data -= length;
+        first->length += length;
+    }
+    else {
+        struct iobuf_block *block = iobuf_block_new(length);
+        first = iobuf_segment_new(block, block->data, length);
+
+        TAILQ_INSERT_HEAD(&self->segments, first, _entry_);
+        self->count++;
+    }
+
+    memcpy(first->data, data, length);
+    self->length += length;
+}
+
+
+/**
+ * Append data of other chain without copying
+ *
+ * Both chains reference the same memory afterwards, it must not be modified.
+ *
+ */
+void iobuf_share(struct iobuf *self, const struct iobuf *other)
+{
+    struct iobuf_segment *segment;
+    TAILQ_FOREACH(segment, &other->segments, _entry_) {
+        struct iobuf_segment *shared = iobuf_segment_new(segment->block, segment->data, segment->length);
+        TAILQ_INSERT_TAIL(&self->segments, shared, _entry_);
+    }
+
+    self->length += other->length;
+    self->count += other->count;
+}
+
+
+/**
+ * Move all segments of other chain to the end of this one
+ *
+ */
+void iobuf_move(struct iobuf *self, struct iobuf *other)
+{
+    TAILQ_CONCAT(&self->segments, &other->segments, _entry_);
+    self->length += other->length;
+    self->count += other->count;
+
+    other->length = 0;
+    other->count = 0;
+}
+
+
+/**
+ * Move first 'length' bytes to the end of 'head' chain
+ *
+ * Segment crossing the boundary is split, both parts share its block.
+ *
+ */
+void iobuf_split(struct iobuf *self, size_t length, struct iobuf *head)
+{
+    length = MIN(length, self->length);
+
+    while (length > 0) {
+        struct iobuf_segment *segment = TAILQ_FIRST(&self->segments);
+
+        if (segment->length <= length) {
+            TAILQ_REMOVE(&self->segments, segment, _entry_);
+            self->count--;
+        }
+        else {
+            struct iobuf_segment *part = iobuf_segment_new(segment->block, segment->data, length);
+            segment->data += length;
+            segment->length -= length;
+            segment = part;
+        }
+
+        TAILQ_INSERT_TAIL(&head->segments, segment, _entry_);
+        head->count++;
+        head->length += segment->length;
+        self->length -= segment->length;
+        length -= segment->length;
+    }
+}
+
+
+/**
+ * Drop first 'length' bytes
+ *
+ * Returns length of data left in chain.
+ *
+ */
+size_t iobuf_cut(struct iobuf *self, size_t length)
+{
+    length = MIN(length, self->length);
+    self->length -= length;
+
+    while (length > 0) {
+        struct iobuf_segment *segment = TAILQ_FIRST(&self->segments);
+
+        if (segment->length > length) {
+            segment->data += length;
+            segment->length -= length;
+            break;
+        }
+
+        length -= segment->length;
+        TAILQ_REMOVE(&self->segments, segment, _entry_);
+        iobuf_segment_delete(segment);
+        self->count--;
+    }
+
+    return self->length;
+}
+
+
+/**
+ * Make chain data contiguous
+ *
+ * Data is copied only if chain consists of more than one segment. Returns
+ * pointer to the data, NULL if chain is empty.
+ *
+ */
+unsigned char* iobuf_pullup(struct iobuf *self)
+{
+    if (self->count == 0)
+        return NULL;
+
+    if (self->count > 1) {
+        struct iobuf_block *block = iobuf_block_new(self->length);
+        struct iobuf_segment *segment = iobuf_segment_new(block, block->data, self->length);
+        iobuf_peek(self, segment->data, self->length);
+
+        size_t length = self->length;
+        iobuf_clean(self);
+
+        TAILQ_INSERT_TAIL(&self->segments, segment, _entry_);
+        self->length = length;
+        self->count = 1;
+    }
+
+    return TAILQ_FIRST(&self->segments)->data;
+}
+
+
+/**
+ * Copy first 'length' bytes at most without consuming them
+ *
+ */
+size_t iobuf_peek(const struct iobuf *self, void *data, size_t length)
+{
+    size_t offset = 0;
+
+    struct iobuf_segment *segment;
+    TAILQ_FOREACH(segment, &self->segments, _entry_) {
+        if (offset == length)
+            break;
+
+        size_t len = MIN(segment->length, length - offset);
+        memcpy((unsigned char*)data + offset, segment->data, len);
+        offset += len;
+    }
+
+    return offset;
+}
+
+
+/**
+ * Describe first 'count' segments at most with I/O vector
+ *
+ * Returns number of used vector entries.
+ *
+ */
+int iobuf_get_iovec(const struct iobuf *self, struct iovec *iov, int count)
+{
+    int idx = 0;
+
+    struct iobuf_segment *segment;
+    TAILQ_FOREACH(segment, &self->segments, _entry_) {
+        if (idx == count)
+            break;
+
+        iov[idx].iov_base = segment->data;
+        iov[idx].iov_len = segment->length;
+        idx++;
+    }
+
+    return idx;
+}
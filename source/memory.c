@@ -1,12 +1,21 @@
 
 #include "mx/memory.h"
 #include "mx/log.h"
+#include "mx/misc.h"
 
+#include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 
 
 
+#define XPOOL_SLAB_OBJECTS      64      // Objects allocated at once
+#define XPOOL_CACHE_SIZE        64      // Objects kept by thread cache at most
+#define XPOOL_MAX_POOLS         32      // Pools which may use thread caches
+#define XPOOL_ALIGNMENT         16      // See XPOOL_OBJ_SIZE()
+
+
+
 /**
  * free() wrapper
  *
@@ -95,3 +104,315 @@ void* xmemdupz(const void *ptr, size_t size)
 {
     return memcpy(xmallocz(size), ptr, size);
 }
+
+
+
+
+
+
+struct xpool_node
+{
+    struct xpool_node *next;
+};
+
+
+struct xpool_cache
+{
+    struct xpool_node *head;
+    unsigned int count;
+    unsigned int generation;        // Generation of the pool which owns the slot
+};
+
+
+static pthread_mutex_t xpool_slots_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct xpool *xpool_slots[XPOOL_MAX_POOLS];     // Pools which own thread cache slots
+
+
+#if !XPOOL_DISABLED
+
+static unsigned int xpool_generation = 0;
+
+static __thread struct xpool_cache xpool_caches[XPOOL_MAX_POOLS];
+static __thread bool xpool_caches_registered = false;
+
+static pthread_once_t xpool_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t xpool_key;
+
+
+
+/**
+ * Return objects cached by exiting thread to their pools
+ *
+ */
+static void xpool_flush_caches(void *arg)
+{
+    struct xpool_cache *caches = arg;
+
+    pthread_mutex_lock(&xpool_slots_lock);
+    for (int i = 0; i < XPOOL_MAX_POOLS; i++) {
+        struct xpool_cache *cache = &caches[i];
+        struct xpool *pool = xpool_slots[i];
+        if (!cache->head || !pool || (pool->generation != cache->generation))
+            continue;   // Nothing cached or pool is gone
+
+        struct xpool_node *tail = cache->head;
+        while (tail->next)
+            tail = tail->next;
+
+        pthread_mutex_lock(&pool->lock);
+        tail->next = pool->free;
+        pool->free = cache->head;
+        pthread_mutex_unlock(&pool->lock);
+
+        cache->head = NULL;
+        cache->count = 0;
+    }
+    pthread_mutex_unlock(&xpool_slots_lock);
+}
+
+
+/**
+ * Create key which flushes thread caches on thread exit
+ *
+ */
+static void xpool_create_key(void)
+{
+    if (pthread_key_create(&xpool_key, xpool_flush_caches) != 0)
+        ERROR("Cannot create key of pool thread caches");
+}
+
+
+/**
+ * Assign thread cache slot to the pool
+ *
+ * Pools which do not get a slot work without thread caches.
+ *
+ */
+static void xpool_register(struct xpool *self)
+{
+    pthread_mutex_lock(&xpool_slots_lock);
+    int id = -2;
+    for (int i = 0; i < XPOOL_MAX_POOLS; i++) {
+        if (!xpool_slots[i]) {
+            xpool_slots[i] = self;
+            id = i;
+            break;
+        }
+    }
+    self->generation = ++xpool_generation;
+    pthread_mutex_unlock(&xpool_slots_lock);
+
+    __atomic_store_n(&self->id, id, __ATOMIC_RELEASE);
+}
+
+
+/**
+ * Return calling thread cache of the pool, NULL if pool has no slot
+ *
+ */
+static struct xpool_cache* xpool_get_cache(struct xpool *self)
+{
+    int id = __atomic_load_n(&self->id, __ATOMIC_ACQUIRE);
+    if (id == -1) {
+        pthread_mutex_lock(&self->lock);
+        if (self->id == -1)
+            xpool_register(self);
+        pthread_mutex_unlock(&self->lock);
+        id = self->id;
+    }
+
+    if (id < 0)
+        return NULL;
+
+    if (!xpool_caches_registered) {
+        // Cached objects are given back when the thread exits
+        pthread_once(&xpool_key_once, xpool_create_key);
+        pthread_setspecific(xpool_key, xpool_caches);
+        xpool_caches_registered = true;
+    }
+
+    struct xpool_cache *cache = &xpool_caches[id];
+    if (cache->generation != self->generation) {
+        // Objects cached for deleted pool are gone with its slabs
+        cache->head = NULL;
+        cache->count = 0;
+        cache->generation = self->generation;
+    }
+
+    return cache;
+}
+
+
+/**
+ * Allocate new slab and put its objects on the free list, pool must be locked
+ *
+ */
+static void xpool_grow(struct xpool *self)
+{
+    size_t header = (sizeof(struct xpool_node) + XPOOL_ALIGNMENT - 1) & ~(size_t)(XPOOL_ALIGNMENT - 1);
+    unsigned char *slab = xmalloc(header + XPOOL_SLAB_OBJECTS * self->obj_size);
+
+    ((struct xpool_node*)slab)->next = self->slabs;
+    self->slabs = slab;
+
+    for (int i = XPOOL_SLAB_OBJECTS - 1; i >= 0; i--) {
+        struct xpool_node *node = (struct xpool_node*)(slab + header + i * self->obj_size);
+        node->next = self->free;
+        self->free = node;
+    }
+}
+
+#endif
+
+
+/**
+ * Constructor
+ *
+ */
+struct xpool* xpool_new(size_t obj_size)
+{
+    struct xpool *self = xmalloc(sizeof(struct xpool));
+    xpool_init(self, obj_size);
+    return self;
+}
+
+
+/**
+ * Destructor
+ *
+ * All objects allocated from the pool are released.
+ *
+ */
+struct xpool* xpool_delete(struct xpool *self)
+{
+    xpool_clean(self);
+    return xfree(self);
+}
+
+
+/**
+ * Initialize pool
+ *
+ */
+void xpool_init(struct xpool *self, size_t obj_size)
+{
+    self->obj_size = XPOOL_OBJ_SIZE(obj_size);
+    self->id = -1;
+    self->generation = 0;
+    pthread_mutex_init(&self->lock, NULL);
+    self->free = NULL;
+    self->slabs = NULL;
+}
+
+
+/**
+ * Clean pool
+ *
+ * All objects allocated from the pool are released.
+ *
+ */
+void xpool_clean(struct xpool *self)
+{
+    // Exiting threads do not return objects to released slot
+    if (self->id >= 0) {
+        pthread_mutex_lock(&xpool_slots_lock);
+        xpool_slots[self->id] = NULL;
+        pthread_mutex_unlock(&xpool_slots_lock);
+    }
+    self->id = -1;
+
+    struct xpool_node *slab = self->slabs;
+    while (slab) {
+        struct xpool_node *next = slab->next;
+        xfree(slab);
+        slab = next;
+    }
+    self->slabs = NULL;
+    self->free = NULL;
+
+    pthread_mutex_destroy(&self->lock);
+}
+
+
+/**
+ * Allocate object
+ *
+ */
+void* xpool_alloc(struct xpool *self)
+{
+#if XPOOL_DISABLED
+    return xmalloc(self->obj_size);
+#else
+    struct xpool_cache *cache = xpool_get_cache(self);
+    if (cache && cache->head) {
+        struct xpool_node *node = cache->head;
+        cache->head = node->next;
+        cache->count--;
+        return node;
+    }
+
+    pthread_mutex_lock(&self->lock);
+    if (!self->free)
+        xpool_grow(self);
+
+    struct xpool_node *node = self->free;
+    self->free = node->next;
+
+    // Refill thread cache with half of its capacity
+    while (cache && self->free && cache->count < XPOOL_CACHE_SIZE/2) {
+        struct xpool_node *cached = self->free;
+        self->free = cached->next;
+        cached->next = cache->head;
+        cache->head = cached;
+        cache->count++;
+    }
+    pthread_mutex_unlock(&self->lock);
+
+    return node;
+#endif
+}
+
+
+/**
+ * Release object
+ *
+ * May be used to free and clean pointer simultaneously
+ * e.g. ptr = xpool_free(pool, ptr);
+ *
+ */
+void* xpool_free(struct xpool *self, void *ptr)
+{
+    if (!ptr)
+        return NULL;
+
+#if XPOOL_DISABLED
+    UNUSED(self);
+    return xfree(ptr);
+#else
+    struct xpool_node *node = ptr;
+
+    struct xpool_cache *cache = xpool_get_cache(self);
+    if (cache && cache->count < XPOOL_CACHE_SIZE) {
+        node->next = cache->head;
+        cache->head = node;
+        cache->count++;
+        return NULL;
+    }
+
+    pthread_mutex_lock(&self->lock);
+    node->next = self->free;
+    self->free = node;
+
+    // Return half of the full thread cache
+    while (cache && cache->count > XPOOL_CACHE_SIZE/2) {
+        struct xpool_node *cached = cache->head;
+        cache->head = cached->next;
+        cache->count--;
+        cached->next = self->free;
+        self->free = cached;
+    }
+    pthread_mutex_unlock(&self->lock);
+
+    return NULL;
+#endif
+}
@@ -448,6 +448,38 @@ size_t mqtt_format_publish(unsigned char *buffer, unsigned char qos, unsigned sh
 
 
 
+/**
+ * Count topic filters in SUBSCRIBE/UNSUBSCRIBE payload
+ *
+ * Every filter is followed by option_size bytes. Returns -1 when payload is
+ * malformed or empty.
+ *
+ */
+static ssize_t mqtt_count_topic_filters(const unsigned char *buffer, size_t length, size_t option_size)
+{
+    size_t offset = 0;
+    ssize_t count = 0;
+
+    while (offset < length) {
+        if (length - offset < MQTT_STR_LENGTH_SIZE)
+            return -1;
+
+        unsigned short topic_len;
+        offset += mqtt_get_short(buffer+offset, &topic_len);
+        if (topic_len == 0 || length - offset < (size_t)topic_len + option_size)
+            return -1;
+
+        offset += topic_len + option_size;
+        count++;
+    }
+
+    return count > 0 ? count : -1;
+}
+
+
+
+
+
 /**
  * Parse MQTT SUBSCRIBE packet body
  *
@@ -515,6 +547,101 @@ size_t mqtt_format_subscribe(unsigned char *buffer, unsigned short id, const cha
 
 
 
+/**
+ * Parse MQTT SUBSCRIBE packet body with many topic filters
+ *
+ */
+ssize_t mqtt_parse_subscribe_many(struct mqtt_subscribe_many *payload, const unsigned char *buffer, size_t length)
+{
+    if (length < MQTT_SUBSCRIBE_VARIABLE_HEADER_SIZE)
+        return -1;
+
+    size_t offset = 0;
+
+    // --- Variable header ---
+    // Packet Identifier
+    offset += mqtt_get_short(buffer+offset, &payload->id);
+
+    // --- Payload ---
+    ssize_t count = mqtt_count_topic_filters(buffer+offset, length-offset, 1);
+    if (count < 0)
+        return -1;
+
+    payload->count = count;
+    payload->data = buffer+offset;
+    payload->length = length-offset;
+    payload->offset = 0;
+
+    return length;
+}
+
+
+/**
+ * Get next topic filter from parsed MQTT SUBSCRIBE packet
+ *
+ */
+bool mqtt_subscribe_many_next(struct mqtt_subscribe_many *payload, struct mqtt_subscribe *entry)
+{
+    if (payload->offset >= payload->length)
+        return false;
+
+    entry->id = payload->id;
+    // Topic Filter
+    payload->offset += mqtt_get_string(payload->data+payload->offset, &entry->topic, &entry->topic_len);
+    // Requested QoS
+    payload->offset += mqtt_get_byte(payload->data+payload->offset, &entry->qos);
+
+    return true;
+}
+
+
+/**
+ * Evaluate MQTT SUBSCRIBE packet body length with many topic filters
+ *
+ */
+size_t mqtt_eval_subscribe_many(const char *const *topics, size_t count)
+{
+    size_t body_size = 0;
+
+    body_size += MQTT_PACKET_ID_SIZE;
+    for (size_t i = 0; i < count; i++) {
+        body_size += MQTT_STR_LENGTH_SIZE + strlen(topics[i]);
+        body_size += 1; // Requested QoS
+    }
+
+    return body_size;
+}
+
+
+/**
+ * Format MQTT SUBSCRIBE packet body with many topic filters
+ *
+ *  Buffer should be long enought to store entire message. Use mqtt_eval_subscribe_many() to find expected size of buffer
+ */
+size_t mqtt_format_subscribe_many(unsigned char *buffer, unsigned short id, const char *const *topics,
+                                                         const unsigned char *qos, size_t count)
+{
+    unsigned int offset = 0;
+
+    // --- Variable header ---
+    // Packet Identifier
+    offset += mqtt_put_short(buffer+offset, id);
+
+    // --- Payload ---
+    for (size_t i = 0; i < count; i++) {
+        // Topic Filter
+        offset += mqtt_put_string(buffer+offset, topics[i]);
+        // Requested QoS
+        offset += mqtt_put_byte(buffer+offset, qos[i]);
+    }
+
+    return offset;
+}
+
+
+
+
+
 /**
  * Parse MQTT SUBACK packet body
  *
@@ -563,6 +690,65 @@ size_t mqtt_format_suback(unsigned char *buffer, unsigned short id, unsigned cha
 
 
 
+/**
+ * Parse MQTT SUBACK packet body with many return codes
+ *
+ */
+ssize_t mqtt_parse_suback_many(struct mqtt_suback_many *payload, const unsigned char *buffer, size_t length)
+{
+    if (length < MQTT_SUBACK_VARIABLE_HEADER_SIZE + MQTT_SUBACK_PAYLOAD_SIZE)
+        return -1;
+
+    unsigned int offset = 0;
+
+    // --- Variable header ---
+    // Packet Identifier
+    offset += mqtt_get_short(buffer+offset, &payload->id);
+
+    // --- Payload ---
+    // Return Codes
+    payload->count = length-offset;
+    offset += mqtt_get_data(buffer+offset, &payload->return_codes, payload->count);
+
+    return offset;
+}
+
+
+/**
+ * Evaluate MQTT SUBACK packet body length with many return codes
+ *
+ */
+size_t mqtt_eval_suback_many(size_t count)
+{
+    return MQTT_SUBACK_VARIABLE_HEADER_SIZE + count*MQTT_SUBACK_PAYLOAD_SIZE;
+}
+
+
+/**
+ * Format MQTT SUBACK packet body with many return codes
+ *
+ *  Buffer should be long enought to store entire message. Use mqtt_eval_suback_many() to find expected size of buffer
+ */
+size_t mqtt_format_suback_many(unsigned char *buffer, unsigned short id, const unsigned char *return_codes, size_t count)
+{
+    unsigned int offset = 0;
+
+    // --- Variable header ---
+    // Packet Identifier
+    offset += mqtt_put_short(buffer+offset, id);
+
+    // --- Payload ---
+    // Return Codes
+    memcpy(buffer+offset, return_codes, count);
+    offset += count;
+
+    return offset;
+}
+
+
+
+
+
 /**
  * Parse MQTT UNSUBSCRIBE packet body
  *
@@ -625,6 +811,94 @@ size_t mqtt_format_unsubscribe(unsigned char *buffer, unsigned short id, const c
 
 
 
+/**
+ * Parse MQTT UNSUBSCRIBE packet body with many topic filters
+ *
+ */
+ssize_t mqtt_parse_unsubscribe_many(struct mqtt_unsubscribe_many *payload, const unsigned char *buffer, size_t length)
+{
+    if (length < MQTT_UNSUBSCRIBE_VARIABLE_HEADER_SIZE)
+        return -1;
+
+    size_t offset = 0;
+
+    // --- Variable header ---
+    // Packet Identifier
+    offset += mqtt_get_short(buffer+offset, &payload->id);
+
+    // --- Payload ---
+    ssize_t count = mqtt_count_topic_filters(buffer+offset, length-offset, 0);
+    if (count < 0)
+        return -1;
+
+    payload->count = count;
+    payload->data = buffer+offset;
+    payload->length = length-offset;
+    payload->offset = 0;
+
+    return length;
+}
+
+
+/**
+ * Get next topic filter from parsed MQTT UNSUBSCRIBE packet
+ *
+ */
+bool mqtt_unsubscribe_many_next(struct mqtt_unsubscribe_many *payload, struct mqtt_unsubscribe *entry)
+{
+    if (payload->offset >= payload->length)
+        return false;
+
+    entry->id = payload->id;
+    // Topic Filter
+    payload->offset += mqtt_get_string(payload->data+payload->offset, &entry->topic, &entry->topic_len);
+
+    return true;
+}
+
+
+/**
+ * Evaluate MQTT UNSUBSCRIBE packet body length with many topic filters
+ *
+ */
+size_t mqtt_eval_unsubscribe_many(const char *const *topics, size_t count)
+{
+    size_t body_size = 0;
+
+    body_size += MQTT_PACKET_ID_SIZE;
+    for (size_t i = 0; i < count; i++)
+        body_size += MQTT_STR_LENGTH_SIZE + strlen(topics[i]);
+
+    return body_size;
+}
+
+
+/**
+ * Format MQTT UNSUBSCRIBE packet body with many topic filters
+ *
+ *  Buffer should be long enought to store entire message. Use mqtt_eval_unsubscribe_many() to find expected size of buffer
+ */
+size_t mqtt_format_unsubscribe_many(unsigned char *buffer, unsigned short id, const char *const *topics, size_t count)
+{
+    unsigned int offset = 0;
+
+    // --- Variable header ---
+    // Packet Identifier
+    offset += mqtt_put_short(buffer+offset, id);
+
+    // --- Payload ---
+    for (size_t i = 0; i < count; i++) {
+        // Topic Filter
+        offset += mqtt_put_string(buffer+offset, topics[i]);
+    }
+
+    return offset;
+}
+
+
+
+
+
 /**
  * Parse MQTT UNSUBACK packet body
  *
@@ -0,0 +1,937 @@
+#include "mx/mqtt_session.h"
+#include "mx/memory.h"
+#include "mx/string.h"
+#include "mx/misc.h"
+#include "mx/queue.h"
+#include "mx/tree.h"
+#include "mx/log.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+
+#define MQTT_SESSION_LOG_MAGIC              0x4C53584D      // "MXSL"
+#define MQTT_SESSION_LOG_VERSION            1
+#define MQTT_SESSION_LOG_HEADER_SIZE        8               // Magic + version
+#define MQTT_SESSION_LOG_RECORD_HEADER_SIZE 8               // Length + checksum
+#define MQTT_SESSION_LOG_MESSAGE_HEADER_SIZE 5              // Direction, packet id, type, flags
+
+#define MQTT_SESSION_LOG_MIN_CAPACITY       (64*1024)
+#define MQTT_SESSION_LOG_COMPACT_THRESHOLD  (64*1024)       // Minimal size of obsolete records worth compaction
+#define MQTT_SESSION_LOG_TMP_SUFFIX         ".tmp"
+
+
+enum mqtt_session_log_op_e
+{
+    MQTT_SESSION_LOG_SAVE_MESSAGE = 1,
+    MQTT_SESSION_LOG_REMOVE_MESSAGE,
+    MQTT_SESSION_LOG_SAVE_SUBSCRIPTION,
+    MQTT_SESSION_LOG_REMOVE_SUBSCRIPTION,
+    MQTT_SESSION_LOG_CLEAR,
+};
+
+
+
+struct mqtt_session_log_message
+{
+    unsigned char direction;
+    unsigned short id;
+
+    size_t offset;                  // Record offset in the log
+    size_t size;                    // Record size including header
+
+    RB_ENTRY(mqtt_session_log_message) _entry_;
+    TAILQ_ENTRY(mqtt_session_log_message) _order_;
+};
+
+
+struct mqtt_session_log_subscription
+{
+    char *topic;
+    unsigned short topic_len;
+
+    size_t offset;
+    size_t size;
+
+    RB_ENTRY(mqtt_session_log_subscription) _entry_;
+};
+
+
+struct mqtt_session_log_client
+{
+    char *client_id;
+    size_t client_id_len;
+
+    RB_HEAD(mqtt_session_log_messages, mqtt_session_log_message) messages;
+    TAILQ_HEAD(mqtt_session_log_order, mqtt_session_log_message) order;
+    RB_HEAD(mqtt_session_log_subscriptions, mqtt_session_log_subscription) subscriptions;
+
+    RB_ENTRY(mqtt_session_log_client) _entry_;
+};
+
+
+/**
+ * Append-only session log
+ *
+ * Every change is appended to memory-mapped file as checksummed record, index
+ * in memory refers to records which are still valid. Torn record at the end
+ * of the log is dropped on recovery. Log is rewritten with valid records only
+ * when obsolete ones prevail.
+ *
+ * Records are stored in host byte order.
+ *
+ */
+struct mqtt_session_log
+{
+    struct mqtt_session_store store;
+
+    char *path;
+    int fd;
+    unsigned char *map;
+    size_t capacity;                // Size of mapped file
+    size_t length;                  // End of valid records
+    size_t live;                    // Size of records referred by index
+
+    RB_HEAD(mqtt_session_log_clients, mqtt_session_log_client) clients;
+};
+
+
+
+static int mqtt_session_log_message_cmp(struct mqtt_session_log_message *a, struct mqtt_session_log_message *b)
+{
+    if (a->direction != b->direction)
+        return (a->direction > b->direction) - (a->direction < b->direction);
+    return (a->id > b->id) - (a->id < b->id);
+}
+
+
+static int mqtt_session_log_subscription_cmp(struct mqtt_session_log_subscription *a, struct mqtt_session_log_subscription *b)
+{
+    int ret = memcmp(a->topic, b->topic, MIN(a->topic_len, b->topic_len));
+    if (ret == 0)
+        ret = (a->topic_len > b->topic_len) - (a->topic_len < b->topic_len);
+    return ret;
+}
+
+
+static int mqtt_session_log_client_cmp(struct mqtt_session_log_client *a, struct mqtt_session_log_client *b)
+{
+    int ret = memcmp(a->client_id, b->client_id, MIN(a->client_id_len, b->client_id_len));
+    if (ret == 0)
+        ret = (a->client_id_len > b->client_id_len) - (a->client_id_len < b->client_id_len);
+    return ret;
+}
+
+
+RB_GENERATE_STATIC(mqtt_session_log_messages, mqtt_session_log_message, _entry_, mqtt_session_log_message_cmp)
+RB_GENERATE_STATIC(mqtt_session_log_subscriptions, mqtt_session_log_subscription, _entry_, mqtt_session_log_subscription_cmp)
+RB_GENERATE_STATIC(mqtt_session_log_clients, mqtt_session_log_client, _entry_, mqtt_session_log_client_cmp)
+
+
+
+static struct xpool mqtt_session_log_message_pool = XPOOL_INITIALIZER(sizeof(struct mqtt_session_log_message));
+
+
+
+static void* mqtt_session_log_destructor_impl(struct mqtt_session_store *store);
+static bool  mqtt_session_log_save_message_impl(struct mqtt_session_store *store, const char *client_id,
+                                                                                  const struct mqtt_session_message *msg);
+static bool  mqtt_session_log_remove_message_impl(struct mqtt_session_store *store, const char *client_id,
+                                                                                    unsigned char direction, unsigned short id);
+static bool  mqtt_session_log_save_subscription_impl(struct mqtt_session_store *store, const char *client_id,
+                                                     const char *topic, unsigned short topic_len, unsigned char qos);
+static bool  mqtt_session_log_remove_subscription_impl(struct mqtt_session_store *store, const char *client_id,
+                                                       const char *topic, unsigned short topic_len);
+static bool  mqtt_session_log_clear_impl(struct mqtt_session_store *store, const char *client_id);
+static bool  mqtt_session_log_load_impl(struct mqtt_session_store *store, const char *client_id,
+                                        mqtt_session_message_fn message_handler,
+                                        mqtt_session_subscription_fn subscription_handler, void *arg);
+static int   mqtt_session_log_sync_impl(struct mqtt_session_store *store);
+
+
+static const struct mqtt_session_store_vtable mqtt_session_log_vtable = {
+        .destructor_fn = mqtt_session_log_destructor_impl,
+        .save_message_fn = mqtt_session_log_save_message_impl,
+        .remove_message_fn = mqtt_session_log_remove_message_impl,
+        .save_subscription_fn = mqtt_session_log_save_subscription_impl,
+        .remove_subscription_fn = mqtt_session_log_remove_subscription_impl,
+        .clear_fn = mqtt_session_log_clear_impl,
+        .load_fn = mqtt_session_log_load_impl,
+        .sync_fn = mqtt_session_log_sync_impl,
+};
+
+
+
+
+
+/**
+ * CRC-32 lookup table, reflected polynomial 0xEDB88320
+ *
+ */
+static const uint32_t mqtt_session_log_crc_table[256] = {
+    0x00000000, 0x77073096, 0xEE0E612C, 0x990951BA, 0x076DC419, 0x706AF48F,
+    0xE963A535, 0x9E6495A3, 0x0EDB8832, 0x79DCB8A4, 0xE0D5E91E, 0x97D2D988,
+    0x09B64C2B, 0x7EB17CBD, 0xE7B82D07, 0x90BF1D91, 0x1DB71064, 0x6AB020F2,
+    0xF3B97148, 0x84BE41DE, 0x1ADAD47D, 0x6DDDE4EB, 0xF4D4B551, 0x83D385C7,
+    0x136C9856, 0x646BA8C0, 0xFD62F97A, 0x8A65C9EC, 0x14015C4F, 0x63066CD9,
+    0xFA0F3D63, 0x8D080DF5, 0x3B6E20C8, 0x4C69105E, 0xD56041E4, 0xA2677172,
+    0x3C03E4D1, 0x4B04D447, 0xD20D85FD, 0xA50AB56B, 0x35B5A8FA, 0x42B2986C,
+    0xDBBBC9D6, 0xACBCF940, 0x32D86CE3, 0x45DF5C75, 0xDCD60DCF, 0xABD13D59,
+    0x26D930AC, 0x51DE003A, 0xC8D75180, 0xBFD06116, 0x21B4F4B5, 0x56B3C423,
+    0xCFBA9599, 0xB8BDA50F, 0x2802B89E, 0x5F058808, 0xC60CD9B2, 0xB10BE924,
+    0x2F6F7C87, 0x58684C11, 0xC1611DAB, 0xB6662D3D, 0x76DC4190, 0x01DB7106,
+    0x98D220BC, 0xEFD5102A, 0x71B18589, 0x06B6B51F, 0x9FBFE4A5, 0xE8B8D433,
+    0x7807C9A2, 0x0F00F934, 0x9609A88E, 0xE10E9818, 0x7F6A0DBB, 0x086D3D2D,
+    0x91646C97, 0xE6635C01, 0x6B6B51F4, 0x1C6C6162, 0x856530D8, 0xF262004E,
+    0x6C0695ED, 0x1B01A57B, 0x8208F4C1, 0xF50FC457, 0x65B0D9C6, 0x12B7E950,
+    0x8BBEB8EA, 0xFCB9887C, 0x62DD1DDF, 0x15DA2D49, 0x8CD37CF3, 0xFBD44C65,
+    0x4DB26158, 0x3AB551CE, 0xA3BC0074, 0xD4BB30E2, 0x4ADFA541, 0x3DD895D7,
+    0xA4D1C46D, 0xD3D6F4FB, 0x4369E96A, 0x346ED9FC, 0xAD678846, 0xDA60B8D0,
+    0x44042D73, 0x33031DE5, 0xAA0A4C5F, 0xDD0D7CC9, 0x5005713C, 0x270241AA,
+    0xBE0B1010, 0xC90C2086, 0x5768B525, 0x206F85B3, 0xB966D409, 0xCE61E49F,
+    0x5EDEF90E, 0x29D9C998, 0xB0D09822, 0xC7D7A8B4, 0x59B33D17, 0x2EB40D81,
+    0xB7BD5C3B, 0xC0BA6CAD, 0xEDB88320, 0x9ABFB3B6, 0x03B6E20C, 0x74B1D29A,
+    0xEAD54739, 0x9DD277AF, 0x04DB2615, 0x73DC1683, 0xE3630B12, 0x94643B84,
+    0x0D6D6A3E, 0x7A6A5AA8, 0xE40ECF0B, 0x9309FF9D, 0x0A00AE27, 0x7D079EB1,
+    0xF00F9344, 0x8708A3D2, 0x1E01F268, 0x6906C2FE, 0xF762575D, 0x806567CB,
+    0x196C3671, 0x6E6B06E7, 0xFED41B76, 0x89D32BE0, 0x10DA7A5A, 0x67DD4ACC,
+    0xF9B9DF6F, 0x8EBEEFF9, 0x17B7BE43, 0x60B08ED5, 0xD6D6A3E8, 0xA1D1937E,
+    0x38D8C2C4, 0x4FDFF252, 0xD1BB67F1, 0xA6BC5767, 0x3FB506DD, 0x48B2364B,
+    0xD80D2BDA, 0xAF0A1B4C, 0x36034AF6, 0x41047A60, 0xDF60EFC3, 0xA867DF55,
+    0x316E8EEF, 0x4669BE79, 0xCB61B38C, 0xBC66831A, 0x256FD2A0, 0x5268E236,
+    0xCC0C7795, 0xBB0B4703, 0x220216B9, 0x5505262F, 0xC5BA3BBE, 0xB2BD0B28,
+    0x2BB45A92, 0x5CB36A04, 0xC2D7FFA7, 0xB5D0CF31, 0x2CD99E8B, 0x5BDEAE1D,
+    0x9B64C2B0, 0xEC63F226, 0x756AA39C, 0x026D930A, 0x9C0906A9, 0xEB0E363F,
+    0x72076785, 0x05005713, 0x95BF4A82, 0xE2B87A14, 0x7BB12BAE, 0x0CB61B38,
+    0x92D28E9B, 0xE5D5BE0D, 0x7CDCEFB7, 0x0BDBDF21, 0x86D3D2D4, 0xF1D4E242,
+    0x68DDB3F8, 0x1FDA836E, 0x81BE16CD, 0xF6B9265B, 0x6FB077E1, 0x18B74777,
+    0x88085AE6, 0xFF0F6A70, 0x66063BCA, 0x11010B5C, 0x8F659EFF, 0xF862AE69,
+    0x616BFFD3, 0x166CCF45, 0xA00AE278, 0xD70DD2EE, 0x4E048354, 0x3903B3C2,
+    0xA7672661, 0xD06016F7, 0x4969474D, 0x3E6E77DB, 0xAED16A4A, 0xD9D65ADC,
+    0x40DF0B66, 0x37D83BF0, 0xA9BCAE53, 0xDEBB9EC5, 0x47B2CF7F, 0x30B5FFE9,
+    0xBDBDF21C, 0xCABAC28A, 0x53B39330, 0x24B4A3A6, 0xBAD03605, 0xCDD70693,
+    0x54DE5729, 0x23D967BF, 0xB3667A2E, 0xC4614AB8, 0x5D681B02, 0x2A6F2B94,
+    0xB40BBE37, 0xC30C8EA1, 0x5A05DF1B, 0x2D02EF8D
+};
+
+
+/**
+ * Calculate CRC-32 checksum of the record
+ *
+ */
+static uint32_t mqtt_session_log_checksum(const unsigned char *data, size_t length)
+{
+    uint32_t crc = 0xFFFFFFFF;
+    for (size_t i = 0; i < length; i++)
+        crc = mqtt_session_log_crc_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+
+    return crc ^ 0xFFFFFFFF;
+}
+
+
+
+
+
+/**
+ * Client session constructor
+ *
+ */
+static struct mqtt_session_log_client* mqtt_session_log_client_new(const char *client_id, size_t client_id_len)
+{
+    struct mqtt_session_log_client *self = xmalloc(sizeof(struct mqtt_session_log_client));
+    self->client_id = xstrndup(client_id, client_id_len);
+    self->client_id_len = client_id_len;
+
+    RB_INIT(&self->messages);
+    TAILQ_INIT(&self->order);
+    RB_INIT(&self->subscriptions);
+    return self;
+}
+
+
+/**
+ * Client session destructor
+ *
+ */
+static struct mqtt_session_log_client* mqtt_session_log_client_delete(struct mqtt_session_log_client *self)
+{
+    struct mqtt_session_log_message *msg, *tmp_msg;
+    TAILQ_FOREACH_SAFE(msg, &self->order, _order_, tmp_msg) {
+        TAILQ_REMOVE(&self->order, msg, _order_);
+        xpool_free(&mqtt_session_log_message_pool, msg);
+    }
+
+    struct mqtt_session_log_subscription *sub, *tmp_sub;
+    RB_FOREACH_SAFE(sub, mqtt_session_log_subscriptions, &self->subscriptions, tmp_sub) {
+        RB_REMOVE(mqtt_session_log_subscriptions, &self->subscriptions, sub);
+        xfree(sub->topic);
+        xfree(sub);
+    }
+
+    xfree(self->client_id);
+    return xfree(self);
+}
+
+
+static bool mqtt_session_log_client_is_empty(struct mqtt_session_log_client *self)
+{
+    return TAILQ_EMPTY(&self->order) && RB_EMPTY(&self->subscriptions);
+}
+
+
+static struct mqtt_session_log_client* mqtt_session_log_find_client(struct mqtt_session_log *self,
+                                                                    const char *client_id, size_t client_id_len)
+{
+    struct mqtt_session_log_client key;
+    key.client_id = (char*)client_id;
+    key.client_id_len = client_id_len;
+    return RB_FIND(mqtt_session_log_clients, &self->clients, &key);
+}
+
+
+static struct mqtt_session_log_client* mqtt_session_log_add_client(struct mqtt_session_log *self,
+                                                                   const char *client_id, size_t client_id_len)
+{
+    struct mqtt_session_log_client *client = mqtt_session_log_client_new(client_id, client_id_len);
+    RB_INSERT(mqtt_session_log_clients, &self->clients, client);
+    return client;
+}
+
+
+static void mqtt_session_log_remove_client(struct mqtt_session_log *self, struct mqtt_session_log_client *client)
+{
+    struct mqtt_session_log_message *msg;
+    TAILQ_FOREACH(msg, &client->order, _order_)
+        self->live -= msg->size;
+
+    struct mqtt_session_log_subscription *sub;
+    RB_FOREACH(sub, mqtt_session_log_subscriptions, &client->subscriptions)
+        self->live -= sub->size;
+
+    RB_REMOVE(mqtt_session_log_clients, &self->clients, client);
+    mqtt_session_log_client_delete(client);
+}
+
+
+
+
+
+/**
+ * Map log file of given size
+ *
+ */
+static bool mqtt_session_log_map(struct mqtt_session_log *self, size_t capacity)
+{
+    if (ftruncate(self->fd, capacity) < 0) {
+        ERROR("Could not resize session log %s, %s", self->path, strerror(errno));
+        return false;
+    }
+
+    unsigned char *map = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, self->fd, 0);
+    if (map == MAP_FAILED) {
+        ERROR("Could not map session log %s, %s", self->path, strerror(errno));
+        return false;
+    }
+
+    if (self->map)
+        munmap(self->map, self->capacity);
+    self->map = map;
+    self->capacity = capacity;
+    return true;
+}
+
+
+/**
+ * Make room for record of given size at the end of the log
+ *
+ */
+static bool mqtt_session_log_reserve(struct mqtt_session_log *self, size_t size)
+{
+    if (self->length + size <= self->capacity)
+        return true;
+
+    size_t capacity = self->capacity;
+    while (self->length + size > capacity)
+        capacity *= 2;
+
+    return mqtt_session_log_map(self, capacity);
+}
+
+
+/**
+ * Decode record and update the index
+ *
+ * Used both for new records and for records replayed on recovery, so the
+ * index is always built the same way. Returns false for malformed record.
+ *
+ */
+static bool mqtt_session_log_apply(struct mqtt_session_log *self, size_t offset)
+{
+    uint32_t length;
+    memcpy(&length, self->map + offset, sizeof(length));
+    const unsigned char *body = self->map + offset + MQTT_SESSION_LOG_RECORD_HEADER_SIZE;
+    size_t size = MQTT_SESSION_LOG_RECORD_HEADER_SIZE + length;
+
+    // Operation and client id
+    if (length < 3)
+        return false;
+    unsigned char op = body[0];
+    uint16_t client_id_len;
+    memcpy(&client_id_len, body + 1, sizeof(client_id_len));
+    if (length < 3 + (size_t)client_id_len)
+        return false;
+    const char *client_id = (const char*)body + 3;
+    const unsigned char *data = body + 3 + client_id_len;
+    size_t data_len = length - 3 - client_id_len;
+
+    struct mqtt_session_log_client *client = mqtt_session_log_find_client(self, client_id, client_id_len);
+
+    switch (op) {
+        case MQTT_SESSION_LOG_SAVE_MESSAGE:
+        case MQTT_SESSION_LOG_REMOVE_MESSAGE: {
+            // Direction, packet id, type and flags of saved message
+            size_t key_len = (op == MQTT_SESSION_LOG_SAVE_MESSAGE) ? MQTT_SESSION_LOG_MESSAGE_HEADER_SIZE : 3;
+            if (data_len < key_len)
+                return false;
+            struct mqtt_session_log_message key;
+            key.direction = data[0];
+            memcpy(&key.id, data + 1, sizeof(key.id));
+            if (!client && op == MQTT_SESSION_LOG_SAVE_MESSAGE)
+                client = mqtt_session_log_add_client(self, client_id, client_id_len);
+            if (!client)
+                break;
+
+            struct mqtt_session_log_message *msg = RB_FIND(mqtt_session_log_messages, &client->messages, &key);
+            if (msg) {
+                self->live -= msg->size;
+                TAILQ_REMOVE(&client->order, msg, _order_);
+                if (op == MQTT_SESSION_LOG_REMOVE_MESSAGE) {
+                    RB_REMOVE(mqtt_session_log_messages, &client->messages, msg);
+                    xpool_free(&mqtt_session_log_message_pool, msg);
+                }
+            }
+            else if (op == MQTT_SESSION_LOG_SAVE_MESSAGE) {
+                msg = xpool_alloc(&mqtt_session_log_message_pool);
+                msg->direction = key.direction;
+                msg->id = key.id;
+                RB_INSERT(mqtt_session_log_messages, &client->messages, msg);
+            }
+
+            if (op == MQTT_SESSION_LOG_SAVE_MESSAGE) {
+                // Replaced message goes to the end
+                msg->offset = offset;
+                msg->size = size;
+                TAILQ_INSERT_TAIL(&client->order, msg, _order_);
+                self->live += size;
+            }
+        }   break;
+
+        case MQTT_SESSION_LOG_SAVE_SUBSCRIPTION:
+        case MQTT_SESSION_LOG_REMOVE_SUBSCRIPTION: {
+            size_t topic_offset = (op == MQTT_SESSION_LOG_SAVE_SUBSCRIPTION) ? 1 : 0;   // Requested QoS
+            if (data_len <= topic_offset || data_len - topic_offset > 0xFFFF)
+                return false;
+            struct mqtt_session_log_subscription key;
+            key.topic = (char*)data + topic_offset;
+            key.topic_len = data_len - topic_offset;
+            if (!client && op == MQTT_SESSION_LOG_SAVE_SUBSCRIPTION)
+                client = mqtt_session_log_add_client(self, client_id, client_id_len);
+            if (!client)
+                break;
+
+            struct mqtt_session_log_subscription *sub = RB_FIND(mqtt_session_log_subscriptions, &client->subscriptions, &key);
+            if (sub) {
+                self->live -= sub->size;
+                if (op == MQTT_SESSION_LOG_REMOVE_SUBSCRIPTION) {
+                    RB_REMOVE(mqtt_session_log_subscriptions, &client->subscriptions, sub);
+                    xfree(sub->topic);
+                    xfree(sub);
+                }
+            }
+            else if (op == MQTT_SESSION_LOG_SAVE_SUBSCRIPTION) {
+                sub = xmalloc(sizeof(struct mqtt_session_log_subscription));
+                sub->topic = xstrndup(key.topic, key.topic_len);
+                sub->topic_len = key.topic_len;
+                RB_INSERT(mqtt_session_log_subscriptions, &client->subscriptions, sub);
+            }
+
+            if (op == MQTT_SESSION_LOG_SAVE_SUBSCRIPTION) {
+                sub->offset = offset;
+                sub->size = size;
+                self->live += size;
+            }
+        }   break;
+
+        case MQTT_SESSION_LOG_CLEAR:
+            if (client)
+                mqtt_session_log_remove_client(self, client);
+            client = NULL;
+            break;
+
+        default:
+            return false;
+    }
+
+    if (client && mqtt_session_log_client_is_empty(client))
+        mqtt_session_log_remove_client(self, client);
+
+    return true;
+}
+
+
+/**
+ * Move valid records to the given map
+ *
+ * Records are visited always in the same order, so the first pass may copy
+ * records and the second one may update offsets once new log is in place.
+ *
+ */
+static size_t mqtt_session_log_move(struct mqtt_session_log *self, unsigned char *dest, bool commit)
+{
+    size_t offset = MQTT_SESSION_LOG_HEADER_SIZE;
+
+    struct mqtt_session_log_client *client;
+    RB_FOREACH(client, mqtt_session_log_clients, &self->clients) {
+        struct mqtt_session_log_message *msg;
+        TAILQ_FOREACH(msg, &client->order, _order_) {
+            if (dest)
+                memcpy(dest + offset, self->map + msg->offset, msg->size);
+            if (commit)
+                msg->offset = offset;
+            offset += msg->size;
+        }
+
+        struct mqtt_session_log_subscription *sub;
+        RB_FOREACH(sub, mqtt_session_log_subscriptions, &client->subscriptions) {
+            if (dest)
+                memcpy(dest + offset, self->map + sub->offset, sub->size);
+            if (commit)
+                sub->offset = offset;
+            offset += sub->size;
+        }
+    }
+
+    return offset;
+}
+
+
+/**
+ * Append record and apply it to the index
+ *
+ * Record is formatted from parts which follow the client id. Log is compacted
+ * when obsolete records prevail.
+ *
+ */
+static bool mqtt_session_log_append(struct mqtt_session_log *self, unsigned char op, const char *client_id,
+                                    const void *part1, size_t part1_len, const void *part2, size_t part2_len)
+{
+    size_t client_id_len = strlen(client_id);
+    if (client_id_len > 0xFFFF) {
+        WARN("Client id too long, %zu bytes", client_id_len);
+        return false;
+    }
+
+    size_t length = 3 + client_id_len + part1_len + part2_len;
+    size_t size = MQTT_SESSION_LOG_RECORD_HEADER_SIZE + length;
+    if (length > UINT32_MAX || !mqtt_session_log_reserve(self, size))
+        return false;
+
+    unsigned char *record = self->map + self->length;
+    unsigned char *body = record + MQTT_SESSION_LOG_RECORD_HEADER_SIZE;
+    uint16_t id_len = client_id_len;
+
+    body[0] = op;
+    memcpy(body + 1, &id_len, sizeof(id_len));
+    memcpy(body + 3, client_id, client_id_len);
+    if (part1_len)
+        memcpy(body + 3 + client_id_len, part1, part1_len);
+    if (part2_len)
+        memcpy(body + 3 + client_id_len + part1_len, part2, part2_len);
+
+    // Length is written last, record is valid once checksum matches
+    uint32_t checksum = mqtt_session_log_checksum(body, length);
+    uint32_t record_len = length;
+    memcpy(record + 4, &checksum, sizeof(checksum));
+    memcpy(record, &record_len, sizeof(record_len));
+
+    size_t offset = self->length;
+    self->length += size;
+    mqtt_session_log_apply(self, offset);
+
+    size_t obsolete = self->length - MQTT_SESSION_LOG_HEADER_SIZE - self->live;
+    if (obsolete > MQTT_SESSION_LOG_COMPACT_THRESHOLD && obsolete > self->live)
+        mqtt_session_log_compact(self);
+
+    return true;
+}
+
+
+/**
+ * Replay records of existing log
+ *
+ * Replay stops at the first record which is incomplete or damaged, the rest
+ * of the file is cleared so that it is not mistaken for valid records later.
+ *
+ */
+static void mqtt_session_log_recover(struct mqtt_session_log *self)
+{
+    size_t offset = MQTT_SESSION_LOG_HEADER_SIZE;
+    bool damaged = false;
+
+    while (offset + MQTT_SESSION_LOG_RECORD_HEADER_SIZE <= self->capacity) {
+        uint32_t length, checksum;
+        memcpy(&length, self->map + offset, sizeof(length));
+        memcpy(&checksum, self->map + offset + 4, sizeof(checksum));
+        if (length == 0)
+            break;  // End of log
+
+        const unsigned char *body = self->map + offset + MQTT_SESSION_LOG_RECORD_HEADER_SIZE;
+        if (length > self->capacity - offset - MQTT_SESSION_LOG_RECORD_HEADER_SIZE ||
+            mqtt_session_log_checksum(body, length) != checksum ||
+            !mqtt_session_log_apply(self, offset)) {
+            damaged = true;
+            break;
+        }
+
+        offset += MQTT_SESSION_LOG_RECORD_HEADER_SIZE + length;
+    }
+
+    self->length = offset;
+    if (damaged) {
+        WARN("Session log %s damaged at %zu offset, %zu bytes dropped", self->path, offset, self->capacity - offset);
+        memset(self->map + offset, 0, self->capacity - offset);
+    }
+}
+
+
+/**
+ * Open or create log file
+ *
+ */
+static bool mqtt_session_log_open(struct mqtt_session_log *self)
+{
+    self->fd = open(self->path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (self->fd < 0) {
+        ERROR("Could not open session log %s, %s", self->path, strerror(errno));
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(self->fd, &st) < 0) {
+        ERROR("Could not stat session log %s, %s", self->path, strerror(errno));
+        return false;
+    }
+
+    bool created = (st.st_size == 0);
+    size_t capacity = MAX((size_t)st.st_size, (size_t)MQTT_SESSION_LOG_MIN_CAPACITY);
+    if (!mqtt_session_log_map(self, capacity))
+        return false;
+
+    uint32_t header[2] = { MQTT_SESSION_LOG_MAGIC, MQTT_SESSION_LOG_VERSION };
+    if (created) {
+        memcpy(self->map, header, sizeof(header));
+        self->length = MQTT_SESSION_LOG_HEADER_SIZE;
+    }
+    else if (memcmp(self->map, header, sizeof(header)) != 0) {
+        ERROR("File %s is not a session log", self->path);
+        return false;
+    }
+    else {
+        mqtt_session_log_recover(self);
+    }
+
+    return true;
+}
+
+
+
+
+
+/**
+ * Session log constructor
+ *
+ * Existing log is recovered, new one is created otherwise.
+ *
+ */
+struct mqtt_session_log* mqtt_session_log_new(const char *path)
+{
+    struct mqtt_session_log *self = xmalloc(sizeof(struct mqtt_session_log));
+    self->store.vtable = &mqtt_session_log_vtable;
+
+    self->path = xstrdup(path);
+    self->fd = -1;
+    self->map = NULL;
+    self->capacity = 0;
+    self->length = 0;
+    self->live = 0;
+    RB_INIT(&self->clients);
+
+    if (!mqtt_session_log_open(self))
+        return mqtt_session_log_delete(self);
+
+    return self;
+}
+
+
+/**
+ * Session log destructor
+ *
+ */
+struct mqtt_session_log* mqtt_session_log_delete(struct mqtt_session_log *self)
+{
+    struct mqtt_session_log_client *client, *tmp;
+    RB_FOREACH_SAFE(client, mqtt_session_log_clients, &self->clients, tmp) {
+        RB_REMOVE(mqtt_session_log_clients, &self->clients, client);
+        mqtt_session_log_client_delete(client);
+    }
+
+    if (self->map) {
+        msync(self->map, self->length, MS_SYNC);
+        munmap(self->map, self->capacity);
+    }
+    if (self->fd >= 0)
+        close(self->fd);
+
+    xfree(self->path);
+    return xfree(self);
+}
+
+
+/**
+ * Cast session log to store interface
+ *
+ */
+struct mqtt_session_store* mqtt_session_log_to_store(struct mqtt_session_log *self)
+{
+    return &self->store;
+}
+
+
+/**
+ * Flush directory entry of the log, so that rename survives a crash
+ *
+ */
+static bool mqtt_session_log_sync_dir(const char *path)
+{
+    const char *slash = strrchr(path, '/');
+    char dir[slash ? (size_t)(slash - path) + 2 : 2];
+    if (!slash)
+        strcpy(dir, ".");
+    else
+        xstrlcpy(dir, path, (slash == path) ? 2 : (size_t)(slash - path) + 1);
+
+    int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+
+    int ret = fsync(fd);
+    close(fd);
+    return ret == 0;
+}
+
+
+/**
+ * Rewrite log with valid records only
+ *
+ * New log is written aside and renamed over the old one, crash at any point
+ * leaves one of them complete.
+ *
+ */
+bool mqtt_session_log_compact(struct mqtt_session_log *self)
+{
+    size_t length = mqtt_session_log_move(self, NULL, false);
+    size_t capacity = MQTT_SESSION_LOG_MIN_CAPACITY;
+    while (capacity < 2 * length)
+        capacity *= 2;
+
+    char tmp_path[strlen(self->path) + sizeof(MQTT_SESSION_LOG_TMP_SUFFIX)];
+    sprintf(tmp_path, "%s" MQTT_SESSION_LOG_TMP_SUFFIX, self->path);
+
+    int fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        ERROR("Could not open session log %s, %s", tmp_path, strerror(errno));
+        return false;
+    }
+    unsigned char *map = MAP_FAILED;
+    if (ftruncate(fd, capacity) == 0)
+        map = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        ERROR("Could not map session log %s, %s", tmp_path, strerror(errno));
+        close(fd);
+        unlink(tmp_path);
+        return false;
+    }
+
+    memcpy(map, self->map, MQTT_SESSION_LOG_HEADER_SIZE);
+    mqtt_session_log_move(self, map, false);
+
+    if (msync(map, length, MS_SYNC) < 0 || fsync(fd) < 0 || rename(tmp_path, self->path) < 0) {
+        ERROR("Could not replace session log %s, %s", self->path, strerror(errno));
+        munmap(map, capacity);
+        close(fd);
+        unlink(tmp_path);
+        return false;
+    }
+
+    if (!mqtt_session_log_sync_dir(self->path))
+        WARN("Could not sync directory of session log %s, %s", self->path, strerror(errno));
+
+    mqtt_session_log_move(self, NULL, true);
+    munmap(self->map, self->capacity);
+    close(self->fd);
+
+    self->fd = fd;
+    self->map = map;
+    self->capacity = capacity;
+    self->length = length;
+    return true;
+}
+
+
+/**
+ * Return size of log including obsolete records
+ *
+ */
+size_t mqtt_session_log_get_size(struct mqtt_session_log *self)
+{
+    return self->length;
+}
+
+
+
+
+
+////// Virtual function definitions for session store
+
+void* mqtt_session_log_destructor_impl(struct mqtt_session_store *store)
+{
+    return mqtt_session_log_delete((struct mqtt_session_log*)store);
+}
+
+
+bool mqtt_session_log_save_message_impl(struct mqtt_session_store *store, const char *client_id,
+                                                                          const struct mqtt_session_message *msg)
+{
+    unsigned char hdr[MQTT_SESSION_LOG_MESSAGE_HEADER_SIZE];
+    hdr[0] = msg->direction;
+    memcpy(hdr + 1, &msg->id, sizeof(msg->id));
+    hdr[3] = msg->type;
+    hdr[4] = msg->flags;
+
+    return mqtt_session_log_append((struct mqtt_session_log*)store, MQTT_SESSION_LOG_SAVE_MESSAGE, client_id,
+                                   hdr, sizeof(hdr), msg->data, msg->length);
+}
+
+
+bool mqtt_session_log_remove_message_impl(struct mqtt_session_store *store, const char *client_id,
+                                                                            unsigned char direction, unsigned short id)
+{
+    struct mqtt_session_log *self = (struct mqtt_session_log*)store;
+    struct mqtt_session_log_client *client = mqtt_session_log_find_client(self, client_id, strlen(client_id));
+    if (!client)
+        return true;    // Nothing to remove
+
+    struct mqtt_session_log_message key;
+    key.direction = direction;
+    key.id = id;
+    if (!RB_FIND(mqtt_session_log_messages, &client->messages, &key))
+        return true;
+
+    unsigned char hdr[3];
+    hdr[0] = direction;
+    memcpy(hdr + 1, &id, sizeof(id));
+    return mqtt_session_log_append(self, MQTT_SESSION_LOG_REMOVE_MESSAGE, client_id, hdr, sizeof(hdr), NULL, 0);
+}
+
+
+bool mqtt_session_log_save_subscription_impl(struct mqtt_session_store *store, const char *client_id,
+                                             const char *topic, unsigned short topic_len, unsigned char qos)
+{
+    if (topic_len == 0)
+        return false;
+
+    return mqtt_session_log_append((struct mqtt_session_log*)store, MQTT_SESSION_LOG_SAVE_SUBSCRIPTION, client_id,
+                                   &qos, sizeof(qos), topic, topic_len);
+}
+
+
+bool mqtt_session_log_remove_subscription_impl(struct mqtt_session_store *store, const char *client_id,
+                                               const char *topic, unsigned short topic_len)
+{
+    struct mqtt_session_log *self = (struct mqtt_session_log*)store;
+    struct mqtt_session_log_client *client = mqtt_session_log_find_client(self, client_id, strlen(client_id));
+    if (!client || topic_len == 0)
+        return true;    // Nothing to remove
+
+    struct mqtt_session_log_subscription key;
+    key.topic = (char*)topic;
+    key.topic_len = topic_len;
+    if (!RB_FIND(mqtt_session_log_subscriptions, &client->subscriptions, &key))
+        return true;
+
+    return mqtt_session_log_append(self, MQTT_SESSION_LOG_REMOVE_SUBSCRIPTION, client_id, topic, topic_len, NULL, 0);
+}
+
+
+bool mqtt_session_log_clear_impl(struct mqtt_session_store *store, const char *client_id)
+{
+    struct mqtt_session_log *self = (struct mqtt_session_log*)store;
+    if (!mqtt_session_log_find_client(self, client_id, strlen(client_id)))
+        return true;    // Nothing to clear
+
+    return mqtt_session_log_append(self, MQTT_SESSION_LOG_CLEAR, client_id, NULL, 0, NULL, 0);
+}
+
+
+bool mqtt_session_log_load_impl(struct mqtt_session_store *store, const char *client_id,
+                                mqtt_session_message_fn message_handler,
+                                mqtt_session_subscription_fn subscription_handler, void *arg)
+{
+    struct mqtt_session_log *self = (struct mqtt_session_log*)store;
+    struct mqtt_session_log_client *client = mqtt_session_log_find_client(self, client_id, strlen(client_id));
+    if (!client)
+        return false;   // No session
+
+    if (message_handler) {
+        struct mqtt_session_log_message *msg;
+        TAILQ_FOREACH(msg, &client->order, _order_) {
+            // Record layout: header, op, client id, direction, id, type, flags, data
+            size_t hdr_offset = MQTT_SESSION_LOG_RECORD_HEADER_SIZE + 3 + client->client_id_len;
+            size_t data_offset = hdr_offset + MQTT_SESSION_LOG_MESSAGE_HEADER_SIZE;
+            const unsigned char *hdr = self->map + msg->offset + hdr_offset;
+
+            struct mqtt_session_message entry;
+            entry.direction = msg->direction;
+            entry.id = msg->id;
+            entry.type = hdr[3];
+            entry.flags = hdr[4];
+            entry.data = self->map + msg->offset + data_offset;
+            entry.length = msg->size - data_offset;
+            message_handler(arg, &entry);
+        }
+    }
+
+    if (subscription_handler) {
+        struct mqtt_session_log_subscription *sub;
+        RB_FOREACH(sub, mqtt_session_log_subscriptions, &client->subscriptions) {
+            const unsigned char *qos = self->map + sub->offset + MQTT_SESSION_LOG_RECORD_HEADER_SIZE + 3 + client->client_id_len;
+            subscription_handler(arg, sub->topic, sub->topic_len, *qos);
+        }
+    }
+
+    return true;
+}
+
+
+int mqtt_session_log_sync_impl(struct mqtt_session_store *store)
+{
+    struct mqtt_session_log *self = (struct mqtt_session_log*)store;
+    return msync(self->map, self->length, MS_SYNC);
+}
@@ -0,0 +1,480 @@
+
+#include "mx/mqtt_trie.h"
+#include "mx/memory.h"
+#include "mx/misc.h"
+#include "mx/tree.h"
+
+#include <string.h>
+
+
+
+struct mqtt_trie_sub
+{
+    void *subscriber;
+    unsigned char qos;
+
+    RB_ENTRY(mqtt_trie_sub) _entry_;
+};
+
+
+struct mqtt_trie_node
+{
+    char *level;
+    size_t level_len;
+
+    struct mqtt_trie_node *parent;
+    RB_HEAD(mqtt_trie_children, mqtt_trie_node) children;
+    struct mqtt_trie_node *single;      // '+' child
+    struct mqtt_trie_node *multi;       // '#' child
+
+    RB_HEAD(mqtt_trie_subs, mqtt_trie_sub) subs;
+
+    RB_ENTRY(mqtt_trie_node) _entry_;
+};
+
+
+
+static int mqtt_trie_node_cmp(struct mqtt_trie_node *a, struct mqtt_trie_node *b)
+{
+    int ret = memcmp(a->level, b->level, MIN(a->level_len, b->level_len));
+    if (ret == 0)
+        ret = (a->level_len > b->level_len) - (a->level_len < b->level_len);
+    return ret;
+}
+
+
+static int mqtt_trie_sub_cmp(struct mqtt_trie_sub *a, struct mqtt_trie_sub *b)
+{
+    return (a->subscriber > b->subscriber) - (a->subscriber < b->subscriber);
+}
+
+
+RB_GENERATE_STATIC(mqtt_trie_children, mqtt_trie_node, _entry_, mqtt_trie_node_cmp)
+RB_GENERATE_STATIC(mqtt_trie_subs, mqtt_trie_sub, _entry_, mqtt_trie_sub_cmp)
+
+
+
+static struct xpool mqtt_trie_sub_pool = XPOOL_INITIALIZER(sizeof(struct mqtt_trie_sub));
+
+
+
+/**
+ * Node constructor
+ *
+ */
+static struct mqtt_trie_node* mqtt_trie_node_new(struct mqtt_trie_node *parent, const char *level, size_t level_len)
+{
+    struct mqtt_trie_node *self = xmalloc(sizeof(struct mqtt_trie_node));
+    self->level = xmalloc(level_len + 1);
+    memcpy(self->level, level, level_len);
+    self->level[level_len] = '\0';
+    self->level_len = level_len;
+
+    self->parent = parent;
+    RB_INIT(&self->children);
+    self->single = NULL;
+    self->multi = NULL;
+    RB_INIT(&self->subs);
+    return self;
+}
+
+
+/**
+ * Node destructor, whole subtree is released
+ *
+ */
+static struct mqtt_trie_node* mqtt_trie_node_delete(struct mqtt_trie_node *self)
+{
+    struct mqtt_trie_node *child, *tmp_child;
+    RB_FOREACH_SAFE(child, mqtt_trie_children, &self->children, tmp_child) {
+        RB_REMOVE(mqtt_trie_children, &self->children, child);
+        mqtt_trie_node_delete(child);
+    }
+    if (self->single)
+        mqtt_trie_node_delete(self->single);
+    if (self->multi)
+        mqtt_trie_node_delete(self->multi);
+
+    struct mqtt_trie_sub *sub, *tmp_sub;
+    RB_FOREACH_SAFE(sub, mqtt_trie_subs, &self->subs, tmp_sub) {
+        RB_REMOVE(mqtt_trie_subs, &self->subs, sub);
+        xpool_free(&mqtt_trie_sub_pool, sub);
+    }
+
+    xfree(self->level);
+    return xfree(self);
+}
+
+
+/**
+ * Check if node may be removed
+ *
+ */
+static bool mqtt_trie_node_is_empty(struct mqtt_trie_node *self)
+{
+    return RB_EMPTY(&self->children) && !self->single && !self->multi && RB_EMPTY(&self->subs);
+}
+
+
+/**
+ * Return slot of wildcard child, NULL for regular level
+ *
+ */
+static struct mqtt_trie_node** mqtt_trie_node_slot(struct mqtt_trie_node *self, const char *level, size_t level_len)
+{
+    if (level_len == 1 && level[0] == MQTT_TOPIC_SINGLE_LEVEL)
+        return &self->single;
+    if (level_len == 1 && level[0] == MQTT_TOPIC_MULTI_LEVEL)
+        return &self->multi;
+    return NULL;
+}
+
+
+/**
+ * Find regular child node
+ *
+ */
+static struct mqtt_trie_node* mqtt_trie_node_find(struct mqtt_trie_node *self, const char *level, size_t level_len)
+{
+    struct mqtt_trie_node key;
+    key.level = (char*)level;
+    key.level_len = level_len;
+    return RB_FIND(mqtt_trie_children, &self->children, &key);
+}
+
+
+/**
+ * Remove empty nodes up to the root
+ *
+ */
+static void mqtt_trie_node_prune(struct mqtt_trie_node *self)
+{
+    while (self->parent && mqtt_trie_node_is_empty(self)) {
+        struct mqtt_trie_node *parent = self->parent;
+        struct mqtt_trie_node **slot = mqtt_trie_node_slot(parent, self->level, self->level_len);
+        if (slot)
+            *slot = NULL;
+        else
+            RB_REMOVE(mqtt_trie_children, &parent->children, self);
+
+        mqtt_trie_node_delete(self);
+        self = parent;
+    }
+}
+
+
+/**
+ * Find node of the filter, create missing levels if requested
+ *
+ */
+static struct mqtt_trie_node* mqtt_trie_find_filter(struct mqtt_trie *self, const char *filter, unsigned short filter_len,
+                                                                            bool create)
+{
+    struct mqtt_trie_node *node = self->root;
+    const char *level = filter;
+    const char *end = filter + filter_len;
+
+    for (;;) {
+        const char *sep = memchr(level, MQTT_TOPIC_SEPARATOR, end - level);
+        size_t level_len = (sep ? sep : end) - level;
+
+        struct mqtt_trie_node **slot = mqtt_trie_node_slot(node, level, level_len);
+        struct mqtt_trie_node *child = slot ? *slot : mqtt_trie_node_find(node, level, level_len);
+        if (!child) {
+            if (!create)
+                return NULL;
+
+            child = mqtt_trie_node_new(node, level, level_len);
+            if (slot)
+                *slot = child;
+            else
+                RB_INSERT(mqtt_trie_children, &node->children, child);
+        }
+
+        node = child;
+        if (!sep)
+            return node;
+        level = sep + 1;
+    }
+}
+
+
+/**
+ * Hand out all subscriptions of the node
+ *
+ */
+static size_t mqtt_trie_node_notify(struct mqtt_trie_node *self, mqtt_trie_match_fn handler, void *arg)
+{
+    size_t count = 0;
+    struct mqtt_trie_sub *sub;
+    RB_FOREACH(sub, mqtt_trie_subs, &self->subs) {
+        handler(sub->subscriber, sub->qos, arg);
+        count++;
+    }
+    return count;
+}
+
+
+/**
+ * Match topic levels starting with given one
+ *
+ * Level is NULL when all levels were matched. Wildcards at the first level
+ * do not match topics starting with '$'.
+ *
+ */
+static size_t mqtt_trie_node_match(struct mqtt_trie_node *self, const char *level, const char *end, bool first,
+                                                                mqtt_trie_match_fn handler, void *arg)
+{
+    size_t count = 0;
+
+    if (!level) {
+        // Parent level is matched by multi-level wildcard too
+        count += mqtt_trie_node_notify(self, handler, arg);
+        if (self->multi)
+            count += mqtt_trie_node_notify(self->multi, handler, arg);
+        return count;
+    }
+
+    const char *sep = memchr(level, MQTT_TOPIC_SEPARATOR, end - level);
+    size_t level_len = (sep ? sep : end) - level;
+    const char *next = sep ? sep + 1 : NULL;
+
+    struct mqtt_trie_node *child = mqtt_trie_node_find(self, level, level_len);
+    if (child)
+        count += mqtt_trie_node_match(child, next, end, false, handler, arg);
+
+    if (first && level_len > 0 && level[0] == MQTT_TOPIC_SYSTEM)
+        return count;
+
+    if (self->single)
+        count += mqtt_trie_node_match(self->single, next, end, false, handler, arg);
+    if (self->multi)
+        count += mqtt_trie_node_notify(self->multi, handler, arg);
+
+    return count;
+}
+
+
+/**
+ * Remove subscriber from the subtree
+ *
+ */
+static size_t mqtt_trie_node_remove_subscriber(struct mqtt_trie_node *self, void *subscriber)
+{
+    size_t count = 0;
+
+    // Children are pruned by their parent
+    struct mqtt_trie_node *child, *tmp;
+    RB_FOREACH_SAFE(child, mqtt_trie_children, &self->children, tmp) {
+        count += mqtt_trie_node_remove_subscriber(child, subscriber);
+        if (mqtt_trie_node_is_empty(child)) {
+            RB_REMOVE(mqtt_trie_children, &self->children, child);
+            mqtt_trie_node_delete(child);
+        }
+    }
+    if (self->single) {
+        count += mqtt_trie_node_remove_subscriber(self->single, subscriber);
+        if (mqtt_trie_node_is_empty(self->single))
+            self->single = mqtt_trie_node_delete(self->single);
+    }
+    if (self->multi) {
+        count += mqtt_trie_node_remove_subscriber(self->multi, subscriber);
+        if (mqtt_trie_node_is_empty(self->multi))
+            self->multi = mqtt_trie_node_delete(self->multi);
+    }
+
+    struct mqtt_trie_sub key;
+    key.subscriber = subscriber;
+    struct mqtt_trie_sub *sub = RB_FIND(mqtt_trie_subs, &self->subs, &key);
+    if (sub) {
+        RB_REMOVE(mqtt_trie_subs, &self->subs, sub);
+        xpool_free(&mqtt_trie_sub_pool, sub);
+        count++;
+    }
+
+    return count;
+}
+
+
+
+
+
+/**
+ * Subscription index initializer
+ *
+ */
+void mqtt_trie_init(struct mqtt_trie *self)
+{
+    self->root = mqtt_trie_node_new(NULL, "", 0);
+    self->count = 0;
+}
+
+
+/**
+ * Subscription index cleaner
+ *
+ */
+void mqtt_trie_clean(struct mqtt_trie *self)
+{
+    self->root = mqtt_trie_node_delete(self->root);
+    self->count = 0;
+}
+
+
+/**
+ * Subscription index constructor
+ *
+ */
+struct mqtt_trie* mqtt_trie_new(void)
+{
+    struct mqtt_trie *self = xmalloc(sizeof(struct mqtt_trie));
+    mqtt_trie_init(self);
+    return self;
+}
+
+
+/**
+ * Subscription index destructor
+ *
+ */
+struct mqtt_trie* mqtt_trie_delete(struct mqtt_trie *self)
+{
+    mqtt_trie_clean(self);
+    return xfree(self);
+}
+
+
+/**
+ * Add subscription
+ *
+ * QoS of existing subscription is updated. Returns false if filter is invalid.
+ *
+ */
+bool mqtt_trie_insert(struct mqtt_trie *self, const char *filter, unsigned short filter_len,
+                                              void *subscriber, unsigned char qos)
+{
+    if (!mqtt_topic_filter_is_valid(filter, filter_len))
+        return false;
+
+    struct mqtt_trie_node *node = mqtt_trie_find_filter(self, filter, filter_len, true);
+
+    struct mqtt_trie_sub key;
+    key.subscriber = subscriber;
+    struct mqtt_trie_sub *sub = RB_FIND(mqtt_trie_subs, &node->subs, &key);
+    if (!sub) {
+        sub = xpool_alloc(&mqtt_trie_sub_pool);
+        sub->subscriber = subscriber;
+        RB_INSERT(mqtt_trie_subs, &node->subs, sub);
+        self->count++;
+    }
+    sub->qos = qos;
+    return true;
+}
+
+
+/**
+ * Remove subscription
+ *
+ * Returns false if subscription was not found.
+ *
+ */
+bool mqtt_trie_remove(struct mqtt_trie *self, const char *filter, unsigned short filter_len, void *subscriber)
+{
+    if (!mqtt_topic_filter_is_valid(filter, filter_len))
+        return false;
+
+    struct mqtt_trie_node *node = mqtt_trie_find_filter(self, filter, filter_len, false);
+    if (!node)
+        return false;
+
+    struct mqtt_trie_sub key;
+    key.subscriber = subscriber;
+    struct mqtt_trie_sub *sub = RB_FIND(mqtt_trie_subs, &node->subs, &key);
+    if (!sub)
+        return false;
+
+    RB_REMOVE(mqtt_trie_subs, &node->subs, sub);
+    xpool_free(&mqtt_trie_sub_pool, sub);
+    self->count--;
+
+    mqtt_trie_node_prune(node);
+    return true;
+}
+
+
+/**
+ * Remove all subscriptions of the subscriber
+ *
+ * Whole index is visited, returns number of removed subscriptions.
+ *
+ */
+size_t mqtt_trie_remove_subscriber(struct mqtt_trie *self, void *subscriber)
+{
+    size_t count = mqtt_trie_node_remove_subscriber(self->root, subscriber);
+    self->count -= count;
+    return count;
+}
+
+
+/**
+ * Find subscriptions matching topic name
+ *
+ * Handler is called for each matching subscription, subscriber matching
+ * with several filters is reported several times. Returns number of matches.
+ *
+ */
+size_t mqtt_trie_match(struct mqtt_trie *self, const char *topic, unsigned short topic_len,
+                                               mqtt_trie_match_fn handler, void *arg)
+{
+    if (!mqtt_topic_name_is_valid(topic, topic_len))
+        return 0;
+
+    return mqtt_trie_node_match(self->root, topic, topic + topic_len, true, handler, arg);
+}
+
+
+/**
+ * Check topic filter
+ *
+ * Wildcards have to occupy entire level, multi-level one has to be the last.
+ *
+ */
+bool mqtt_topic_filter_is_valid(const char *filter, unsigned short filter_len)
+{
+    if (!filter || filter_len == 0)
+        return false;
+
+    for (unsigned short i = 0; i < filter_len; i++) {
+        char c = filter[i];
+        if (c == '\0')
+            return false;
+        if (c != MQTT_TOPIC_SINGLE_LEVEL && c != MQTT_TOPIC_MULTI_LEVEL)
+            continue;
+
+        if (i > 0 && filter[i-1] != MQTT_TOPIC_SEPARATOR)
+            return false;
+        if (c == MQTT_TOPIC_MULTI_LEVEL && i != filter_len - 1)
+            return false;
+        if (c == MQTT_TOPIC_SINGLE_LEVEL && i != filter_len - 1 && filter[i+1] != MQTT_TOPIC_SEPARATOR)
+            return false;
+    }
+    return true;
+}
+
+
+/**
+ * Check topic name, wildcards are not allowed
+ *
+ */
+bool mqtt_topic_name_is_valid(const char *topic, unsigned short topic_len)
+{
+    if (!topic || topic_len == 0)
+        return false;
+
+    for (unsigned short i = 0; i < topic_len; i++) {
+        char c = topic[i];
+        if (c == '\0' || c == MQTT_TOPIC_SINGLE_LEVEL || c == MQTT_TOPIC_MULTI_LEVEL)
+            return false;
+    }
+    return true;
+}
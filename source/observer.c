@@ -5,6 +5,10 @@
 
 
 
+static struct xpool observer_pool = XPOOL_INITIALIZER(sizeof(struct observer));
+
+
+
 /**
  * Initialize object
  *
@@ -33,7 +37,7 @@ void observer_clean(struct observer *self)
  */
 struct observer* observer_new(void)
 {
-    struct observer *self = xmalloc(sizeof(struct observer));
+    struct observer *self = xpool_alloc(&observer_pool);
     observer_init(self);
     return self;
 }
@@ -60,7 +64,7 @@ struct observer* observer_create(void *object, int type, observer_notify_fn hand
 struct observer* observer_delete(struct observer *self)
 {
     observer_clean(self);
-    return xfree(self);
+    return xpool_free(&observer_pool, self);
 }
 
 
@@ -5,11 +5,15 @@
 
 #include "mx/stream.h"
 #include "mx/buffer.h"
+#include "mx/iobuf.h"
 #include "mx/observer.h"
 #include "mx/queue.h"
 #include "mx/log.h"
+#include "mx/timer.h"
 
 #include <stdio.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 
 
 
@@ -33,6 +37,9 @@
 #define STREAM_MQTT_CLS     3
 
 
+#define STREAM_RING_IOV     64      // Segments written by single ring request at most
+
+
 
 
 enum stream_notify_type_en
@@ -51,21 +58,50 @@ enum stream_notify_type_en
 typedef void* (*stream_destructor_fn)(struct stream *self);
 typedef ssize_t (*stream_read_fn)(struct stream *self, void *buffer, size_t length);
 typedef ssize_t (*stream_write_fn)(struct stream *self, const void *buffer, size_t length);
+typedef ssize_t (*stream_write_iobuf_fn)(struct stream *self, struct iobuf *data);
 typedef int     (*stream_flush_fn)(struct stream *self);
 typedef int     (*stream_time_fn)(struct stream *self);
+typedef ssize_t (*stream_pending_fn)(struct stream *self, bool discard);
 
 struct stream_vtable
 {
     stream_destructor_fn destructor_fn;
     stream_read_fn read_fn;
     stream_write_fn write_fn;
+    stream_write_iobuf_fn write_iobuf_fn;   // Optional, data is copied into contiguous buffer if not defined
     stream_flush_fn flush_fn;
     stream_time_fn time_fn;
+    stream_pending_fn pending_fn;           // Optional, writes next part of held back data or drops it
 };
 
 
 
 
+/**
+ * Reads and writes submitted by io_uring idler
+ *
+ * Owned by the stream which holds the descriptor, see stream_set_ring_io().
+ * Requests reference this memory until they complete.
+ *
+ */
+struct stream_ring
+{
+    bool enabled;                   // Requested by application
+    bool active;                    // Requests are submitted by idler
+    unsigned int read_token;        // Pending receive request, 0 if none
+    unsigned int write_token;       // Pending send request, 0 if none
+
+    struct iobuf inbound;           // Received data not read by the stream yet
+    bool eof;
+    int error;                      // Error reported by completed request
+
+    struct iobuf inflight;          // Queued data referenced by pending send request
+    bool discard;                   // Queue was reset while send was pending
+    struct msghdr msg;
+    struct iovec iov[STREAM_RING_IOV];
+};
+
+
 struct stream{
     const struct stream_vtable *vtable;
     int rtti;
@@ -74,10 +110,30 @@ struct stream{
     int status;
 
     struct stream *decorated;
+    struct stream *decorator;       // Stream which decorates this one
     struct observer *observer;
 
+    time_t deadline;                // Time handler deadline in ms, 0 if not needed
+
+    struct idler *idler;            // Idler the stream is registered in
+    unsigned int idler_events;      // Events registered in idler
+    unsigned int idler_status;      // Status reported by last idler wait
+    time_t idler_deadline;          // Earliest deadline of decoration chain
+    int idler_heap_idx;             // Position in idler deadline heap
+    unsigned int idler_token;       // Pending io_uring poll request, 0 if none
+    struct stream_ring *ring;       // io_uring reads and writes, NULL if not requested
+
     LIST_ENTRY(stream) _entry_;
-    TAILQ_HEAD(stream_buffer_slice_head, buffer_slice) outgoing;
+    struct iobuf outgoing;
+    size_t pending_length;          // Data held back until queues drain, see pending_fn
+
+    size_t inbound_length;          // Received data cached by the stream
+    size_t inbound_low;             // Reading is resumed when cache drops to this level
+    size_t inbound_high;            // Reading is paused when cache reaches this level, 0 if unlimited
+    bool inbound_paused;
+    size_t outbound_low;            // Writing is accepted again when queues drop to this level
+    size_t outbound_high;           // Writing is refused when queues reach this level, 0 if unlimited
+    bool outbound_paused;
 
 };
 
@@ -87,5 +143,10 @@ void stream_clean(struct stream *self);
 
 struct stream* stream_get_decorated(struct stream *self);
 
+void stream_set_deadline(struct stream *self, time_t deadline);
+void stream_set_inbound_length(struct stream *self, size_t length);
+void stream_set_pending_length(struct stream *self, size_t length);
+time_t stream_get_deadline(struct stream *self);
+
 
 #endif /* __MX_PRIVATE_STREAM_H_ */
@@ -0,0 +1,77 @@
+#ifndef __MX_PRIVATE_URING_H_
+#define __MX_PRIVATE_URING_H_
+
+
+#include <linux/io_uring.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+
+
+
+/**
+ * Minimal io_uring instance
+ *
+ * Kernel interface is used directly, so that liburing is not needed.
+ *
+ */
+struct uring
+{
+    int fd;
+
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned int sq_pending;        // Entries prepared but not submitted yet
+
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *ring;
+    size_t ring_size;
+    size_t sqes_size;
+};
+
+
+/**
+ * Provided buffer ring
+ *
+ * Receive requests with IOSQE_BUFFER_SELECT take buffers from the ring, so
+ * that memory is not bound to requests until data arrives.
+ *
+ */
+struct uring_buffers
+{
+    struct io_uring_buf_ring *ring;
+    size_t ring_size;
+    unsigned char *data;
+    unsigned int count;             // Number of buffers, power of two
+    unsigned int size;              // Size of each buffer
+    unsigned short group;           // Buffer group identifier
+    unsigned short tail;            // Local copy of ring tail
+};
+
+
+
+bool uring_init(struct uring *self, unsigned int entries);
+void uring_clean(struct uring *self);
+
+struct io_uring_sqe* uring_get_sqe(struct uring *self);
+int uring_submit(struct uring *self);
+int uring_submit_and_wait(struct uring *self, unsigned long time_ms);
+
+struct io_uring_cqe* uring_peek_cqe(struct uring *self);
+void uring_cqe_seen(struct uring *self);
+
+bool uring_buffers_init(struct uring_buffers *self, struct uring *uring, unsigned short group,
+                        unsigned int count, unsigned int size);
+void uring_buffers_clean(struct uring_buffers *self, struct uring *uring);
+unsigned char* uring_buffers_get(struct uring_buffers *self, unsigned short bid);
+void uring_buffers_put(struct uring_buffers *self, unsigned short bid);
+
+
+#endif /* __MX_PRIVATE_URING_H_ */
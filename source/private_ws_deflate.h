@@ -0,0 +1,42 @@
+#ifndef __MX_PRIVATE_WS_DEFLATE_H_
+#define __MX_PRIVATE_WS_DEFLATE_H_
+
+
+#include "mx/buffer.h"
+
+#include <stddef.h>
+#include <stdbool.h>
+
+
+
+enum ws_deflate_mode_e
+{
+    WS_DEFLATE_CHUNK,       // More data of the same frame follows
+    WS_DEFLATE_FRAME,       // End of frame, message is continued in next frame
+    WS_DEFLATE_MESSAGE,     // End of message
+};
+
+
+enum ws_deflate_status_e
+{
+    WS_DEFLATE_OK,
+    WS_DEFLATE_FAILED,      // Corrupted data
+    WS_DEFLATE_TOO_BIG,     // Decompressed payload exceeds the limit
+};
+
+
+struct ws_deflate;
+
+
+
+struct ws_deflate* ws_deflate_new(int deflate_window_bits, bool deflate_no_context_takeover,
+                                  int inflate_window_bits, bool inflate_no_context_takeover,
+                                  int mem_level);
+struct ws_deflate* ws_deflate_delete(struct ws_deflate *self);
+
+bool ws_deflate_compress(struct ws_deflate *self, const void *data, size_t length, int mode, struct buffer *out);
+int ws_deflate_decompress(struct ws_deflate *self, const void *data, size_t length, bool final,
+                          size_t limit, struct buffer *out);
+
+
+#endif /* __MX_PRIVATE_WS_DEFLATE_H_ */
@@ -0,0 +1,503 @@
+
+#define _GNU_SOURCE
+
+#include "mx/reactor.h"
+#include "mx/idler.h"
+#include "mx/stream.h"
+#include "mx/socket.h"
+
+#include "mx/log.h"
+#include "mx/memory.h"
+#include "mx/queue.h"
+#include "mx/misc.h"
+#include "mx/timer.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+
+
+#define REACTOR_WAIT_TIMEOUT        1000
+#define REACTOR_LISTEN_BACKLOG      128
+
+
+
+struct reactor_job
+{
+    reactor_job_fn job;         // NULL for accepted descriptor hand-off
+    void *object;
+    int fd;
+
+    TAILQ_ENTRY(reactor_job) _entry_;
+};
+
+
+struct reactor_loop
+{
+    struct reactor *reactor;
+    unsigned int idx;
+
+    pthread_t thread;
+    bool running;               // Cleared by other thread, accessed atomically
+
+    struct idler *idler;
+    struct stream *listener;    // Own listening socket, SO_REUSEPORT shares the port
+
+    pthread_mutex_t jobs_lock;
+    TAILQ_HEAD(reactor_job_head, reactor_job) jobs;
+};
+
+
+struct reactor
+{
+    struct reactor_loop *loops;
+    unsigned int loops_count;
+    unsigned int next_loop;     // Round robin dispatch position
+
+    bool started;
+
+    void *acceptor_object;
+    reactor_on_accept_clbk acceptor_handler;
+
+    void *stream_object;
+    reactor_on_stream_clbk stream_handler;
+};
+
+
+
+
+/**
+ * Constructor
+ *
+ * Number of loops defaults to number of online cores if 0 is given.
+ *
+ */
+struct reactor* reactor_new(unsigned int loops)
+{
+    if (loops == 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        loops = (cores > 0) ? cores : 1;
+    }
+
+    struct reactor *self = xmalloc(sizeof(struct reactor));
+    self->loops = xcalloc(loops, sizeof(struct reactor_loop));
+    self->loops_count = loops;
+    self->next_loop = 0;
+    self->started = false;
+
+    self->acceptor_object = NULL;
+    self->acceptor_handler = NULL;
+    self->stream_object = NULL;
+    self->stream_handler = NULL;
+
+    for (unsigned int i = 0; i < self->loops_count; i++) {
+        struct reactor_loop *loop = &self->loops[i];
+        loop->reactor = self;
+        loop->idx = i;
+        loop->running = false;
+        loop->idler = idler_new();
+        loop->listener = NULL;
+        pthread_mutex_init(&loop->jobs_lock, NULL);
+        TAILQ_INIT(&loop->jobs);
+    }
+
+    return self;
+}
+
+
+/**
+ * Destructor
+ *
+ * Streams added to loop idlers are not deleted, they are owned by application.
+ *
+ */
+struct reactor* reactor_delete(struct reactor *self)
+{
+    reactor_stop(self);
+
+    for (unsigned int i = 0; i < self->loops_count; i++) {
+        struct reactor_loop *loop = &self->loops[i];
+
+        if (loop->listener) {
+            socket_close(stream_get_fd(loop->listener));
+            loop->listener = stream_delete(loop->listener);
+        }
+
+        struct reactor_job *job, *tmp;
+        TAILQ_FOREACH_SAFE(job, &loop->jobs, _entry_, tmp) {
+            TAILQ_REMOVE(&loop->jobs, job, _entry_);
+            if (!job->job)
+                socket_close(job->fd);      // Never handed over
+            xfree(job);
+        }
+
+        pthread_mutex_destroy(&loop->jobs_lock);
+        loop->idler = idler_delete(loop->idler);
+    }
+
+    xfree(self->loops);
+    return xfree(self);
+}
+
+
+unsigned int reactor_get_loops(struct reactor *self)
+{
+    return self->loops_count;
+}
+
+
+/**
+ * Return idler of given loop
+ *
+ * Idler should be accessed from its own loop thread only, once reactor is started.
+ *
+ */
+struct idler* reactor_get_idler(struct reactor *self, unsigned int loop)
+{
+    if (loop >= self->loops_count)
+        return NULL;
+
+    return self->loops[loop].idler;
+}
+
+
+/**
+ * Set handler of accepted connections
+ *
+ * Handler is called from the loop thread which owns the connection. It should
+ * create a stream and add it to the given idler.
+ *
+ */
+void reactor_set_acceptor(struct reactor *self, void *object, reactor_on_accept_clbk handler)
+{
+    self->acceptor_object = object;
+    self->acceptor_handler = handler;
+}
+
+
+/**
+ * Set handler of streams which need attention
+ *
+ * If handler is not defined, time, outgoing data and incoming data handlers
+ * are called directly, in this order.
+ *
+ */
+void reactor_set_handler(struct reactor *self, void *object, reactor_on_stream_clbk handler)
+{
+    self->stream_object = object;
+    self->stream_handler = handler;
+}
+
+
+/**
+ * Close listening sockets opened so far
+ *
+ */
+static void reactor_close_sockets(int *socks, unsigned int count)
+{
+    for (unsigned int i = 0; i < count; i++) {
+        if (socks[i] >= 0)
+            socket_close(socks[i]);
+    }
+}
+
+
+/**
+ * Listen on given address in every loop
+ *
+ * Each loop gets its own socket bound with SO_REUSEPORT, so that kernel
+ * distributes incoming connections between loops. Sockets are registered
+ * only if all of them are listening, none is left open otherwise.
+ *
+ */
+int reactor_listen(struct reactor *self, const char *addr, unsigned int port)
+{
+    int family = strchr(addr, ':') ? AF_INET6 : AF_INET;
+    int socks[self->loops_count];
+
+    for (unsigned int i = 0; i < self->loops_count; i++) {
+        socks[i] = -1;
+        if (self->loops[i].listener)
+            continue;   // Already listening
+
+        int sock = socket_open(family, SOCK_STREAM);
+        if (sock < 0) {
+            reactor_close_sockets(socks, i);
+            return -1;
+        }
+        socket_set_reuse_addr(sock, 1);
+        socket_set_reuse_port(sock, 1);
+
+        int ret = socket_listen_inet(sock, addr, port);
+        if (ret >= 0) {
+            // Raise backlog of listening socket
+            ret = listen(sock, REACTOR_LISTEN_BACKLOG);
+            if (ret < 0)
+                ERROR("Reactor loop %u, cannot listen on %s : %u, %s", i, addr, port, strerror(errno));
+        }
+        if (ret < 0) {
+            socket_close(sock);
+            reactor_close_sockets(socks, i);
+            return -1;
+        }
+        socket_set_non_blocking(sock, 1);
+        socks[i] = sock;
+    }
+
+    for (unsigned int i = 0; i < self->loops_count; i++) {
+        if (socks[i] < 0)
+            continue;
+
+        struct reactor_loop *loop = &self->loops[i];
+        loop->listener = stream_new(socks[i]);
+        idler_add_stream(loop->idler, loop->listener);
+    }
+
+    return 0;
+}
+
+
+/**
+ * Hand accepted descriptor to the application
+ *
+ */
+static void reactor_loop_accept(struct reactor_loop *self, int fd)
+{
+    struct reactor *reactor = self->reactor;
+
+    if (!reactor->acceptor_handler) {
+        WARN("Reactor acceptor not defined, closing %d fd", fd);
+        socket_close(fd);
+        return;
+    }
+
+    reactor->acceptor_handler(reactor->acceptor_object, self->idler, fd);
+}
+
+
+/**
+ * Accept all pending connections of the loop listening socket
+ *
+ */
+static void reactor_loop_handle_listener(struct reactor_loop *self)
+{
+    while (1) {
+        int fd = accept(stream_get_fd(self->listener), NULL, NULL);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                WARN("Reactor loop %u, accept failed %s", self->idx, strerror(errno));
+            break;
+        }
+
+        socket_set_non_blocking(fd, 1);
+        reactor_loop_accept(self, fd);
+    }
+}
+
+
+/**
+ * Run jobs posted by other threads
+ *
+ */
+static void reactor_loop_handle_jobs(struct reactor_loop *self)
+{
+    struct reactor_job_head jobs;
+    TAILQ_INIT(&jobs);
+
+    pthread_mutex_lock(&self->jobs_lock);
+    TAILQ_CONCAT(&jobs, &self->jobs, _entry_);
+    pthread_mutex_unlock(&self->jobs_lock);
+
+    struct reactor_job *job, *tmp;
+    TAILQ_FOREACH_SAFE(job, &jobs, _entry_, tmp) {
+        TAILQ_REMOVE(&jobs, job, _entry_);
+        if (job->job)
+            job->job(job->object, self->idler);
+        else
+            reactor_loop_accept(self, job->fd);
+        xfree(job);
+    }
+}
+
+
+/**
+ * Handle stream which needs attention
+ *
+ * Observer is notified last, it may delete the stream.
+ *
+ */
+static void reactor_loop_handle_stream(struct reactor_loop *self, struct stream *stream, unsigned int status)
+{
+    struct reactor *reactor = self->reactor;
+
+    if (reactor->stream_handler) {
+        reactor->stream_handler(reactor->stream_object, self->idler, stream, status);
+        return;
+    }
+
+    if (status & STREAM_TIMER_EXPIRED)
+        stream_time(stream);
+    if (status & STREAM_OUTGOING_READY)
+        stream_handle_outgoing_data(stream);
+    if (status & STREAM_INCOMING_READY)
+        stream_handle_incoming_data(stream);
+}
+
+
+/**
+ * Pin calling thread to given core
+ *
+ */
+static void reactor_loop_set_affinity(struct reactor_loop *self)
+{
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cores <= 0)
+        return;
+
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(self->idx % cores, &cpuset);
+
+    int ret = pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+    if (ret != 0)
+        WARN("Reactor loop %u, cannot set affinity %s", self->idx, strerror(ret));
+}
+
+
+/**
+ * Loop thread
+ *
+ */
+static void* reactor_loop_run(void *arg)
+{
+    struct reactor_loop *self = arg;
+
+    reactor_loop_set_affinity(self);
+
+    while (__atomic_load_n(&self->running, __ATOMIC_ACQUIRE)) {
+        clock_update_sys();
+
+        int ret = idler_wait(self->idler, REACTOR_WAIT_TIMEOUT);
+        if (ret == IDLER_ERROR) {
+            ERROR("Reactor loop %u, wait failed", self->idx);
+            break;
+        }
+
+        // Handlers check timers against time after wait
+        clock_update_sys();
+
+        reactor_loop_handle_jobs(self);
+
+        if (ret != IDLER_OPERATION)
+            continue;
+
+        unsigned int status;
+        struct stream *stream = NULL;
+        while ((stream = idler_get_next_stream(self->idler, stream, &status))) {
+            if (stream == self->listener)
+                reactor_loop_handle_listener(self);
+            else
+                reactor_loop_handle_stream(self, stream, status);
+        }
+    }
+
+    return NULL;
+}
+
+
+/**
+ * Start loop threads
+ *
+ */
+bool reactor_start(struct reactor *self)
+{
+    if (self->started)
+        return true;
+
+    for (unsigned int i = 0; i < self->loops_count; i++) {
+        struct reactor_loop *loop = &self->loops[i];
+        loop->running = true;
+        if (pthread_create(&loop->thread, NULL, reactor_loop_run, loop) != 0) {
+            ERROR("Cannot start reactor loop %u", i);
+            loop->running = false;
+            reactor_stop(self);
+            return false;
+        }
+    }
+
+    self->started = true;
+    return true;
+}
+
+
+/**
+ * Stop loop threads and wait for them
+ *
+ */
+void reactor_stop(struct reactor *self)
+{
+    for (unsigned int i = 0; i < self->loops_count; i++) {
+        struct reactor_loop *loop = &self->loops[i];
+        if (!loop->running)
+            continue;
+
+        __atomic_store_n(&loop->running, false, __ATOMIC_RELEASE);
+        idler_wakeup(loop->idler);
+        pthread_join(loop->thread, NULL);
+    }
+
+    self->started = false;
+}
+
+
+/**
+ * Add job to the loop queue and wake the loop up
+ *
+ */
+static bool reactor_loop_post(struct reactor_loop *self, reactor_job_fn job, void *object, int fd)
+{
+    struct reactor_job *item = xmalloc(sizeof(struct reactor_job));
+    item->job = job;
+    item->object = object;
+    item->fd = fd;
+
+    pthread_mutex_lock(&self->jobs_lock);
+    TAILQ_INSERT_TAIL(&self->jobs, item, _entry_);
+    pthread_mutex_unlock(&self->jobs_lock);
+
+    idler_wakeup(self->idler);
+    return true;
+}
+
+
+/**
+ * Run job in given loop thread
+ *
+ */
+bool reactor_post(struct reactor *self, unsigned int loop, reactor_job_fn job, void *object)
+{
+    if ((loop >= self->loops_count) || !job)
+        return false;
+
+    return reactor_loop_post(&self->loops[loop], job, object, -1);
+}
+
+
+/**
+ * Hand descriptor accepted elsewhere to the next loop, round robin
+ *
+ * Returns index of the loop which takes the descriptor.
+ *
+ */
+unsigned int reactor_dispatch(struct reactor *self, int fd)
+{
+    unsigned int loop = __sync_fetch_and_add(&self->next_loop, 1) % self->loops_count;
+
+    reactor_loop_post(&self->loops[loop], NULL, NULL, fd);
+    return loop;
+}
@@ -306,7 +306,7 @@ int socket_listen_inet(int sock, const char *addr, unsigned int port)
 
     struct addrinfo hints, *result;
     memset (&hints, 0, sizeof (hints));
-    hints.ai_family = socket_is_valid(sock) ? AF_UNSPEC : socket_get_addr_family(sock);
+    hints.ai_family = socket_is_valid(sock) ? socket_get_addr_family(sock) : AF_UNSPEC;
     hints.ai_socktype = SOCK_STREAM;
     hints.ai_flags |= AI_PASSIVE;
 
@@ -1,5 +1,7 @@
 
 #include "mx/stream.h"
+#include "mx/buffer.h"
+#include "mx/idler.h"
 #include "mx/memory.h"
 #include "mx/queue.h"
 #include "mx/misc.h"
@@ -10,35 +12,11 @@
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <sys/uio.h>
 
 
 
-
-
-
-
-struct buffer_slice
-{
-    struct buffer buffer;
-
-    TAILQ_ENTRY(buffer_slice) _entry_;
-};
-
-
-struct buffer_slice* buffer_slice_new(const void *buffer, size_t length)
-{
-    struct buffer_slice *self = xmalloc(sizeof(struct buffer_slice));
-    buffer_init(&self->buffer, length);
-    buffer_append(&self->buffer, buffer, length);
-    return self;
-}
-
-
-struct buffer_slice* buffer_slice_delete(struct buffer_slice *self)
-{
-    buffer_clean(&self->buffer);
-    return xfree(self);
-}
+#define STREAM_IOV_MAX          64      // Segments written by single writev() at most, kept on stack
 
 
 
@@ -49,6 +27,7 @@ struct buffer_slice* buffer_slice_delete(struct buffer_slice *self)
 static void* stream_destructor_impl(struct stream*);
 static ssize_t stream_read_impl(struct stream *self, void *buffer, size_t length);
 static ssize_t stream_write_impl(struct stream *self, const void *buffer, size_t length);
+static ssize_t stream_write_iobuf_impl(struct stream *self, struct iobuf *data);
 static int     stream_flush_impl(struct stream *self);
 static int     stream_time_impl(struct stream *self);
 
@@ -56,6 +35,7 @@ static const struct stream_vtable stream_vtable = {
         .destructor_fn = stream_destructor_impl,
         .read_fn = stream_read_impl,
         .write_fn = stream_write_impl,
+        .write_iobuf_fn = stream_write_iobuf_impl,
         .flush_fn = stream_flush_impl,
         .time_fn = stream_time_impl,
 };
@@ -70,12 +50,42 @@ void stream_init(struct stream *self, int fd, struct stream *decorated)
 {
     self->fd = fd;
     self->decorated = decorated;
+    self->decorator = NULL;
     self->observer = NULL;
 
+    if (decorated)
+        decorated->decorator = self;
+
+    self->deadline = 0;
+
+    self->idler = NULL;
+    self->idler_events = 0;
+    self->idler_status = 0;
+    self->idler_deadline = 0;
+    self->idler_heap_idx = -1;
+    self->idler_token = 0;
+    self->ring = NULL;
+
+    self->inbound_length = 0;
+    self->inbound_low = 0;
+    self->inbound_high = 0;
+    self->inbound_paused = false;
+    self->outbound_low = 0;
+    self->outbound_high = 0;
+    self->outbound_paused = false;
+
     // Stream is ready if file descriptor is defined
     self->status = (fd >= 0) ? STREAM_ST_READY : STREAM_ST_INIT;
 
-    TAILQ_INIT(&self->outgoing);
+    iobuf_init(&self->outgoing);
+    self->pending_length = 0;
+
+    if (decorated && decorated->idler) {
+        // Idler is attached to the outermost stream, decorator takes over registration
+        struct idler *idler = decorated->idler;
+        idler_remove_stream(idler, decorated);
+        idler_add_stream(idler, self);
+    }
 }
 
 
@@ -85,11 +95,20 @@ void stream_init(struct stream *self, int fd, struct stream *decorated)
  */
 void stream_clean(struct stream *self)
 {
+    if (self->idler)
+        idler_remove_stream(self->idler, self);
+
     stream_reset_outgoing_data(self);
     stream_remove_observer(self);
 
     self->fd = -1;
 
+    if (self->ring) {
+        iobuf_clean(&self->ring->inbound);
+        iobuf_clean(&self->ring->inflight);
+        self->ring = xfree(self->ring);
+    }
+
     if (self->decorated)
         self->decorated = stream_delete(self->decorated);
 }
@@ -137,6 +156,34 @@ int stream_get_fd(struct stream *self)
 }
 
 
+/**
+ * Return the outermost stream of decoration chain
+ *
+ * Idler is attached to this stream.
+ *
+ */
+static struct stream* stream_get_outermost(struct stream *self)
+{
+    while (self->decorator)
+        self = self->decorator;
+
+    return self;
+}
+
+
+/**
+ * Let idler know that outgoing data state might have changed
+ *
+ */
+static void stream_update_idler(struct stream *self)
+{
+    self = stream_get_outermost(self);
+
+    if (self->idler)
+        idler_update_stream(self->idler, self);
+}
+
+
 /**
  * Set new status for the stream
  *
@@ -144,6 +191,9 @@ int stream_get_fd(struct stream *self)
 void stream_set_status(struct stream *self, int status)
 {
     self->status = status;
+
+    // Decorator may push its queued data only if this stream is ready
+    stream_update_idler(self);
 }
 
 
@@ -167,6 +217,199 @@ struct stream* stream_get_decorated(struct stream *self)
 }
 
 
+/**
+ * Set deadline for stream time handler
+ *
+ * Deadline is absolute time in milliseconds, see timer_deadline(). Pass 0
+ * if time handler is not needed.
+ *
+ */
+void stream_set_deadline(struct stream *self, time_t deadline)
+{
+    // Expired stream is taken out of idler heap, the same deadline schedules it again
+    if ((self->deadline == deadline) && (!deadline || stream_get_outermost(self)->idler_heap_idx >= 0))
+        return;
+
+    self->deadline = deadline;
+    stream_update_idler(self);
+}
+
+
+/**
+ * Return the earliest deadline of the stream and decorated streams
+ *
+ */
+time_t stream_get_deadline(struct stream *self)
+{
+    time_t deadline = self->deadline;
+
+    if (self->decorated) {
+        time_t decorated_deadline = stream_get_deadline(self->decorated);
+        if (decorated_deadline && (!deadline || decorated_deadline < deadline))
+            deadline = decorated_deadline;
+    }
+
+    return deadline;
+}
+
+
+/**
+ * Set limits of received data cached by the stream
+ *
+ * When cache reaches high watermark, stream stops reading from the descriptor
+ * until the application consumes data down to low watermark. Pass 0 as high
+ * watermark to disable the limit.
+ *
+ */
+void stream_set_inbound_watermarks(struct stream *self, size_t low, size_t high)
+{
+    self->inbound_low = low;
+    self->inbound_high = high;
+    stream_set_inbound_length(self, self->inbound_length);
+}
+
+
+/**
+ * Set limits of outgoing data queued by the stream and decorated streams
+ *
+ * When queues reach high watermark, writes are refused with ENOBUFS until
+ * queued data drops to low watermark. Pass 0 as high watermark to disable
+ * the limit. Limits should be set on the stream used by the application.
+ *
+ */
+void stream_set_outbound_watermarks(struct stream *self, size_t low, size_t high)
+{
+    self->outbound_low = low;
+    self->outbound_high = high;
+    self->outbound_paused = false;
+}
+
+
+/**
+ * Update amount of received data cached by the stream
+ *
+ * Called by streams which cache received messages.
+ *
+ */
+void stream_set_inbound_length(struct stream *self, size_t length)
+{
+    self->inbound_length = length;
+
+    bool paused = self->inbound_paused;
+    if (!self->inbound_high)
+        paused = false;
+    else if (length >= self->inbound_high)
+        paused = true;
+    else if (length <= self->inbound_low)
+        paused = false;
+
+    if (paused != self->inbound_paused) {
+        self->inbound_paused = paused;
+        stream_update_idler(self);      // Read interest changed
+    }
+}
+
+
+/**
+ * Update amount of outgoing data held back by the stream
+ *
+ * Called by streams which format data lazily, see pending_fn. Held back
+ * data counts as queued, it is requested once all queues are drained.
+ *
+ */
+void stream_set_pending_length(struct stream *self, size_t length)
+{
+    bool changed = !self->pending_length != !length;
+    self->pending_length = length;
+
+    if (changed)
+        stream_update_idler(self);      // Output held back or finished
+}
+
+
+/**
+ * Check if reading is paused by the stream or any decorated stream
+ *
+ */
+bool stream_is_read_paused(struct stream *self)
+{
+    for (; self; self = self->decorated) {
+        if (self->inbound_paused)
+            return true;
+    }
+    return false;
+}
+
+
+/**
+ * Return length of outgoing data queued by the stream and decorated streams
+ *
+ */
+size_t stream_get_outgoing_length(struct stream *self)
+{
+    size_t length = 0;
+    for (; self; self = self->decorated) {
+        length += iobuf_length(&self->outgoing) + self->pending_length;
+        if (self->ring)
+            length += iobuf_length(&self->ring->inflight);
+    }
+    return length;
+}
+
+
+/**
+ * Submit reads and writes of the descriptor through io_uring
+ *
+ * Applies to the stream which owns the descriptor. Idler built with io_uring
+ * backend, see IDLER_IO_URING, then receives data into provided buffers and
+ * writes queued data itself, so that reads and writes of all streams cost
+ * single system call per wait. Received data is served by stream_read(),
+ * writes are queued until the next wait. Only sockets are supported, epoll
+ * backend ignores the setting.
+ *
+ */
+void stream_set_ring_io(struct stream *self, bool enabled)
+{
+    while (self->decorated)
+        self = self->decorated;
+
+    if (!self->ring) {
+        if (!enabled)
+            return;
+
+        self->ring = xmalloc(sizeof(struct stream_ring));
+        memset(self->ring, 0, sizeof(struct stream_ring));
+        iobuf_init(&self->ring->inbound);
+        iobuf_init(&self->ring->inflight);
+    }
+
+    self->ring->enabled = enabled;
+    stream_update_idler(self);
+}
+
+
+/**
+ * Check if stream accepts writes with respect to outbound watermarks
+ *
+ */
+bool stream_is_writable(struct stream *self)
+{
+    if (!self->outbound_high)
+        return true;
+
+    size_t length = stream_get_outgoing_length(self);
+    if (self->outbound_paused) {
+        if (length <= self->outbound_low)
+            self->outbound_paused = false;
+    }
+    else if (length >= self->outbound_high) {
+        self->outbound_paused = true;
+    }
+
+    return !self->outbound_paused;
+}
+
+
 /**
  * Add stream observer
  *
@@ -189,6 +432,33 @@ void stream_remove_observer(struct stream *self)
 }
 
 
+/**
+ * Read data received by io_uring idler
+ *
+ * Returns -1 with EAGAIN when nothing was received yet, so that the stream
+ * behaves like non-blocking descriptor.
+ *
+ */
+static ssize_t stream_ring_read(struct stream *self, void *buffer, size_t length)
+{
+    struct stream_ring *ring = self->ring;
+
+    if (!iobuf_is_empty(&ring->inbound)) {
+        size_t ret = iobuf_peek(&ring->inbound, buffer, length);
+        iobuf_cut(&ring->inbound, ret);
+
+        STREAM_LOG("- s:ring read %lu", ret);
+        return ret;
+    }
+
+    if (ring->eof)
+        return 0;
+
+    errno = ring->error ? ring->error : EAGAIN;
+    return -1;
+}
+
+
 /**
  * Read function
  *
@@ -198,6 +468,9 @@ ssize_t stream_real_read(struct stream *self, void *buffer, size_t length)
     if (self->decorated)
         return stream_read(self->decorated, buffer, length);
 
+    if (self->ring && (self->ring->active || !iobuf_is_empty(&self->ring->inbound) || self->ring->eof || self->ring->error))
+        return stream_ring_read(self, buffer, length);
+
     ssize_t ret = read(self->fd, buffer, length);
 
     STREAM_LOG("- s:read %ld", ret);
@@ -215,6 +488,12 @@ ssize_t stream_real_write(struct stream *self, const void *buffer, size_t length
     if (self->decorated)
         return stream_write(self->decorated, buffer, length);
 
+    if (self->ring && self->ring->active) {
+        // Data is queued and written by idler
+        errno = self->ring->error ? self->ring->error : EAGAIN;
+        return -1;
+    }
+
     ssize_t ret = write(self->fd, buffer, length);
 
     STREAM_LOG("- s:write %ld", ret);
@@ -223,14 +502,66 @@ ssize_t stream_real_write(struct stream *self, const void *buffer, size_t length
 }
 
 
+/**
+ * Write chain function
+ *
+ * Data taken by the stream is removed from the chain, number of taken bytes
+ * is returned.
+ *
+ */
+ssize_t stream_real_write_iobuf(struct stream *self, struct iobuf *data)
+{
+    if (self->decorated)
+        return stream_write_iobuf(self->decorated, data);
+
+    if (self->ring && self->ring->active) {
+        errno = self->ring->error ? self->ring->error : EAGAIN;
+        return -1;
+    }
+
+    struct iovec iov[STREAM_IOV_MAX];
+    int count = iobuf_get_iovec(data, iov, STREAM_IOV_MAX);
+
+    ssize_t ret = writev(self->fd, iov, count);
+    if (ret > 0)
+        iobuf_cut(data, ret);
+
+    STREAM_LOG("- s:writev %ld (%d)", ret, count);
+    return ret;
+}
+
+
 /**
  * Queue outgoing data
  *
  */
 static size_t stream_queue_outgoing_data(struct stream *self, const void *buffer, size_t length)
 {
-    struct buffer_slice *slice = buffer_slice_new(buffer, length);
-    TAILQ_INSERT_TAIL(&self->outgoing, slice, _entry_);
+    bool was_empty = iobuf_is_empty(&self->outgoing);
+
+    iobuf_append(&self->outgoing, buffer, length);
+
+    if (was_empty)
+        stream_update_idler(self);      // Output queued
+
+    STREAM_LOG("- s:queue %lu", length);
+    return length;
+}
+
+
+/**
+ * Queue outgoing chain without copying
+ *
+ */
+static size_t stream_queue_outgoing_iobuf(struct stream *self, struct iobuf *data)
+{
+    bool was_empty = iobuf_is_empty(&self->outgoing);
+    size_t length = iobuf_length(data);
+
+    iobuf_move(&self->outgoing, data);
+
+    if (was_empty && length)
+        stream_update_idler(self);      // Output queued
 
     STREAM_LOG("- s:queue %lu", length);
     return length;
@@ -245,10 +576,13 @@ bool stream_has_outgoing_data(struct stream *self)
 {
     if (!self->decorated || (stream_get_status(self->decorated) == STREAM_ST_READY) ) {
         // In case of decoration we may push our data only if decorated stream is ready
-        if (!TAILQ_EMPTY(&self->outgoing))
+        if (!iobuf_is_empty(&self->outgoing) || self->pending_length)
             return true;
     }
 
+    if (self->ring && !iobuf_is_empty(&self->ring->inflight))
+        return true;
+
     return self->decorated ? stream_has_outgoing_data(self->decorated) : false;
 }
 
@@ -262,17 +596,51 @@ void stream_reset_outgoing_data(struct stream *self)
     if (self->decorated)
         stream_reset_outgoing_data(self->decorated);
 
-    struct buffer_slice *slice, *tmp;
-    TAILQ_FOREACH_SAFE(slice, &self->outgoing, _entry_, tmp) {
-        TAILQ_REMOVE(&self->outgoing, slice, _entry_);
-        buffer_slice_delete(slice);
+    if (self->ring && !iobuf_is_empty(&self->ring->inflight))
+        self->ring->discard = true;     // Pending send still references the data
+
+    if (self->pending_length)
+        self->vtable->pending_fn(self, true);
+
+    if (iobuf_is_empty(&self->outgoing))
+        return;
+
+    iobuf_clean(&self->outgoing);
+
+    stream_update_idler(self);      // Queue drained
+}
+
+
+/**
+ * Let the stream write data it held back
+ *
+ * Next part is requested only once everything written before is sent, so
+ * data written meanwhile does not wait behind the held back data. Returns
+ * false if nothing could be written.
+ *
+ */
+static bool stream_handle_pending_data(struct stream *self)
+{
+    bool written = false;
+
+    while (self->pending_length && (stream_get_outgoing_length(self) == self->pending_length)) {
+        size_t length = self->pending_length;
+        if ((self->vtable->pending_fn(self, false) < 0) || (self->pending_length == length))
+            break;
+        written = true;
     }
+
+    return written;
 }
 
 
 /**
  * Handle outgoing data
  *
+ * Stream which owns the descriptor flushes entire queue with writev(),
+ * STREAM_IOV_MAX segments at most per call. Decorating stream passes its
+ * queue to the decorated one without copying.
+ *
  */
 int stream_handle_outgoing_data(struct stream *self)
 {
@@ -281,24 +649,30 @@ int stream_handle_outgoing_data(struct stream *self)
     if (self->decorated)
         written = stream_handle_outgoing_data(self->decorated);
 
-    while (!TAILQ_EMPTY(&self->outgoing)) {
-        struct buffer_slice *slice = TAILQ_FIRST(&self->outgoing);
+    while (!iobuf_is_empty(&self->outgoing)) {
+        size_t length = iobuf_length(&self->outgoing);
+        unsigned int count = self->outgoing.count;
 
-        ssize_t ret = stream_real_write(self, slice->buffer.data, slice->buffer.length);
+        ssize_t ret = stream_real_write_iobuf(self, &self->outgoing);
         if (ret <= 0) {
+            if ((ret < 0) && written && (errno == EAGAIN || errno == EWOULDBLOCK))
+                break;  // Socket filled up right after previous call
             return ret;
         }
 
         written += ret;
 
-        if (buffer_cut(&slice->buffer, ret) > 0)
-            break;      // Something is still in queue
+        if (iobuf_is_empty(&self->outgoing)) {
+            stream_update_idler(self);  // Queue drained
+            break;
+        }
 
-        // Entire slice was used
-        TAILQ_REMOVE(&self->outgoing, slice, _entry_);
-        buffer_slice_delete(slice);
+        if (((size_t)ret < length) && (count <= STREAM_IOV_MAX))
+            break;      // Something is still in queue
     }
 
+    stream_handle_pending_data(self);
+
     return written;
 }
 
@@ -338,7 +712,12 @@ ssize_t stream_do_read(struct stream *self, void *buffer, size_t length)
  */
 ssize_t stream_do_write(struct stream *self, const void *buffer, size_t length)
 {
-    if (!TAILQ_EMPTY(&self->outgoing))
+    if (!stream_is_writable(self)) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    if (!iobuf_is_empty(&self->outgoing))
         return stream_queue_outgoing_data(self, buffer, length);
 
     int ret = stream_real_write(self, buffer, length);
@@ -358,6 +737,36 @@ ssize_t stream_do_write(struct stream *self, const void *buffer, size_t length)
 }
 
 
+/**
+ * Stream non-virtual chain write
+ *
+ * Chain is taken entirely, what can not be written is queued without copying.
+ * On error chain is left untouched.
+ *
+ */
+ssize_t stream_do_write_iobuf(struct stream *self, struct iobuf *data)
+{
+    size_t length = iobuf_length(data);
+
+    if (!stream_is_writable(self)) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    if (!iobuf_is_empty(&self->outgoing))
+        return stream_queue_outgoing_iobuf(self, data);
+
+    ssize_t ret = stream_real_write_iobuf(self, data);
+    if (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+        return ret;
+
+    if (!iobuf_is_empty(data))
+        stream_queue_outgoing_iobuf(self, data);
+
+    return length;
+}
+
+
 /**
  * Stream non-virtual flush
  *
@@ -366,7 +775,10 @@ ssize_t stream_do_write(struct stream *self, const void *buffer, size_t length)
  */
 int stream_do_flush(struct stream *self)
 {
-    while (!TAILQ_EMPTY(&self->outgoing)) {
+    if (self->ring && self->ring->active)
+        return 1;       // Queue is written by idler
+
+    while (!iobuf_is_empty(&self->outgoing)) {
         int ret = stream_handle_outgoing_data(self);
         if (ret == 0)
             return ret;
@@ -374,11 +786,17 @@ int stream_do_flush(struct stream *self)
             return ret;
     }
 
-    if (self->decorated) {
-        return stream_flush(self->decorated);
+    int ret = 1;
+    if (self->decorated)
+        ret = stream_flush(self->decorated);
+
+    // Held back data is written part by part as queues drain
+    while ((ret > 0) && stream_handle_pending_data(self)) {
+        if (self->decorated)
+            ret = stream_flush(self->decorated);
     }
 
-    return 1;
+    return ret;
 }
 
 
@@ -406,6 +824,22 @@ ssize_t stream_read(struct stream *self, void *buffer, size_t length)
 }
 
 
+/**
+ * Stream virtual read appending data to the buffer
+ *
+ * Data is read directly into the buffer tail, no intermediate copy is made.
+ *
+ */
+ssize_t stream_read_buffer(struct stream *self, struct buffer *buffer, size_t length)
+{
+    void *tail = buffer_reserve_tail(buffer, length);
+    ssize_t ret = self->vtable->read_fn(self, tail, length);
+    if (ret > 0)
+        buffer_commit(buffer, ret);
+    return ret;
+}
+
+
 /**
  * Stream virtual write
  *
@@ -416,6 +850,25 @@ ssize_t stream_write(struct stream *self, const void *buffer, size_t length)
 }
 
 
+/**
+ * Stream virtual chain write
+ *
+ * Streams which do not handle chains get contiguous copy of the data.
+ *
+ */
+ssize_t stream_write_iobuf(struct stream *self, struct iobuf *data)
+{
+    if (self->vtable->write_iobuf_fn)
+        return self->vtable->write_iobuf_fn(self, data);
+
+    ssize_t ret = self->vtable->write_fn(self, iobuf_pullup(data), iobuf_length(data));
+    if (ret > 0)
+        iobuf_cut(data, ret);
+
+    return ret;
+}
+
+
 /**
  * Stream virtual flush
  *
@@ -473,6 +926,15 @@ ssize_t stream_write_impl(struct stream *self, const void *buffer, size_t length
 }
 
 
+/**
+ * Stream virtual chain write implementation
+ */
+ssize_t stream_write_iobuf_impl(struct stream *self, struct iobuf *data)
+{
+    return stream_do_write_iobuf(self, data);
+}
+
+
 /**
  * Stream virtual flush implementation
  */
@@ -8,6 +8,8 @@
 #include "mx/string.h"
 #include "mx/misc.h"
 #include "mx/mqtt.h"
+#include "mx/mqtt_session.h"
+#include "mx/iobuf.h"
 #include "mx/timer.h"
 
 #include "private_stream.h"
@@ -33,30 +35,66 @@
 #define MQTT_RESEND_ATTEMPTS            3
 #define MQTT_RESEND_TIMEOUT             30
 
+#define MQTT_FRAME_INDEX_SIZE           128     // Power of 2, packet ids are usually sequential
+
+#define MQTT_OBSERVER_MANY              1       // Observer receives views of all topic filters
+
 
 
 struct mqtt_frame_item
 {
-    struct buffer buffer;
+    struct iobuf data;          // Body of received frame, entire frame to be sent
 
     unsigned char type;
     unsigned char flags;
     unsigned short id;
 
     TAILQ_ENTRY(mqtt_frame_item) _entry_;
+    LIST_ENTRY(mqtt_frame_item) _index_entry_;
 };
 
 // struct mqtt_frame_queue
 TAILQ_HEAD(mqtt_frame_queue, mqtt_frame_item);
+// struct mqtt_frame_bucket
+LIST_HEAD(mqtt_frame_bucket, mqtt_frame_item);
+
+
+/**
+ * Frames indexed by packet id
+ *
+ * Acknowledge finds its request without walking the queue, chains stay short
+ * as long as less than MQTT_FRAME_INDEX_SIZE sequential ids are in flight.
+ *
+ */
+struct mqtt_frame_index
+{
+    struct mqtt_frame_bucket buckets[MQTT_FRAME_INDEX_SIZE];
+};
+
+
+static struct xpool mqtt_frame_item_pool = XPOOL_INITIALIZER(sizeof(struct mqtt_frame_item));
 
 
 
 struct mqtt_frame_item* mqtt_frame_item_new(unsigned char type, unsigned char flags, unsigned short id,
                                               const void *buffer, size_t length)
 {
-    struct mqtt_frame_item *self = xmalloc(sizeof(struct mqtt_frame_item));
-    buffer_init(&self->buffer, length);
-    buffer_append(&self->buffer, buffer, length);
+    struct mqtt_frame_item *self = xpool_alloc(&mqtt_frame_item_pool);
+    iobuf_init(&self->data);
+    memcpy(iobuf_reserve(&self->data, 0, length), buffer, length);
+    self->type = type;
+    self->flags = flags;
+    self->id = id;
+    return self;
+}
+
+
+struct mqtt_frame_item* mqtt_frame_item_share(unsigned char type, unsigned char flags, unsigned short id,
+                                                const struct iobuf *data)
+{
+    struct mqtt_frame_item *self = xpool_alloc(&mqtt_frame_item_pool);
+    iobuf_init(&self->data);
+    iobuf_share(&self->data, data);
     self->type = type;
     self->flags = flags;
     self->id = id;
@@ -66,8 +104,71 @@ struct mqtt_frame_item* mqtt_frame_item_new(unsigned char type, unsigned char fl
 
 struct mqtt_frame_item* mqtt_frame_item_delete(struct mqtt_frame_item *self)
 {
-    buffer_clean(&self->buffer);
-    return xfree(self);
+    iobuf_clean(&self->data);
+    return xpool_free(&mqtt_frame_item_pool, self);
+}
+
+
+
+
+
+void mqtt_frame_index_init(struct mqtt_frame_index *self)
+{
+    for (size_t i = 0; i < MQTT_FRAME_INDEX_SIZE; i++)
+        LIST_INIT(&self->buckets[i]);
+}
+
+
+static inline struct mqtt_frame_bucket* mqtt_frame_index_bucket(struct mqtt_frame_index *self, unsigned short id)
+{
+    return &self->buckets[id & (MQTT_FRAME_INDEX_SIZE - 1)];
+}
+
+
+void mqtt_frame_index_insert(struct mqtt_frame_index *self, struct mqtt_frame_item *item)
+{
+    LIST_INSERT_HEAD(mqtt_frame_index_bucket(self, item->id), item, _index_entry_);
+}
+
+
+void mqtt_frame_index_remove(struct mqtt_frame_index *self, struct mqtt_frame_item *item)
+{
+    UNUSED(self);
+    LIST_REMOVE(item, _index_entry_);
+}
+
+
+/**
+ * Find frame of given type with given packet id
+ *
+ * Any type matches MQTT_FORBIDDEN.
+ *
+ */
+struct mqtt_frame_item* mqtt_frame_index_find(struct mqtt_frame_index *self, unsigned char type, unsigned short id)
+{
+    struct mqtt_frame_item *item;
+    LIST_FOREACH(item, mqtt_frame_index_bucket(self, id), _index_entry_) {
+        if ((item->id == id) && (type == MQTT_FORBIDDEN || item->type == type))
+            return item;
+    }
+
+    return NULL;
+}
+
+
+/**
+ * Check if frame occupies in-flight window
+ *
+ * Publish QoS 1/2 stays in flight until acknowledged, QoS 2 is then
+ * continued with Pubrel.
+ *
+ */
+static inline bool mqtt_frame_item_is_inflight(struct mqtt_frame_item *self)
+{
+    if (self->type == MQTT_PUBLISH)
+        return MQTT_QOS_FROM_FLAGS(self->flags) > MQTT_QOS_0;
+
+    return self->type == MQTT_PUBREL;
 }
 
 
@@ -105,8 +206,21 @@ struct stream_mqtt
     struct mqtt_frame_queue incoming;       // Incoming messages
     struct mqtt_frame_queue outgoing;       // Outgoing messages require acknowledgement
     struct mqtt_frame_queue inbound;        // Inbound publish qos=2 messages, waiting for delivery confirmation
+    struct mqtt_frame_queue pending;        // Outgoing publish qos>0 messages above in-flight window
+    struct mqtt_frame_index outgoing_index;
+    struct mqtt_frame_index inbound_index;
+    struct mqtt_frame_index pending_index;
+    unsigned short packet_id;               // Recently allocated packet id
+
+    unsigned int inflight;                  // Publish qos>0 and pubrel messages in outgoing queue
+    unsigned int inflight_window;           // Maximal number of in-flight messages, 0 if unlimited
+    bool publish_blocked;                   // Window was full, application waits for publish ready
 
     struct observer *mqtt_observer;
+    struct observer *publish_observer;
+
+    struct mqtt_session_store *session;     // Persistent session, not owned
+    char *client_id;
 
     unsigned int keep_alive;
     bool keep_alive_responded;
@@ -130,8 +244,21 @@ void stream_mqtt_init(struct stream_mqtt *self)
     TAILQ_INIT(&self->incoming);
     TAILQ_INIT(&self->outgoing);
     TAILQ_INIT(&self->inbound);
+    TAILQ_INIT(&self->pending);
+    mqtt_frame_index_init(&self->outgoing_index);
+    mqtt_frame_index_init(&self->inbound_index);
+    mqtt_frame_index_init(&self->pending_index);
+    self->packet_id = 0;
+
+    self->inflight = 0;
+    self->inflight_window = 0;
+    self->publish_blocked = false;
 
     self->mqtt_observer = NULL;
+    self->publish_observer = NULL;
+
+    self->session = NULL;
+    self->client_id = NULL;
 
     self->keep_alive = 0;   // Disable keep alive
     self->keep_alive_responded = true;
@@ -165,8 +292,16 @@ void stream_mqtt_clean(struct stream_mqtt *self)
         TAILQ_REMOVE(&self->inbound, item, _entry_);
         mqtt_frame_item_delete(item);
     }
+    TAILQ_FOREACH_SAFE(item, &self->pending, _entry_, tmp) {
+        TAILQ_REMOVE(&self->pending, item, _entry_);
+        mqtt_frame_item_delete(item);
+    }
 
     stream_mqtt_remove_observer(self);
+    stream_mqtt_remove_publish_observer(self);
+
+    if (self->client_id)
+        xfree(self->client_id);
 }
 
 
@@ -244,6 +379,31 @@ void stream_mqtt_set_observer(struct stream_mqtt *self, void *object, stream_on_
 }
 
 
+/**
+ * Set MQTT observer receiving all topic filters
+ *
+ * Same as stream_mqtt_set_observer(), but Subscribe, Unsubscribe and Suback
+ * are passed as struct mqtt_subscribe_many, struct mqtt_unsubscribe_many and
+ * struct mqtt_suback_many instead of their first entry only.
+ *
+ */
+void stream_mqtt_set_many_observer(struct stream_mqtt *self, void *object, stream_on_mqtt_msg_received_clbk handler)
+{
+    if (!self->mqtt_observer)
+         self->mqtt_observer = observer_create(object, MQTT_OBSERVER_MANY, (observer_notify_fn)handler);
+}
+
+
+/**
+ * Check if observer receives views of all topic filters
+ *
+ */
+static bool stream_mqtt_observes_many(struct stream_mqtt *self)
+{
+    return self->mqtt_observer->notify_type == MQTT_OBSERVER_MANY;
+}
+
+
 /**
  * Remove MQTT observer
  *
@@ -256,52 +416,462 @@ void stream_mqtt_remove_observer(struct stream_mqtt *self)
 
 
 /**
- * Stream MQTT write
+ * Set publish ready observer
+ *
+ * Observer is notified when in-flight window, which was full, accepts publish again.
  *
  */
-ssize_t stream_mqtt_real_write(struct stream_mqtt *self, const void *buffer, size_t length)
+void stream_mqtt_set_publish_observer(struct stream_mqtt *self, void *object, stream_on_mqtt_publish_ready_clbk handler)
 {
-    ssize_t ret = stream_do_write(stream_mqtt_to_stream(self), buffer, length);
+    if (!self->publish_observer)
+         self->publish_observer = observer_create(object, 0, (observer_notify_fn)handler);
+}
+
+
+/**
+ * Remove publish ready observer
+ *
+ */
+void stream_mqtt_remove_publish_observer(struct stream_mqtt *self)
+{
+     if (self->publish_observer)
+         self->publish_observer = observer_delete(self->publish_observer);
+}
+
+
+/**
+ * Check if in-flight window accepts another Publish QoS 1/2 message
+ *
+ */
+bool stream_mqtt_can_publish(struct stream_mqtt *self)
+{
+    if (!TAILQ_EMPTY(&self->pending))
+        return false;
+
+    return (self->inflight_window == 0) || (self->inflight < self->inflight_window);
+}
+
+
+/**
+ * Stream MQTT chain write
+ *
+ */
+ssize_t stream_mqtt_real_write_iobuf(struct stream_mqtt *self, struct iobuf *frame)
+{
+    ssize_t ret = stream_do_write_iobuf(stream_mqtt_to_stream(self), frame);
     STREAM_LOG("--- mqtt:write %ld", ret);
-    STREAM_MQTT_LOG_DATA("mqtt:wr ", buffer, ret);
     return ret;
 }
 
 
+/**
+ * Write queued frame, it is kept in queue until acknowledged
+ *
+ */
+ssize_t stream_mqtt_write_item(struct stream_mqtt *self, struct mqtt_frame_item *item)
+{
+    struct iobuf frame;
+    iobuf_init(&frame);
+    iobuf_share(&frame, &item->data);
+
+    ssize_t ret = stream_mqtt_real_write_iobuf(self, &frame);
+
+    iobuf_clean(&frame);
+    return ret;
+}
+
+
+/**
+ * Reserve MQTT frame in chain
+ *
+ * Fixed header is placed in front of the body, room for headers of decorated
+ * streams is left as well. Returns pointer where body should be formatted.
+ *
+ */
+unsigned char* stream_mqtt_reserve_frame(struct iobuf *frame, unsigned char type, unsigned char flags, size_t body_len)
+{
+    unsigned char header[MQTT_MAX_FIXED_HEADER_SIZE];
+    size_t header_len = mqtt_format_fixed_header(header, type, flags, body_len);
 
-void stream_mqtt_append_frame(struct mqtt_frame_queue *queue, unsigned char type, unsigned char flags, unsigned short id,
-                                                             const unsigned char *body_data, size_t body_length)
+    unsigned char *body = iobuf_reserve(frame, IOBUF_HEADROOM + MQTT_MAX_FIXED_HEADER_SIZE, body_len);
+    iobuf_prepend(frame, header, header_len);
+    return body;
+}
+
+
+
+void stream_mqtt_append_frame(struct mqtt_frame_queue *queue, struct mqtt_frame_index *index,
+                              unsigned char type, unsigned char flags, unsigned short id,
+                              const unsigned char *body_data, size_t body_length)
 {
     struct mqtt_frame_item *item = mqtt_frame_item_new(type, flags, id, body_data, body_length);
     TAILQ_INSERT_TAIL(queue, item, _entry_);
+    mqtt_frame_index_insert(index, item);
 }
 
 
-void stream_mqtt_insert_frame(struct mqtt_frame_queue *queue, unsigned char type, unsigned char flags, unsigned short id,
-                                                             const unsigned char *body_data, size_t body_length)
+/**
+ * Queue received frame for the application
+ *
+ */
+void stream_mqtt_insert_incoming(struct stream_mqtt *self, struct mqtt_frame_item *item)
 {
-    struct mqtt_frame_item *item = mqtt_frame_item_new(type, flags, id, body_data, body_length);
+    TAILQ_INSERT_TAIL(&self->incoming, item, _entry_);
+    stream_set_inbound_length(&self->stream, self->stream.inbound_length + iobuf_length(&item->data));
+}
+
+
+/**
+ * Remove the first received frame from the queue
+ *
+ */
+void stream_mqtt_remove_incoming(struct stream_mqtt *self)
+{
+    struct mqtt_frame_item *item = TAILQ_FIRST(&self->incoming);
+    TAILQ_REMOVE(&self->incoming, item, _entry_);
+    stream_set_inbound_length(&self->stream, self->stream.inbound_length - iobuf_length(&item->data));
+    mqtt_frame_item_delete(item);
+}
+
+
+void stream_mqtt_append_incoming(struct stream_mqtt *self, unsigned char type, unsigned char flags,
+                                                           const unsigned char *body_data, size_t body_length)
+{
+    struct mqtt_frame_item *item = mqtt_frame_item_new(type, flags, 0, body_data, body_length);
+    stream_mqtt_insert_incoming(self, item);
+}
+
+
+void stream_mqtt_append_frame_shared(struct mqtt_frame_queue *queue, struct mqtt_frame_index *index,
+                                     unsigned char type, unsigned char flags, unsigned short id,
+                                     const struct iobuf *frame)
+{
+    struct mqtt_frame_item *item = mqtt_frame_item_share(type, flags, id, frame);
+    TAILQ_INSERT_TAIL(queue, item, _entry_);
+    mqtt_frame_index_insert(index, item);
+}
+
+
+void stream_mqtt_insert_frame_shared(struct mqtt_frame_queue *queue, struct mqtt_frame_index *index,
+                                     unsigned char type, unsigned char flags, unsigned short id,
+                                     const struct iobuf *frame)
+{
+    struct mqtt_frame_item *item = mqtt_frame_item_share(type, flags, id, frame);
     TAILQ_INSERT_HEAD(queue, item, _entry_);
+    mqtt_frame_index_insert(index, item);
+}
+
+
+/**
+ * Take frame out of the queue and the index
+ *
+ */
+void stream_mqtt_unlink_frame(struct mqtt_frame_queue *queue, struct mqtt_frame_index *index,
+                              struct mqtt_frame_item *item)
+{
+    TAILQ_REMOVE(queue, item, _entry_);
+    mqtt_frame_index_remove(index, item);
 }
 
 
-bool stream_mqtt_remove_frame(struct mqtt_frame_queue *queue, unsigned char type, unsigned short id)
+bool stream_mqtt_remove_frame(struct mqtt_frame_queue *queue, struct mqtt_frame_index *index,
+                              unsigned char type, unsigned short id)
 {
     bool found = false;
 
-    struct mqtt_frame_item *item, *tmp;
-    TAILQ_FOREACH_SAFE(item, queue, _entry_, tmp) {
-        if ((item->type == type) && (item->id == id)) {
-            TAILQ_REMOVE(queue, item, _entry_);
-            mqtt_frame_item_delete(item);
-            found = true;
-        }
+    struct mqtt_frame_item *item;
+    while ((item = mqtt_frame_index_find(index, type, id)) != NULL) {
+        stream_mqtt_unlink_frame(queue, index, item);
+        mqtt_frame_item_delete(item);
+        found = true;
+    }
+
+    return found;
+}
+
+
+
+/**
+ * Persist message in session store
+ *
+ */
+void stream_mqtt_save_message(struct stream_mqtt *self, unsigned char direction, unsigned char type, unsigned char flags,
+                                                       unsigned short id, const unsigned char *data, size_t length)
+{
+    if (!self->session)
+        return;
+
+    struct mqtt_session_message msg;
+    msg.direction = direction;
+    msg.type = type;
+    msg.flags = flags;
+    msg.id = id;
+    msg.data = data;
+    msg.length = length;
+
+    if (!mqtt_session_store_save_message(self->session, self->client_id, &msg))
+        WARN("Stream MQTT %d fd, could not save %s message", stream_mqtt_get_fd(self), mqtt_packet_name(type));
+}
+
+
+/**
+ * Remove message from session store
+ *
+ */
+void stream_mqtt_forget_message(struct stream_mqtt *self, unsigned char direction, unsigned short id)
+{
+    if (!self->session)
+        return;
+
+    if (!mqtt_session_store_remove_message(self->session, self->client_id, direction, id))
+        WARN("Stream MQTT %d fd, could not remove %hu message", stream_mqtt_get_fd(self), id);
+}
+
+
+/**
+ * Persist subscriptions requested by the client
+ *
+ */
+static void stream_mqtt_save_subscriptions(struct stream_mqtt *self, const char *const *topics, const unsigned char *qos,
+                                                                    size_t count)
+{
+    if (!self->session)
+        return;
+
+    for (size_t i = 0; i < count; i++) {
+        if (!mqtt_session_store_save_subscription(self->session, self->client_id, topics[i], strlen(topics[i]), qos[i]))
+            WARN("Stream MQTT %d fd, could not save %s subscription", stream_mqtt_get_fd(self), topics[i]);
+    }
+}
+
+
+/**
+ * Remove subscriptions cancelled by the client from session store
+ *
+ */
+static void stream_mqtt_forget_subscriptions(struct stream_mqtt *self, const char *const *topics, size_t count)
+{
+    if (!self->session)
+        return;
+
+    for (size_t i = 0; i < count; i++) {
+        if (!mqtt_session_store_remove_subscription(self->session, self->client_id, topics[i], strlen(topics[i])))
+            WARN("Stream MQTT %d fd, could not remove %s subscription", stream_mqtt_get_fd(self), topics[i]);
+    }
+}
+
+
+/**
+ * Start new session if clean session is requested
+ *
+ */
+static void stream_mqtt_clean_session(struct stream_mqtt *self, bool clean_session)
+{
+    if (!self->session || !clean_session)
+        return;
+
+    if (!mqtt_session_store_clear(self->session, self->client_id))
+        WARN("Stream MQTT %d fd, could not clear session", stream_mqtt_get_fd(self));
+}
+
+
+/**
+ * Delete frame from outgoing queue
+ *
+ */
+void stream_mqtt_drop_outgoing(struct stream_mqtt *self, struct mqtt_frame_item *item)
+{
+    if (mqtt_frame_item_is_inflight(item)) {
+        self->inflight--;
+        stream_mqtt_forget_message(self, MQTT_SESSION_OUTGOING, item->id);
+    }
+
+    stream_mqtt_unlink_frame(&self->outgoing, &self->outgoing_index, item);
+    mqtt_frame_item_delete(item);
+}
+
+
+/**
+ * Remove acknowledged frame from outgoing queue
+ *
+ */
+bool stream_mqtt_remove_outgoing(struct stream_mqtt *self, unsigned char type, unsigned short id)
+{
+    bool found = false;
+
+    struct mqtt_frame_item *item;
+    while ((item = mqtt_frame_index_find(&self->outgoing_index, type, id)) != NULL) {
+        stream_mqtt_drop_outgoing(self, item);
+        found = true;
     }
 
     return found;
 }
 
 
+/**
+ * Move held messages to outgoing queue as long as in-flight window allows
+ *
+ * Queued messages are sent by time handler. Application is notified when
+ * window, which was full, accepts messages again.
+ *
+ */
+void stream_mqtt_release_pending(struct stream_mqtt *self)
+{
+    struct mqtt_frame_item *item;
+    while ((item = TAILQ_FIRST(&self->pending)) != NULL) {
+        if (self->inflight_window && self->inflight >= self->inflight_window)
+            break;
+
+        stream_mqtt_unlink_frame(&self->pending, &self->pending_index, item);
+        TAILQ_INSERT_TAIL(&self->outgoing, item, _entry_);
+        mqtt_frame_index_insert(&self->outgoing_index, item);
+        self->inflight++;
+    }
+
+    if (self->publish_blocked && stream_mqtt_can_publish(self)) {
+        self->publish_blocked = false;
+        if (observer_is_available(self->publish_observer)) {
+            stream_on_mqtt_publish_ready_clbk handler = (stream_on_mqtt_publish_ready_clbk)self->publish_observer->notify_handler;
+            handler(self->publish_observer->object, self);
+        }
+    }
+}
+
+
+
+/**
+ * Let idler know when time handler is needed
+ *
+ */
+void stream_mqtt_schedule_time(struct stream_mqtt *self)
+{
+    time_t deadline = timer_deadline(&self->keep_alive_timer);
+
+    time_t resend_deadline = 0;
+    if (timer_running(&self->resend_timer))
+        resend_deadline = timer_deadline(&self->resend_timer);
+    else if (!TAILQ_EMPTY(&self->outgoing))
+        resend_deadline = clock_get_milis();    // Queued message is sent by time handler
+
+    if (resend_deadline && (!deadline || resend_deadline < deadline))
+        deadline = resend_deadline;
+
+    stream_set_deadline(&self->stream, deadline);
+}
+
+
+
+/**
+ * Set in-flight window
+ *
+ * Limits number of unacknowledged Publish QoS 1/2 messages. Messages above
+ * the limit are held until acknowledges arrive. Pass 0 to disable the limit.
+ *
+ */
+void stream_mqtt_set_inflight_window(struct stream_mqtt *self, unsigned int window)
+{
+    self->inflight_window = window;
+    stream_mqtt_release_pending(self);
+    stream_mqtt_schedule_time(self);
+}
+
+
+/**
+ * Attach persistent session
+ *
+ * Publish QoS 1/2 state of the stream is kept in the store under given client
+ * id. Client stream keeps also its subscriptions there and clears the session
+ * when it connects with clean session. Server stream switches to client id of
+ * received Connect and clears the session if clean session is requested.
+ * Store is not owned by the stream, pass NULL to detach it.
+ *
+ */
+void stream_mqtt_set_session(struct stream_mqtt *self, struct mqtt_session_store *store, const char *client_id)
+{
+    if (self->client_id)
+        self->client_id = xfree(self->client_id);
+
+    self->session = store;
+    if (store)
+        self->client_id = xstrdup(client_id);
+}
+
+
+struct stream_mqtt_restore_ctx
+{
+    struct stream_mqtt *stream;
+    mqtt_session_subscription_fn subscription_handler;
+    void *arg;
+};
+
+
+/**
+ * Pass subscription loaded from session store to the application
+ *
+ */
+static void stream_mqtt_restore_subscription(void *arg, const char *topic, unsigned short topic_len, unsigned char qos)
+{
+    struct stream_mqtt_restore_ctx *ctx = arg;
+
+    if (ctx->subscription_handler)
+        ctx->subscription_handler(ctx->arg, topic, topic_len, qos);
+}
+
+
+/**
+ * Queue message loaded from session store
+ *
+ */
+static void stream_mqtt_restore_message(void *arg, const struct mqtt_session_message *msg)
+{
+    struct stream_mqtt *self = ((struct stream_mqtt_restore_ctx*)arg)->stream;
+
+    if (msg->direction == MQTT_SESSION_INBOUND) {
+        stream_mqtt_append_frame(&self->inbound, &self->inbound_index, msg->type, msg->flags, msg->id,
+                                 msg->data, msg->length);
+        return;
+    }
+
+    struct mqtt_frame_item *item = mqtt_frame_item_new(msg->type, msg->flags, msg->id, msg->data, msg->length);
+    if (item->type == MQTT_PUBLISH) {
+        // Message might have been received already
+        item->flags |= MQTT_DUP_FLAG;
+        iobuf_pullup(&item->data)[MQTT_TYPE_FLAGS_IDX] |= MQTT_DUP_FLAG;
+
+        if (!stream_mqtt_can_publish(self)) {
+            TAILQ_INSERT_TAIL(&self->pending, item, _entry_);
+            mqtt_frame_index_insert(&self->pending_index, item);
+            return;
+        }
+    }
+
+    TAILQ_INSERT_TAIL(&self->outgoing, item, _entry_);
+    mqtt_frame_index_insert(&self->outgoing_index, item);
+    self->inflight++;
+}
+
+
+/**
+ * Restore messages of persistent session
+ *
+ * Unacknowledged messages are queued for resending, received Publish QoS 2
+ * waits for Pubrel again. Saved subscriptions are given to the handler, which
+ * may be NULL. Returns false if there is no session to restore.
+ *
+ */
+bool stream_mqtt_restore_session(struct stream_mqtt *self, mqtt_session_subscription_fn subscription_handler, void *arg)
+{
+    if (!self->session)
+        return false;
+
+    struct stream_mqtt_restore_ctx ctx = { self, subscription_handler, arg };
+    bool restored = mqtt_session_store_load(self->session, self->client_id, stream_mqtt_restore_message,
+                                            stream_mqtt_restore_subscription, &ctx);
+    stream_mqtt_schedule_time(self);
+    return restored;
+}
+
 
 bool stream_mqtt_notify_observer(struct stream_mqtt *self, unsigned char type, unsigned char flags, void *msg)
 {
@@ -333,9 +903,15 @@ void stream_mqtt_handle_received_frame(struct stream_mqtt *self, struct mqtt_fix
                 self->keep_alive = msg.keep_alive + MQTT_KEEP_ALIVE_TIMEOUT;
                 timer_start(&self->keep_alive_timer, TIMER_SEC, self->keep_alive);
             }
+            if (self->session && msg.client_id_len) {
+                // Session belongs to connecting client
+                xfree(self->client_id);
+                self->client_id = xstrndup(msg.client_id, msg.client_id_len);
+            }
+            stream_mqtt_clean_session(self, msg.clean_session);
             bool handled_by_observer = stream_mqtt_notify_observer(self, frame->type, frame->flags, &msg);
             if (!handled_by_observer)
-                stream_mqtt_append_frame(&self->incoming, frame->type, frame->flags, 0, body, frame->body_length);
+                stream_mqtt_append_incoming(self, frame->type, frame->flags, body, frame->body_length);
         }   break;
 
         case MQTT_CONNACK: {
@@ -347,29 +923,39 @@ void stream_mqtt_handle_received_frame(struct stream_mqtt *self, struct mqtt_fix
             }
             bool handled_by_observer = stream_mqtt_notify_observer(self, frame->type, frame->flags, &msg);
             if (!handled_by_observer)
-                stream_mqtt_append_frame(&self->incoming, frame->type, frame->flags, 0, body, frame->body_length);
+                stream_mqtt_append_incoming(self, frame->type, frame->flags, body, frame->body_length);
         }   break;
 
         case MQTT_SUBSCRIBE: {
             bool handled_by_observer = false;
-            if (observer_is_available(self->mqtt_observer)) {
+            if (observer_is_available(self->mqtt_observer) && stream_mqtt_observes_many(self)) {
+                struct mqtt_subscribe_many msg;
+                if (mqtt_parse_subscribe_many(&msg, body, frame->body_length) > 0)
+                    handled_by_observer = stream_mqtt_notify_observer(self, frame->type, frame->flags, &msg);
+            }
+            else if (observer_is_available(self->mqtt_observer)) {
                 struct mqtt_subscribe msg;
                 mqtt_parse_subscribe(&msg, body, frame->body_length);
                 handled_by_observer = stream_mqtt_notify_observer(self, frame->type, frame->flags, &msg);
             }
             if (!handled_by_observer)
-                stream_mqtt_append_frame(&self->incoming, frame->type, frame->flags, 0, body, frame->body_length);
+                stream_mqtt_append_incoming(self, frame->type, frame->flags, body, frame->body_length);
         }   break;
 
         case MQTT_UNSUBSCRIBE: {
             bool handled_by_observer = false;
-            if (observer_is_available(self->mqtt_observer)) {
+            if (observer_is_available(self->mqtt_observer) && stream_mqtt_observes_many(self)) {
+                struct mqtt_unsubscribe_many msg;
+                if (mqtt_parse_unsubscribe_many(&msg, body, frame->body_length) > 0)
+                    handled_by_observer = stream_mqtt_notify_observer(self, frame->type, frame->flags, &msg);
+            }
+            else if (observer_is_available(self->mqtt_observer)) {
                 struct mqtt_unsubscribe msg;
                 mqtt_parse_unsubscribe(&msg, body, frame->body_length);
                 handled_by_observer = stream_mqtt_notify_observer(self, frame->type, frame->flags, &msg);
             }
             if (!handled_by_observer)
-                stream_mqtt_append_frame(&self->incoming, frame->type, frame->flags, 0, body, frame->body_length);
+                stream_mqtt_append_incoming(self, frame->type, frame->flags, body, frame->body_length);
         }   break;
 
         case MQTT_PUBLISH: {
@@ -378,8 +964,11 @@ void stream_mqtt_handle_received_frame(struct stream_mqtt *self, struct mqtt_fix
             mqtt_parse_publish(&msg, body, frame->body_length, qos);
 
             if (qos == MQTT_QOS_2) {
-                stream_mqtt_remove_frame(&self->inbound, frame->type, msg.id);
-                stream_mqtt_append_frame(&self->inbound, frame->type, frame->flags, msg.id, body, frame->body_length);
+                stream_mqtt_remove_frame(&self->inbound, &self->inbound_index, frame->type, msg.id);
+                stream_mqtt_append_frame(&self->inbound, &self->inbound_index, frame->type, frame->flags, msg.id,
+                                         body, frame->body_length);
+                stream_mqtt_save_message(self, MQTT_SESSION_INBOUND, frame->type, frame->flags, msg.id,
+                                         body, frame->body_length);
                 stream_mqtt_pubrec(self, msg.id);
             }
             else {
@@ -388,7 +977,7 @@ void stream_mqtt_handle_received_frame(struct stream_mqtt *self, struct mqtt_fix
 
                 bool handled_by_observer = stream_mqtt_notify_observer(self, frame->type, frame->flags, &msg);
                 if (!handled_by_observer)
-                    stream_mqtt_append_frame(&self->incoming, frame->type, frame->flags, 0, body, frame->body_length);
+                    stream_mqtt_append_incoming(self, frame->type, frame->flags, body, frame->body_length);
             }
         }   break;
 
@@ -399,7 +988,7 @@ void stream_mqtt_handle_received_frame(struct stream_mqtt *self, struct mqtt_fix
         case MQTT_PUBCOMP: {
             struct mqtt_var_header_id varhdr;
             mqtt_parse_var_header_id(&varhdr, body, frame->body_length);
-            if (stream_mqtt_remove_frame(&self->outgoing, mqtt_request_type(frame->type), varhdr.id))
+            if (stream_mqtt_remove_outgoing(self, mqtt_request_type(frame->type), varhdr.id))
                 timer_stop(&self->resend_timer);
 
             if (frame->type == MQTT_PUBREC) {
@@ -409,13 +998,18 @@ void stream_mqtt_handle_received_frame(struct stream_mqtt *self, struct mqtt_fix
             }
             else if (frame->type == MQTT_SUBACK) {
                 bool handled_by_observer = false;
-                if (observer_is_available(self->mqtt_observer)) {
+                if (observer_is_available(self->mqtt_observer) && stream_mqtt_observes_many(self)) {
+                    struct mqtt_suback_many msg;
+                    if (mqtt_parse_suback_many(&msg, body, frame->body_length) > 0)
+                        handled_by_observer = stream_mqtt_notify_observer(self, frame->type, frame->flags, &msg);
+                }
+                else if (observer_is_available(self->mqtt_observer)) {
                     struct mqtt_suback msg;
                     mqtt_parse_suback(&msg, body, frame->body_length);
                     handled_by_observer = stream_mqtt_notify_observer(self, frame->type, frame->flags, &msg);
                 }
                 if (!handled_by_observer)
-                    stream_mqtt_append_frame(&self->incoming, frame->type, frame->flags, 0, body, frame->body_length);
+                    stream_mqtt_append_incoming(self, frame->type, frame->flags, body, frame->body_length);
             }
             else if (frame->type == MQTT_UNSUBACK) {
                 bool handled_by_observer = false;
@@ -425,8 +1019,11 @@ void stream_mqtt_handle_received_frame(struct stream_mqtt *self, struct mqtt_fix
                     handled_by_observer = stream_mqtt_notify_observer(self, frame->type, frame->flags, &msg);
                 }
                 if (!handled_by_observer)
-                    stream_mqtt_append_frame(&self->incoming, frame->type, frame->flags, 0, body, frame->body_length);
+                    stream_mqtt_append_incoming(self, frame->type, frame->flags, body, frame->body_length);
             }
+
+            // Acknowledge frees in-flight window
+            stream_mqtt_release_pending(self);
         }   break;
 
         case MQTT_PUBREL: {
@@ -434,24 +1031,23 @@ void stream_mqtt_handle_received_frame(struct stream_mqtt *self, struct mqtt_fix
             mqtt_parse_var_header_id(&msg, body, frame->body_length);
             stream_mqtt_pubcomp(self, msg.id); // Always replay to PUBREL
 
-            struct mqtt_frame_item *item, *tmp;
-            TAILQ_FOREACH_SAFE(item, &self->inbound, _entry_, tmp) {
-                if (item->id == msg.id) {
-                    // Delivery qos=2 message complete
-                    TAILQ_REMOVE(&self->inbound, item, _entry_);
-
-                    bool handled_by_observer = false;
-                    if (item->type == MQTT_PUBLISH && observer_is_available(self->mqtt_observer)) {
-                        struct mqtt_publish msg;
-                        mqtt_parse_publish(&msg, item->buffer.data, item->buffer.length, MQTT_QOS_FROM_FLAGS(item->flags));
-                        handled_by_observer = stream_mqtt_notify_observer(self, item->type, item->flags, &msg);
-                    }
-                    if (handled_by_observer) {
-                        mqtt_frame_item_delete(item);
-                    } else {
-                        //Save received packet so that it may be read by application
-                        TAILQ_INSERT_TAIL(&self->incoming, item, _entry_);
-                    }
+            struct mqtt_frame_item *item;
+            while ((item = mqtt_frame_index_find(&self->inbound_index, MQTT_FORBIDDEN, msg.id)) != NULL) {
+                // Delivery qos=2 message complete
+                stream_mqtt_unlink_frame(&self->inbound, &self->inbound_index, item);
+                stream_mqtt_forget_message(self, MQTT_SESSION_INBOUND, item->id);
+
+                bool handled_by_observer = false;
+                if (item->type == MQTT_PUBLISH && observer_is_available(self->mqtt_observer)) {
+                    struct mqtt_publish msg;
+                    mqtt_parse_publish(&msg, iobuf_pullup(&item->data), iobuf_length(&item->data), MQTT_QOS_FROM_FLAGS(item->flags));
+                    handled_by_observer = stream_mqtt_notify_observer(self, item->type, item->flags, &msg);
+                }
+                if (handled_by_observer) {
+                    mqtt_frame_item_delete(item);
+                } else {
+                    //Save received packet so that it may be read by application
+                    stream_mqtt_insert_incoming(self, item);
                 }
             }
         }   break;
@@ -474,10 +1070,12 @@ void stream_mqtt_handle_received_frame(struct stream_mqtt *self, struct mqtt_fix
             if (!handled_by_observer) {
                 // Store dummy byte to forward frame to application and avoid blocking incoming queue because of empty body
                 unsigned char dummy = 0;
-                stream_mqtt_append_frame(&self->incoming, frame->type, frame->flags, 0, &dummy, sizeof(dummy));
+                stream_mqtt_append_incoming(self, frame->type, frame->flags, &dummy, sizeof(dummy));
             }
         }   break;
     }
+
+    stream_mqtt_schedule_time(self);
 }
 
 
@@ -487,15 +1085,15 @@ void stream_mqtt_handle_received_frame(struct stream_mqtt *self, struct mqtt_fix
  */
 ssize_t stream_mqtt_peek_frame(struct stream_mqtt *self)
 {
-    char tmpbuf[MQTT_MESSAGE_BUFFER_SIZE];
-
     STREAM_LOG("--- mqtt:peek");
     ssize_t ret;
     do {
         if (!TAILQ_EMPTY(&self->incoming))
             break;  // Something is already waiting
+        if (self->stream.inbound_paused)
+            break;  // Queue is full, application has to consume data first
 
-        ret = stream_read(stream_mqtt_get_decorated(self), tmpbuf, sizeof(tmpbuf));
+        ret = stream_read_buffer(stream_mqtt_get_decorated(self), &self->buffer, MQTT_MESSAGE_BUFFER_SIZE);
         if (ret <= 0) {
             if ((ret == 0) || (errno != EAGAIN && errno != EWOULDBLOCK))
                 return ret;     // Error
@@ -504,9 +1102,8 @@ ssize_t stream_mqtt_peek_frame(struct stream_mqtt *self)
             break;
         }
         else {
-            // Received some data
-            buffer_append(&self->buffer, tmpbuf, ret);
-            STREAM_MQTT_LOG_DATA("mqtt:rd ", tmpbuf, ret);
+            // Received some data, it is already stored in the buffer
+            STREAM_MQTT_LOG_DATA("mqtt:rd ", self->buffer.data + self->buffer.length - ret, ret);
 
             while (!buffer_is_empty(&self->buffer)) {
                 struct mqtt_fixed_header frame;
@@ -530,7 +1127,7 @@ ssize_t stream_mqtt_peek_frame(struct stream_mqtt *self)
 
     if (!TAILQ_EMPTY(&self->incoming)) {
         struct mqtt_frame_item *item = TAILQ_FIRST(&self->incoming);
-        return item->buffer.length;
+        return iobuf_length(&item->data);
     }
 
     errno = EAGAIN;
@@ -550,23 +1147,61 @@ ssize_t stream_mqtt_read_frame(struct stream_mqtt *self, unsigned char *type, un
          return -1;     // No data received
      }
      struct mqtt_frame_item *item = TAILQ_FIRST(&self->incoming);
-     if (item->buffer.length > length) {
+     if (iobuf_length(&item->data) > length) {
          errno = ENOMEM;
          return -1;     // Bigger buffer needed
      }
 
-     ssize_t ret = buffer_take(&item->buffer, buffer, length);
+     ssize_t ret = iobuf_peek(&item->data, buffer, length);
      if (type)
          *type = item->type;
      if (flags)
          *flags = item->flags;
 
-     TAILQ_REMOVE(&self->incoming, item, _entry_);
-     mqtt_frame_item_delete(item);
+     stream_mqtt_remove_incoming(self);
      return ret;
 }
 
 
+/**
+ * Borrow MQTT frame
+ *
+ * Body is not copied, returned data stays valid until the frame
+ * is released with stream_mqtt_release_frame().
+ *
+ */
+ssize_t stream_mqtt_borrow_frame(struct stream_mqtt *self, unsigned char *type, unsigned char *flags,
+                                                         const void **data)
+{
+    if (TAILQ_EMPTY(&self->incoming)) {
+        errno = EAGAIN;
+        return -1;     // No data received
+    }
+    struct mqtt_frame_item *item = TAILQ_FIRST(&self->incoming);
+
+    if (type)
+        *type = item->type;
+    if (flags)
+        *flags = item->flags;
+    if (data)
+        *data = iobuf_pullup(&item->data);    // Received frames are stored in one segment
+    return iobuf_length(&item->data);
+}
+
+
+/**
+ * Release borrowed MQTT frame
+ *
+ */
+void stream_mqtt_release_frame(struct stream_mqtt *self)
+{
+    if (TAILQ_EMPTY(&self->incoming))
+        return;
+
+    stream_mqtt_remove_incoming(self);
+}
+
+
 /**
  * Write MQTT frame
  *
@@ -574,11 +1209,15 @@ ssize_t stream_mqtt_read_frame(struct stream_mqtt *self, unsigned char *type, un
 ssize_t stream_mqtt_write_frame(struct stream_mqtt *self, unsigned char type, unsigned char flags,
                                                       const void *buffer, size_t length)
 {
-    unsigned char *frame = xmalloc(length + MQTT_MAX_FIXED_HEADER_SIZE);
-    size_t frame_len = mqtt_format_frame(frame, type, flags, buffer, length);
-    ssize_t ret = stream_mqtt_real_write(self, frame, frame_len);
-    xfree(frame);
+    struct iobuf frame;
+    iobuf_init(&frame);
 
+    unsigned char *body = stream_mqtt_reserve_frame(&frame, type, flags, length);
+    if (length)
+        memcpy(body, buffer, length);
+    ssize_t ret = stream_mqtt_real_write_iobuf(self, &frame);
+
+    iobuf_clean(&frame);
     return ret;
 }
 
@@ -603,6 +1242,35 @@ ssize_t stream_mqtt_write_frame_packet_id(struct stream_mqtt *self, unsigned cha
 
 
 
+/**
+ * Allocate packet id for the next request
+ *
+ * Ids of requests still waiting for acknowledge are skipped. Returns 0 when
+ * all ids are in flight.
+ *
+ */
+unsigned short stream_mqtt_next_packet_id(struct stream_mqtt *self)
+{
+    unsigned short id = self->packet_id;
+
+    for (unsigned int attempt = 0; attempt < 0xFFFF; attempt++) {
+        if (++id == 0)
+            id = 1;     // Packet id 0 is not allowed
+        if (!mqtt_frame_index_find(&self->outgoing_index, MQTT_FORBIDDEN, id) &&
+            !mqtt_frame_index_find(&self->pending_index, MQTT_FORBIDDEN, id)) {
+            self->packet_id = id;
+            return id;
+        }
+    }
+
+    WARN("Stream MQTT %d fd, no packet id available", stream_mqtt_get_fd(self));
+    return 0;
+}
+
+
+
+
+
 /**
  * Send MQTT Connect message
  *
@@ -613,19 +1281,20 @@ ssize_t stream_mqtt_connect(struct stream_mqtt *self, bool clean_session, unsign
 {
     self->client_role = true;
     self->keep_alive = keep_alive;
+    stream_mqtt_clean_session(self, clean_session);
 
     size_t body_len = mqtt_eval_connect(client_id, will_topic, will_msg_len, user_name, password_len);
-    unsigned char *buffer = xmalloc(body_len + MQTT_MAX_FIXED_HEADER_SIZE);
-    size_t offset = 0;
+    struct iobuf frame;
+    iobuf_init(&frame);
 
-    offset += mqtt_format_fixed_header(buffer, MQTT_CONNECT, 0, body_len);
-    offset += mqtt_format_connect(buffer+offset, clean_session, keep_alive, client_id,
-                                                 will_topic, will_msg, will_msg_len, will_retain, will_qos,
-                                                 user_name, password, password_len);
+    unsigned char *body = stream_mqtt_reserve_frame(&frame, MQTT_CONNECT, 0, body_len);
+    mqtt_format_connect(body, clean_session, keep_alive, client_id,
+                              will_topic, will_msg, will_msg_len, will_retain, will_qos,
+                              user_name, password, password_len);
     STREAM_LOG("--- mqtt:connect");
-    ssize_t ret = stream_mqtt_real_write(self, buffer, offset);
-    xfree(buffer);
+    ssize_t ret = stream_mqtt_real_write_iobuf(self, &frame);
 
+    iobuf_clean(&frame);
     return ret;
 }
 
@@ -661,26 +1330,45 @@ ssize_t stream_mqtt_publish(struct stream_mqtt *self, bool retain, bool dup, uns
 
 
     size_t body_len = mqtt_eval_publish(qos, topic, payload_len);
-    unsigned char *buffer = xmalloc(body_len + MQTT_MAX_FIXED_HEADER_SIZE);
-    size_t offset = 0;
+    struct iobuf frame;
+    iobuf_init(&frame);
 
-    offset += mqtt_format_fixed_header(buffer, MQTT_PUBLISH, flags, body_len);
-    offset += mqtt_format_publish(buffer+offset, qos, id, topic, payload, payload_len);
+    unsigned char *body = stream_mqtt_reserve_frame(&frame, MQTT_PUBLISH, flags, body_len);
+    mqtt_format_publish(body, qos, id, topic, payload, payload_len);
+
+    if ((qos > MQTT_QOS_0) && !stream_mqtt_can_publish(self)) {
+        // Window is full, hold message until acknowledges arrive
+        stream_mqtt_append_frame_shared(&self->pending, &self->pending_index, MQTT_PUBLISH, flags, id, &frame);
+        stream_mqtt_save_message(self, MQTT_SESSION_OUTGOING, MQTT_PUBLISH, flags, id,
+                                       iobuf_pullup(&frame), iobuf_length(&frame));
+        self->publish_blocked = true;
+
+        iobuf_clean(&frame);
+        return 1;
+    }
 
     ssize_t ret = 1;
     bool msg_sent = TAILQ_EMPTY(&self->outgoing);
+    bool msg_queued = !msg_sent || (qos > MQTT_QOS_0);
+    if (msg_queued)
+        stream_mqtt_append_frame_shared(&self->outgoing, &self->outgoing_index, MQTT_PUBLISH, flags, id, &frame);
+    if (qos > MQTT_QOS_0) {
+        self->inflight++;
+        stream_mqtt_save_message(self, MQTT_SESSION_OUTGOING, MQTT_PUBLISH, flags, id,
+                                       iobuf_pullup(&frame), iobuf_length(&frame));
+    }
+
     if (msg_sent) {
-        ret = stream_mqtt_real_write(self, buffer, offset);
+        ret = stream_mqtt_real_write_iobuf(self, &frame);
         if (qos > MQTT_QOS_0) {
             timer_start(&self->resend_timer, TIMER_SEC, MQTT_RESEND_TIMEOUT);
             self->resend_attempts = 0;
         }
     }
-    if (!msg_sent || (qos > MQTT_QOS_0)) {
-        stream_mqtt_append_frame(&self->outgoing, MQTT_PUBLISH, flags, id, buffer, offset);
-    }
+    if (msg_queued)
+        stream_mqtt_schedule_time(self);
 
-    xfree(buffer);
+    iobuf_clean(&frame);
     return ret;
 }
 
@@ -693,41 +1381,80 @@ ssize_t stream_mqtt_publish(struct stream_mqtt *self, bool retain, bool dup, uns
  */
 ssize_t stream_mqtt_pubrel(struct stream_mqtt *self, unsigned short id)
 {
-    size_t offset = 0;
-    unsigned char buffer[MQTT_MIN_FIXED_HEADER_SIZE + MQTT_PACKET_ID_SIZE];
+    unsigned char flags = MQTT_QOS_TO_FLAGS(MQTT_QOS_1);
+    struct iobuf frame;
+    iobuf_init(&frame);
+
+    unsigned char *body = stream_mqtt_reserve_frame(&frame, MQTT_PUBREL, flags, MQTT_PACKET_ID_SIZE);
+    mqtt_put_short(body, id);
 
-    offset += mqtt_format_fixed_header(buffer+offset, MQTT_PUBREL, MQTT_QOS_TO_FLAGS(MQTT_QOS_1), MQTT_PACKET_ID_SIZE);
-    offset += mqtt_put_short(buffer+offset, id);
+    stream_mqtt_insert_frame_shared(&self->outgoing, &self->outgoing_index, MQTT_PUBREL, flags, id, &frame);
+    self->inflight++;
+    stream_mqtt_save_message(self, MQTT_SESSION_OUTGOING, MQTT_PUBREL, flags, id,
+                                   iobuf_pullup(&frame), iobuf_length(&frame));
+    ssize_t ret = stream_mqtt_real_write_iobuf(self, &frame);
 
-    stream_mqtt_insert_frame(&self->outgoing, MQTT_PUBREL, MQTT_QOS_TO_FLAGS(MQTT_QOS_1), id, buffer, offset);
-    return stream_mqtt_real_write(self, buffer, offset);
+    iobuf_clean(&frame);
+    return ret;
 }
 
 
 
+/**
+ * Queue MQTT request waiting for acknowledge
+ *
+ * Request is sent at once if nothing else is pending, otherwise it is sent
+ * by time handler.
+ *
+ */
+ssize_t stream_mqtt_send_request(struct stream_mqtt *self, unsigned char type, unsigned char flags, unsigned short id,
+                                                           struct iobuf *frame)
+{
+    ssize_t ret = 1;
+    bool msg_sent = TAILQ_EMPTY(&self->outgoing);
+    stream_mqtt_append_frame_shared(&self->outgoing, &self->outgoing_index, type, flags, id, frame);
+    if (msg_sent) {
+        ret = stream_mqtt_real_write_iobuf(self, frame);
+        timer_start(&self->resend_timer, TIMER_SEC, MQTT_RESEND_TIMEOUT);
+        self->resend_attempts = 0;
+    }
+    stream_mqtt_schedule_time(self);
+
+    return ret;
+}
+
+
 /**
  * Send MQTT Subscribe message
  */
 ssize_t stream_mqtt_subscribe(struct stream_mqtt *self, unsigned short id, const char *topic, unsigned char qos)
+{
+    return stream_mqtt_subscribe_many(self, id, &topic, &qos, 1);
+}
+
+
+/**
+ * Send MQTT Subscribe message with many topic filters
+ *
+ * All filters are acknowledged by single Suback with return code for each of them.
+ *
+ */
+ssize_t stream_mqtt_subscribe_many(struct stream_mqtt *self, unsigned short id, const char *const *topics,
+                                                             const unsigned char *qos, size_t count)
 {
     unsigned char flags = MQTT_QOS_TO_FLAGS(MQTT_QOS_1);
 
-    size_t body_len = mqtt_eval_subscribe(topic);
-    unsigned char *buffer = xmalloc(body_len + MQTT_MAX_FIXED_HEADER_SIZE);
-    size_t offset = 0;
+    size_t body_len = mqtt_eval_subscribe_many(topics, count);
+    struct iobuf frame;
+    iobuf_init(&frame);
 
-    offset += mqtt_format_fixed_header(buffer, MQTT_SUBSCRIBE, flags, body_len);
-    offset += mqtt_format_subscribe(buffer+offset, id, topic, qos);
+    unsigned char *body = stream_mqtt_reserve_frame(&frame, MQTT_SUBSCRIBE, flags, body_len);
+    mqtt_format_subscribe_many(body, id, topics, qos, count);
 
-    ssize_t ret = 1;
-    if (TAILQ_EMPTY(&self->outgoing)) {
-        ret = stream_mqtt_real_write(self, buffer, offset);
-        timer_start(&self->resend_timer, TIMER_SEC, MQTT_RESEND_TIMEOUT);
-        self->resend_attempts = 0;
-    }
-    stream_mqtt_append_frame(&self->outgoing, MQTT_SUBSCRIBE, flags, id, buffer, offset);
+    ssize_t ret = stream_mqtt_send_request(self, MQTT_SUBSCRIBE, flags, id, &frame);
+    stream_mqtt_save_subscriptions(self, topics, qos, count);
 
-    xfree(buffer);
+    iobuf_clean(&frame);
     return ret;
 }
 
@@ -746,30 +1473,54 @@ ssize_t stream_mqtt_suback(struct stream_mqtt *self, unsigned short id, unsigned
 }
 
 
+/**
+ * Send MQTT Suback message with many return codes
+ *
+ */
+ssize_t stream_mqtt_suback_many(struct stream_mqtt *self, unsigned short id, const unsigned char *return_codes, size_t count)
+{
+    size_t body_len = mqtt_eval_suback_many(count);
+    struct iobuf frame;
+    iobuf_init(&frame);
+
+    unsigned char *body = stream_mqtt_reserve_frame(&frame, MQTT_SUBACK, 0, body_len);
+    mqtt_format_suback_many(body, id, return_codes, count);
+    ssize_t ret = stream_mqtt_real_write_iobuf(self, &frame);
+
+    iobuf_clean(&frame);
+    return ret;
+}
+
+
 /**
  * Send MQTT Unsubscribe message
  *
  */
 ssize_t stream_mqtt_unsubscribe(struct stream_mqtt *self, unsigned short id, const char *topic)
+{
+    return stream_mqtt_unsubscribe_many(self, id, &topic, 1);
+}
+
+
+/**
+ * Send MQTT Unsubscribe message with many topic filters
+ *
+ */
+ssize_t stream_mqtt_unsubscribe_many(struct stream_mqtt *self, unsigned short id, const char *const *topics, size_t count)
 {
     unsigned char flags = MQTT_QOS_TO_FLAGS(MQTT_QOS_1);
 
-    size_t body_len = mqtt_eval_unsubscribe(topic);
-    unsigned char *buffer = xmalloc(body_len + MQTT_MAX_FIXED_HEADER_SIZE);
-    size_t offset = 0;
+    size_t body_len = mqtt_eval_unsubscribe_many(topics, count);
+    struct iobuf frame;
+    iobuf_init(&frame);
 
-    offset += mqtt_format_fixed_header(buffer, MQTT_UNSUBSCRIBE, flags, body_len);
-    offset += mqtt_format_unsubscribe(buffer+offset, id, topic);
+    unsigned char *body = stream_mqtt_reserve_frame(&frame, MQTT_UNSUBSCRIBE, flags, body_len);
+    mqtt_format_unsubscribe_many(body, id, topics, count);
 
-    ssize_t ret = 1;
-    if (TAILQ_EMPTY(&self->outgoing)) {
-        ret = stream_mqtt_real_write(self, buffer, offset);
-        timer_start(&self->resend_timer, TIMER_SEC, MQTT_RESEND_TIMEOUT);
-        self->resend_attempts = 0;
-    }
-    stream_mqtt_append_frame(&self->outgoing, MQTT_UNSUBSCRIBE, flags, id, buffer, offset);
+    ssize_t ret = stream_mqtt_send_request(self, MQTT_UNSUBSCRIBE, flags, id, &frame);
+    stream_mqtt_forget_subscriptions(self, topics, count);
 
-    xfree(buffer);
+    iobuf_clean(&frame);
     return ret;
 }
 
@@ -816,26 +1567,33 @@ int stream_mqtt_do_time(struct stream_mqtt *self)
         if (item) {
             if (++self->resend_attempts < MQTT_RESEND_ATTEMPTS) {
                 WARN("Stream MQTT %d fd, resend %s message", stream_mqtt_get_fd(self), mqtt_packet_name(item->type));
-                stream_mqtt_real_write(self, item->buffer.data, item->buffer.length);
+                stream_mqtt_write_item(self, item);
                 timer_start(&self->resend_timer, TIMER_SEC, MQTT_RESEND_TIMEOUT);
             }
             else {
                 WARN("Stream MQTT %d fd, abandon %s message", stream_mqtt_get_fd(self), mqtt_packet_name(item->type));
-                TAILQ_REMOVE(&self->outgoing, item, _entry_);
-                mqtt_frame_item_delete(item);
+                stream_mqtt_drop_outgoing(self, item);
                 timer_stop(&self->resend_timer);
                 self->resend_attempts = 0;
+                stream_mqtt_release_pending(self);
             }
         }
     }
     if (!timer_running(&self->resend_timer)) {
-        struct mqtt_frame_item *item = TAILQ_FIRST(&self->outgoing);
-        if (item) {
-            stream_mqtt_real_write(self, item->buffer.data, item->buffer.length);
+        struct mqtt_frame_item *item;
+        while ((item = TAILQ_FIRST(&self->outgoing)) != NULL) {
+            stream_mqtt_write_item(self, item);
+            if (item->type == MQTT_PUBLISH && !mqtt_frame_item_is_inflight(item)) {
+                // Publish QoS 0 is not acknowledged
+                stream_mqtt_drop_outgoing(self, item);
+                continue;
+            }
             timer_start(&self->resend_timer, TIMER_SEC, MQTT_RESEND_TIMEOUT);
+            break;
         }
     }
 
+    stream_mqtt_schedule_time(self);
     return stream_do_time(&self->stream);
 }
 
@@ -11,12 +11,17 @@
 #include "mx/websocket.h"
 #include "mx/http.h"
 #include "mx/buffer.h"
+#include "mx/iobuf.h"
 #include "mx/rand.h"
 #include "mx/timer.h"
 
 #include "private_stream.h"
+#if STREAM_WS_DEFLATE
+  #include "private_ws_deflate.h"
+#endif
 
 #include <stdio.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
@@ -33,6 +38,10 @@
 
 #define WS_KEY_BUFFER_SIZE              128
 #define WS_MESSAGE_BUFFER_SIZE          4096
+#define WS_CONTROL_PAYLOAD_SIZE         125
+#define WS_EXTENSIONS_BUFFER_SIZE       256
+#define WS_FRAGMENT_SIZE                65536
+#define WS_MAX_MESSAGE_SIZE             (16 * 1024 * 1024)
 
 #define WS_KEEP_ALIVE_SERVER_TIMEOUT    100
 #define WS_KEEP_ALIVE_CLIENT_TIMEOUT    90
@@ -53,11 +62,16 @@ struct ws_frame_slice
 
 
 
-struct ws_frame_slice* ws_frame_slice_new(const void *buffer, size_t length)
+static struct xpool ws_frame_slice_pool = XPOOL_INITIALIZER(sizeof(struct ws_frame_slice));
+
+
+
+struct ws_frame_slice* ws_frame_slice_new(unsigned char opcode, size_t length)
 {
-    struct ws_frame_slice *self = xmalloc(sizeof(struct ws_frame_slice));
+    struct ws_frame_slice *self = xpool_alloc(&ws_frame_slice_pool);
     buffer_init(&self->buffer, length);
-    buffer_append(&self->buffer, buffer, length);
+    self->fin = 0;
+    self->opcode = opcode;
     return self;
 }
 
@@ -65,7 +79,73 @@ struct ws_frame_slice* ws_frame_slice_new(const void *buffer, size_t length)
 struct ws_frame_slice* ws_frame_slice_delete(struct ws_frame_slice *self)
 {
     buffer_clean(&self->buffer);
-    return xfree(self);
+    return xpool_free(&ws_frame_slice_pool, self);
+}
+
+
+
+
+/**
+ * Data frame held back until frames written before are sent
+ *
+ * Payload is split into fragments as the queue drains, so that control
+ * frames written meanwhile are not sent after the whole message.
+ *
+ */
+struct ws_pending_frame
+{
+    unsigned char flags;                    // Flags of the written frame
+    bool first;                             // No fragment was sent yet
+    bool masked;
+    unsigned char mask[WS_MASK_SIZE];       // Mask of the next fragment
+    bool deflating;                         // Each fragment is compressed on its own
+    struct iobuf payload;                   // Payload not sent yet
+
+    TAILQ_ENTRY(ws_pending_frame) _entry_;
+};
+
+
+
+static struct xpool ws_pending_frame_pool = XPOOL_INITIALIZER(sizeof(struct ws_pending_frame));
+
+
+
+static struct ws_pending_frame* ws_pending_frame_new(unsigned char flags, const unsigned char *mask, bool deflating)
+{
+    struct ws_pending_frame *self = xpool_alloc(&ws_pending_frame_pool);
+    self->flags = flags;
+    self->first = true;
+    self->masked = mask ? true : false;
+    if (mask)
+        memcpy(self->mask, mask, WS_MASK_SIZE);
+    self->deflating = deflating;
+    iobuf_init(&self->payload);
+    return self;
+}
+
+
+static struct ws_pending_frame* ws_pending_frame_delete(struct ws_pending_frame *self)
+{
+    iobuf_clean(&self->payload);
+    return xpool_free(&ws_pending_frame_pool, self);
+}
+
+
+/**
+ * Return length accounted for held back frame, payload and single header
+ *
+ * Frame without payload is accounted too, so that it is not forgotten.
+ *
+ */
+static size_t ws_pending_frame_length(struct ws_pending_frame *self)
+{
+    return iobuf_length(&self->payload) + WS_MIN_HEADER_SIZE;
+}
+
+
+static bool ws_pending_frame_is_sent(struct ws_pending_frame *self)
+{
+    return !self->first && iobuf_is_empty(&self->payload);
 }
 
 
@@ -77,15 +157,19 @@ struct ws_frame_slice* ws_frame_slice_delete(struct ws_frame_slice *self)
 static void* stream_ws_destructor_impl(struct stream *stream);
 static ssize_t stream_ws_read_impl(struct stream *stream, void *buffer, size_t length);
 static ssize_t stream_ws_write_impl(struct stream *stream, const void *buffer, size_t length);
+static ssize_t stream_ws_write_iobuf_impl(struct stream *stream, struct iobuf *data);
 static int     stream_ws_flush_impl(struct stream *stream);
 static int     stream_ws_time_impl(struct stream *stream);
+static ssize_t stream_ws_pending_impl(struct stream *stream, bool discard);
 
 static const struct stream_vtable stream_ws_vtable = {
         .destructor_fn = stream_ws_destructor_impl,
         .read_fn = stream_ws_read_impl,
         .write_fn = stream_ws_write_impl,
+        .write_iobuf_fn = stream_ws_write_iobuf_impl,
         .flush_fn = stream_ws_flush_impl,
         .time_fn = stream_ws_time_impl,
+        .pending_fn = stream_ws_pending_impl,
 };
 
 
@@ -101,11 +185,35 @@ struct stream_ws
 
     TAILQ_HEAD(ws_frame_slice_head, ws_frame_slice) cache;
 
+    struct ws_parser parser;
+    unsigned char control[WS_CONTROL_PAYLOAD_SIZE];     // Payload of received control frame
+    size_t control_length;
+
+    size_t max_message_size;                // Longer received messages are refused, 0 if unlimited
+    size_t message_received;                // Payload of received message declared so far
+    size_t message_inflated;                // Decompressed payload of received message so far
+
+    bool direct;                            // Complete frame is served from the buffer
+    unsigned char direct_opcode;
+    size_t direct_length;                   // Payload of the frame left in the buffer
+
     unsigned char data_type;
+    size_t fragment_size;                   // Data frames are split above this size, 0 disables
+    bool message_active;                    // Fragmented message is being written
+    TAILQ_HEAD(ws_pending_frame_head, ws_pending_frame) pending;    // Data frames not fully sent yet
+    unsigned char message_opcode;           // Opcode of the next fragment
     char *key;
     unsigned char *mask;
     unsigned char mask_data[4];
 
+#if STREAM_WS_DEFLATE
+    bool deflate_enabled;                   // Offer or accept permessage-deflate
+    struct ws_deflate_params deflate_params;
+    struct ws_deflate *deflate;             // Negotiated compression context
+    struct buffer deflate_buffer;           // Compressed payload of outgoing frame
+    bool inflating;                         // Received message is compressed
+    bool deflating;                         // Sent message is compressed
+#endif
 
     unsigned int keep_alive;
     bool keep_alive_responded;
@@ -124,12 +232,34 @@ void stream_ws_init(struct stream_ws *self)
 {
     buffer_init(&self->buffer, WS_MESSAGE_BUFFER_SIZE);
     TAILQ_INIT(&self->cache);
+    ws_parser_init(&self->parser);
+    self->control_length = 0;
+    self->max_message_size = WS_MAX_MESSAGE_SIZE;
+    self->message_received = 0;
+    self->message_inflated = 0;
+    self->parser.max_payload = self->max_message_size;
+    self->direct = false;
+    self->direct_opcode = WS_OPCODE_CONTINUE;
+    self->direct_length = 0;
 
     self->client_role = false;
     self->data_type = WS_OPCODE_BINARY;
+    self->fragment_size = WS_FRAGMENT_SIZE;
+    self->message_active = false;
+    self->message_opcode = WS_OPCODE_CONTINUE;
+    TAILQ_INIT(&self->pending);
     self->mask = NULL;      // Needs to be NULL for server role
     self->key = NULL;
 
+#if STREAM_WS_DEFLATE
+    self->deflate_enabled = false;
+    ws_deflate_params_init(&self->deflate_params);
+    self->deflate = NULL;
+    buffer_init(&self->deflate_buffer, 0);
+    self->inflating = false;
+    self->deflating = false;
+#endif
+
     self->keep_alive = 0;   // Disable keep alive
     self->keep_alive_responded = true;
     timer_stop(&self->keep_alive_timer);
@@ -142,11 +272,18 @@ void stream_ws_init(struct stream_ws *self)
  */
 void stream_ws_clean(struct stream_ws *self)
 {
+    stream_ws_pending_impl(&self->stream, true);
     buffer_clean(&self->buffer);
 
     if (self->key)
         self->key = xfree(self->key);
 
+#if STREAM_WS_DEFLATE
+    if (self->deflate)
+        self->deflate = ws_deflate_delete(self->deflate);
+    buffer_clean(&self->deflate_buffer);
+#endif
+
     struct ws_frame_slice *slice, *tmp;
     TAILQ_FOREACH_SAFE(slice, &self->cache, _entry_, tmp) {
         TAILQ_REMOVE(&self->cache, slice, _entry_);
@@ -234,6 +371,150 @@ void stream_ws_generate_mask(struct stream_ws *self)
 }
 
 
+/**
+ * Let idler know when time handler is needed
+ *
+ */
+void stream_ws_schedule_time(struct stream_ws *self)
+{
+    stream_set_deadline(&self->stream, timer_deadline(&self->keep_alive_timer));
+}
+
+
+/**
+ * Enable permessage-deflate extension
+ *
+ * Client offers given parameters, server accepts offers within them.
+ * Must be called before the handshake, NULL disables compression.
+ *
+ */
+void stream_ws_set_deflate(struct stream_ws *self, const struct ws_deflate_params *params)
+{
+#if STREAM_WS_DEFLATE
+    self->deflate_enabled = params ? true : false;
+    if (params)
+        self->deflate_params = *params;
+#else
+    if (params)
+        WARN("Stream WS %d fd, permessage-deflate not supported", stream_ws_get_fd(self));
+#endif
+}
+
+
+#if STREAM_WS_DEFLATE
+
+/**
+ * Copy value of Sec-WebSocket-Extensions header
+ *
+ * Must be called before any header is terminated in place.
+ *
+ */
+static char* stream_ws_find_extensions(const char *headers)
+{
+    const char *value = NULL;
+    if (!http_header_find(headers, "Sec-WebSocket-Extensions", &value))
+        return NULL;
+
+    return xstrndup(value, strcspn(value, "\r\n"));
+}
+
+
+/**
+ * Format Sec-WebSocket-Extensions header line
+ *
+ */
+static void stream_ws_format_extensions(const struct ws_deflate_params *params, char *buffer, size_t length)
+{
+    size_t offset = snprintf(buffer, length, "Sec-WebSocket-Extensions: ");
+    offset += ws_deflate_format_params(params, buffer + offset, length - offset);
+    snprintf(buffer + offset, length - offset, "\r\n");
+}
+
+
+/**
+ * Negotiate permessage-deflate offered by client
+ *
+ * Returns response header formatted in the buffer, empty if offer is declined.
+ *
+ */
+static void stream_ws_accept_deflate(struct stream_ws *self, const char *extensions, char *buffer, size_t length)
+{
+    buffer[0] = '\0';
+
+    struct ws_deflate_params offer;
+    if (!self->deflate_enabled || !extensions || !ws_deflate_parse_params(&offer, extensions))
+        return;
+
+    const struct ws_deflate_params *config = &self->deflate_params;
+    struct ws_deflate_params response;
+    ws_deflate_params_init(&response);
+    response.server_no_context_takeover = offer.server_no_context_takeover || config->server_no_context_takeover;
+    response.client_no_context_takeover = offer.client_no_context_takeover || config->client_no_context_takeover;
+
+    // Configured window is raised to the smallest supported, offered limit is kept
+    response.server_max_window_bits = config->server_max_window_bits ? MAX(config->server_max_window_bits, WS_DEFLATE_MIN_WINDOW_BITS) : 0;
+    if (offer.server_max_window_bits) {
+        if (!response.server_max_window_bits || offer.server_max_window_bits < response.server_max_window_bits)
+            response.server_max_window_bits = offer.server_max_window_bits;
+    }
+    if (response.server_max_window_bits && response.server_max_window_bits < WS_DEFLATE_MIN_WINDOW_BITS)
+        return;     // Deflate can not use such small window, offer is declined
+
+    // Client window may be limited only if client supports it
+    int client_bits = offer.client_max_window_bits ? offer.client_max_window_bits : WS_DEFLATE_MAX_WINDOW_BITS;
+    if (offer.client_max_window_bits && config->client_max_window_bits) {
+        response.client_max_window_bits = MIN(config->client_max_window_bits, offer.client_max_window_bits);
+        client_bits = response.client_max_window_bits;
+    }
+
+    int server_bits = response.server_max_window_bits ? response.server_max_window_bits : WS_DEFLATE_MAX_WINDOW_BITS;
+    self->deflate = ws_deflate_new(server_bits, response.server_no_context_takeover,
+                                   client_bits, response.client_no_context_takeover,
+                                   config->mem_level);
+    if (self->deflate)
+        stream_ws_format_extensions(&response, buffer, length);
+}
+
+
+/**
+ * Apply permessage-deflate parameters accepted by server
+ *
+ */
+static bool stream_ws_apply_deflate(struct stream_ws *self, const char *extensions)
+{
+    if (!extensions)
+        return true;    // Server declined compression
+
+    struct ws_deflate_params response;
+    if (!self->deflate_enabled || !ws_deflate_parse_params(&response, extensions)) {
+        WARN("Unexpected Sec-WebSocket-Extensions %s", extensions);
+        return false;
+    }
+
+    const struct ws_deflate_params *config = &self->deflate_params;
+    if (config->server_no_context_takeover && !response.server_no_context_takeover) {
+        WARN("Requested server_no_context_takeover not accepted");
+        return false;
+    }
+
+    // Own window may be always smaller than allowed
+    int client_bits = response.client_max_window_bits ? response.client_max_window_bits : WS_DEFLATE_MAX_WINDOW_BITS;
+    if (config->client_max_window_bits)
+        client_bits = MIN(client_bits, MAX(config->client_max_window_bits, WS_DEFLATE_MIN_WINDOW_BITS));
+    if (client_bits < WS_DEFLATE_MIN_WINDOW_BITS) {
+        WARN("Requested client_max_window_bits=%d not supported", client_bits);
+        return false;
+    }
+    int server_bits = response.server_max_window_bits ? response.server_max_window_bits : WS_DEFLATE_MAX_WINDOW_BITS;
+    self->deflate = ws_deflate_new(client_bits, response.client_no_context_takeover,
+                                   server_bits, response.server_no_context_takeover,
+                                   config->mem_level);
+    return self->deflate ? true : false;
+}
+
+#endif
+
+
 /**
  * Handle handshake request received from client
  *
@@ -243,6 +524,14 @@ int stream_ws_handle_handshake_request(struct stream_ws *self)
     struct http_msg_view http_view;
     if (http_msg_view_parse_request(&http_view, (const char*)self->buffer.data)) {
 
+        char extensions[WS_EXTENSIONS_BUFFER_SIZE] = "";
+#if STREAM_WS_DEFLATE
+        char *offer = stream_ws_find_extensions(http_view.headers);
+        stream_ws_accept_deflate(self, offer, extensions, sizeof(extensions));
+        if (offer)
+            xfree(offer);
+#endif
+
         char *key = NULL;
         if (!http_header_find(http_view.headers, "Sec-WebSocket-Key", (const char**)&key)) {
             WARN("Sec-WebSocket-Key header not found");
@@ -265,7 +554,8 @@ int stream_ws_handle_handshake_request(struct stream_ws *self)
         snprintf(response, sizeof(response), "HTTP/1.1 101 Switching Protocols\r\n"
                                              "Upgrade: websocket\r\n"
                                              "Connection: Upgrade\r\n"
-                                             "Sec-WebSocket-Accept: %s\r\n\r\n", accept_key);
+                                             "Sec-WebSocket-Accept: %s\r\n"
+                                             "%s\r\n", accept_key, extensions);
         stream_do_write(stream_ws_to_stream(self), response, strlen(response));
 
         // Client connected
@@ -274,6 +564,7 @@ int stream_ws_handle_handshake_request(struct stream_ws *self)
 
         self->keep_alive = WS_KEEP_ALIVE_SERVER_TIMEOUT;
         timer_start(&self->keep_alive_timer, TIMER_SEC, self->keep_alive);
+        stream_ws_schedule_time(self);
     }
 
     // No message yet
@@ -297,6 +588,17 @@ int stream_ws_handle_handshake_accept(struct stream_ws *self)
             return 0;   // Disconnect
         }
 
+#if STREAM_WS_DEFLATE
+        char *extensions = stream_ws_find_extensions(http_view.headers);
+        bool accepted = stream_ws_apply_deflate(self, extensions);
+        if (extensions)
+            xfree(extensions);
+        if (!accepted) {
+            buffer_reset(&self->buffer);
+            return 0;   // Disconnect
+        }
+#endif
+
         char *key = NULL;
         if (!http_header_find(http_view.headers, "Sec-WebSocket-Accept", (const char**)&key)) {
             WARN("Sec-WebSocket-Accept header not found");
@@ -327,6 +629,7 @@ int stream_ws_handle_handshake_accept(struct stream_ws *self)
 
         self->keep_alive = WS_KEEP_ALIVE_CLIENT_TIMEOUT;
         timer_start(&self->keep_alive_timer, TIMER_SEC, self->keep_alive);
+        stream_ws_schedule_time(self);
     }
 
     // No message yet
@@ -336,55 +639,46 @@ int stream_ws_handle_handshake_accept(struct stream_ws *self)
 
 
 /**
- * Handle websocket frame
+ * Account received data cached by the stream
  *
  */
-void stream_ws_handle_received_frame(struct stream_ws *self, struct ws_frame *frame, unsigned char *data)
+static inline void stream_ws_cached(struct stream_ws *self, size_t added, size_t removed)
 {
-    unsigned char *payload = NULL;
-    if (frame->payload_offset > 0)
-        payload = data + frame->payload_offset;
-
-    // Unmask payload if necessary
-    if (payload && frame->mask_flag) {
-        if (self->client_role) {
-            // Client MUST close connection if received masked frame
-            stream_ws_disconnect(self, WS_CLOSE_PROTOCOL_ERROR);
-        }
-        else {
-            unsigned char *mask = data + frame->mask_offset;
-            ws_apply_mask(payload, frame->payload_length, mask);
-        }
-    }
+    stream_set_inbound_length(&self->stream, self->stream.inbound_length + added - removed);
+}
 
-    switch (frame->opcode) {
-        case WS_OPCODE_TEXT:
-        case WS_OPCODE_BINARY: {
-            // Save received data type as default
-            self->data_type = frame->opcode;
 
-            struct ws_frame_slice *slice = ws_frame_slice_new(payload, frame->payload_length);
-            slice->fin = frame->fin_flag;
-            slice->opcode = frame->opcode;
-            TAILQ_INSERT_TAIL(&self->cache, slice, _entry_);
-        }   break;
+/**
+ * Return slice which receives payload of data frames
+ *
+ */
+static struct ws_frame_slice* stream_ws_get_receiving_slice(struct stream_ws *self)
+{
+    struct ws_frame_slice *slice = TAILQ_LAST(&self->cache, ws_frame_slice_head);
+    if (!slice || slice->fin) {
+        // Beginning of the message has been already consumed
+        slice = ws_frame_slice_new(WS_OPCODE_CONTINUE, 0);
+        TAILQ_INSERT_TAIL(&self->cache, slice, _entry_);
+    }
+    return slice;
+}
 
-        case WS_OPCODE_CONTINUE: {
-            // Append received data to last slice
-            struct ws_frame_slice *slice = TAILQ_LAST(&self->cache, ws_frame_slice_head);
-            if (slice) {
-                buffer_append(&slice->buffer, payload, frame->payload_length);
-                slice->fin = frame->fin_flag;
-            }
-        }   break;
 
+/**
+ * Handle received control frame
+ *
+ */
+static void stream_ws_handle_control_frame(struct stream_ws *self, unsigned char opcode)
+{
+    switch (opcode) {
         case WS_OPCODE_CLOSE:
             break;  // Client should disconnect eventually
 
         case WS_OPCODE_PING:
             stream_ws_generate_mask(self);
-            stream_ws_write_frame(self, WS_FIN_FLAG, WS_OPCODE_PONG, self->mask, payload, frame->payload_length);
+            stream_ws_write_frame(self, WS_FIN_FLAG, WS_OPCODE_PONG, self->mask, self->control, self->control_length);
             timer_start(&self->keep_alive_timer, TIMER_SEC, self->keep_alive);
+            stream_ws_schedule_time(self);
             break;
 
         case WS_OPCODE_PONG:
@@ -395,167 +689,1067 @@ void stream_ws_handle_received_frame(struct stream_ws *self, struct ws_frame *fr
 
 
 /**
- * Peek for websocket frame
+ * Mark received message as compressed
+ *
+ * Only the first frame of data message may have RSV1 flag set.
  *
  */
-ssize_t stream_ws_peek_frame(struct stream_ws *self)
+static bool stream_ws_start_inflating(struct stream_ws *self, unsigned char opcode)
 {
-    char inbuffer[WS_MESSAGE_BUFFER_SIZE];
+#if STREAM_WS_DEFLATE
+    if (self->deflate && (opcode == WS_OPCODE_TEXT || opcode == WS_OPCODE_BINARY)) {
+        self->inflating = true;
+        self->message_inflated = 0;
+        return true;
+    }
+#else
+    UNUSED(self);
+    UNUSED(opcode);
+#endif
+    return false;
+}
 
-    STREAM_LOG("--- ws:peek");
 
-    ssize_t ret;
-    do {
-        if (!TAILQ_EMPTY(&self->cache)) {
-            struct ws_frame_slice *slice = TAILQ_FIRST(&self->cache);
-            if (slice->fin)
-                break;  // Something is already waiting
+/**
+ * Store received payload of data frame, decompress it if needed
+ *
+ * Message which can not be decompressed is dropped together with its slice,
+ * nothing is parsed afterwards. Returns false in such case.
+ *
+ */
+static bool stream_ws_store_payload(struct stream_ws *self, struct ws_frame_slice *slice,
+                                    const unsigned char *data, size_t length, bool final)
+{
+    size_t stored = slice->buffer.length;
+
+#if STREAM_WS_DEFLATE
+    if (self->inflating) {
+        // Declared length says nothing about decompressed size, limit is applied while inflating
+        size_t limit = self->max_message_size ? self->max_message_size - self->message_inflated : SIZE_MAX;
+        int ret = ws_deflate_decompress(self->deflate, data, length, final, limit, &slice->buffer);
+        self->message_inflated += slice->buffer.length - stored;
+
+        if (ret != WS_DEFLATE_OK) {
+            if (ret == WS_DEFLATE_TOO_BIG) {
+                WARN("Stream WS %d fd, decompressed message exceeds %lu bytes", stream_ws_get_fd(self), self->max_message_size);
+                stream_ws_disconnect(self, WS_CLOSE_MESSAGE_TOO_BIG);
+            }
+            else {
+                WARN("Stream WS %d fd, decompression failed", stream_ws_get_fd(self));
+                stream_ws_disconnect(self, WS_CLOSE_PROTOCOL_ERROR);
+            }
+            self->parser.state = WS_PARSER_ST_ERROR;
+            self->inflating = false;
+
+            // Partly inflated message is never delivered
+            stream_ws_cached(self, 0, stored);
+            TAILQ_REMOVE(&self->cache, slice, _entry_);
+            ws_frame_slice_delete(slice);
+            return false;
         }
+        if (final)
+            self->inflating = false;
+    }
+    else
+#else
+    UNUSED(final);
+#endif
+    if (length) {
+        buffer_append(&slice->buffer, data, length);
+    }
 
-        ret = stream_read(stream_ws_get_decorated(self), inbuffer, sizeof(inbuffer));
-        if (ret <= 0) {
-            if ((ret == 0) || (errno != EAGAIN && errno != EWOULDBLOCK))
-                return ret;     // Error
+    stream_ws_cached(self, slice->buffer.length - stored, 0);
+    return true;
+}
 
-            // All received data was read
+
+/**
+ * Handle websocket parser event
+ *
+ * Payload of data frames is stored in slices as it arrives,
+ * control frames are handled once they are complete.
+ *
+ */
+void stream_ws_handle_parser_event(struct stream_ws *self, struct ws_parser_event *event)
+{
+    struct ws_frame *frame = &self->parser.frame;
+    bool control = (frame->opcode & WS_OPCODE_CONTROL_MSK) != 0;
+
+    switch (event->type) {
+        case WS_PARSER_ERROR:
+            WARN("Stream WS %d fd, refused frame of %lu bytes", stream_ws_get_fd(self), frame->payload_length);
+            stream_ws_disconnect(self, event->code);
             break;
-        }
-        else {
-            // Received some data
-            buffer_append(&self->buffer, inbuffer, ret);
-
-            if (stream_get_status(&self->stream) != STREAM_ST_READY) {
-                if (self->client_role)
-                    return stream_ws_handle_handshake_accept(self);
-                else
-                    return stream_ws_handle_handshake_request(self);
+
+        case WS_PARSER_HEADER:
+            if (!control) {
+                // Declared length is checked before anything is stored
+                self->message_received = (frame->opcode == WS_OPCODE_CONTINUE) ? self->message_received + frame->payload_length
+                                                                               : frame->payload_length;
+                if (self->max_message_size && (self->message_received > self->max_message_size)) {
+                    WARN("Stream WS %d fd, message exceeds %lu bytes", stream_ws_get_fd(self), self->max_message_size);
+                    stream_ws_disconnect(self, WS_CLOSE_MESSAGE_TOO_BIG);
+                    self->parser.state = WS_PARSER_ST_ERROR;
+                    break;
+                }
             }
+            if (frame->mask_flag && self->client_role) {
+                // Client MUST close connection if received masked frame
+                stream_ws_disconnect(self, WS_CLOSE_PROTOCOL_ERROR);
+            }
+            if (frame->rsv1_flag && !stream_ws_start_inflating(self, frame->opcode)) {
+                // Compression was not negotiated or flag is misplaced
+                stream_ws_disconnect(self, WS_CLOSE_PROTOCOL_ERROR);
+            }
+            if (frame->opcode == WS_OPCODE_TEXT || frame->opcode == WS_OPCODE_BINARY) {
+                // Save received data type as default
+                self->data_type = frame->opcode;
 
-            while (!buffer_is_empty(&self->buffer)) {
-                struct ws_frame frame;
-                size_t frame_length;
-                if (!ws_parse_frame(&frame, self->buffer.data, self->buffer.length, &frame_length))
-                    break;  // More data is needed
+                // Slice grows as payload arrives, declared length is not trusted
+                struct ws_frame_slice *slice = ws_frame_slice_new(frame->opcode, MIN(frame->payload_length, WS_MESSAGE_BUFFER_SIZE));
+                TAILQ_INSERT_TAIL(&self->cache, slice, _entry_);
+            }
+            self->control_length = 0;
+            break;
 
-                stream_ws_handle_received_frame(self, &frame, self->buffer.data);
-                buffer_cut(&self->buffer, frame_length);
+        case WS_PARSER_PAYLOAD:
+            if (control) {
+                size_t length = MIN(event->length, sizeof(self->control) - self->control_length);
+                memcpy(self->control + self->control_length, event->data, length);
+                self->control_length += length;
             }
-        }
-    } while (ret > 0);
+            else {
+                struct ws_frame_slice *slice = stream_ws_get_receiving_slice(self);
+                stream_ws_store_payload(self, slice, event->data, event->length, false);
+            }
+            break;
 
-    if (!TAILQ_EMPTY(&self->cache)) {
-        struct ws_frame_slice *slice = TAILQ_FIRST(&self->cache);
-        if (slice->fin)
-            return slice->buffer.length;
+        case WS_PARSER_FRAME_END:
+            if (control) {
+                stream_ws_handle_control_frame(self, frame->opcode);
+            }
+            else {
+                struct ws_frame_slice *slice = stream_ws_get_receiving_slice(self);
+                if (frame->fin_flag && !stream_ws_store_payload(self, slice, NULL, 0, true))
+                    break;      // Message dropped
+                slice->fin = frame->fin_flag;
+            }
+            break;
     }
-
-    errno = EAGAIN;
-    return -1;
 }
 
 
 /**
- * Read websocket frame
+ * Leave complete data frame in the receive buffer
+ *
+ * Unfragmented frame received at once does not need a slice if nothing
+ * else is waiting, its payload is handed out directly from the buffer.
  *
  */
-ssize_t stream_ws_read_frame(struct stream_ws *self, unsigned char *fin, unsigned char *opcode,
-                                                      void *buffer, size_t length)
+static bool stream_ws_take_direct_frame(struct stream_ws *self)
 {
-     if (TAILQ_EMPTY(&self->cache)) {
-         errno = EAGAIN;
-         return -1;     // No data received
-     }
-     struct ws_frame_slice *slice = TAILQ_FIRST(&self->cache);
-     if (!slice->fin) {
-         errno = EAGAIN;
-         return -1;     // Frame is not fully received
-     }
-     if (slice->buffer.length > length) {
-         errno = ENOMEM;
-         return -1;     // Bigger buffer needed
-     }
-
-     ssize_t ret = buffer_take(&slice->buffer, buffer, length);
-     if (fin)
-         *fin = slice->fin;
-     if (opcode)
-         *opcode = slice->opcode;
-
-     TAILQ_REMOVE(&self->cache, slice, _entry_);
-     ws_frame_slice_delete(slice);
-     return ret;
+    if (!TAILQ_EMPTY(&self->cache) || self->parser.state != WS_PARSER_ST_HEADER || self->parser.header_length)
+        return false;   // Frame boundary with empty cache only
+
+    struct ws_frame frame;
+    size_t header_length;
+    if (!ws_parse_frame_header(&frame, self->buffer.data, self->buffer.length, &header_length))
+        return false;   // Header not complete
+    if (!frame.fin_flag || frame.rsv1_flag || (frame.mask_flag && self->client_role))
+        return false;   // Regular handling needed
+    if (frame.opcode != WS_OPCODE_TEXT && frame.opcode != WS_OPCODE_BINARY)
+        return false;
+    if (self->buffer.length - header_length < frame.payload_length)
+        return false;   // Payload not complete
+    if (self->max_message_size && (frame.payload_length > self->max_message_size))
+        return false;   // Refused by parser
+
+    const unsigned char *mask = self->buffer.data + frame.mask_offset;
+    buffer_cut(&self->buffer, frame.payload_offset);
+    if (frame.mask_flag)
+        ws_apply_mask_offset(self->buffer.data, frame.payload_length, mask, 0);
+
+    // Save received data type as default
+    self->data_type = frame.opcode;
+
+    self->direct = true;
+    self->direct_opcode = frame.opcode;
+    self->direct_length = frame.payload_length;
+    stream_ws_cached(self, frame.payload_length, 0);
+    return true;
 }
 
 
 /**
- * Write websocket frame
+ * Parse data waiting in the receive buffer
+ *
+ * Parsing stops at complete frame which may be served directly.
  *
  */
-ssize_t stream_ws_write_frame(struct stream_ws *self, unsigned char fin, unsigned char opcode,
-                                                      const unsigned char *mask,
-                                                      const void *buffer, size_t length)
+static void stream_ws_parse_buffer(struct stream_ws *self)
 {
-    fin = fin ? WS_FIN_FLAG : 0;
+    while (!self->direct) {
+        if (stream_ws_take_direct_frame(self))
+            break;
 
-    unsigned char *outbuffer = xmalloc(length + WS_MAX_HEADER_SIZE);
-    size_t frame_len = ws_format_frame(outbuffer, fin | opcode, mask, buffer, length);
-    ssize_t ret = stream_do_write(stream_ws_to_stream(self), outbuffer, frame_len);
+        struct ws_parser_event event;
+        size_t consumed = ws_parser_execute(&self->parser, self->buffer.data, self->buffer.length, &event);
+        buffer_cut(&self->buffer, consumed);
+        if (event.type == WS_PARSER_NONE)
+            break;  // More data is needed
 
-    STREAM_LOG("--- ws:write %ld", ret);
-    STREAM_WS_LOG_DATA("ws:wr ", outbuffer, ret);
+        stream_ws_handle_parser_event(self, &event);
+    }
 
-    xfree(outbuffer);
-    return ret;
+    // Parser keeps partial header on its own
+    if (buffer_is_empty(&self->buffer))
+        buffer_reset(&self->buffer);
 }
 
 
+/**
+ * Read payload of the frame left in the receive buffer
+ *
+ * Buffer is compacted lazily, only when it gets empty or needs room.
+ *
+ */
+static size_t stream_ws_read_direct(struct stream_ws *self, void *buffer, size_t length)
+{
+    length = MIN(length, self->direct_length);
+    if (buffer)
+        memcpy(buffer, self->buffer.data, length);
+    buffer_cut(&self->buffer, length);
+    stream_ws_cached(self, 0, length);
+
+    self->direct_opcode = WS_OPCODE_CONTINUE;     // Rest of the message follows
+    self->direct_length -= length;
+    if (!self->direct_length) {
+        // Frame consumed, parse what was received behind it
+        self->direct = false;
+        stream_ws_parse_buffer(self);
+    }
 
+    return length;
+}
 
 
 /**
- * Websocket stream class read operation
+ * Check if received data is ready for the application
  *
  */
-ssize_t stream_ws_do_read(struct stream_ws *self, void *buffer, size_t length)
+static bool stream_ws_has_received_data(struct stream_ws *self, bool whole_message)
 {
-    ssize_t ret = stream_ws_peek_frame(self);
-    if (ret <= 0) {
-        if (errno != EAGAIN && errno != EWOULDBLOCK)
-            return ret;     // Error
-    }
+    if (self->direct)
+        return true;
 
-    if (TAILQ_EMPTY(&self->cache)) {
-        errno = EAGAIN;
-        return -1;
-    }
+    if (TAILQ_EMPTY(&self->cache))
+        return false;
 
     struct ws_frame_slice *slice = TAILQ_FIRST(&self->cache);
-    ret = buffer_take(&slice->buffer, buffer, length);
-    if (slice->buffer.length == 0) {
-        TAILQ_REMOVE(&self->cache, slice, _entry_);
-        ws_frame_slice_delete(slice);
-    }
+    if (whole_message)
+        return slice->fin;
 
-    STREAM_LOG("--- ws:read %ld", ret);
-    STREAM_WS_LOG_DATA("ws:rd ", buffer, ret);
-
-    return ret;
+    return slice->fin || !buffer_is_empty(&slice->buffer);
 }
 
 
 /**
- * Websocket stream class write operation
+ * Receive and parse data until a message, or a part of it, is available
+ *
+ * Returns 1 if nothing failed.
  *
  */
-ssize_t stream_ws_do_write(struct stream_ws *self, const void *buffer, size_t length)
+static ssize_t stream_ws_receive(struct stream_ws *self, bool whole_message)
 {
-    stream_ws_generate_mask(self);
-    return stream_ws_write_frame(self, WS_FIN_FLAG, self->data_type, self->mask, buffer, length);
-}
+    for (;;) {
+        // Data may be left behind the frame served directly
+        if (stream_get_status(&self->stream) == STREAM_ST_READY)
+            stream_ws_parse_buffer(self);
 
+        if (stream_ws_has_received_data(self, whole_message))
+            break;  // Something is already waiting
+        if (self->stream.inbound_paused)
+            break;  // Cache is full, application has to consume data first
 
-/**
- * Websocket stream class time operation
+        ssize_t ret = stream_read_buffer(stream_ws_get_decorated(self), &self->buffer, WS_MESSAGE_BUFFER_SIZE);
+        if (ret <= 0) {
+            if ((ret == 0) || (errno != EAGAIN && errno != EWOULDBLOCK))
+                return ret;     // Error
+
+            // All received data was read
+            break;
+        }
+
+        // Received some data, it is already stored in the buffer
+        if (stream_get_status(&self->stream) != STREAM_ST_READY) {
+            if (self->client_role)
+                return stream_ws_handle_handshake_accept(self);
+            else
+                return stream_ws_handle_handshake_request(self);
+        }
+    }
+
+    return 1;
+}
+
+
+/**
+ * Peek for websocket frame
+ *
+ */
+ssize_t stream_ws_peek_frame(struct stream_ws *self)
+{
+    STREAM_LOG("--- ws:peek");
+
+    ssize_t ret = stream_ws_receive(self, true);
+    if (ret <= 0)
+        return ret;
+
+    if (self->direct)
+        return self->direct_length;
+
+    if (stream_ws_has_received_data(self, true)) {
+        struct ws_frame_slice *slice = TAILQ_FIRST(&self->cache);
+        return slice->buffer.length;
+    }
+
+    errno = EAGAIN;
+    return -1;
+}
+
+
+/**
+ * Read chunk of websocket message
+ *
+ * Data is handed out as soon as it is received, so large messages may be
+ * consumed with bounded memory. Opcode of the first chunk is the message type,
+ * following chunks are marked as continuation. Fin is set with the last chunk.
+ *
+ */
+ssize_t stream_ws_read_chunk(struct stream_ws *self, unsigned char *fin, unsigned char *opcode,
+                                                     void *buffer, size_t length)
+{
+    ssize_t ret = stream_ws_receive(self, false);
+    if (ret <= 0)
+        return ret;
+
+    if (!stream_ws_has_received_data(self, false)) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    if (self->direct) {
+        if (opcode)
+            *opcode = self->direct_opcode;
+        if (fin)
+            *fin = (self->direct_length <= length);
+        return stream_ws_read_direct(self, buffer, length);
+    }
+
+    struct ws_frame_slice *slice = TAILQ_FIRST(&self->cache);
+    ret = buffer_take(&slice->buffer, buffer, length);
+    stream_ws_cached(self, 0, ret);
+    if (opcode)
+        *opcode = slice->opcode;
+    if (fin)
+        *fin = slice->fin && buffer_is_empty(&slice->buffer);
+
+    slice->opcode = WS_OPCODE_CONTINUE;     // Rest of the message follows
+    if (slice->fin && buffer_is_empty(&slice->buffer)) {
+        TAILQ_REMOVE(&self->cache, slice, _entry_);
+        ws_frame_slice_delete(slice);
+    }
+    return ret;
+}
+
+
+/**
+ * Read websocket frame
+ *
+ */
+ssize_t stream_ws_read_frame(struct stream_ws *self, unsigned char *fin, unsigned char *opcode,
+                                                      void *buffer, size_t length)
+{
+     if (self->direct) {
+         if (self->direct_length > length) {
+             errno = ENOMEM;
+             return -1;     // Bigger buffer needed
+         }
+         if (fin)
+             *fin = 1;
+         if (opcode)
+             *opcode = self->direct_opcode;
+         return stream_ws_read_direct(self, buffer, length);
+     }
+
+     if (TAILQ_EMPTY(&self->cache)) {
+         errno = EAGAIN;
+         return -1;     // No data received
+     }
+     struct ws_frame_slice *slice = TAILQ_FIRST(&self->cache);
+     if (!slice->fin) {
+         errno = EAGAIN;
+         return -1;     // Frame is not fully received
+     }
+     if (slice->buffer.length > length) {
+         errno = ENOMEM;
+         return -1;     // Bigger buffer needed
+     }
+
+     ssize_t ret = buffer_take(&slice->buffer, buffer, length);
+     stream_ws_cached(self, 0, ret);
+     if (fin)
+         *fin = slice->fin;
+     if (opcode)
+         *opcode = slice->opcode;
+
+     TAILQ_REMOVE(&self->cache, slice, _entry_);
+     ws_frame_slice_delete(slice);
+     return ret;
+}
+
+
+/**
+ * Borrow websocket frame
+ *
+ * Payload is not copied, returned data stays valid until the frame
+ * is released with stream_ws_release_frame().
+ *
+ */
+ssize_t stream_ws_borrow_frame(struct stream_ws *self, unsigned char *fin, unsigned char *opcode,
+                                                       const void **data)
+{
+    if (self->direct) {
+        if (fin)
+            *fin = 1;
+        if (opcode)
+            *opcode = self->direct_opcode;
+        if (data)
+            *data = self->buffer.data;
+        return self->direct_length;
+    }
+
+    if (TAILQ_EMPTY(&self->cache)) {
+        errno = EAGAIN;
+        return -1;     // No data received
+    }
+    struct ws_frame_slice *slice = TAILQ_FIRST(&self->cache);
+    if (!slice->fin) {
+        errno = EAGAIN;
+        return -1;     // Frame is not fully received
+    }
+
+    if (fin)
+        *fin = slice->fin;
+    if (opcode)
+        *opcode = slice->opcode;
+    if (data)
+        *data = slice->buffer.data;
+    return slice->buffer.length;
+}
+
+
+/**
+ * Release borrowed websocket frame
+ *
+ */
+void stream_ws_release_frame(struct stream_ws *self)
+{
+    if (self->direct) {
+        stream_ws_read_direct(self, NULL, self->direct_length);
+        return;
+    }
+
+    if (TAILQ_EMPTY(&self->cache))
+        return;
+
+    struct ws_frame_slice *slice = TAILQ_FIRST(&self->cache);
+    stream_ws_cached(self, 0, slice->buffer.length);
+    TAILQ_REMOVE(&self->cache, slice, _entry_);
+    ws_frame_slice_delete(slice);
+}
+
+
+/**
+ * Send frame which payload is already masked
+ *
+ * Header is prepended to the payload chain, on error chain is restored.
+ *
+ */
+static ssize_t stream_ws_send_frame(struct stream_ws *self, unsigned char flags, const unsigned char *mask,
+                                                            struct iobuf *payload)
+{
+    unsigned char header[WS_MAX_HEADER_SIZE];
+    size_t header_len = ws_format_frame_header(header, flags, mask, iobuf_length(payload));
+    iobuf_prepend(payload, header, header_len);
+
+    ssize_t ret = stream_do_write_iobuf(stream_ws_to_stream(self), payload);
+    if (ret < 0)
+        iobuf_cut(payload, header_len);
+
+    STREAM_LOG("--- ws:write %ld", ret);
+    STREAM_WS_LOG_DATA("ws:wr ", header, header_len);
+    return ret;
+}
+
+
+/**
+ * Copy and mask payload chain into new segment of the frame
+ *
+ */
+static void stream_ws_mask_chain(struct iobuf *frame, const unsigned char *mask, const struct iobuf *data)
+{
+    size_t length = iobuf_length(data);
+    if (!length)
+        return;
+
+    unsigned char *payload = iobuf_reserve(frame, WS_MAX_HEADER_SIZE, length);
+    size_t offset = 0;
+    struct iobuf_segment *segment;
+    TAILQ_FOREACH(segment, &data->segments, _entry_) {
+        offset = ws_copy_mask(payload, segment->data, segment->length, mask, offset);
+        payload += segment->length;
+    }
+}
+
+
+/**
+ * Return length of payload carried by single frame
+ *
+ * Large data messages are split into continuation frames, so that memory needed
+ * for a frame is bounded. Control frames are never fragmented.
+ *
+ */
+static size_t stream_ws_fragment_length(struct stream_ws *self, unsigned char flags, size_t length)
+{
+    if (!self->fragment_size || (flags & WS_OPCODE_CONTROL_MSK))
+        return length;
+
+    return MIN(length, self->fragment_size);
+}
+
+
+/**
+ * Append frame which payload is already masked to the message chain
+ *
+ * Opcode and RSV1 flag are kept in the first frame of the message only,
+ * FIN flag in the last one.
+ *
+ */
+static void stream_ws_append_frame(struct iobuf *message, unsigned char flags, bool first, bool last,
+                                                          const unsigned char *mask, struct iobuf *frame)
+{
+    if (!first)
+        flags = (flags & WS_FIN_FLAG) | WS_OPCODE_CONTINUE;
+    if (!last)
+        flags &= ~WS_FIN_FLAG;
+
+    unsigned char header[WS_MAX_HEADER_SIZE];
+    size_t header_len = ws_format_frame_header(header, flags, mask, iobuf_length(frame));
+    iobuf_prepend(frame, header, header_len);
+    iobuf_move(message, frame);
+
+    STREAM_WS_LOG_DATA("ws:wr ", header, header_len);
+}
+
+
+/**
+ * Send chain of formatted frames
+ *
+ */
+static ssize_t stream_ws_send_message(struct stream_ws *self, struct iobuf *message)
+{
+    ssize_t ret = stream_do_write_iobuf(stream_ws_to_stream(self), message);
+
+    STREAM_LOG("--- ws:write %ld", ret);
+    return ret;
+}
+
+
+#if STREAM_WS_DEFLATE
+
+/**
+ * Check if payload of data frame has to be compressed
+ *
+ * First frame of compressed message gets RSV1 flag.
+ *
+ */
+static bool stream_ws_is_deflating(struct stream_ws *self, unsigned char *flags)
+{
+    unsigned char opcode = *flags & WS_OPCODE_MSK;
+    if (!self->deflate || (opcode & WS_OPCODE_CONTROL_MSK))
+        return false;
+
+    if (opcode != WS_OPCODE_CONTINUE) {
+        self->deflating = true;
+        *flags |= WS_RSV1_FLAG;
+    }
+    return self->deflating;
+}
+
+
+/**
+ * Compress part of frame payload into deflate buffer
+ *
+ */
+static bool stream_ws_compress(struct stream_ws *self, unsigned char flags, const void *data, size_t length, bool last)
+{
+    int mode = WS_DEFLATE_CHUNK;
+    if (last)
+        mode = (flags & WS_FIN_FLAG) ? WS_DEFLATE_MESSAGE : WS_DEFLATE_FRAME;
+
+    if (!ws_deflate_compress(self->deflate, data, length, mode, &self->deflate_buffer)) {
+        errno = EIO;
+        return false;
+    }
+    return true;
+}
+
+
+/**
+ * Compress fragment payload chain into deflate buffer
+ *
+ * Each fragment ends with sync flush, so that it may be sent as soon
+ * as it is compressed.
+ *
+ */
+static bool stream_ws_compress_fragment(struct stream_ws *self, unsigned char flags, struct iobuf *part)
+{
+    buffer_reset(&self->deflate_buffer);
+
+    struct iobuf_segment *segment;
+    TAILQ_FOREACH(segment, &part->segments, _entry_) {
+        if (!stream_ws_compress(self, flags, segment->data, segment->length, false))
+            return false;
+    }
+    return stream_ws_compress(self, flags, NULL, 0, true);
+}
+
+#endif
+
+
+/**
+ * Format next fragment of held back frame
+ *
+ * Opcode and RSV1 flag are kept in the first fragment, FIN flag in
+ * the last one. Compression state advances, fragment must be sent.
+ *
+ */
+static bool stream_ws_format_fragment(struct stream_ws *self, struct ws_pending_frame *frame, struct iobuf *message)
+{
+    size_t length = iobuf_length(&frame->payload);
+    size_t len = stream_ws_fragment_length(self, frame->flags, length);
+    bool last = (len == length);
+
+    struct iobuf part, payload;
+    iobuf_init(&part);
+    iobuf_init(&payload);
+    iobuf_split(&frame->payload, len, &part);
+
+#if STREAM_WS_DEFLATE
+    if (frame->deflating) {
+        unsigned char flags = last ? frame->flags : (frame->flags & ~WS_FIN_FLAG);
+        if (!stream_ws_compress_fragment(self, flags, &part)) {
+            iobuf_clean(&part);
+            return false;
+        }
+
+        size_t deflated = self->deflate_buffer.length;
+        if (deflated) {
+            unsigned char *data = iobuf_reserve(&payload, WS_MAX_HEADER_SIZE, deflated);
+            if (frame->masked)
+                ws_copy_mask(data, self->deflate_buffer.data, deflated, frame->mask, 0);
+            else
+                memcpy(data, self->deflate_buffer.data, deflated);
+        }
+    }
+    else
+#endif
+    if (frame->masked) {
+        // Masking modifies payload which might be shared
+        stream_ws_mask_chain(&payload, frame->mask, &part);
+    }
+    else {
+        iobuf_move(&payload, &part);
+    }
+    iobuf_clean(&part);
+
+    stream_ws_append_frame(message, frame->flags, frame->first, last, frame->masked ? frame->mask : NULL, &payload);
+    frame->first = false;
+
+    if (frame->masked && !last) {
+        // Each frame needs fresh mask
+        rand_data(frame->mask, sizeof(frame->mask));
+    }
+    return true;
+}
+
+
+/**
+ * Send next fragment of held back frame
+ *
+ * Watermarks were checked when the frame was written, fragment is passed
+ * to the decorated stream right away.
+ *
+ */
+static ssize_t stream_ws_send_fragment(struct stream_ws *self, struct ws_pending_frame *frame)
+{
+    struct iobuf message;
+    iobuf_init(&message);
+
+    ssize_t ret = -1;
+    if (stream_ws_format_fragment(self, frame, &message))
+        ret = stream_write_iobuf(self->stream.decorated, &message);
+
+    STREAM_LOG("--- ws:write %ld", ret);
+    iobuf_clean(&message);
+    return ret;
+}
+
+
+/**
+ * Check if data frame has to be held back
+ *
+ * Frames longer than fragment size are sent part by part, frames written
+ * meanwhile wait for them. Control frames are sent in between.
+ *
+ */
+static bool stream_ws_is_held_back(struct stream_ws *self, unsigned char flags, size_t length)
+{
+    if (flags & WS_OPCODE_CONTROL_MSK)
+        return false;
+
+    return !TAILQ_EMPTY(&self->pending) || (stream_ws_fragment_length(self, flags, length) < length);
+}
+
+
+/**
+ * Write data frame which is split into fragments
+ *
+ * Fragments are sent while the queue stays empty, the rest is held back
+ * and sent as the queue drains, see stream_ws_pending_impl(). Returns
+ * length of sent fragments and held back payload.
+ *
+ */
+static ssize_t stream_ws_write_pending(struct stream_ws *self, struct ws_pending_frame *frame)
+{
+    if (!stream_is_writable(&self->stream)) {
+        ws_pending_frame_delete(frame);
+        errno = ENOBUFS;
+        return -1;
+    }
+
+#if STREAM_WS_DEFLATE
+    if (frame->deflating && (frame->flags & WS_FIN_FLAG))
+        self->deflating = false;
+#endif
+
+    size_t written = 0;
+    if (TAILQ_EMPTY(&self->pending)) {
+        do {
+            ssize_t ret = stream_ws_send_fragment(self, frame);
+            if (ret < 0) {
+                ws_pending_frame_delete(frame);
+                return ret;
+            }
+            written += ret;
+        } while (!ws_pending_frame_is_sent(frame) && !stream_get_outgoing_length(&self->stream));
+
+        if (ws_pending_frame_is_sent(frame)) {
+            ws_pending_frame_delete(frame);
+            return written;
+        }
+    }
+
+    written += iobuf_length(&frame->payload);
+    TAILQ_INSERT_TAIL(&self->pending, frame, _entry_);
+    stream_set_pending_length(&self->stream, self->stream.pending_length + ws_pending_frame_length(frame));
+    return written;
+}
+
+
+/**
+ * Write frame with given payload as is
+ *
+ * Payload of single frame is copied once, directly into the frame. Longer
+ * payload is copied and held back, see stream_ws_write_pending().
+ *
+ */
+static ssize_t stream_ws_write_raw_frame(struct stream_ws *self, unsigned char flags, const unsigned char *mask,
+                                                                 const void *buffer, size_t length)
+{
+    if (stream_ws_is_held_back(self, flags, length)) {
+        struct ws_pending_frame *frame = ws_pending_frame_new(flags, mask, false);
+        iobuf_append(&frame->payload, buffer, length);
+        return stream_ws_write_pending(self, frame);
+    }
+
+    struct iobuf message, frame;
+    iobuf_init(&message);
+    iobuf_init(&frame);
+    if (length) {
+        unsigned char *payload = iobuf_reserve(&frame, WS_MAX_HEADER_SIZE, length);
+        if (mask)
+            ws_copy_mask(payload, buffer, length, mask, 0);
+        else
+            memcpy(payload, buffer, length);
+    }
+    stream_ws_append_frame(&message, flags, true, true, mask, &frame);
+
+    ssize_t ret = stream_ws_send_message(self, &message);
+
+    iobuf_clean(&message);
+    return ret;
+}
+
+
+/**
+ * Write websocket frame
+ *
+ * Payload of data frames is compressed if permessage-deflate was negotiated.
+ *
+ */
+ssize_t stream_ws_write_frame(struct stream_ws *self, unsigned char fin, unsigned char opcode,
+                                                      const unsigned char *mask,
+                                                      const void *buffer, size_t length)
+{
+    unsigned char flags = (fin ? WS_FIN_FLAG : 0) | opcode;
+
+#if STREAM_WS_DEFLATE
+    if (stream_ws_is_deflating(self, &flags)) {
+        struct ws_pending_frame *frame = ws_pending_frame_new(flags, mask, true);
+        iobuf_append(&frame->payload, buffer, length);
+        return stream_ws_write_pending(self, frame);
+    }
+#endif
+
+    return stream_ws_write_raw_frame(self, flags, mask, buffer, length);
+}
+
+
+/**
+ * Write websocket frame with payload chain
+ *
+ * Chain is taken without copying unless it has to be masked or compressed.
+ *
+ */
+ssize_t stream_ws_write_frame_iobuf(struct stream_ws *self, unsigned char fin, unsigned char opcode,
+                                                            const unsigned char *mask,
+                                                            struct iobuf *data)
+{
+    unsigned char flags = (fin ? WS_FIN_FLAG : 0) | opcode;
+    bool deflating = false;
+
+#if STREAM_WS_DEFLATE
+    deflating = stream_ws_is_deflating(self, &flags);
+#endif
+
+    if (deflating || stream_ws_is_held_back(self, flags, iobuf_length(data))) {
+        // Chain is shared, it is released only when fragments are sent
+        struct ws_pending_frame *frame = ws_pending_frame_new(flags, mask, deflating);
+        iobuf_share(&frame->payload, data);
+
+        ssize_t ret = stream_ws_write_pending(self, frame);
+        if (ret >= 0)
+            iobuf_clean(data);
+        return ret;
+    }
+
+    if (!mask)
+        return stream_ws_send_frame(self, flags, mask, data);
+
+    // Masking modifies payload which might be shared
+    struct iobuf frame;
+    iobuf_init(&frame);
+    stream_ws_mask_chain(&frame, mask, data);
+
+    ssize_t ret = stream_ws_send_frame(self, flags, mask, &frame);
+    if (ret >= 0)
+        iobuf_clean(data);
+
+    iobuf_clean(&frame);
+    return ret;
+}
+
+
+
+
+
+/**
+ * Set maximal size of received message
+ *
+ * Peer which declares longer frame or message is disconnected with
+ * WS_CLOSE_MESSAGE_TOO_BIG before payload is stored. Zero disables the limit.
+ *
+ */
+void stream_ws_set_max_message_size(struct stream_ws *self, size_t size)
+{
+    self->max_message_size = size;
+    self->parser.max_payload = size;
+}
+
+
+/**
+ * Set size above which data frames are split into continuation frames
+ *
+ * Fragments are sent one by one as the queue drains, control frames written
+ * meanwhile go in between. Compressed frames are split before compression.
+ * Zero disables automatic fragmentation.
+ *
+ */
+void stream_ws_set_fragment_size(struct stream_ws *self, size_t size)
+{
+    self->fragment_size = size;
+}
+
+
+/**
+ * Begin fragmented message
+ *
+ * Message payload is written with stream_ws_write_fragment() in parts of any
+ * size, each part is sent as separate frame. Control frames may be sent
+ * between them. Opcode 0 selects default data type.
+ *
+ */
+int stream_ws_begin_message(struct stream_ws *self, unsigned char opcode)
+{
+    if (self->message_active) {
+        errno = EBUSY;
+        return -1;  // Previous message not finished
+    }
+
+    self->message_active = true;
+    self->message_opcode = opcode ? opcode : self->data_type;
+    return 0;
+}
+
+
+/**
+ * Write fragment of message
+ *
+ * Returns length of written payload.
+ *
+ */
+ssize_t stream_ws_write_fragment(struct stream_ws *self, const void *buffer, size_t length)
+{
+    if (!self->message_active) {
+        errno = EINVAL;
+        return -1;  // Message not started
+    }
+    if (!length)
+        return 0;
+
+    stream_ws_generate_mask(self);
+    ssize_t ret = stream_ws_write_frame(self, 0, self->message_opcode, self->mask, buffer, length);
+    if (ret < 0)
+        return ret;
+
+    self->message_opcode = WS_OPCODE_CONTINUE;
+    return length;
+}
+
+
+/**
+ * End fragmented message, optionally with the last fragment
+ *
+ * Returns length of written payload.
+ *
+ */
+ssize_t stream_ws_end_message(struct stream_ws *self, const void *buffer, size_t length)
+{
+    if (!self->message_active) {
+        errno = EINVAL;
+        return -1;  // Message not started
+    }
+
+    stream_ws_generate_mask(self);
+    ssize_t ret = stream_ws_write_frame(self, WS_FIN_FLAG, self->message_opcode, self->mask, buffer, length);
+    if (ret < 0)
+        return ret;
+
+    self->message_active = false;
+    self->message_opcode = WS_OPCODE_CONTINUE;
+    return length;
+}
+
+
+
+
+
+/**
+ * Websocket stream class read operation
+ *
+ */
+ssize_t stream_ws_do_read(struct stream_ws *self, void *buffer, size_t length)
+{
+    ssize_t ret = stream_ws_peek_frame(self);
+    if (ret <= 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            return ret;     // Error
+    }
+
+    if (self->direct) {
+        ret = stream_ws_read_direct(self, buffer, length);
+    }
+    else if (!TAILQ_EMPTY(&self->cache)) {
+        struct ws_frame_slice *slice = TAILQ_FIRST(&self->cache);
+        ret = buffer_take(&slice->buffer, buffer, length);
+        stream_ws_cached(self, 0, ret);
+        if (slice->buffer.length == 0) {
+            TAILQ_REMOVE(&self->cache, slice, _entry_);
+            ws_frame_slice_delete(slice);
+        }
+    }
+    else {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    STREAM_LOG("--- ws:read %ld", ret);
+    STREAM_WS_LOG_DATA("ws:rd ", buffer, ret);
+
+    return ret;
+}
+
+
+/**
+ * Websocket stream class write operation
+ *
+ */
+ssize_t stream_ws_do_write(struct stream_ws *self, const void *buffer, size_t length)
+{
+    if (self->message_active) {
+        errno = EBUSY;
+        return -1;  // Data must not be mixed with fragmented message
+    }
+
+    stream_ws_generate_mask(self);
+    return stream_ws_write_frame(self, WS_FIN_FLAG, self->data_type, self->mask, buffer, length);
+}
+
+
+/**
+ * Websocket stream class chain write operation
+ *
+ */
+ssize_t stream_ws_do_write_iobuf(struct stream_ws *self, struct iobuf *data)
+{
+    size_t length = iobuf_length(data);
+
+    if (self->message_active) {
+        errno = EBUSY;
+        return -1;  // Data must not be mixed with fragmented message
+    }
+
+    stream_ws_generate_mask(self);
+    ssize_t ret = stream_ws_write_frame_iobuf(self, WS_FIN_FLAG, self->data_type, self->mask, data);
+
+    return (ret < 0) ? ret : (ssize_t)length;
+}
+
+
+/**
+ * Websocket stream class time operation
  *
  */
 int stream_ws_do_time(struct stream_ws *self)
@@ -579,6 +1773,7 @@ int stream_ws_do_time(struct stream_ws *self)
         }
     }
 
+    stream_ws_schedule_time(self);
     return stream_do_time(&self->stream);
 }
 
@@ -609,16 +1804,29 @@ void stream_ws_connect(struct stream_ws *self, const char *uri, const char *key,
         self->key = xstrdup(ws_key);
     }
 
+    char extensions[WS_EXTENSIONS_BUFFER_SIZE] = "";
+#if STREAM_WS_DEFLATE
+    if (self->deflate_enabled) {
+        // Own deflate window is never smaller than supported, server must not ask for less
+        struct ws_deflate_params offer = self->deflate_params;
+        if (offer.client_max_window_bits)
+            offer.client_max_window_bits = MAX(offer.client_max_window_bits, WS_DEFLATE_MIN_WINDOW_BITS);
+        stream_ws_format_extensions(&offer, extensions, sizeof(extensions));
+    }
+#endif
+
     char request[WS_MESSAGE_BUFFER_SIZE];
     snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\n"
                                        "%s"
                                        "Upgrade: websocket\r\n"
                                        "Connection: Upgrade\r\n"
                                        "Sec-WebSocket-Version: 13\r\n"
-                                       "Sec-WebSocket-Key: %s\r\n\r\n",
+                                       "Sec-WebSocket-Key: %s\r\n"
+                                       "%s\r\n",
                                        uri ? uri : "/",
                                        header ? header : "",
-                                       self->key);
+                                       self->key,
+                                       extensions);
 
     STREAM_LOG("--- ws:connect");
     stream_do_write(stream_ws_to_stream(self), request, strlen(request));
@@ -631,13 +1839,16 @@ void stream_ws_connect(struct stream_ws *self, const char *uri, const char *key,
  */
 void stream_ws_disconnect(struct stream_ws *self, unsigned short code)
 {
-    unsigned short payload[2];
+    unsigned char payload[2];
     payload[0] = (unsigned char)((code >> 8) & 0xFF);
     payload[1] = (unsigned char)((code     ) & 0xFF);
 
     stream_ws_generate_mask(self);
     stream_ws_write_frame(self, WS_FIN_FLAG, WS_OPCODE_CLOSE, self->mask, payload, sizeof(payload));
     stream_set_status(&self->stream, STREAM_ST_CLOSING);
+
+    // No data frame may follow close frame
+    stream_ws_pending_impl(&self->stream, true);
 }
 
 
@@ -682,6 +1893,16 @@ ssize_t stream_ws_write_impl(struct stream *stream, const void *buffer, size_t l
 }
 
 
+/**
+ * Websocket stream virtual chain write implementation
+ *
+ */
+ssize_t stream_ws_write_iobuf_impl(struct stream *stream, struct iobuf *data)
+{
+    return stream_ws_do_write_iobuf((struct stream_ws*)stream, data);
+}
+
+
 /**
  * Websocket stream virtual flush implementation
  *
@@ -700,3 +1921,43 @@ int stream_ws_time_impl(struct stream *stream)
 {
     return stream_ws_do_time((struct stream_ws*)stream);
 }
+
+
+/**
+ * Websocket stream virtual pending data implementation
+ *
+ * Sends next fragment of the first held back frame, or drops all of them.
+ *
+ */
+ssize_t stream_ws_pending_impl(struct stream *stream, bool discard)
+{
+    struct stream_ws *self = (struct stream_ws*)stream;
+
+    if (discard) {
+        struct ws_pending_frame *frame, *tmp;
+        TAILQ_FOREACH_SAFE(frame, &self->pending, _entry_, tmp) {
+            TAILQ_REMOVE(&self->pending, frame, _entry_);
+            ws_pending_frame_delete(frame);
+        }
+        stream_set_pending_length(stream, 0);
+        return 0;
+    }
+
+    struct ws_pending_frame *frame = TAILQ_FIRST(&self->pending);
+    if (!frame)
+        return 0;
+
+    size_t length = ws_pending_frame_length(frame);
+    ssize_t ret = stream_ws_send_fragment(self, frame);
+
+    // Fragment is gone even if it could not be sent
+    if (ws_pending_frame_is_sent(frame) || (ret < 0)) {
+        TAILQ_REMOVE(&self->pending, frame, _entry_);
+        ws_pending_frame_delete(frame);
+        stream_set_pending_length(stream, stream->pending_length - length);
+    }
+    else {
+        stream_set_pending_length(stream, stream->pending_length - length + ws_pending_frame_length(frame));
+    }
+    return ret;
+}
@@ -5,9 +5,24 @@
 
 
 
-static volatile time_t clock_ms = 0;
-static volatile time_t clock_s = 0;
-static volatile time_t clock_chrono = 0;
+// Clock is shared by all threads, it is accessed atomically and updated under lock
+static time_t clock_ms = 0;
+static time_t clock_s = 0;
+static time_t clock_chrono = 0;
+static bool clock_lock = false;
+
+
+
+static inline void clock_acquire(void)
+{
+    while (__atomic_test_and_set(&clock_lock, __ATOMIC_ACQUIRE));
+}
+
+
+static inline void clock_release(void)
+{
+    __atomic_clear(&clock_lock, __ATOMIC_RELEASE);
+}
 
 
 
@@ -23,28 +38,38 @@ static volatile time_t clock_chrono = 0;
  */
 void clock_update(time_t ms, time_t chrono)
 {
+    clock_acquire();
+
     if (ms) {
-        clock_s += ((clock_ms % 1000) + ms)/1000;
-        clock_ms += ms;
+        time_t current = __atomic_load_n(&clock_ms, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&clock_s, ((current % 1000) + ms)/1000, __ATOMIC_RELAXED);
+        __atomic_store_n(&clock_ms, current + ms, __ATOMIC_RELAXED);
     }
 
-    clock_chrono = chrono;
+    __atomic_store_n(&clock_chrono, chrono, __ATOMIC_RELAXED);
+
+    clock_release();
 }
 
 
 /**
  * Update clock values from system timers
  *
+ * May be called from many threads. Time is sampled under lock, so that
+ * a thread never stores older time than the one already stored.
+ *
  */
 void clock_update_sys(void)
 {
+    clock_acquire();
+
     struct timespec ts;
     clock_gettime(CLOCK_MONOTONIC, &ts);
-    clock_s = ts.tv_sec;
-    clock_ms = ts.tv_sec * 1000;
-    clock_ms += ts.tv_nsec / 1000 / 1000;
+    __atomic_store_n(&clock_s, ts.tv_sec, __ATOMIC_RELAXED);
+    __atomic_store_n(&clock_ms, ts.tv_sec * 1000 + ts.tv_nsec / 1000 / 1000, __ATOMIC_RELAXED);
+    __atomic_store_n(&clock_chrono, time(NULL), __ATOMIC_RELAXED);
 
-    clock_chrono = time(NULL);
+    clock_release();
 }
 
 
@@ -54,7 +79,7 @@ void clock_update_sys(void)
  */
 time_t clock_get_milis()
 {
-    return clock_ms;
+    return __atomic_load_n(&clock_ms, __ATOMIC_RELAXED);
 }
 
 
@@ -64,7 +89,7 @@ time_t clock_get_milis()
  */
 time_t clock_get_seconds()
 {
-    return clock_s;
+    return __atomic_load_n(&clock_s, __ATOMIC_RELAXED);
 }
 
 
@@ -74,5 +99,6 @@ time_t clock_get_seconds()
  */
 time_t clock_get_chrono()
 {
-    return clock_chrono != 0 ? clock_chrono : clock_s;
+    time_t chrono = __atomic_load_n(&clock_chrono, __ATOMIC_RELAXED);
+    return chrono != 0 ? chrono : clock_get_seconds();
 }
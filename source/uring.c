@@ -0,0 +1,280 @@
+#include "private_uring.h"
+
+#include "mx/log.h"
+#include "mx/memory.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+
+
+static inline int uring_setup(unsigned int entries, struct io_uring_params *params)
+{
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+
+static inline int uring_enter(int fd, unsigned int to_submit, unsigned int min_complete,
+                              unsigned int flags, void *arg, size_t argsz)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+
+
+static inline int uring_register(int fd, unsigned int opcode, void *arg, unsigned int count)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+
+
+/**
+ * Initialize ring with given number of submission entries
+ *
+ * Kernel with single mmap and extended wait arguments support (5.11) is required.
+ *
+ */
+bool uring_init(struct uring *self, unsigned int entries)
+{
+    memset(self, 0, sizeof(struct uring));
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    self->fd = uring_setup(entries, &params);
+    if (self->fd < 0) {
+        ERROR("Could not setup io_uring, %s", strerror(errno));
+        return false;
+    }
+
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG)) {
+        ERROR("Kernel io_uring support is too old");
+        close(self->fd);
+        return false;
+    }
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    self->ring_size = (sq_size > cq_size) ? sq_size : cq_size;
+
+    self->ring = mmap(NULL, self->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      self->fd, IORING_OFF_SQ_RING);
+    if (self->ring == MAP_FAILED) {
+        ERROR("Could not map io_uring, %s", strerror(errno));
+        close(self->fd);
+        return false;
+    }
+
+    self->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    self->sqes = mmap(NULL, self->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      self->fd, IORING_OFF_SQES);
+    if (self->sqes == MAP_FAILED) {
+        ERROR("Could not map io_uring entries, %s", strerror(errno));
+        munmap(self->ring, self->ring_size);
+        close(self->fd);
+        return false;
+    }
+
+    char *ring = self->ring;
+    self->sq_head = (unsigned int*)(ring + params.sq_off.head);
+    self->sq_tail = (unsigned int*)(ring + params.sq_off.tail);
+    self->sq_mask = (unsigned int*)(ring + params.sq_off.ring_mask);
+    self->sq_array = (unsigned int*)(ring + params.sq_off.array);
+
+    self->cq_head = (unsigned int*)(ring + params.cq_off.head);
+    self->cq_tail = (unsigned int*)(ring + params.cq_off.tail);
+    self->cq_mask = (unsigned int*)(ring + params.cq_off.ring_mask);
+    self->cqes = (struct io_uring_cqe*)(ring + params.cq_off.cqes);
+
+    // Submission entries are used in order, array is mapped one to one
+    for (unsigned int i = 0; i <= *self->sq_mask; i++)
+        self->sq_array[i] = i;
+
+    return true;
+}
+
+
+void uring_clean(struct uring *self)
+{
+    munmap(self->sqes, self->sqes_size);
+    munmap(self->ring, self->ring_size);
+    close(self->fd);
+}
+
+
+/**
+ * Return next free submission entry
+ *
+ * Pending entries are submitted if the ring is full. Returned entry is zeroed.
+ *
+ */
+struct io_uring_sqe* uring_get_sqe(struct uring *self)
+{
+    unsigned int tail = *self->sq_tail;
+
+    while (tail - __atomic_load_n(self->sq_head, __ATOMIC_ACQUIRE) > *self->sq_mask) {
+        if (uring_submit(self) < 0)
+            return NULL;
+    }
+
+    struct io_uring_sqe *sqe = &self->sqes[tail & *self->sq_mask];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+
+    __atomic_store_n(self->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    self->sq_pending++;
+
+    return sqe;
+}
+
+
+/**
+ * Submit pending entries without waiting
+ *
+ */
+int uring_submit(struct uring *self)
+{
+    int ret = uring_enter(self->fd, self->sq_pending, 0, 0, NULL, 0);
+    if (ret < 0)
+        return -errno;
+
+    self->sq_pending -= ret;
+    return ret;
+}
+
+
+/**
+ * Submit pending entries and wait for at least one completion
+ *
+ * Everything is done with single system call. Returns -ETIME on timeout.
+ *
+ */
+int uring_submit_and_wait(struct uring *self, unsigned long time_ms)
+{
+    struct __kernel_timespec ts;
+    ts.tv_sec = time_ms / 1000;
+    ts.tv_nsec = (time_ms % 1000) * 1000000;
+
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.sigmask_sz = _NSIG / 8;
+    arg.ts = (unsigned long)&ts;
+
+    unsigned int to_submit = self->sq_pending;
+    int ret = uring_enter(self->fd, to_submit, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                          &arg, sizeof(arg));
+    if (ret < 0)
+        return -errno;
+
+    self->sq_pending -= ((unsigned int)ret < to_submit) ? (unsigned int)ret : to_submit;
+    return ret;
+}
+
+
+/**
+ * Return next completion entry or NULL if there is none
+ *
+ */
+struct io_uring_cqe* uring_peek_cqe(struct uring *self)
+{
+    unsigned int head = *self->cq_head;
+    if (head == __atomic_load_n(self->cq_tail, __ATOMIC_ACQUIRE))
+        return NULL;
+
+    return &self->cqes[head & *self->cq_mask];
+}
+
+
+void uring_cqe_seen(struct uring *self)
+{
+    __atomic_store_n(self->cq_head, *self->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+
+
+/**
+ * Register provided buffer ring with 'count' buffers of 'size' bytes
+ *
+ * Kernel 5.19 is required. Count must be power of two.
+ *
+ */
+bool uring_buffers_init(struct uring_buffers *self, struct uring *uring, unsigned short group,
+                        unsigned int count, unsigned int size)
+{
+    memset(self, 0, sizeof(struct uring_buffers));
+
+    // Ring must be page aligned, it is shared with kernel
+    self->ring_size = count * sizeof(struct io_uring_buf);
+    self->ring = mmap(NULL, self->ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (self->ring == MAP_FAILED) {
+        ERROR("Could not map io_uring buffer ring, %s", strerror(errno));
+        return false;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long)self->ring;
+    reg.ring_entries = count;
+    reg.bgid = group;
+
+    if (uring_register(uring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        WARN("Could not register io_uring buffer ring, %s", strerror(errno));
+        munmap(self->ring, self->ring_size);
+        return false;
+    }
+
+    self->data = xmalloc(count * size);
+    self->count = count;
+    self->size = size;
+    self->group = group;
+    self->tail = 0;
+
+    for (unsigned int i = 0; i < count; i++)
+        uring_buffers_put(self, i);
+
+    return true;
+}
+
+
+void uring_buffers_clean(struct uring_buffers *self, struct uring *uring)
+{
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.bgid = self->group;
+
+    uring_register(uring->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+    munmap(self->ring, self->ring_size);
+    xfree(self->data);
+}
+
+
+/**
+ * Return memory of buffer selected by completed request
+ *
+ */
+unsigned char* uring_buffers_get(struct uring_buffers *self, unsigned short bid)
+{
+    return self->data + (size_t)bid * self->size;
+}
+
+
+/**
+ * Give buffer back to kernel
+ *
+ */
+void uring_buffers_put(struct uring_buffers *self, unsigned short bid)
+{
+    struct io_uring_buf *buf = &self->ring->bufs[self->tail & (self->count - 1)];
+    buf->addr = (unsigned long)uring_buffers_get(self, bid);
+    buf->len = self->size;
+    buf->bid = bid;
+
+    // Entry must be visible before kernel sees new tail
+    self->tail++;
+    __atomic_store_n(&self->ring->tail, self->tail, __ATOMIC_RELEASE);
+}
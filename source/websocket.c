@@ -3,10 +3,21 @@
 
 #include "mx/base64.h"
 #include "mx/sha1.h"
+#include "mx/memory.h"
 #include "mx/misc.h"
+#include "mx/string.h"
 
 #define _GNU_SOURCE
 #include <string.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+  #define WS_MASK_X86       1
+  #include <immintrin.h>
+#endif
 
 
 #define SHA1_HASH_SIZE      20
@@ -15,28 +26,186 @@
 
 
 
+typedef void (*ws_mask_fn)(unsigned char *dst, const unsigned char *src, size_t length,
+                           const unsigned char *mask, size_t offset);
+
+
+
+/**
+ * Copy and mask byte by byte
+ *
+ * All kernels accept dst equal to src, which masks data in place.
+ *
+ */
+static void ws_mask_scalar(unsigned char *dst, const unsigned char *src, size_t length,
+                           const unsigned char *mask, size_t offset)
+{
+    for (size_t i = 0; i < length; i++)
+        dst[i] = src[i] ^ mask[(offset + i) & (WS_MASK_SIZE - 1)];
+}
+
+
+/**
+ * Return mask rotated by offset and repeated to fill 32 bits
+ *
+ */
+static inline uint32_t ws_mask_word32(const unsigned char *mask, size_t offset)
+{
+    unsigned char rotated[WS_MASK_SIZE];
+    for (size_t i = 0; i < WS_MASK_SIZE; i++)
+        rotated[i] = mask[(offset + i) & (WS_MASK_SIZE - 1)];
+
+    uint32_t word;
+    memcpy(&word, rotated, sizeof(word));
+    return word;
+}
+
+
+/**
+ * Copy and mask word by word
+ *
+ */
+static void ws_mask_word(unsigned char *dst, const unsigned char *src, size_t length,
+                         const unsigned char *mask, size_t offset)
+{
+    uint64_t word = ws_mask_word32(mask, offset);
+    word |= word << 32;
+
+    size_t i = 0;
+    for (; i + sizeof(word) <= length; i += sizeof(word)) {
+        uint64_t chunk;
+        memcpy(&chunk, src + i, sizeof(chunk));
+        chunk ^= word;
+        memcpy(dst + i, &chunk, sizeof(chunk));
+    }
+    ws_mask_scalar(dst + i, src + i, length - i, mask, offset + i);
+}
+
+
+#if WS_MASK_X86
+
+/**
+ * Copy and mask with SSE2
+ *
+ */
+__attribute__((target("sse2")))
+static void ws_mask_sse2(unsigned char *dst, const unsigned char *src, size_t length,
+                         const unsigned char *mask, size_t offset)
+{
+    __m128i word = _mm_set1_epi32((int)ws_mask_word32(mask, offset));
+
+    size_t i = 0;
+    for (; i + sizeof(word) <= length; i += sizeof(word)) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)(src + i));
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_xor_si128(chunk, word));
+    }
+    ws_mask_word(dst + i, src + i, length - i, mask, offset + i);
+}
+
+
+/**
+ * Copy and mask with AVX2
+ *
+ */
+__attribute__((target("avx2")))
+static void ws_mask_avx2(unsigned char *dst, const unsigned char *src, size_t length,
+                         const unsigned char *mask, size_t offset)
+{
+    __m256i word = _mm256_set1_epi32((int)ws_mask_word32(mask, offset));
+
+    size_t i = 0;
+    for (; i + sizeof(word) <= length; i += sizeof(word)) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i*)(src + i));
+        _mm256_storeu_si256((__m256i*)(dst + i), _mm256_xor_si256(chunk, word));
+    }
+    ws_mask_word(dst + i, src + i, length - i, mask, offset + i);
+}
+
+#endif
+
+
+/**
+ * Select the fastest implementation supported by the CPU
+ *
+ */
+static ws_mask_fn ws_mask_select(void)
+{
+#if WS_MASK_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return ws_mask_avx2;
+    if (__builtin_cpu_supports("sse2"))
+        return ws_mask_sse2;
+#endif
+    return ws_mask_word;
+}
+
+
+static ws_mask_fn ws_mask_impl = NULL;
+
+
+
 /**
  * Apply websocket mask
  *
  */
 void ws_apply_mask(unsigned char *data, size_t length, const unsigned char *mask)
 {
-    for (size_t i = 0; i < length; i++)
-        data[i] = data[i] ^ mask[i%WS_MASK_SIZE];
+    ws_copy_mask(data, data, length, mask, 0);
 }
 
 
 /**
- * Perform meta-analysis of the data and find websocket frame
+ * Apply websocket mask starting at given mask offset
+ *
+ * Returns offset to be used with the next chunk of the same payload,
+ * so mask may be applied incrementally to partially received frames.
  *
  */
-bool ws_parse_frame(struct ws_frame *frame, const unsigned char *data, size_t length, size_t *frame_length)
+size_t ws_apply_mask_offset(unsigned char *data, size_t length, const unsigned char *mask, size_t offset)
 {
-    size_t expected_frame_lenght = WS_MIN_HEADER_SIZE;
+    return ws_copy_mask(data, data, length, mask, offset);
+}
 
-    if (length < expected_frame_lenght) {
-        if (frame_length)
-            *frame_length = expected_frame_lenght;
+
+/**
+ * Copy data and apply websocket mask in one pass
+ *
+ * Returns mask offset for the next chunk, see ws_apply_mask_offset().
+ *
+ */
+size_t ws_copy_mask(unsigned char *dst, const unsigned char *src, size_t length,
+                    const unsigned char *mask, size_t offset)
+{
+    if (length < sizeof(uint64_t)) {
+        ws_mask_scalar(dst, src, length, mask, offset);
+    }
+    else {
+        ws_mask_fn impl = __atomic_load_n(&ws_mask_impl, __ATOMIC_RELAXED);
+        if (!impl) {
+            impl = ws_mask_select();
+            __atomic_store_n(&ws_mask_impl, impl, __ATOMIC_RELAXED);
+        }
+        impl(dst, src, length, mask, offset);
+    }
+
+    return (offset + length) & (WS_MASK_SIZE - 1);
+}
+
+
+/**
+ * Parse websocket frame header
+ *
+ * Header length, or minimal length needed to find it, is stored in header_length.
+ *
+ */
+bool ws_parse_frame_header(struct ws_frame *frame, const unsigned char *data, size_t length, size_t *header_length)
+{
+    size_t expected_header_length = WS_MIN_HEADER_SIZE;
+
+    if (length < expected_header_length) {
+        if (header_length)
+            *header_length = expected_header_length;
         return false;   // Wait for basic header
     }
 
@@ -44,30 +213,31 @@ bool ws_parse_frame(struct ws_frame *frame, const unsigned char *data, size_t le
     frame->payload_offset = WS_MIN_HEADER_SIZE;
 
     frame->fin_flag = (data[WS_FIN_OPCODE_IDX] & WS_FIN_FLAG) == WS_FIN_FLAG ? 1 : 0;
+    frame->rsv1_flag = (data[WS_FIN_OPCODE_IDX] & WS_RSV1_FLAG) == WS_RSV1_FLAG ? 1 : 0;
     frame->mask_flag = (data[WS_MASK_LEN_IDX] & WS_MASK_FLAG) == WS_MASK_FLAG ? 1 : 0;
     if (frame->mask_flag) {
-        expected_frame_lenght += WS_MASK_SIZE;
+        expected_header_length += WS_MASK_SIZE;
         frame->payload_offset += WS_MASK_SIZE;
     }
 
     frame->opcode = data[WS_FIN_OPCODE_IDX] & WS_OPCODE_MSK;
     frame->payload_length = data[WS_MASK_LEN_IDX] & WS_PAYLOAD_LEN_MSK;
     if (frame->payload_length == WS_EXTLEN16_MARK) {
-        expected_frame_lenght += WS_EXTLEN16_SIZE;
+        expected_header_length += WS_EXTLEN16_SIZE;
         frame->payload_offset += WS_EXTLEN16_SIZE;
         frame->mask_offset += WS_EXTLEN16_SIZE;
     }
     else if (frame->payload_length == WS_EXTLEN64_MARK) {
-        expected_frame_lenght += WS_EXTLEN64_SIZE;
+        expected_header_length += WS_EXTLEN64_SIZE;
         frame->payload_offset += WS_EXTLEN64_SIZE;
         frame->mask_offset += WS_EXTLEN64_SIZE;
     }
 
-    if (length < expected_frame_lenght) {
-        if (frame_length)
-            *frame_length = expected_frame_lenght;
+    if (header_length)
+        *header_length = expected_header_length;
+
+    if (length < expected_header_length)
         return false;   // Wait for full header
-    }
 
     if (frame->payload_length == WS_EXTLEN16_MARK) {
         frame->payload_length = ( (size_t)data[WS_EXTLEN_IDX  ] << 8 |
@@ -84,25 +254,161 @@ bool ws_parse_frame(struct ws_frame *frame, const unsigned char *data, size_t le
                                   (size_t)data[WS_EXTLEN_IDX+7] );
     }
 
-    expected_frame_lenght += frame->payload_length;
+    return true;
+}
+
+
+/**
+ * Perform meta-analysis of the data and find websocket frame
+ *
+ */
+bool ws_parse_frame(struct ws_frame *frame, const unsigned char *data, size_t length, size_t *frame_length)
+{
+    size_t header_length;
+    if (!ws_parse_frame_header(frame, data, length, &header_length)) {
+        if (frame_length)
+            *frame_length = header_length;
+        return false;   // Wait for full header
+    }
+
+    size_t expected_frame_lenght = header_length + frame->payload_length;
     if (frame_length)
         *frame_length = expected_frame_lenght;
 
-    if (length < expected_frame_lenght) {
+    if (length < expected_frame_lenght)
         return false;   // Wait for full message
-    }
 
     return true;
 }
 
 
 /**
- * Format websocket frame
+ * Initialize incremental frame parser
  *
- * Buffer should be WS_MAX_HEADER_SIZE longer than data length
+ */
+void ws_parser_init(struct ws_parser *self)
+{
+    self->state = WS_PARSER_ST_HEADER;
+    self->header_length = 0;
+    self->payload_received = 0;
+    self->max_payload = 0;
+}
+
+
+/**
+ * Check parsed frame header
+ *
+ * Frame is refused before any payload is stored, so that declared length
+ * alone can not make the receiver allocate memory. Returns close code,
+ * 0 if frame is acceptable.
  *
  */
-size_t ws_format_frame(unsigned char *buffer, unsigned char flags, const unsigned char *mask, const unsigned char *data, size_t length)
+static unsigned short ws_parser_check_header(struct ws_parser *self)
+{
+    struct ws_frame *frame = &self->frame;
+
+    // Most significant bit of 64 bit length must be 0
+    if (((self->header[WS_MASK_LEN_IDX] & WS_PAYLOAD_LEN_MSK) == WS_EXTLEN64_MARK) && (self->header[WS_EXTLEN_IDX] & 0x80))
+        return WS_CLOSE_PROTOCOL_ERROR;
+
+    // Control frames must not be fragmented or longer than 125 bytes
+    if ((frame->opcode & WS_OPCODE_CONTROL_MSK) && (!frame->fin_flag || frame->payload_length > WS_MAX_CONTROL_PAYLOAD))
+        return WS_CLOSE_PROTOCOL_ERROR;
+
+    if (self->max_payload && (frame->payload_length > self->max_payload))
+        return WS_CLOSE_MESSAGE_TOO_BIG;
+
+    return 0;
+}
+
+
+/**
+ * Feed incremental frame parser
+ *
+ * Bytes are consumed until the next event, number of consumed bytes is returned.
+ * Payload chunks point into the given data and are already unmasked.
+ * WS_PARSER_NONE means that all data was consumed and more is needed.
+ * WS_PARSER_ERROR is reported once for frame which must be refused, nothing
+ * is parsed afterwards.
+ *
+ */
+size_t ws_parser_execute(struct ws_parser *self, unsigned char *data, size_t length, struct ws_parser_event *event)
+{
+    event->type = WS_PARSER_NONE;
+    event->data = NULL;
+    event->length = 0;
+    event->code = 0;
+
+    switch (self->state) {
+        case WS_PARSER_ST_HEADER: {
+            size_t consumed = 0;
+            size_t needed;
+            while (!ws_parse_frame_header(&self->frame, self->header, self->header_length, &needed)) {
+                size_t chunk = MIN(needed - self->header_length, length - consumed);
+                if (chunk == 0)
+                    return consumed;    // More data is needed
+
+                memcpy(self->header + self->header_length, data + consumed, chunk);
+                self->header_length += chunk;
+                consumed += chunk;
+            }
+
+            event->code = ws_parser_check_header(self);
+            if (event->code) {
+                // Nothing else is parsed, connection is going to be closed
+                self->state = WS_PARSER_ST_ERROR;
+                event->type = WS_PARSER_ERROR;
+                return consumed;
+            }
+
+            if (self->frame.mask_flag)
+                memcpy(self->mask, self->header + self->frame.mask_offset, WS_MASK_SIZE);
+
+            self->header_length = 0;
+            self->payload_received = 0;
+            self->state = self->frame.payload_length ? WS_PARSER_ST_PAYLOAD : WS_PARSER_ST_END;
+            event->type = WS_PARSER_HEADER;
+            return consumed;
+        }
+
+        case WS_PARSER_ST_PAYLOAD: {
+            size_t chunk = MIN(self->frame.payload_length - self->payload_received, length);
+            if (chunk == 0)
+                return 0;   // More data is needed
+
+            if (self->frame.mask_flag)
+                ws_apply_mask_offset(data, chunk, self->mask, self->payload_received);
+
+            self->payload_received += chunk;
+            if (self->payload_received == self->frame.payload_length)
+                self->state = WS_PARSER_ST_END;
+
+            event->type = WS_PARSER_PAYLOAD;
+            event->data = data;
+            event->length = chunk;
+            return chunk;
+        }
+
+        case WS_PARSER_ST_END:
+            self->state = WS_PARSER_ST_HEADER;
+            event->type = WS_PARSER_FRAME_END;
+            return 0;
+
+        case WS_PARSER_ST_ERROR:
+            return 0;
+    }
+
+    return 0;
+}
+
+
+/**
+ * Format websocket frame header
+ *
+ * Buffer should be WS_MAX_HEADER_SIZE long. Returns header length.
+ *
+ */
+size_t ws_format_frame_header(unsigned char *buffer, unsigned char flags, const unsigned char *mask, size_t length)
 {
     unsigned char mask_flag = mask ? WS_MASK_FLAG : 0;
     size_t frame_offset = WS_MIN_HEADER_SIZE;
@@ -137,16 +443,180 @@ size_t ws_format_frame(unsigned char *buffer, unsigned char flags, const unsigne
         frame_offset += WS_MASK_SIZE;
     }
 
+    return frame_offset;
+}
+
+
+/**
+ * Format websocket frame
+ *
+ * Buffer should be WS_MAX_HEADER_SIZE longer than data length
+ *
+ */
+size_t ws_format_frame(unsigned char *buffer, unsigned char flags, const unsigned char *mask, const unsigned char *data, size_t length)
+{
+    size_t frame_offset = ws_format_frame_header(buffer, flags, mask, length);
+
     if (length) {
-        memcpy(buffer + frame_offset, data, length);
         if (mask)
-            ws_apply_mask(buffer + frame_offset, length, mask);
+            ws_copy_mask(buffer + frame_offset, data, length, mask, 0);
+        else
+            memcpy(buffer + frame_offset, data, length);
     }
 
     return frame_offset + length;
 }
 
 
+/**
+ * Prepare websocket frame for scatter-gather write
+ *
+ * Header is stored in the given buffer. Masked payload is written to
+ * the scratch memory, unmasked payload is referenced directly.
+ * Returns number of used iovec entries.
+ *
+ */
+int ws_format_frame_iovec(struct iovec *iov, unsigned char *header, unsigned char *scratch,
+                          unsigned char flags, const unsigned char *mask, const unsigned char *data, size_t length)
+{
+    iov[0].iov_base = header;
+    iov[0].iov_len = ws_format_frame_header(header, flags, mask, length);
+    if (length == 0)
+        return 1;
+
+    if (mask) {
+        ws_copy_mask(scratch, data, length, mask, 0);
+        data = scratch;
+    }
+    iov[1].iov_base = (void*)data;
+    iov[1].iov_len = length;
+    return 2;
+}
+
+
+/**
+ * Initialize permessage-deflate parameters
+ *
+ */
+void ws_deflate_params_init(struct ws_deflate_params *params)
+{
+    params->server_no_context_takeover = false;
+    params->client_no_context_takeover = false;
+    params->server_max_window_bits = 0;
+    params->client_max_window_bits = 0;
+    params->mem_level = 8;
+}
+
+
+/**
+ * Trim white spaces and quotes in place
+ *
+ */
+static char* ws_deflate_trim(char *str)
+{
+    while (isspace((unsigned char)*str) || *str == '"')
+        str++;
+
+    size_t len = strlen(str);
+    while (len > 0 && (isspace((unsigned char)str[len-1]) || str[len-1] == '"'))
+        str[--len] = '\0';
+
+    return str;
+}
+
+
+/**
+ * Parse window bits parameter, value is optional for client_max_window_bits only
+ *
+ */
+static bool ws_deflate_parse_window_bits(const char *value, bool optional, int *bits)
+{
+    if (!value)
+        value = optional ? "15" : "";
+
+    char *end = NULL;
+    long val = strtol(value, &end, 10);
+    if (!isdigit((unsigned char)*value) || *end != '\0')
+        return false;
+    if (val < 8 || val > WS_DEFLATE_MAX_WINDOW_BITS)
+        return false;
+
+    *bits = (int)val;
+    return true;
+}
+
+
+/**
+ * Parse permessage-deflate offer or response
+ *
+ * Extensions are given as Sec-WebSocket-Extensions header value. The first
+ * valid permessage-deflate entry is used. Returns false if there is none.
+ *
+ */
+bool ws_deflate_parse_params(struct ws_deflate_params *params, const char *extensions)
+{
+    char *copy = xstrdup(extensions);
+    char *extension_ctx = NULL;
+    bool found = false;
+
+    for (char *extension = strtok_r(copy, ",", &extension_ctx); extension && !found;
+               extension = strtok_r(NULL, ",", &extension_ctx)) {
+        char *param_ctx = NULL;
+        char *name = strtok_r(extension, ";", &param_ctx);
+        if (!name || strcmp(ws_deflate_trim(name), WS_DEFLATE_EXTENSION))
+            continue;
+
+        ws_deflate_params_init(params);
+        found = true;
+
+        char *param;
+        while (found && (param = strtok_r(NULL, ";", &param_ctx))) {
+            char *value = strchr(param, '=');
+            if (value) {
+                *value++ = '\0';
+                value = ws_deflate_trim(value);
+            }
+            param = ws_deflate_trim(param);
+
+            if (!strcmp(param, "server_no_context_takeover"))
+                params->server_no_context_takeover = true;
+            else if (!strcmp(param, "client_no_context_takeover"))
+                params->client_no_context_takeover = true;
+            else if (!strcmp(param, "server_max_window_bits"))
+                found = ws_deflate_parse_window_bits(value, false, &params->server_max_window_bits);
+            else if (!strcmp(param, "client_max_window_bits"))
+                found = ws_deflate_parse_window_bits(value, true, &params->client_max_window_bits);
+            else
+                found = false;  // Unknown parameter, offer must be declined
+        }
+    }
+
+    xfree(copy);
+    return found;
+}
+
+
+/**
+ * Format permessage-deflate parameters as Sec-WebSocket-Extensions header value
+ *
+ */
+size_t ws_deflate_format_params(const struct ws_deflate_params *params, char *buffer, size_t length)
+{
+    size_t offset = snprintf(buffer, length, WS_DEFLATE_EXTENSION);
+
+    if (params->server_no_context_takeover && offset < length)
+        offset += snprintf(buffer + offset, length - offset, "; server_no_context_takeover");
+    if (params->client_no_context_takeover && offset < length)
+        offset += snprintf(buffer + offset, length - offset, "; client_no_context_takeover");
+    if (params->server_max_window_bits && offset < length)
+        offset += snprintf(buffer + offset, length - offset, "; server_max_window_bits=%d", params->server_max_window_bits);
+    if (params->client_max_window_bits && offset < length)
+        offset += snprintf(buffer + offset, length - offset, "; client_max_window_bits=%d", params->client_max_window_bits);
+
+    return MIN(offset, length ? length - 1 : 0);
+}
+
+
 /**
  * Calculate websocket accept key
  *
@@ -0,0 +1,180 @@
+
+#include "private_ws_deflate.h"
+
+#include "mx/websocket.h"
+#include "mx/memory.h"
+#include "mx/log.h"
+
+#include <zlib.h>
+#include <string.h>
+
+
+
+#define WS_DEFLATE_CHUNK_SIZE       4096
+
+static const unsigned char ws_deflate_trailer[] = { 0x00, 0x00, 0xFF, 0xFF };
+
+
+
+/**
+ * Per-connection compression context
+ *
+ * Memory used by zlib is bounded by negotiated window bits and memory level.
+ *
+ */
+struct ws_deflate
+{
+    z_stream deflater;
+    z_stream inflater;
+
+    bool deflate_no_context_takeover;
+    bool inflate_no_context_takeover;
+};
+
+
+
+/**
+ * Constructor
+ *
+ */
+struct ws_deflate* ws_deflate_new(int deflate_window_bits, bool deflate_no_context_takeover,
+                                  int inflate_window_bits, bool inflate_no_context_takeover,
+                                  int mem_level)
+{
+    struct ws_deflate *self = xmalloc(sizeof(struct ws_deflate));
+    memset(self, 0, sizeof(struct ws_deflate));
+
+    self->deflate_no_context_takeover = deflate_no_context_takeover;
+    self->inflate_no_context_takeover = inflate_no_context_takeover;
+
+    // Zlib does not support 8 bit window for raw deflate, larger window is safe
+    // for inflate only, peer would not decode references beyond its window
+    if (deflate_window_bits < WS_DEFLATE_MIN_WINDOW_BITS) {
+        ERROR("Could not initialize deflate, %d window bits not supported", deflate_window_bits);
+        return xfree(self);
+    }
+    if (inflate_window_bits < WS_DEFLATE_MIN_WINDOW_BITS)
+        inflate_window_bits = WS_DEFLATE_MIN_WINDOW_BITS;
+
+    // Negative window bits select raw deflate stream
+    if (deflateInit2(&self->deflater, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -deflate_window_bits,
+                     mem_level, Z_DEFAULT_STRATEGY) != Z_OK) {
+        ERROR("Could not initialize deflate, %d window bits", deflate_window_bits);
+        return xfree(self);
+    }
+    if (inflateInit2(&self->inflater, -inflate_window_bits) != Z_OK) {
+        ERROR("Could not initialize inflate, %d window bits", inflate_window_bits);
+        deflateEnd(&self->deflater);
+        return xfree(self);
+    }
+
+    return self;
+}
+
+
+/**
+ * Destructor
+ *
+ */
+struct ws_deflate* ws_deflate_delete(struct ws_deflate *self)
+{
+    deflateEnd(&self->deflater);
+    inflateEnd(&self->inflater);
+    return xfree(self);
+}
+
+
+/**
+ * Compress payload and append it to the buffer
+ *
+ * Frame ends with sync flush, trailing 00 00 FF FF is removed at the end
+ * of message as required by RFC 7692.
+ *
+ */
+bool ws_deflate_compress(struct ws_deflate *self, const void *data, size_t length, int mode, struct buffer *out)
+{
+    z_stream *zs = &self->deflater;
+    int flush = (mode == WS_DEFLATE_CHUNK) ? Z_NO_FLUSH : Z_SYNC_FLUSH;
+
+    zs->next_in = (Bytef*)data;
+    zs->avail_in = length;
+
+    do {
+        zs->next_out = buffer_reserve_tail(out, WS_DEFLATE_CHUNK_SIZE);
+        zs->avail_out = WS_DEFLATE_CHUNK_SIZE;
+
+        int ret = deflate(zs, flush);
+        if (ret != Z_OK && ret != Z_BUF_ERROR) {
+            ERROR("Deflate failed, %d", ret);
+            return false;
+        }
+        buffer_commit(out, WS_DEFLATE_CHUNK_SIZE - zs->avail_out);
+    } while (zs->avail_in > 0 || zs->avail_out == 0);
+
+    if (mode == WS_DEFLATE_MESSAGE) {
+        if (out->length >= sizeof(ws_deflate_trailer) &&
+            !memcmp(out->data + out->length - sizeof(ws_deflate_trailer), ws_deflate_trailer, sizeof(ws_deflate_trailer)))
+            out->length -= sizeof(ws_deflate_trailer);
+
+        if (self->deflate_no_context_takeover)
+            deflateReset(zs);
+    }
+
+    return true;
+}
+
+
+/**
+ * Decompress payload and append it to the buffer
+ *
+ * Payload may be given in chunks as it is received, final flag marks
+ * the end of message. Inflating stops once more than limit bytes are
+ * produced, the rest of message is not decompressed then.
+ *
+ */
+int ws_deflate_decompress(struct ws_deflate *self, const void *data, size_t length, bool final,
+                          size_t limit, struct buffer *out)
+{
+    z_stream *zs = &self->inflater;
+    size_t produced = 0;
+
+    for (int pass = 0; pass < (final ? 2 : 1); pass++) {
+        if (pass == 0) {
+            zs->next_in = (Bytef*)data;
+            zs->avail_in = length;
+        }
+        else {
+            // Restore trailer removed by the peer
+            zs->next_in = (Bytef*)ws_deflate_trailer;
+            zs->avail_in = sizeof(ws_deflate_trailer);
+        }
+
+        while (zs->avail_in > 0) {
+            zs->next_out = buffer_reserve_tail(out, WS_DEFLATE_CHUNK_SIZE);
+            zs->avail_out = WS_DEFLATE_CHUNK_SIZE;
+
+            int ret = inflate(zs, Z_SYNC_FLUSH);
+            if (ret != Z_OK && ret != Z_BUF_ERROR && ret != Z_STREAM_END) {
+                WARN("Inflate failed, %d", ret);
+                return WS_DEFLATE_FAILED;
+            }
+            buffer_commit(out, WS_DEFLATE_CHUNK_SIZE - zs->avail_out);
+
+            produced += WS_DEFLATE_CHUNK_SIZE - zs->avail_out;
+            if (produced > limit)
+                return WS_DEFLATE_TOO_BIG;
+
+            if (ret == Z_STREAM_END) {
+                inflateReset(zs);
+                break;
+            }
+            if (ret == Z_BUF_ERROR && zs->avail_out > 0)
+                break;      // No progress possible
+        }
+    }
+
+    if (final && self->inflate_no_context_takeover)
+        inflateReset(zs);
+
+    return WS_DEFLATE_OK;
+}
@@ -46,6 +46,7 @@ struct test_module
 extern CU_ErrorCode cu_test_log();
 extern CU_ErrorCode cu_test_http();
 extern CU_ErrorCode cu_test_misc();
+extern CU_ErrorCode cu_test_reactor();
 extern CU_ErrorCode cu_test_stream();
 extern CU_ErrorCode cu_test_stream_mqtt();
 extern CU_ErrorCode cu_test_stream_ws();
@@ -56,6 +57,7 @@ const struct test_module test_modules[] = {
         {"log",             cu_test_log},
         {"http",            cu_test_http},
         {"misc",            cu_test_misc},
+        {"reactor",         cu_test_reactor},
         {"stream",          cu_test_stream},
         {"stream_mqtt",     cu_test_stream_mqtt},
         {"stream_ws",       cu_test_stream_ws},
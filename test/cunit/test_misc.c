@@ -3,6 +3,7 @@
 
 #include "mx/base64.h"
 #include "mx/buffer.h"
+#include "mx/iobuf.h"
 #include "mx/memory.h"
 #include "mx/observer.h"
 #include "mx/rand.h"
@@ -11,13 +12,19 @@
 
 #include <CUnit/Basic.h>
 
+#include <pthread.h>
+#include <stdint.h>
 #include <unistd.h>
 
 
 
 static void test_base64(void);
 static void test_buffer(void);
+static void test_buffer_ring(void);
+static void test_iobuf(void);
+static void test_iobuf_threads(void);
 static void test_memory(void);
+static void test_memory_pool(void);
 static void test_observer(void);
 static void test_rand(void);
 
@@ -36,7 +43,11 @@ CU_ErrorCode cu_test_misc()
 
     CU_add_test(suite, "Test base64 encoding/decoding",             test_base64);
     CU_add_test(suite, "Test buffer",                               test_buffer);
+    CU_add_test(suite, "Test ring buffer",                          test_buffer_ring);
+    CU_add_test(suite, "Test buffer chain",                         test_iobuf);
+    CU_add_test(suite, "Test buffer chain shared by threads",       test_iobuf_threads);
     CU_add_test(suite, "Test memory allocation",                    test_memory);
+    CU_add_test(suite, "Test memory pool",                          test_memory_pool);
     CU_add_test(suite, "Test observer",                             test_observer);
     CU_add_test(suite, "Test random",                               test_rand);
 
@@ -103,6 +114,7 @@ void test_buffer(void)
 {
     struct buffer *buffer = buffer_create(8);
     CU_ASSERT_PTR_NOT_NULL(buffer);
+    CU_ASSERT_PTR_EQUAL(buffer->alloc, buffer->inline_data);
 
     const char *hello = "hello";
     size_t hello_len = strlen(hello);
@@ -135,12 +147,245 @@ void test_buffer(void)
     buffer_append(buffer, hello, hello_len);
     CU_ASSERT_EQUAL(world_len+hello_len, buffer->length);
     CU_ASSERT_NSTRING_EQUAL("worldhello", buffer->data, buffer->length);
+    CU_ASSERT_PTR_EQUAL(buffer->alloc, buffer->inline_data);
+
+    // Spill to the heap
+    char large[3*BUFFER_INLINE_SIZE];
+    memset(large, 'x', sizeof(large));
+    buffer_append(buffer, large, sizeof(large));
+    CU_ASSERT_PTR_NOT_EQUAL(buffer->alloc, buffer->inline_data);
+    CU_ASSERT_EQUAL(world_len+hello_len+sizeof(large), buffer->length);
+    CU_ASSERT_NSTRING_EQUAL("worldhello", buffer->data, world_len+hello_len);
+    CU_ASSERT_EQUAL('x', buffer->data[buffer->length-1]);
+
+    // Capacity grows geometrically
+    size_t size = buffer->size;
+    buffer_append(buffer, "x", 1);
+    CU_ASSERT_EQUAL(size, buffer->size);
+
+    // Write directly to the tail
+    size_t length = buffer->length;
+    char *tail = buffer_reserve_tail(buffer, 200);
+    CU_ASSERT_TRUE(buffer->size - length >= 200);
+    memcpy(tail, "tail", 4);
+    buffer_commit(buffer, 4);
+    CU_ASSERT_EQUAL(length + 4, buffer->length);
+    CU_ASSERT_NSTRING_EQUAL("tail", buffer->data + length, 4);
 
     buffer = buffer_delete(buffer);
     CU_ASSERT_PTR_NULL(buffer);
 }
 
 
+/**
+ *  Test ring buffer
+ *
+ */
+void test_buffer_ring(void)
+{
+    struct buffer buffer;
+    char chunk[256];
+    size_t bytes;
+
+    buffer_init_ring(&buffer, 256);
+    CU_ASSERT_EQUAL(256, buffer.size);
+
+    memset(chunk, 'a', 200);
+    buffer_append(&buffer, chunk, 200);
+    bytes = buffer_take(&buffer, chunk, 150);
+    CU_ASSERT_EQUAL(150, bytes);
+    CU_ASSERT_EQUAL(50, buffer.length);
+
+    // Data wraps around without moving stored bytes
+    unsigned char *data = buffer.data;
+    memset(chunk, 'b', 150);
+    buffer_append(&buffer, chunk, 150);
+    CU_ASSERT_EQUAL(256, buffer.size);
+    CU_ASSERT_PTR_EQUAL(data, buffer.data);
+    CU_ASSERT_EQUAL(200, buffer.length);
+    CU_ASSERT_EQUAL(106, buffer_contiguous_length(&buffer));
+
+    bytes = buffer_take(&buffer, chunk, 100);
+    CU_ASSERT_EQUAL(100, bytes);
+    CU_ASSERT_EQUAL('a', chunk[0]);
+    CU_ASSERT_EQUAL('a', chunk[49]);
+    CU_ASSERT_EQUAL('b', chunk[50]);
+    CU_ASSERT_EQUAL('b', chunk[99]);
+    CU_ASSERT_EQUAL(100, buffer.length);
+
+    // Growing keeps the order of data
+    memset(chunk, 'c', 250);
+    buffer_append(&buffer, chunk, 250);
+    CU_ASSERT_EQUAL(350, buffer.length);
+    CU_ASSERT_TRUE(buffer.size >= 350);
+    CU_ASSERT_EQUAL(350, buffer_contiguous_length(&buffer));
+    CU_ASSERT_EQUAL('b', buffer.data[99]);
+    CU_ASSERT_EQUAL('c', buffer.data[100]);
+
+    // Linearize wrapped data
+    buffer_take(&buffer, chunk, 200);
+    memset(chunk, 'd', 250);
+    buffer_append(&buffer, chunk, 250);
+    CU_ASSERT_TRUE(buffer_contiguous_length(&buffer) < buffer.length);
+    buffer_linearize(&buffer);
+    CU_ASSERT_EQUAL(buffer.length, buffer_contiguous_length(&buffer));
+    CU_ASSERT_EQUAL('c', buffer.data[0]);
+    CU_ASSERT_EQUAL('d', buffer.data[buffer.length-1]);
+
+    buffer_clean(&buffer);
+}
+
+
+/**
+ *  Test buffer chain
+ *
+ */
+void test_iobuf(void)
+{
+    struct iovec iov[4];
+    char chunk[64];
+    size_t bytes;
+
+    struct iobuf *iobuf = iobuf_new();
+    CU_ASSERT_PTR_NOT_NULL(iobuf);
+    CU_ASSERT_TRUE(iobuf_is_empty(iobuf));
+
+    // Appended data is stored in single block
+    iobuf_append(iobuf, "hello", 5);
+    iobuf_append(iobuf, "world", 5);
+    CU_ASSERT_EQUAL(iobuf_length(iobuf), 10);
+    CU_ASSERT_EQUAL(iobuf->count, 1);
+
+    // Header is placed in headroom
+    struct iobuf frame;
+    iobuf_init(&frame);
+    unsigned char *payload = iobuf_reserve(&frame, 4, 5);
+    memcpy(payload, "12345", 5);
+    iobuf_prepend(&frame, "hd", 2);
+    CU_ASSERT_EQUAL(frame.count, 1);
+    CU_ASSERT_EQUAL(iobuf_length(&frame), 7);
+    CU_ASSERT_PTR_EQUAL(iobuf_pullup(&frame), payload - 2);
+    CU_ASSERT_NSTRING_EQUAL(payload - 2, "hd12345", 7);
+
+    // Shared data is not modified by prepend
+    struct iobuf shared;
+    iobuf_init(&shared);
+    iobuf_share(&shared, &frame);
+    iobuf_prepend(&shared, "xy", 2);
+    CU_ASSERT_EQUAL(shared.count, 2);
+    CU_ASSERT_EQUAL(iobuf_length(&shared), 9);
+    bytes = iobuf_peek(&shared, chunk, sizeof(chunk));
+    CU_ASSERT_EQUAL(bytes, 9);
+    CU_ASSERT_NSTRING_EQUAL(chunk, "xyhd12345", 9);
+    CU_ASSERT_NSTRING_EQUAL(payload - 2, "hd12345", 7);
+
+    // Move chain, source gets empty
+    iobuf_move(iobuf, &shared);
+    CU_ASSERT_TRUE(iobuf_is_empty(&shared));
+    CU_ASSERT_EQUAL(iobuf_length(iobuf), 19);
+    CU_ASSERT_EQUAL(iobuf->count, 3);
+    CU_ASSERT_EQUAL(iobuf_get_iovec(iobuf, iov, 4), 3);
+    CU_ASSERT_EQUAL(iov[0].iov_len, 10);
+    CU_ASSERT_EQUAL(iov[1].iov_len, 2);
+    CU_ASSERT_EQUAL(iov[2].iov_len, 7);
+    CU_ASSERT_EQUAL(iobuf_get_iovec(iobuf, iov, 2), 2);
+
+    // Split in the middle of segment
+    struct iobuf head;
+    iobuf_init(&head);
+    iobuf_split(iobuf, 7, &head);
+    CU_ASSERT_EQUAL(iobuf_length(&head), 7);
+    CU_ASSERT_EQUAL(iobuf_length(iobuf), 12);
+    bytes = iobuf_peek(&head, chunk, sizeof(chunk));
+    CU_ASSERT_NSTRING_EQUAL(chunk, "hellowo", bytes);
+    bytes = iobuf_peek(iobuf, chunk, sizeof(chunk));
+    CU_ASSERT_NSTRING_EQUAL(chunk, "rldxyhd12345", bytes);
+
+    // Cut across segments
+    bytes = iobuf_cut(iobuf, 6);
+    CU_ASSERT_EQUAL(bytes, 6);
+    CU_ASSERT_EQUAL(iobuf->count, 1);
+    CU_ASSERT_NSTRING_EQUAL(iobuf_pullup(iobuf), "d12345", 6);
+
+    // Pull up copies segments into one
+    iobuf_move(&head, iobuf);
+    CU_ASSERT_EQUAL(head.count, 2);
+    CU_ASSERT_NSTRING_EQUAL(iobuf_pullup(&head), "hellowod12345", 13);
+    CU_ASSERT_EQUAL(head.count, 1);
+
+    // Small block comes from pool, its room is used by appends
+    struct iobuf small;
+    iobuf_init(&small);
+    memcpy(iobuf_reserve(&small, 0, 2), "ok", 2);
+    memset(chunk, 'x', sizeof(chunk));
+    iobuf_append(&small, chunk, sizeof(chunk));
+    CU_ASSERT_EQUAL(small.count, 1);
+    CU_ASSERT_EQUAL(iobuf_length(&small), 2 + sizeof(chunk));
+    CU_ASSERT_NSTRING_EQUAL(iobuf_pullup(&small), "okxx", 4);
+    iobuf_clean(&small);
+
+    iobuf_clean(&head);
+    iobuf_clean(&frame);
+    CU_ASSERT_PTR_NULL(iobuf_pullup(&frame));
+
+    iobuf = iobuf_delete(iobuf);
+    CU_ASSERT_PTR_NULL(iobuf);
+}
+
+
+#define TEST_IOBUF_THREADS      4
+
+
+static void* test_iobuf_thread(void *arg)
+{
+    struct iobuf *chain = arg;
+
+    // Blocks are referenced and released concurrently with other threads
+    for (int i = 0; i < 1000; i++) {
+        struct iobuf copy;
+        iobuf_init(&copy);
+        iobuf_share(&copy, chain);
+        iobuf_cut(&copy, 3);
+        iobuf_clean(&copy);
+    }
+
+    iobuf_clean(chain);
+    return NULL;
+}
+
+
+/**
+ *  Test buffer chain shared by threads
+ *
+ */
+void test_iobuf_threads(void)
+{
+    struct iobuf data;
+    iobuf_init(&data);
+    iobuf_append(&data, "hello", 5);
+    iobuf_append(&data, " world", 6);
+
+    pthread_t threads[TEST_IOBUF_THREADS];
+    struct iobuf chains[TEST_IOBUF_THREADS];
+    for (int i = 0; i < TEST_IOBUF_THREADS; i++) {
+        iobuf_init(&chains[i]);
+        iobuf_share(&chains[i], &data);
+    }
+    for (int i = 0; i < TEST_IOBUF_THREADS; i++)
+        pthread_create(&threads[i], NULL, test_iobuf_thread, &chains[i]);
+    for (int i = 0; i < TEST_IOBUF_THREADS; i++)
+        pthread_join(threads[i], NULL);
+
+    // Block is still referenced by the original chain only
+    CU_ASSERT_EQUAL(iobuf_length(&data), 11);
+    CU_ASSERT_NSTRING_EQUAL(iobuf_pullup(&data), "hello world", 11);
+    iobuf_append(&data, "!", 1);
+    CU_ASSERT_EQUAL(data.count, 1);
+
+    iobuf_clean(&data);
+}
+
+
 /**
  *  Test memory
  *
@@ -174,6 +419,77 @@ void test_memory(void)
 }
 
 
+#if !XPOOL_DISABLED
+static void* test_memory_pool_thread(void *arg)
+{
+    struct xpool *pool = arg;
+    void *objs[10];
+
+    for (int i = 0; i < 10; i++)
+        objs[i] = xpool_alloc(pool);
+    for (int i = 0; i < 10; i++)
+        xpool_free(pool, objs[i]);
+
+    return NULL;
+}
+#endif
+
+
+/**
+ *  Test memory pool
+ *
+ */
+void test_memory_pool(void)
+{
+    static struct xpool static_pool = XPOOL_INITIALIZER(20);
+    struct xpool *pool;
+    unsigned char *objs[200];
+    unsigned char *obj;
+
+    pool = xpool_new(20);
+    CU_ASSERT_PTR_NOT_NULL(pool);
+    CU_ASSERT_TRUE(pool->obj_size >= 20);
+
+    for (int i = 0; i < 200; i++) {
+        objs[i] = xpool_alloc(pool);
+        CU_ASSERT_PTR_NOT_NULL(objs[i]);
+        CU_ASSERT_EQUAL(0, ((uintptr_t)objs[i]) % sizeof(void*));
+        memset(objs[i], i, 20);
+    }
+    for (int i = 0; i < 200; i++) {
+        CU_ASSERT_EQUAL(i, objs[i][0]);
+        CU_ASSERT_EQUAL(i, objs[i][19]);
+    }
+    for (int i = 0; i < 200; i++)
+        objs[i] = xpool_free(pool, objs[i]);
+    CU_ASSERT_PTR_NULL(objs[0]);
+    pool = xpool_delete(pool);
+    CU_ASSERT_PTR_NULL(pool);
+
+#if !XPOOL_DISABLED
+    // Exiting thread returns cached objects, the whole slab is free again
+    pthread_t thread;
+    pool = xpool_new(20);
+    pthread_create(&thread, NULL, test_memory_pool_thread, pool);
+    pthread_join(thread, NULL);
+    int count = 0;
+    for (void **node = pool->free; node; node = *node)
+        count++;
+    CU_ASSERT_EQUAL(count, 64);
+    pool = xpool_delete(pool);
+#endif
+
+    obj = xpool_alloc(&static_pool);
+    CU_ASSERT_PTR_NOT_NULL(obj);
+    memset(obj, 0xAA, 20);
+    obj = xpool_free(&static_pool, obj);
+    CU_ASSERT_PTR_NULL(obj);
+    obj = xpool_free(&static_pool, NULL);
+    CU_ASSERT_PTR_NULL(obj);
+    xpool_clean(&static_pool);
+}
+
+
 /**
  *  Test observer
  *
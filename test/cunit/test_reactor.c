@@ -0,0 +1,263 @@
+
+#include "test.h"
+
+#include "mx/idler.h"
+#include "mx/reactor.h"
+#include "mx/socket.h"
+#include "mx/stream.h"
+#include "../../source/private_stream.h"
+
+#include <CUnit/Basic.h>
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+
+
+static void test_reactor_dispatch(void);
+static void test_reactor_post(void);
+static void test_reactor_listen(void);
+static void test_reactor_stream_closed(void);
+
+
+
+CU_ErrorCode cu_test_reactor()
+{
+    CU_pSuite suite = CU_add_suite("Suite reactor", NULL, NULL);
+    if ( !suite ) {
+        CU_cleanup_registry();
+        return CU_get_error();
+    }
+
+    CU_add_test(suite, "Test reactor dispatch",                     test_reactor_dispatch);
+    CU_add_test(suite, "Test reactor post",                         test_reactor_post);
+    CU_add_test(suite, "Test reactor listen",                       test_reactor_listen);
+    CU_add_test(suite, "Test reactor stream closed by observer",    test_reactor_stream_closed);
+
+    return CU_get_error();
+}
+
+
+
+
+struct reactor_test
+{
+    struct reactor *reactor;
+    volatile int accepted[2];
+    volatile int jobs;
+    volatile int closed;
+    int fd;
+};
+
+
+static void reactor_test_on_accept(void *object, struct idler *idler, int fd)
+{
+    struct reactor_test *test = object;
+
+    for (unsigned int i = 0; i < reactor_get_loops(test->reactor); i++) {
+        if (reactor_get_idler(test->reactor, i) == idler)
+            __sync_fetch_and_add(&test->accepted[i], 1);
+    }
+
+    socket_close(fd);
+}
+
+
+static void reactor_test_job(void *object, struct idler *idler)
+{
+    struct reactor_test *test = object;
+
+    if (reactor_get_idler(test->reactor, 1) == idler)
+        __sync_fetch_and_add(&test->jobs, 1);
+}
+
+
+static int reactor_test_on_ready(void *object, struct stream *stream)
+{
+    struct reactor_test *test = object;
+
+    int fd = stream_get_fd(stream);
+    stream_delete(stream);
+    socket_close(fd);
+    __sync_fetch_and_add(&test->closed, 1);
+
+    return -1;
+}
+
+
+static void reactor_test_add_stream(void *object, struct idler *idler)
+{
+    struct reactor_test *test = object;
+
+    struct stream *stream = stream_new(test->fd);
+    stream_set_observer(stream, test, reactor_test_on_ready);
+    stream_set_deadline(stream, 1);     // Already expired
+    idler_add_stream(idler, stream);
+}
+
+
+static bool reactor_test_wait(volatile int *counter, int expected)
+{
+    for (int i = 0; i < 1000; i++) {
+        if (__atomic_load_n(counter, __ATOMIC_RELAXED) == expected)
+            return true;
+        usleep(1000);
+    }
+
+    return false;
+}
+
+
+
+/**
+ *  Test dispatching descriptors between loops
+ *
+ */
+void test_reactor_dispatch(void)
+{
+    struct reactor_test test = { 0 };
+    int fds[2];
+
+    test.reactor = reactor_new(2);
+    CU_ASSERT_EQUAL(reactor_get_loops(test.reactor), 2);
+    CU_ASSERT_PTR_NOT_NULL(reactor_get_idler(test.reactor, 1));
+    CU_ASSERT_PTR_NULL(reactor_get_idler(test.reactor, 2));
+    reactor_set_acceptor(test.reactor, &test, reactor_test_on_accept);
+    CU_ASSERT(reactor_start(test.reactor));
+
+    for (int i = 0; i < 4; i++) {
+        socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+        CU_ASSERT_EQUAL(reactor_dispatch(test.reactor, fds[0]), i % 2);
+        close(fds[1]);
+    }
+
+    CU_ASSERT(reactor_test_wait(&test.accepted[0], 2));
+    CU_ASSERT(reactor_test_wait(&test.accepted[1], 2));
+
+    test.reactor = reactor_delete(test.reactor);
+    CU_ASSERT_PTR_NULL(test.reactor);
+}
+
+
+
+/**
+ *  Test running jobs in loop thread
+ *
+ */
+void test_reactor_post(void)
+{
+    struct reactor_test test = { 0 };
+
+    test.reactor = reactor_new(2);
+    CU_ASSERT_FALSE(reactor_post(test.reactor, 2, reactor_test_job, &test));
+
+    // Job is queued until reactor is started
+    CU_ASSERT(reactor_post(test.reactor, 1, reactor_test_job, &test));
+    CU_ASSERT(reactor_start(test.reactor));
+    CU_ASSERT(reactor_test_wait(&test.jobs, 1));
+
+    CU_ASSERT(reactor_post(test.reactor, 1, reactor_test_job, &test));
+    CU_ASSERT(reactor_post(test.reactor, 1, reactor_test_job, &test));
+    CU_ASSERT(reactor_test_wait(&test.jobs, 3));
+
+    reactor_stop(test.reactor);
+    CU_ASSERT(reactor_post(test.reactor, 1, reactor_test_job, &test));
+    usleep(10000);
+    CU_ASSERT_EQUAL(test.jobs, 3);
+
+    test.reactor = reactor_delete(test.reactor);
+}
+
+
+
+static int reactor_test_accepted(struct reactor_test *test, unsigned int loop)
+{
+    return __atomic_load_n(&test->accepted[loop], __ATOMIC_RELAXED);
+}
+
+
+static unsigned int reactor_test_free_port(void)
+{
+    struct sockaddr_in addr = { 0 };
+    socklen_t len = sizeof(addr);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    bind(sock, (struct sockaddr*)&addr, sizeof(addr));
+    getsockname(sock, (struct sockaddr*)&addr, &len);
+    close(sock);
+
+    return ntohs(addr.sin_port);
+}
+
+
+
+/**
+ *  Test accepting connections in every loop
+ *
+ */
+void test_reactor_listen(void)
+{
+    struct reactor_test test = { 0 };
+    unsigned int port = reactor_test_free_port();
+
+    test.reactor = reactor_new(2);
+    reactor_set_acceptor(test.reactor, &test, reactor_test_on_accept);
+
+    // Port is taken by socket without SO_REUSEPORT
+    int busy = socket_listen("127.0.0.1", port);
+    CU_ASSERT(busy >= 0);
+    CU_ASSERT_EQUAL(reactor_listen(test.reactor, "127.0.0.1", port), -1);
+    socket_close(busy);
+
+    CU_ASSERT_EQUAL(reactor_listen(test.reactor, "127.0.0.1", port), 0);
+    CU_ASSERT_EQUAL(reactor_listen(test.reactor, "127.0.0.1", port), 0);    // Already listening
+    CU_ASSERT(reactor_start(test.reactor));
+
+    // Kernel spreads connections between loops
+    int connections = 0;
+    while (reactor_test_accepted(&test, 0) == 0 || reactor_test_accepted(&test, 1) == 0) {
+        if (connections == 64)
+            break;
+
+        int sock = socket_connect_inet(AF_INET, "127.0.0.1", port);
+        CU_ASSERT(sock >= 0);
+        connections++;
+        for (int i = 0; (i < 1000) && (reactor_test_accepted(&test, 0) + reactor_test_accepted(&test, 1) < connections); i++)
+            usleep(1000);
+        socket_close(sock);
+    }
+    CU_ASSERT(reactor_test_accepted(&test, 0) > 0);
+    CU_ASSERT(reactor_test_accepted(&test, 1) > 0);
+
+    test.reactor = reactor_delete(test.reactor);
+}
+
+
+
+/**
+ *  Test stream deleted by observer while its deadline expired
+ *
+ */
+void test_reactor_stream_closed(void)
+{
+    struct reactor_test test = { 0 };
+    int fds[2];
+
+    socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+    CU_ASSERT_EQUAL(write(fds[1], "x", 1), 1);
+    socket_set_non_blocking(fds[0], 1);
+    test.fd = fds[0];
+
+    test.reactor = reactor_new(1);
+    CU_ASSERT(reactor_post(test.reactor, 0, reactor_test_add_stream, &test));
+    CU_ASSERT(reactor_start(test.reactor));
+    CU_ASSERT(reactor_test_wait(&test.closed, 1));
+
+    test.reactor = reactor_delete(test.reactor);
+    CU_ASSERT_EQUAL(test.closed, 1);
+
+    close(fds[1]);
+}
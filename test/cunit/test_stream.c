@@ -5,6 +5,7 @@
 #include "mx/observer.h"
 #include "mx/socket.h"
 #include "mx/idler.h"
+#include "mx/misc.h"
 #include "mx/rand.h"
 
 #include <CUnit/Basic.h>
@@ -24,7 +25,12 @@
 static void test_stream_misc(void);
 
 static void test_stream_idler(void);
+static void test_stream_idler_remove(void);
+static void test_stream_idler_delete_current(void);
+static void test_stream_ring_io(void);
 static void test_stream_queuing(void);
+static void test_stream_queuing_slices(void);
+static void test_stream_outbound_watermarks(void);
 static void test_stream_observer(void);
 
 
@@ -40,7 +46,12 @@ CU_ErrorCode cu_test_stream()
 
     CU_add_test(suite, "Test stream ws miscellaneous functions",    test_stream_misc);
     CU_add_test(suite, "Test stream queuing",                       test_stream_queuing);
+    CU_add_test(suite, "Test stream queuing many slices",           test_stream_queuing_slices);
+    CU_add_test(suite, "Test stream outbound watermarks",           test_stream_outbound_watermarks);
     CU_add_test(suite, "Test stream with idler",                    test_stream_idler);
+    CU_add_test(suite, "Test stream idler remove while iterating",  test_stream_idler_remove);
+    CU_add_test(suite, "Test stream idler delete current stream",   test_stream_idler_delete_current);
+    CU_add_test(suite, "Test stream ring I/O",                      test_stream_ring_io);
     CU_add_test(suite, "Test stream observer",                      test_stream_observer);
 
     return CU_get_error();
@@ -157,6 +168,90 @@ void test_stream_queuing(void)
 }
 
 
+/**
+ *  Test stream queuing of many small slices
+ *
+ */
+void test_stream_queuing_slices(void)
+{
+    ssize_t bytes;
+    size_t offset;
+    int loops;
+    unsigned char request[BUFFER_SIZE];
+    unsigned char response[BUFFER_SIZE];
+
+    rand_data(request, sizeof(request));
+
+    struct stream *client, *server;
+    test_stream_init(&client, &server);
+
+    // Fill socket buffer
+    offset = 0;
+    stream_write(client, request+offset, SOCKET_BUFFER_SIZE);
+    offset += SOCKET_BUFFER_SIZE;
+    // Queue more slices than single vectored write accepts
+    while (offset < sizeof(request)) {
+        size_t len = MIN(100, sizeof(request) - offset);
+        stream_write(client, request+offset, len);
+        offset += len;
+    }
+    CU_ASSERT_TRUE(stream_has_outgoing_data(client));
+
+    // Receive everything, partially written slices must be continued
+    offset = 0;
+    for (loops = 0; loops < 100 && offset < sizeof(response); loops++) {
+        bytes = stream_read(server, response+offset, sizeof(response)-offset);
+        if (bytes > 0)
+            offset += bytes;
+        stream_handle_outgoing_data(client);
+    }
+    CU_ASSERT_EQUAL(offset, sizeof(response));
+    CU_ASSERT_FALSE(stream_has_outgoing_data(client));
+    CU_ASSERT_EQUAL(0, memcmp(request, response, sizeof(request)));
+
+    test_stream_clean(client, server);
+}
+
+
+/**
+ *  Test stream outbound watermarks
+ *
+ */
+void test_stream_outbound_watermarks(void)
+{
+    ssize_t bytes;
+    unsigned char request[BUFFER_SIZE];
+    unsigned char response[BUFFER_SIZE];
+
+    struct stream *client, *server;
+    test_stream_init(&client, &server);
+
+    stream_set_outbound_watermarks(client, 1000, 100000);
+    CU_ASSERT_TRUE(stream_is_writable(client));
+
+    // Fill socket buffer and queue above high watermark
+    bytes = stream_write(client, request, sizeof(request));
+    CU_ASSERT_EQUAL(bytes, sizeof(request));
+    CU_ASSERT_TRUE(stream_get_outgoing_length(client) >= 100000);
+    CU_ASSERT_FALSE(stream_is_writable(client));
+
+    bytes = stream_write(client, request, 1);
+    CU_ASSERT_EQUAL(bytes, -1);
+    CU_ASSERT_EQUAL(errno, ENOBUFS);
+
+    // Drain queue below low watermark
+    for (int loops = 0; loops < 100 && stream_get_outgoing_length(client) > 1000; loops++) {
+        stream_read(server, response, sizeof(response));
+        stream_handle_outgoing_data(client);
+    }
+    CU_ASSERT_TRUE(stream_is_writable(client));
+    bytes = stream_write(client, request, 1);
+    CU_ASSERT_EQUAL(bytes, 1);
+
+    test_stream_clean(client, server);
+}
+
+
 /**
  *  Test stream idler
  *
@@ -242,6 +337,182 @@ void test_stream_idler(void)
 }
 
 
+/**
+ *  Test stream idler remove while iterating
+ *
+ */
+void test_stream_idler_remove(void)
+{
+    const char *hello = "hello";
+    const size_t hello_len = strlen(hello)+1;
+
+    struct stream *client1, *server1, *client2, *server2, *tmp;
+    test_stream_init(&client1, &server1);
+    test_stream_init(&client2, &server2);
+
+    struct idler *idler = idler_new();
+    idler_add_stream(idler, server1);
+    idler_add_stream(idler, server2);
+    CU_ASSERT_PTR_EQUAL(idler_find_stream(idler, stream_get_fd(server1)), server1);
+    CU_ASSERT_PTR_EQUAL(idler_find_stream(idler, stream_get_fd(server2)), server2);
+    CU_ASSERT_PTR_NULL(idler_find_stream(idler, stream_get_fd(client1)));
+
+    // Both servers are ready for reading
+    stream_write(client1, hello, hello_len);
+    stream_write(client2, hello, hello_len);
+
+    int op = idler_wait(idler, 100);
+    CU_ASSERT_EQUAL(op, IDLER_OPERATION);
+
+    unsigned int stream_status;
+    tmp = idler_get_next_stream(idler, NULL, &stream_status);
+    CU_ASSERT_PTR_NOT_NULL(tmp);
+    CU_ASSERT_TRUE(stream_status & STREAM_INCOMING_READY);
+
+    // Remove the other stream, it must not be visited anymore
+    struct stream *other = (tmp == server1) ? server2 : server1;
+    idler_remove_stream(idler, other);
+    CU_ASSERT_EQUAL(idler_get_stream_status(idler, other), 0);
+    CU_ASSERT_PTR_NULL(idler_find_stream(idler, stream_get_fd(other)));
+
+    tmp = idler_get_next_stream(idler, tmp, &stream_status);
+    CU_ASSERT_PTR_NULL(tmp);
+
+    idler = idler_delete(idler);
+
+    test_stream_clean(client1, server1);
+    test_stream_clean(client2, server2);
+}
+
+
+/**
+ *  Test stream idler delete current stream
+ *
+ */
+void test_stream_idler_delete_current(void)
+{
+    const char *hello = "hello";
+    const size_t hello_len = strlen(hello)+1;
+
+    struct stream *client1, *server1, *client2, *server2, *tmp;
+    test_stream_init(&client1, &server1);
+    test_stream_init(&client2, &server2);
+
+    struct idler *idler = idler_new();
+    idler_add_stream(idler, server1);
+    idler_add_stream(idler, server2);
+
+    stream_write(client1, hello, hello_len);
+    stream_write(client2, hello, hello_len);
+
+    int op = idler_wait(idler, 100);
+    CU_ASSERT_EQUAL(op, IDLER_OPERATION);
+
+    // Delete every visited stream, as application does on disconnection
+    unsigned int stream_status;
+    unsigned int visited = 0;
+    tmp = idler_get_next_stream(idler, NULL, &stream_status);
+    while (tmp) {
+        visited++;
+        close(stream_get_fd(tmp));
+        stream_delete(tmp);
+        tmp = idler_get_next_stream(idler, tmp, &stream_status);
+    }
+    CU_ASSERT_EQUAL(visited, 2);
+
+    // Deleted streams are not touched by the next wait
+    op = idler_wait(idler, 10);
+    CU_ASSERT_EQUAL(op, IDLER_TIMEOUT);
+
+    idler = idler_delete(idler);
+
+    close(stream_get_fd(client1));
+    close(stream_get_fd(client2));
+    stream_delete(client1);
+    stream_delete(client2);
+}
+
+
+/**
+ *  Test stream ring I/O
+ *
+ */
+void test_stream_ring_io(void)
+{
+    static unsigned char request[BUFFER_SIZE];
+    static unsigned char response[BUFFER_SIZE];
+    rand_data(request, sizeof(request));
+
+    struct stream *client, *server, *tmp;
+    test_stream_init(&client, &server);
+
+    struct idler *idler = idler_new();
+    idler_add_stream(idler, client);
+    idler_add_stream(idler, server);
+    stream_set_ring_io(client, true);
+    stream_set_ring_io(server, true);
+
+    // Nothing received yet
+    ssize_t bytes = stream_read(server, response, sizeof(response));
+    CU_ASSERT_EQUAL(bytes, -1);
+    CU_ASSERT_EQUAL(errno, EAGAIN);
+
+    // Whole request is taken, the rest is written while waiting
+    bytes = stream_write(client, request, sizeof(request));
+    CU_ASSERT_EQUAL(bytes, sizeof(request));
+
+    size_t offset = 0;
+    for (int i = 0; (i < 1000) && (offset < sizeof(response)); i++) {
+        int op = idler_wait(idler, 100);
+        CU_ASSERT_EQUAL(op, IDLER_OPERATION);
+
+        unsigned int stream_status;
+        tmp = idler_get_next_stream(idler, NULL, &stream_status);
+        for (; tmp; tmp = idler_get_next_stream(idler, tmp, &stream_status)) {
+            if ((tmp == server) && (stream_status & STREAM_INCOMING_READY)) {
+                while (offset < sizeof(response)) {
+                    bytes = stream_read(server, response + offset, sizeof(response) - offset);
+                    if (bytes <= 0) {
+                        CU_ASSERT_TRUE(stream_try_again(bytes));
+                        break;
+                    }
+                    offset += bytes;
+                }
+            }
+            if ((tmp == client) && (stream_status & STREAM_OUTGOING_READY))
+                stream_handle_outgoing_data(client);
+        }
+    }
+    CU_ASSERT_EQUAL(offset, sizeof(response));
+    CU_ASSERT_EQUAL(memcmp(request, response, sizeof(request)), 0);
+    CU_ASSERT_FALSE(stream_has_outgoing_data(client));
+
+    // Pending receive is cancelled by removal, stream reads descriptor again
+    idler_remove_stream(idler, server);
+    stream_write(client, "hello", 6);
+    bytes = -1;
+    for (int i = 0; (i < 100) && (bytes < 0); i++) {
+        idler_wait(idler, 10);
+        bytes = stream_read(server, response, sizeof(response));
+    }
+    CU_ASSERT_EQUAL(bytes, 6);
+    CU_ASSERT_STRING_EQUAL((char*)response, "hello");
+
+    // End of stream is reported as readable
+    idler_add_stream(idler, server);
+    shutdown(stream_get_fd(client), SHUT_WR);
+    int op = idler_wait(idler, 100);
+    CU_ASSERT_EQUAL(op, IDLER_OPERATION);
+    CU_ASSERT_TRUE(idler_get_stream_status(idler, server) & STREAM_INCOMING_READY);
+    bytes = stream_read(server, response, sizeof(response));
+    CU_ASSERT_EQUAL(bytes, 0);
+
+    idler = idler_delete(idler);
+
+    test_stream_clean(client, server);
+}
+
+
 /**
  *  Test stream observer
  *
@@ -2,13 +2,17 @@
 #include "test.h"
 
 #include "mx/stream_mqtt.h"
+#include "mx/mqtt_trie.h"
+#include "mx/mqtt_session.h"
 #include "mx/socket.h"
+#include "mx/idler.h"
 #include "mx/timer.h"
 
 #include <CUnit/Basic.h>
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <sys/socket.h>
 
@@ -31,15 +35,20 @@
 
 #define TEST_KEEP_ALIVE         10
 
+#define TEST_SESSION_PATH       "/tmp/test_mqtt_session.log"
+
 
 
 static void test_stream_mqtt_misc(void);
 static void test_stream_mqtt_peek_frame(void);
 static void test_stream_mqtt_read_frame(void);
+static void test_stream_mqtt_idler(void);
 
 static void test_stream_mqtt_connect(void);
 static void test_stream_mqtt_subscribe(void);
 static void test_stream_mqtt_unsubscribe(void);
+static void test_stream_mqtt_subscribe_many(void);
+static void test_stream_mqtt_subscribe_observer(void);
 static void test_stream_mqtt_publish_qos_0(void);
 static void test_stream_mqtt_publish_qos_1(void);
 static void test_stream_mqtt_publish_qos_2(void);
@@ -48,6 +57,13 @@ static void test_stream_mqtt_ping(void);
 
 static void test_stream_mqtt_resend_subscribe_unsubscribe(void);
 static void test_stream_mqtt_resend_publish_pubrel(void);
+static void test_stream_mqtt_packet_id(void);
+static void test_stream_mqtt_inflight_window(void);
+static void test_stream_mqtt_session_log(void);
+static void test_stream_mqtt_session_restore(void);
+static void test_stream_mqtt_session_clean(void);
+
+static void test_stream_mqtt_topic_trie(void);
 
 
 
@@ -63,10 +79,13 @@ CU_ErrorCode cu_test_stream_mqtt()
     CU_add_test(suite, "Test stream mqtt miscellaneous functions",  test_stream_mqtt_misc);
     CU_add_test(suite, "Test stream mqtt peek frame",               test_stream_mqtt_peek_frame);
     CU_add_test(suite, "Test stream mqtt read frame",               test_stream_mqtt_read_frame);
+    CU_add_test(suite, "Test stream mqtt decorating idler stream",  test_stream_mqtt_idler);
 
     CU_add_test(suite, "Test stream mqtt connect",                  test_stream_mqtt_connect);
     CU_add_test(suite, "Test stream mqtt subscribe",                test_stream_mqtt_subscribe);
     CU_add_test(suite, "Test stream mqtt unsubscribe",              test_stream_mqtt_unsubscribe);
+    CU_add_test(suite, "Test stream mqtt subscribe many",           test_stream_mqtt_subscribe_many);
+    CU_add_test(suite, "Test stream mqtt subscribe observers",      test_stream_mqtt_subscribe_observer);
     CU_add_test(suite, "Test stream mqtt publish qos 0",            test_stream_mqtt_publish_qos_0);
     CU_add_test(suite, "Test stream mqtt publish qos 1",            test_stream_mqtt_publish_qos_1);
     CU_add_test(suite, "Test stream mqtt publish qos 2",            test_stream_mqtt_publish_qos_2);
@@ -75,6 +94,13 @@ CU_ErrorCode cu_test_stream_mqtt()
 
     CU_add_test(suite, "Test stream mqtt resend sub/unsub",         test_stream_mqtt_resend_subscribe_unsubscribe);
     CU_add_test(suite, "Test stream mqtt resend publish/pubrel",    test_stream_mqtt_resend_publish_pubrel);
+    CU_add_test(suite, "Test stream mqtt packet id allocation",     test_stream_mqtt_packet_id);
+    CU_add_test(suite, "Test stream mqtt in-flight window",         test_stream_mqtt_inflight_window);
+    CU_add_test(suite, "Test stream mqtt session log",              test_stream_mqtt_session_log);
+    CU_add_test(suite, "Test stream mqtt session restore",          test_stream_mqtt_session_restore);
+    CU_add_test(suite, "Test stream mqtt session clean",            test_stream_mqtt_session_clean);
+
+    CU_add_test(suite, "Test stream mqtt topic trie",               test_stream_mqtt_topic_trie);
 
     return CU_get_error();
 }
@@ -213,8 +239,17 @@ void test_stream_mqtt_read_frame(void)
 
     bytes = stream_mqtt_peek_frame(server);
     CU_ASSERT_EQUAL(bytes, 1);      // Second frame received, dummy byte is used to forward disconnect to application
-    bytes = stream_mqtt_read_frame(server, &type, &flags, buffer, sizeof(buffer));
+
+    // Borrow frame without copying
+    const void *data = NULL;
+    bytes = stream_mqtt_borrow_frame(server, &type, &flags, &data);
     CU_ASSERT_EQUAL(bytes, 1);
+    CU_ASSERT_EQUAL(type, MQTT_DISCONNECT);
+    CU_ASSERT_PTR_NOT_NULL(data);
+    stream_mqtt_release_frame(server);
+
+    bytes = stream_mqtt_read_frame(server, &type, &flags, buffer, sizeof(buffer));
+    CU_ASSERT_EQUAL(bytes, -1);
 
     test_stream_mqtt_clean(client, server);
 }
@@ -223,6 +258,46 @@ void test_stream_mqtt_read_frame(void)
 
 
 
+/**
+ *  Test stream mqtt decorating stream registered in idler
+ *
+ */
+void test_stream_mqtt_idler(void)
+{
+    static unsigned char payload[400000];
+    static unsigned char buffer[sizeof(payload)];
+
+    int sockets[2];
+    CU_ASSERT_EQUAL(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets), 0);
+    socket_set_non_blocking(sockets[0], 1);
+    socket_set_non_blocking(sockets[1], 1);
+
+    struct stream *raw = stream_new(sockets[0]);
+    struct idler *idler = idler_new();
+    idler_add_stream(idler, raw);
+
+    // Decorator takes over registration
+    struct stream_mqtt *client = stream_mqtt_new(raw);
+    struct stream *stream = stream_mqtt_to_stream(client);
+    CU_ASSERT_PTR_EQUAL(idler_find_stream(idler, sockets[0]), stream);
+
+    // Data queued by decorated stream is announced to idler
+    stream_mqtt_publish(client, false, false, MQTT_QOS_0, 0, TEST_TOPIC_1, payload, sizeof(payload));
+    CU_ASSERT_TRUE(stream_has_outgoing_data(stream));
+    CU_ASSERT_TRUE(read(sockets[1], buffer, sizeof(buffer)) > 0);
+
+    unsigned int status = 0;
+    CU_ASSERT_EQUAL(idler_wait(idler, 100), IDLER_OPERATION);
+    CU_ASSERT_PTR_EQUAL(idler_get_next_stream(idler, NULL, &status), stream);
+    CU_ASSERT_TRUE(status & STREAM_OUTGOING_READY);
+
+    close(sockets[0]);
+    close(sockets[1]);
+    stream_mqtt_delete(client);
+    idler_delete(idler);
+}
+
+
 /**
  *  Test MQTT connect frame
  *
@@ -370,6 +445,165 @@ void test_stream_mqtt_unsubscribe(void)
 }
 
 
+/**
+ *  Test MQTT subscribe/unsubscribe frames with many topic filters
+ *
+ */
+void test_stream_mqtt_subscribe_many(void)
+{
+    struct stream_mqtt *client, *server;
+    test_stream_mqtt_init(&client, &server);
+
+    const char *topics[] = { TEST_TOPIC_1, TEST_TOPIC_2, TEST_TOPIC_3 };
+    const unsigned char qos[] = { MQTT_QOS_0, MQTT_QOS_1, MQTT_QOS_2 };
+    const unsigned char codes[] = { MQTT_SUBACK_SUCCESS_MAX_QOS_0, MQTT_SUBACK_FAILURE, MQTT_SUBACK_SUCCESS_MAX_QOS_2 };
+
+    unsigned char buffer[512];
+    unsigned char type;
+    unsigned char flags;
+    ssize_t ret;
+    ssize_t bytes;
+    ssize_t written;
+    size_t idx;
+
+    written = stream_mqtt_subscribe_many(client, TEST_MSG_ID_1, topics, qos, 3);
+    CU_ASSERT_TRUE(written > 0);
+
+    bytes = stream_mqtt_peek_frame(server);
+    CU_ASSERT_EQUAL(bytes, mqtt_eval_subscribe_many(topics, 3));
+    bytes = stream_mqtt_read_frame(server, &type, &flags, buffer, sizeof(buffer));
+    CU_ASSERT_EQUAL(type, MQTT_SUBSCRIBE);
+    CU_ASSERT_EQUAL(MQTT_QOS_FROM_FLAGS(flags), MQTT_QOS_1);
+
+    struct mqtt_subscribe_many subscribe_msg;
+    struct mqtt_subscribe subscribe_entry;
+    ret = mqtt_parse_subscribe_many(&subscribe_msg, buffer, bytes);
+    CU_ASSERT_EQUAL(ret, bytes);
+    CU_ASSERT_EQUAL(subscribe_msg.id, TEST_MSG_ID_1);
+    CU_ASSERT_EQUAL(subscribe_msg.count, 3);
+    for (idx = 0; mqtt_subscribe_many_next(&subscribe_msg, &subscribe_entry); idx++) {
+        CU_ASSERT_EQUAL(subscribe_entry.id, TEST_MSG_ID_1);
+        CU_ASSERT_EQUAL(subscribe_entry.qos, qos[idx]);
+        CU_ASSERT_EQUAL(subscribe_entry.topic_len, strlen(topics[idx]));
+        CU_ASSERT_NSTRING_EQUAL(subscribe_entry.topic, topics[idx], strlen(topics[idx]));
+    }
+    CU_ASSERT_EQUAL(idx, 3);
+
+    // Single filter parser rejects packet with many filters
+    struct mqtt_subscribe subscribe_single;
+    ret = mqtt_parse_subscribe(&subscribe_single, buffer, bytes);
+    CU_ASSERT_EQUAL(ret, -1);
+
+    // Malformed packets
+    CU_ASSERT_EQUAL(mqtt_parse_subscribe_many(&subscribe_msg, buffer, MQTT_PACKET_ID_SIZE), -1);   // No filter
+    CU_ASSERT_EQUAL(mqtt_parse_subscribe_many(&subscribe_msg, buffer, bytes-1), -1);               // Missing QoS
+    CU_ASSERT_EQUAL(mqtt_parse_subscribe_many(&subscribe_msg, buffer, 1), -1);
+
+    // Response
+    written = stream_mqtt_suback_many(server, TEST_MSG_ID_1, codes, 3);
+    CU_ASSERT_TRUE(written > 0);
+    bytes = stream_mqtt_peek_frame(client);
+    CU_ASSERT_EQUAL(bytes, mqtt_eval_suback_many(3));
+    bytes = stream_mqtt_read_frame(client, &type, &flags, buffer, sizeof(buffer));
+    CU_ASSERT_EQUAL(type, MQTT_SUBACK);
+    CU_ASSERT_EQUAL(flags, 0);
+
+    struct mqtt_suback_many suback_msg;
+    ret = mqtt_parse_suback_many(&suback_msg, buffer, bytes);
+    CU_ASSERT_EQUAL(ret, bytes);
+    CU_ASSERT_EQUAL(suback_msg.id, TEST_MSG_ID_1);
+    CU_ASSERT_EQUAL(suback_msg.count, 3);
+    CU_ASSERT_NSTRING_EQUAL(suback_msg.return_codes, codes, sizeof(codes));
+    CU_ASSERT_EQUAL(mqtt_parse_suback_many(&suback_msg, buffer, MQTT_PACKET_ID_SIZE), -1);
+
+    // Unsubscribe
+    written = stream_mqtt_unsubscribe_many(client, TEST_MSG_ID_2, topics, 3);
+    CU_ASSERT_TRUE(written > 0);
+
+    bytes = stream_mqtt_peek_frame(server);
+    CU_ASSERT_EQUAL(bytes, mqtt_eval_unsubscribe_many(topics, 3));
+    bytes = stream_mqtt_read_frame(server, &type, &flags, buffer, sizeof(buffer));
+    CU_ASSERT_EQUAL(type, MQTT_UNSUBSCRIBE);
+
+    struct mqtt_unsubscribe_many unsubscribe_msg;
+    struct mqtt_unsubscribe unsubscribe_entry;
+    ret = mqtt_parse_unsubscribe_many(&unsubscribe_msg, buffer, bytes);
+    CU_ASSERT_EQUAL(ret, bytes);
+    CU_ASSERT_EQUAL(unsubscribe_msg.id, TEST_MSG_ID_2);
+    CU_ASSERT_EQUAL(unsubscribe_msg.count, 3);
+    for (idx = 0; mqtt_unsubscribe_many_next(&unsubscribe_msg, &unsubscribe_entry); idx++) {
+        CU_ASSERT_EQUAL(unsubscribe_entry.id, TEST_MSG_ID_2);
+        CU_ASSERT_NSTRING_EQUAL(unsubscribe_entry.topic, topics[idx], strlen(topics[idx]));
+    }
+    CU_ASSERT_EQUAL(idx, 3);
+    CU_ASSERT_EQUAL(mqtt_parse_unsubscribe_many(&unsubscribe_msg, buffer, bytes-1), -1);
+
+    test_stream_mqtt_clean(client, server);
+}
+
+
+static int test_stream_mqtt_on_subscribe(void *object, struct stream_mqtt *stream, unsigned char type, unsigned char flags, void *msg)
+{
+    (void)stream;
+    (void)flags;
+    size_t *filters = object;
+    if (type != MQTT_SUBSCRIBE)
+        return 0;
+
+    const struct mqtt_subscribe *subscribe = msg;
+    if ((subscribe->topic_len == strlen(TEST_TOPIC_1)) && !memcmp(subscribe->topic, TEST_TOPIC_1, subscribe->topic_len))
+        (*filters)++;
+    return 1;
+}
+
+static int test_stream_mqtt_on_subscribe_many(void *object, struct stream_mqtt *stream, unsigned char type, unsigned char flags, void *msg)
+{
+    (void)stream;
+    (void)flags;
+    size_t *filters = object;
+    if (type != MQTT_SUBSCRIBE)
+        return 0;
+
+    struct mqtt_subscribe entry;
+    while (mqtt_subscribe_many_next(msg, &entry))
+        (*filters)++;
+    return 1;
+}
+
+
+/**
+ *  Test MQTT subscribe observers
+ *
+ */
+void test_stream_mqtt_subscribe_observer(void)
+{
+    struct stream_mqtt *client, *server;
+    test_stream_mqtt_init(&client, &server);
+
+    const char *topics[] = { TEST_TOPIC_1, TEST_TOPIC_2, TEST_TOPIC_3 };
+    const unsigned char qos[] = { MQTT_QOS_0, MQTT_QOS_1, MQTT_QOS_2 };
+    size_t filters = 0;
+
+    // Observer gets the first filter by default
+    stream_mqtt_set_observer(server, &filters, test_stream_mqtt_on_subscribe);
+    stream_mqtt_subscribe_many(client, TEST_MSG_ID_1, topics, qos, 3);
+    CU_ASSERT_EQUAL(stream_mqtt_peek_frame(server), -1);    // Handled by observer
+    CU_ASSERT_EQUAL(filters, 1);
+    stream_mqtt_suback(server, TEST_MSG_ID_1, MQTT_SUBACK_SUCCESS_MAX_QOS_0);
+    stream_mqtt_peek_frame(client);
+
+    // All filters are passed on request
+    filters = 0;
+    stream_mqtt_remove_observer(server);
+    stream_mqtt_set_many_observer(server, &filters, test_stream_mqtt_on_subscribe_many);
+    stream_mqtt_subscribe_many(client, TEST_MSG_ID_2, topics, qos, 3);
+    CU_ASSERT_EQUAL(stream_mqtt_peek_frame(server), -1);
+    CU_ASSERT_EQUAL(filters, 3);
+
+    test_stream_mqtt_clean(client, server);
+}
+
+
 /**
  *  Test MQTT publish frame with QoS 0
  *
@@ -731,3 +965,511 @@ void test_stream_mqtt_resend_publish_pubrel(void)
 
     test_stream_mqtt_clean(client, server);
 }
+
+
+/**
+ *  Test MQTT packet id allocation
+ *
+ */
+void test_stream_mqtt_packet_id(void)
+{
+    struct stream_mqtt *client, *server;
+    test_stream_mqtt_init(&client, &server);
+
+    unsigned short id;
+    unsigned int i;
+
+    CU_ASSERT_EQUAL(stream_mqtt_next_packet_id(client), 1);
+    CU_ASSERT_EQUAL(stream_mqtt_next_packet_id(client), 2);
+
+    // Keep ids 3..302 in flight, only the first one is actually sent
+    for (i = 0; i < 300; i++) {
+        id = stream_mqtt_next_packet_id(client);
+        CU_ASSERT_EQUAL(id, i + 3);
+        stream_mqtt_publish(client, false, false, MQTT_QOS_1, id, TEST_TOPIC_1,
+                            (const unsigned char*)TEST_PAYLOAD_1, strlen(TEST_PAYLOAD_1));
+    }
+
+    // Acknowledge some of them out of order
+    stream_mqtt_puback(server, 150);
+    stream_mqtt_puback(server, 150 + 128);      // Same index bucket
+    stream_mqtt_puback(server, 1000);           // Unknown id
+    CU_ASSERT_EQUAL(stream_mqtt_peek_frame(client), -1);
+
+    // Wrap around, ids in flight are skipped
+    for (i = 303; i <= 0xFFFF; i++)
+        stream_mqtt_next_packet_id(client);
+    CU_ASSERT_EQUAL(stream_mqtt_next_packet_id(client), 1);
+    CU_ASSERT_EQUAL(stream_mqtt_next_packet_id(client), 2);
+    CU_ASSERT_EQUAL(stream_mqtt_next_packet_id(client), 150);
+    CU_ASSERT_EQUAL(stream_mqtt_next_packet_id(client), 150 + 128);
+    CU_ASSERT_EQUAL(stream_mqtt_next_packet_id(client), 303);
+
+    test_stream_mqtt_clean(client, server);
+}
+
+
+static void test_stream_mqtt_publish_ready(void *object, struct stream_mqtt *stream)
+{
+    (void)stream;
+    unsigned int *notified = object;
+    (*notified)++;
+}
+
+static unsigned short test_stream_mqtt_read_publish_id(struct stream_mqtt *server)
+{
+    unsigned char buffer[512];
+    unsigned char type;
+    unsigned char flags;
+    struct mqtt_publish publish_msg = { 0 };
+
+    if (stream_mqtt_peek_frame(server) < 0)
+        return 0;
+    ssize_t bytes = stream_mqtt_read_frame(server, &type, &flags, buffer, sizeof(buffer));
+    if (type != MQTT_PUBLISH)
+        return 0;
+    mqtt_parse_publish(&publish_msg, buffer, bytes, MQTT_QOS_FROM_FLAGS(flags));
+    return publish_msg.id;
+}
+
+
+/**
+ *  Test MQTT in-flight window
+ *
+ */
+void test_stream_mqtt_inflight_window(void)
+{
+    struct stream_mqtt *client, *server;
+    test_stream_mqtt_init(&client, &server);
+    unsigned int notified = 0;
+
+    stream_mqtt_set_inflight_window(client, 2);
+    stream_mqtt_set_publish_observer(client, &notified, test_stream_mqtt_publish_ready);
+
+    CU_ASSERT_TRUE(stream_mqtt_can_publish(client));
+    stream_mqtt_publish(client, false, false, MQTT_QOS_1, TEST_MSG_ID_1, TEST_TOPIC_1,
+                        (const unsigned char*)TEST_PAYLOAD_1, strlen(TEST_PAYLOAD_1));
+    stream_mqtt_publish(client, false, false, MQTT_QOS_1, TEST_MSG_ID_2, TEST_TOPIC_1,
+                        (const unsigned char*)TEST_PAYLOAD_1, strlen(TEST_PAYLOAD_1));
+    CU_ASSERT_FALSE(stream_mqtt_can_publish(client));
+
+    // Held above the window
+    stream_mqtt_publish(client, false, false, MQTT_QOS_2, TEST_MSG_ID_3, TEST_TOPIC_1,
+                        (const unsigned char*)TEST_PAYLOAD_1, strlen(TEST_PAYLOAD_1));
+    CU_ASSERT_FALSE(stream_mqtt_can_publish(client));
+    // QoS 0 is not limited
+    stream_mqtt_publish(client, false, false, MQTT_QOS_0, 0, TEST_TOPIC_2,
+                        (const unsigned char*)TEST_PAYLOAD_2, strlen(TEST_PAYLOAD_2));
+    // Packet ids waiting for the window are not reused
+    CU_ASSERT_NOT_EQUAL(stream_mqtt_next_packet_id(client), TEST_MSG_ID_3);
+
+    CU_ASSERT_EQUAL(test_stream_mqtt_read_publish_id(server), TEST_MSG_ID_1);
+    stream_mqtt_puback(server, TEST_MSG_ID_1);
+    stream_mqtt_peek_frame(client);             // Held message enters the window
+    CU_ASSERT_FALSE(stream_mqtt_can_publish(client));
+    CU_ASSERT_EQUAL(notified, 0);
+
+    stream_time(stream_mqtt_to_stream(client));
+    CU_ASSERT_EQUAL(test_stream_mqtt_read_publish_id(server), TEST_MSG_ID_2);
+    stream_mqtt_puback(server, TEST_MSG_ID_2);
+    stream_mqtt_peek_frame(client);
+    CU_ASSERT_TRUE(stream_mqtt_can_publish(client));
+    CU_ASSERT_EQUAL(notified, 1);
+
+    // Queued QoS 0 goes first, QoS 2 stays in the window until Pubcomp
+    stream_time(stream_mqtt_to_stream(client));
+    CU_ASSERT_EQUAL(test_stream_mqtt_read_publish_id(server), 0);   // Server responded Pubrec
+    stream_mqtt_peek_frame(client);             // Pubrel is sent
+    stream_mqtt_publish(client, false, false, MQTT_QOS_1, TEST_MSG_ID_1, TEST_TOPIC_1,
+                        (const unsigned char*)TEST_PAYLOAD_1, strlen(TEST_PAYLOAD_1));
+    CU_ASSERT_FALSE(stream_mqtt_can_publish(client));
+    CU_ASSERT_EQUAL(test_stream_mqtt_read_publish_id(server), TEST_MSG_ID_3);   // Server responded Pubcomp
+    stream_mqtt_peek_frame(client);
+    CU_ASSERT_TRUE(stream_mqtt_can_publish(client));
+    CU_ASSERT_EQUAL(notified, 1);               // Application was not blocked
+
+    // Disabling the window releases held messages
+    stream_mqtt_publish(client, false, false, MQTT_QOS_1, TEST_MSG_ID_2, TEST_TOPIC_1,
+                        (const unsigned char*)TEST_PAYLOAD_1, strlen(TEST_PAYLOAD_1));
+    stream_mqtt_publish(client, false, false, MQTT_QOS_1, TEST_MSG_ID_3, TEST_TOPIC_1,
+                        (const unsigned char*)TEST_PAYLOAD_1, strlen(TEST_PAYLOAD_1));
+    CU_ASSERT_FALSE(stream_mqtt_can_publish(client));
+    stream_mqtt_set_inflight_window(client, 0);
+    CU_ASSERT_TRUE(stream_mqtt_can_publish(client));
+    CU_ASSERT_EQUAL(notified, 2);
+
+    test_stream_mqtt_clean(client, server);
+}
+
+
+struct test_session_content
+{
+    unsigned int messages;
+    unsigned short ids[8];
+    unsigned char directions[8];
+    unsigned int subscriptions;
+    unsigned char qos;
+};
+
+static void test_stream_mqtt_session_message(void *arg, const struct mqtt_session_message *msg)
+{
+    struct test_session_content *content = arg;
+    if (content->messages < 8) {
+        content->ids[content->messages] = msg->id;
+        content->directions[content->messages] = msg->direction;
+    }
+    content->messages++;
+}
+
+static void test_stream_mqtt_session_subscription(void *arg, const char *topic, unsigned short topic_len, unsigned char qos)
+{
+    (void)topic;
+    (void)topic_len;
+    struct test_session_content *content = arg;
+    content->subscriptions++;
+    content->qos = qos;
+}
+
+static bool test_stream_mqtt_session_load(struct mqtt_session_store *store, const char *client_id,
+                                                                            struct test_session_content *content)
+{
+    memset(content, 0, sizeof(struct test_session_content));
+    return mqtt_session_store_load(store, client_id, test_stream_mqtt_session_message,
+                                   test_stream_mqtt_session_subscription, content);
+}
+
+static void test_stream_mqtt_session_save(struct mqtt_session_store *store, const char *client_id,
+                                          unsigned char direction, unsigned short id)
+{
+    struct mqtt_session_message msg;
+    msg.direction = direction;
+    msg.type = MQTT_PUBLISH;
+    msg.flags = MQTT_QOS_TO_FLAGS(MQTT_QOS_1);
+    msg.id = id;
+    msg.data = (const unsigned char*)TEST_PAYLOAD_1;
+    msg.length = strlen(TEST_PAYLOAD_1);
+    CU_ASSERT_TRUE(mqtt_session_store_save_message(store, client_id, &msg));
+}
+
+
+/**
+ *  Test MQTT session log
+ *
+ */
+void test_stream_mqtt_session_log(void)
+{
+    struct test_session_content content;
+    unlink(TEST_SESSION_PATH);
+
+    struct mqtt_session_log *log = mqtt_session_log_new(TEST_SESSION_PATH);
+    CU_ASSERT_PTR_NOT_NULL(log);
+    struct mqtt_session_store *store = mqtt_session_log_to_store(log);
+
+    CU_ASSERT_FALSE(test_stream_mqtt_session_load(store, TEST_CLIENT_ID_1, &content));
+
+    test_stream_mqtt_session_save(store, TEST_CLIENT_ID_1, MQTT_SESSION_OUTGOING, TEST_MSG_ID_1);
+    test_stream_mqtt_session_save(store, TEST_CLIENT_ID_1, MQTT_SESSION_OUTGOING, TEST_MSG_ID_2);
+    test_stream_mqtt_session_save(store, TEST_CLIENT_ID_1, MQTT_SESSION_INBOUND, TEST_MSG_ID_1);
+    test_stream_mqtt_session_save(store, TEST_CLIENT_ID_2, MQTT_SESSION_OUTGOING, TEST_MSG_ID_3);
+    CU_ASSERT_TRUE(mqtt_session_store_remove_message(store, TEST_CLIENT_ID_1, MQTT_SESSION_OUTGOING, TEST_MSG_ID_1));
+    CU_ASSERT_TRUE(mqtt_session_store_save_subscription(store, TEST_CLIENT_ID_1, TEST_TOPIC_1, strlen(TEST_TOPIC_1), MQTT_QOS_1));
+    CU_ASSERT_TRUE(mqtt_session_store_save_subscription(store, TEST_CLIENT_ID_1, TEST_TOPIC_2, strlen(TEST_TOPIC_2), MQTT_QOS_1));
+    CU_ASSERT_TRUE(mqtt_session_store_save_subscription(store, TEST_CLIENT_ID_1, TEST_TOPIC_2, strlen(TEST_TOPIC_2), MQTT_QOS_2));
+    CU_ASSERT_TRUE(mqtt_session_store_remove_subscription(store, TEST_CLIENT_ID_1, TEST_TOPIC_1, strlen(TEST_TOPIC_1)));
+
+    CU_ASSERT_TRUE(test_stream_mqtt_session_load(store, TEST_CLIENT_ID_1, &content));
+    CU_ASSERT_EQUAL(content.messages, 2);
+    CU_ASSERT_EQUAL(content.ids[0], TEST_MSG_ID_2);
+    CU_ASSERT_EQUAL(content.directions[0], MQTT_SESSION_OUTGOING);
+    CU_ASSERT_EQUAL(content.ids[1], TEST_MSG_ID_1);
+    CU_ASSERT_EQUAL(content.directions[1], MQTT_SESSION_INBOUND);
+    CU_ASSERT_EQUAL(content.subscriptions, 1);
+    CU_ASSERT_EQUAL(content.qos, MQTT_QOS_2);
+    CU_ASSERT_EQUAL(mqtt_session_store_sync(store), 0);
+
+    // Session is recovered from file
+    mqtt_session_log_delete(log);
+    log = mqtt_session_log_new(TEST_SESSION_PATH);
+    CU_ASSERT_PTR_NOT_NULL(log);
+    store = mqtt_session_log_to_store(log);
+
+    CU_ASSERT_TRUE(test_stream_mqtt_session_load(store, TEST_CLIENT_ID_1, &content));
+    CU_ASSERT_EQUAL(content.messages, 2);
+    CU_ASSERT_EQUAL(content.ids[0], TEST_MSG_ID_2);
+    CU_ASSERT_EQUAL(content.subscriptions, 1);
+    CU_ASSERT_TRUE(test_stream_mqtt_session_load(store, TEST_CLIENT_ID_2, &content));
+    CU_ASSERT_EQUAL(content.messages, 1);
+
+    // Torn record is dropped on recovery
+    test_stream_mqtt_session_save(store, TEST_CLIENT_ID_2, MQTT_SESSION_OUTGOING, TEST_MSG_ID_1);
+    size_t size = mqtt_session_log_get_size(log);
+    mqtt_session_log_delete(log);
+
+    FILE *file = fopen(TEST_SESSION_PATH, "r+b");
+    CU_ASSERT_PTR_NOT_NULL(file);
+    fseek(file, size - 2, SEEK_SET);
+    fputc(0xAA, file);
+    fclose(file);
+
+    log = mqtt_session_log_new(TEST_SESSION_PATH);
+    CU_ASSERT_PTR_NOT_NULL(log);
+    store = mqtt_session_log_to_store(log);
+    CU_ASSERT_TRUE(test_stream_mqtt_session_load(store, TEST_CLIENT_ID_2, &content));
+    CU_ASSERT_EQUAL(content.messages, 1);
+    CU_ASSERT_EQUAL(content.ids[0], TEST_MSG_ID_3);
+    CU_ASSERT_TRUE(test_stream_mqtt_session_load(store, TEST_CLIENT_ID_1, &content));
+    CU_ASSERT_EQUAL(content.messages, 2);
+
+    // Obsolete records are compacted
+    for (unsigned short id = 2001; id <= 7000; id++) {
+        test_stream_mqtt_session_save(store, TEST_CLIENT_ID_2, MQTT_SESSION_OUTGOING, id);
+        mqtt_session_store_remove_message(store, TEST_CLIENT_ID_2, MQTT_SESSION_OUTGOING, id);
+    }
+    size = mqtt_session_log_get_size(log);
+    CU_ASSERT_TRUE(mqtt_session_log_compact(log));
+    CU_ASSERT_TRUE(mqtt_session_log_get_size(log) < size);
+    CU_ASSERT_TRUE(test_stream_mqtt_session_load(store, TEST_CLIENT_ID_1, &content));
+    CU_ASSERT_EQUAL(content.messages, 2);
+    CU_ASSERT_EQUAL(content.subscriptions, 1);
+
+    // Clean session
+    CU_ASSERT_TRUE(mqtt_session_store_clear(store, TEST_CLIENT_ID_1));
+    CU_ASSERT_FALSE(test_stream_mqtt_session_load(store, TEST_CLIENT_ID_1, &content));
+
+    mqtt_session_log_delete(log);
+    log = mqtt_session_log_new(TEST_SESSION_PATH);
+    CU_ASSERT_PTR_NOT_NULL(log);
+    store = mqtt_session_log_to_store(log);
+    CU_ASSERT_FALSE(test_stream_mqtt_session_load(store, TEST_CLIENT_ID_1, &content));
+    CU_ASSERT_TRUE(test_stream_mqtt_session_load(store, TEST_CLIENT_ID_2, &content));
+    CU_ASSERT_EQUAL(content.messages, 1);
+
+    mqtt_session_store_delete(store);
+    unlink(TEST_SESSION_PATH);
+}
+
+
+/**
+ *  Test MQTT session restore
+ *
+ */
+void test_stream_mqtt_session_restore(void)
+{
+    struct test_session_content content;
+    unlink(TEST_SESSION_PATH);
+
+    struct mqtt_session_store *store = mqtt_session_log_to_store(mqtt_session_log_new(TEST_SESSION_PATH));
+    struct stream_mqtt *client, *server;
+    test_stream_mqtt_init(&client, &server);
+    stream_mqtt_set_session(client, store, TEST_CLIENT_ID_1);
+    stream_mqtt_set_session(server, store, TEST_CLIENT_ID_2);
+
+    stream_mqtt_publish(client, false, false, MQTT_QOS_1, TEST_MSG_ID_1, TEST_TOPIC_1,
+                        (const unsigned char*)TEST_PAYLOAD_1, strlen(TEST_PAYLOAD_1));
+    stream_mqtt_publish(client, false, false, MQTT_QOS_0, 0, TEST_TOPIC_2,
+                        (const unsigned char*)TEST_PAYLOAD_2, strlen(TEST_PAYLOAD_2));
+    stream_mqtt_publish(client, false, false, MQTT_QOS_2, TEST_MSG_ID_2, TEST_TOPIC_1,
+                        (const unsigned char*)TEST_PAYLOAD_1, strlen(TEST_PAYLOAD_1));
+    CU_ASSERT_TRUE(test_stream_mqtt_session_load(store, TEST_CLIENT_ID_1, &content));
+    CU_ASSERT_EQUAL(content.messages, 2);       // QoS 0 is not kept
+
+    // Server keeps QoS 2 message until Pubrel
+    CU_ASSERT_EQUAL(test_stream_mqtt_read_publish_id(server), TEST_MSG_ID_1);
+    stream_mqtt_puback(server, TEST_MSG_ID_1);
+    stream_mqtt_peek_frame(client);
+    CU_ASSERT_TRUE(test_stream_mqtt_session_load(store, TEST_CLIENT_ID_1, &content));
+    CU_ASSERT_EQUAL(content.messages, 1);
+    CU_ASSERT_EQUAL(content.ids[0], TEST_MSG_ID_2);
+
+    stream_time(stream_mqtt_to_stream(client));
+    CU_ASSERT_EQUAL(test_stream_mqtt_read_publish_id(server), 0);   // Qos 0 message
+    CU_ASSERT_EQUAL(test_stream_mqtt_read_publish_id(server), 0);   // Server responded Pubrec
+    CU_ASSERT_TRUE(test_stream_mqtt_session_load(store, TEST_CLIENT_ID_2, &content));
+    CU_ASSERT_EQUAL(content.messages, 1);
+    CU_ASSERT_EQUAL(content.ids[0], TEST_MSG_ID_2);
+    CU_ASSERT_EQUAL(content.directions[0], MQTT_SESSION_INBOUND);
+
+    // Client sends Pubrel and connection breaks
+    stream_mqtt_peek_frame(client);
+    CU_ASSERT_TRUE(test_stream_mqtt_session_load(store, TEST_CLIENT_ID_1, &content));
+    CU_ASSERT_EQUAL(content.messages, 1);
+    test_stream_mqtt_clean(client, server);
+
+    // Both sides continue after reconnect
+    test_stream_mqtt_init(&client, &server);
+    stream_mqtt_set_session(client, store, TEST_CLIENT_ID_1);
+    stream_mqtt_set_session(server, store, TEST_CLIENT_ID_2);
+    CU_ASSERT_TRUE(stream_mqtt_restore_session(client, NULL, NULL));
+    CU_ASSERT_TRUE(stream_mqtt_restore_session(server, NULL, NULL));
+    CU_ASSERT_NOT_EQUAL(stream_mqtt_next_packet_id(client), TEST_MSG_ID_2);
+
+    stream_time(stream_mqtt_to_stream(client));      // Pubrel is resent
+    CU_ASSERT_EQUAL(test_stream_mqtt_read_publish_id(server), TEST_MSG_ID_2);   // Server responded Pubcomp
+    stream_mqtt_peek_frame(client);
+
+    // Nothing left in sessions
+    CU_ASSERT_FALSE(test_stream_mqtt_session_load(store, TEST_CLIENT_ID_1, &content));
+    CU_ASSERT_FALSE(test_stream_mqtt_session_load(store, TEST_CLIENT_ID_2, &content));
+
+    test_stream_mqtt_clean(client, server);
+    mqtt_session_store_delete(store);
+    unlink(TEST_SESSION_PATH);
+}
+
+
+/**
+ *  Test MQTT clean session and subscriptions
+ *
+ */
+void test_stream_mqtt_session_clean(void)
+{
+    struct test_session_content content;
+    const char *topics[] = { TEST_TOPIC_1, TEST_TOPIC_2 };
+    const unsigned char qos[] = { MQTT_QOS_1, MQTT_QOS_2 };
+    unlink(TEST_SESSION_PATH);
+
+    struct mqtt_session_store *store = mqtt_session_log_to_store(mqtt_session_log_new(TEST_SESSION_PATH));
+    struct stream_mqtt *client, *server;
+    test_stream_mqtt_init(&client, &server);
+    stream_mqtt_set_session(client, store, TEST_CLIENT_ID_1);
+
+    // Client keeps its subscriptions
+    stream_mqtt_connect(client, false, TEST_KEEP_ALIVE, TEST_CLIENT_ID_1, NULL, NULL, 0, false, 0, NULL, NULL, 0);
+    stream_mqtt_subscribe_many(client, TEST_MSG_ID_1, topics, qos, 2);
+    stream_mqtt_unsubscribe(client, TEST_MSG_ID_2, TEST_TOPIC_1);
+    stream_mqtt_publish(client, false, false, MQTT_QOS_1, TEST_MSG_ID_3, TEST_TOPIC_2,
+                        (const unsigned char*)TEST_PAYLOAD_1, strlen(TEST_PAYLOAD_1));
+    CU_ASSERT_TRUE(test_stream_mqtt_session_load(store, TEST_CLIENT_ID_1, &content));
+    CU_ASSERT_EQUAL(content.messages, 1);
+    CU_ASSERT_EQUAL(content.subscriptions, 1);
+    CU_ASSERT_EQUAL(content.qos, MQTT_QOS_2);
+    test_stream_mqtt_clean(client, server);
+
+    // Restored subscriptions are given to the application
+    test_stream_mqtt_init(&client, &server);
+    stream_mqtt_set_session(client, store, TEST_CLIENT_ID_1);
+    memset(&content, 0, sizeof(content));
+    CU_ASSERT_TRUE(stream_mqtt_restore_session(client, test_stream_mqtt_session_subscription, &content));
+    CU_ASSERT_EQUAL(content.subscriptions, 1);
+    test_stream_mqtt_clean(client, server);
+
+    // Clean session drops everything
+    test_stream_mqtt_init(&client, &server);
+    stream_mqtt_set_session(client, store, TEST_CLIENT_ID_1);
+    stream_mqtt_connect(client, true, TEST_KEEP_ALIVE, TEST_CLIENT_ID_1, NULL, NULL, 0, false, 0, NULL, NULL, 0);
+    CU_ASSERT_FALSE(test_stream_mqtt_session_load(store, TEST_CLIENT_ID_1, &content));
+    test_stream_mqtt_clean(client, server);
+
+    // Server uses session of connecting client
+    test_stream_mqtt_session_save(store, TEST_CLIENT_ID_2, MQTT_SESSION_INBOUND, TEST_MSG_ID_1);
+    test_stream_mqtt_init(&client, &server);
+    stream_mqtt_set_session(server, store, TEST_CLIENT_ID_1);
+    stream_mqtt_connect(client, false, TEST_KEEP_ALIVE, TEST_CLIENT_ID_2, NULL, NULL, 0, false, 0, NULL, NULL, 0);
+    stream_mqtt_peek_frame(server);
+    CU_ASSERT_TRUE(stream_mqtt_restore_session(server, test_stream_mqtt_session_subscription, &content));
+    test_stream_mqtt_clean(client, server);
+
+    test_stream_mqtt_init(&client, &server);
+    stream_mqtt_set_session(server, store, TEST_CLIENT_ID_1);
+    stream_mqtt_connect(client, true, TEST_KEEP_ALIVE, TEST_CLIENT_ID_2, NULL, NULL, 0, false, 0, NULL, NULL, 0);
+    stream_mqtt_peek_frame(server);
+    CU_ASSERT_FALSE(test_stream_mqtt_session_load(store, TEST_CLIENT_ID_2, &content));
+    CU_ASSERT_FALSE(stream_mqtt_restore_session(server, NULL, NULL));
+    test_stream_mqtt_clean(client, server);
+
+    mqtt_session_store_delete(store);
+    unlink(TEST_SESSION_PATH);
+}
+
+
+static void test_stream_mqtt_topic_trie_handler(void *subscriber, unsigned char qos, void *arg)
+{
+    unsigned int *matched = arg;
+    *matched |= (unsigned int)(uintptr_t)subscriber << (qos * 8);
+}
+
+static unsigned int test_stream_mqtt_topic_trie_match(struct mqtt_trie *trie, const char *topic)
+{
+    unsigned int matched = 0;
+    mqtt_trie_match(trie, topic, strlen(topic), test_stream_mqtt_topic_trie_handler, &matched);
+    return matched;
+}
+
+#define TEST_TRIE_INSERT(trie, filter, sub, qos)    mqtt_trie_insert(trie, filter, strlen(filter), (void*)(uintptr_t)(sub), qos)
+#define TEST_TRIE_REMOVE(trie, filter, sub)         mqtt_trie_remove(trie, filter, strlen(filter), (void*)(uintptr_t)(sub))
+
+
+/**
+ *  Test stream mqtt topic trie
+ *
+ */
+void test_stream_mqtt_topic_trie(void)
+{
+    struct mqtt_trie trie;
+    mqtt_trie_init(&trie);
+
+    CU_ASSERT_TRUE(mqtt_topic_filter_is_valid("sport/+/player1", 15));
+    CU_ASSERT_TRUE(mqtt_topic_filter_is_valid("+", 1));
+    CU_ASSERT_TRUE(mqtt_topic_filter_is_valid("sport/#", 7));
+    CU_ASSERT_FALSE(mqtt_topic_filter_is_valid("sport/#/player1", 15));
+    CU_ASSERT_FALSE(mqtt_topic_filter_is_valid("sport+", 6));
+    CU_ASSERT_FALSE(mqtt_topic_filter_is_valid("sport/+a", 8));
+    CU_ASSERT_FALSE(mqtt_topic_name_is_valid("sport/+", 7));
+
+    // Subscribers are bit masks, QoS selects byte of the result
+    CU_ASSERT_TRUE(TEST_TRIE_INSERT(&trie, "sport/tennis/player1", 0x01, MQTT_QOS_0));
+    CU_ASSERT_TRUE(TEST_TRIE_INSERT(&trie, "sport/tennis/+", 0x02, MQTT_QOS_0));
+    CU_ASSERT_TRUE(TEST_TRIE_INSERT(&trie, "sport/#", 0x04, MQTT_QOS_0));
+    CU_ASSERT_TRUE(TEST_TRIE_INSERT(&trie, "+/+/+", 0x08, MQTT_QOS_0));
+    CU_ASSERT_TRUE(TEST_TRIE_INSERT(&trie, "#", 0x10, MQTT_QOS_0));
+    CU_ASSERT_TRUE(TEST_TRIE_INSERT(&trie, "$SYS/#", 0x20, MQTT_QOS_0));
+    CU_ASSERT_TRUE(TEST_TRIE_INSERT(&trie, "sport/tennis/", 0x40, MQTT_QOS_0));
+    CU_ASSERT_FALSE(TEST_TRIE_INSERT(&trie, "sport/#/x", 0x80, MQTT_QOS_0));
+    CU_ASSERT_EQUAL(mqtt_trie_get_count(&trie), 7);
+
+    CU_ASSERT_EQUAL(test_stream_mqtt_topic_trie_match(&trie, "sport/tennis/player1"), 0x1F);
+    CU_ASSERT_EQUAL(test_stream_mqtt_topic_trie_match(&trie, "sport/tennis/player2"), 0x1E);
+    CU_ASSERT_EQUAL(test_stream_mqtt_topic_trie_match(&trie, "sport/tennis/"), 0x5E);
+    CU_ASSERT_EQUAL(test_stream_mqtt_topic_trie_match(&trie, "sport"), 0x14);
+    CU_ASSERT_EQUAL(test_stream_mqtt_topic_trie_match(&trie, "sport/tennis"), 0x14);
+    CU_ASSERT_EQUAL(test_stream_mqtt_topic_trie_match(&trie, "news/a/b"), 0x18);
+    CU_ASSERT_EQUAL(test_stream_mqtt_topic_trie_match(&trie, "$SYS/broker"), 0x20);
+    CU_ASSERT_EQUAL(test_stream_mqtt_topic_trie_match(&trie, "$SYS/a/b"), 0x20);
+    CU_ASSERT_EQUAL(test_stream_mqtt_topic_trie_match(&trie, "sport/+"), 0x00);
+
+    // Update QoS
+    CU_ASSERT_TRUE(TEST_TRIE_INSERT(&trie, "sport/#", 0x04, MQTT_QOS_1));
+    CU_ASSERT_EQUAL(mqtt_trie_get_count(&trie), 7);
+    CU_ASSERT_EQUAL(test_stream_mqtt_topic_trie_match(&trie, "sport"), 0x0410);
+
+    // Publish view is used directly
+    struct mqtt_publish publish;
+    publish.topic = "sport/tennis/player1/ranking";
+    publish.topic_len = strlen("sport/tennis");
+    unsigned int matched = 0;
+    CU_ASSERT_EQUAL(mqtt_trie_match_publish(&trie, &publish, test_stream_mqtt_topic_trie_handler, &matched), 2);
+    CU_ASSERT_EQUAL(matched, 0x0410);
+
+    CU_ASSERT_FALSE(TEST_TRIE_REMOVE(&trie, "sport/tennis/+", 0x01));
+    CU_ASSERT_FALSE(TEST_TRIE_REMOVE(&trie, "sport/football/+", 0x02));
+    CU_ASSERT_TRUE(TEST_TRIE_REMOVE(&trie, "sport/tennis/+", 0x02));
+    CU_ASSERT_EQUAL(mqtt_trie_get_count(&trie), 6);
+    CU_ASSERT_EQUAL(test_stream_mqtt_topic_trie_match(&trie, "sport/tennis/player2"), 0x0418);
+
+    CU_ASSERT_TRUE(TEST_TRIE_INSERT(&trie, "a/b/c", 0x01, MQTT_QOS_0));
+    CU_ASSERT_TRUE(TEST_TRIE_INSERT(&trie, "a/+/c", 0x01, MQTT_QOS_0));
+    CU_ASSERT_EQUAL(mqtt_trie_remove_subscriber(&trie, (void*)0x01), 3);
+    CU_ASSERT_EQUAL(mqtt_trie_get_count(&trie), 5);
+    CU_ASSERT_EQUAL(test_stream_mqtt_topic_trie_match(&trie, "a/b/c"), 0x18);
+
+    // Many subscribers of the same filter
+    mqtt_trie_clean(&trie);
+    mqtt_trie_init(&trie);
+    for (uintptr_t i = 1; i <= 1000; i++)
+        TEST_TRIE_INSERT(&trie, "x/y", i, MQTT_QOS_0);
+    CU_ASSERT_EQUAL(mqtt_trie_get_count(&trie), 1000);
+    CU_ASSERT_EQUAL(mqtt_trie_match(&trie, "x/y", 3, test_stream_mqtt_topic_trie_handler, &matched), 1000);
+    CU_ASSERT_EQUAL(mqtt_trie_match(&trie, "x/z", 3, test_stream_mqtt_topic_trie_handler, &matched), 0);
+
+    mqtt_trie_clean(&trie);
+}
@@ -2,9 +2,12 @@
 #include "test.h"
 
 #include "mx/stream_ws.h"
+#include "mx/websocket.h"
+#include "mx/idler.h"
 #include "mx/socket.h"
 #include "mx/timer.h"
 #include "mx/rand.h"
+#include "mx/iobuf.h"
 
 #include <CUnit/Basic.h>
 
@@ -37,8 +40,20 @@ static void test_stream_ws_multiple_frames(void);
 
 static void test_stream_ws_fragments(void);
 static void test_stream_ws_ping_pong(void);
+static void test_stream_ws_idler_keep_alive(void);
 static void test_stream_ws_masking(void);
+static void test_stream_ws_apply_mask(void);
 static void test_stream_ws_extended_length_msg(void);
+static void test_stream_ws_parser(void);
+static void test_stream_ws_read_chunk(void);
+static void test_stream_ws_inbound_watermarks(void);
+static void test_stream_ws_paused_hangup(void);
+static void test_stream_ws_deflate_params(void);
+static void test_stream_ws_deflate(void);
+static void test_stream_ws_fragmented_writer(void);
+static void test_stream_ws_pending_fragments(void);
+static void test_stream_ws_direct_frames(void);
+static void test_stream_ws_oversized_frame(void);
 
 
 
@@ -61,8 +76,20 @@ CU_ErrorCode cu_test_stream_ws()
 
     CU_add_test(suite, "Test stream ws fragments",                  test_stream_ws_fragments);
     CU_add_test(suite, "Test stream ws ping/pong",                  test_stream_ws_ping_pong);
+    CU_add_test(suite, "Test stream ws keep alive with idler",      test_stream_ws_idler_keep_alive);
     CU_add_test(suite, "Test stream ws masking",                    test_stream_ws_masking);
+    CU_add_test(suite, "Test stream ws apply mask",                 test_stream_ws_apply_mask);
     CU_add_test(suite, "Test stream ws extended length message",    test_stream_ws_extended_length_msg);
+    CU_add_test(suite, "Test stream ws incremental parser",         test_stream_ws_parser);
+    CU_add_test(suite, "Test stream ws read chunks",                test_stream_ws_read_chunk);
+    CU_add_test(suite, "Test stream ws inbound watermarks",         test_stream_ws_inbound_watermarks);
+    CU_add_test(suite, "Test stream ws paused stream hang up",      test_stream_ws_paused_hangup);
+    CU_add_test(suite, "Test stream ws deflate parameters",         test_stream_ws_deflate_params);
+    CU_add_test(suite, "Test stream ws permessage-deflate",         test_stream_ws_deflate);
+    CU_add_test(suite, "Test stream ws fragmented writer",          test_stream_ws_fragmented_writer);
+    CU_add_test(suite, "Test stream ws pong between fragments",     test_stream_ws_pending_fragments);
+    CU_add_test(suite, "Test stream ws direct frames",              test_stream_ws_direct_frames);
+    CU_add_test(suite, "Test stream ws oversized frame",            test_stream_ws_oversized_frame);
 
     return CU_get_error();
 }
@@ -285,6 +312,22 @@ void test_stream_ws_read_write_frame(void)
     CU_ASSERT_EQUAL(opcode, WS_OPCODE_BINARY);
     CU_ASSERT_NSTRING_EQUAL(buffer, TEST_PAYLOAD_1, bytes);
 
+    // Borrow frame without copying
+    const void *data = NULL;
+    bytes = stream_ws_borrow_frame(server, &fin, &opcode, &data);
+    CU_ASSERT_TRUE(bytes < 0);
+    bytes = stream_ws_write_frame(client, WS_FIN_FLAG, WS_OPCODE_TEXT, NULL, TEST_PAYLOAD_1, strlen(TEST_PAYLOAD_1));
+    CU_ASSERT_TRUE(bytes > 0);
+    bytes = stream_ws_peek_frame(server);
+    CU_ASSERT_TRUE(bytes > 0);
+    bytes = stream_ws_borrow_frame(server, &fin, &opcode, &data);
+    CU_ASSERT_EQUAL(bytes, strlen(TEST_PAYLOAD_1));
+    CU_ASSERT_EQUAL(opcode, WS_OPCODE_TEXT);
+    CU_ASSERT_NSTRING_EQUAL(data, TEST_PAYLOAD_1, bytes);
+    stream_ws_release_frame(server);
+    bytes = stream_ws_borrow_frame(server, &fin, &opcode, &data);
+    CU_ASSERT_TRUE(bytes < 0);
+
     test_stream_ws_clean(client, server);
 }
 
@@ -428,6 +471,57 @@ void test_stream_ws_ping_pong(void)
 }
 
 
+/**
+ *  Test stream ws keep alive scheduled by idler
+ *
+ */
+void test_stream_ws_idler_keep_alive(void)
+{
+    struct stream_ws *client, *server;
+    test_stream_ws_init(&client, &server);
+
+    stream_ws_connect(client, "/", NULL, NULL);
+
+    stream_ws_peek_frame(server);
+    stream_ws_peek_frame(client);
+
+    struct idler *idler = idler_new();
+    idler_add_stream(idler, stream_ws_to_stream(client));
+    idler_add_stream(idler, stream_ws_to_stream(server));
+
+    int op;
+    unsigned int status;
+    struct stream *tmp;
+
+    op = idler_wait(idler, 0);
+    CU_ASSERT_EQUAL(op, IDLER_TIMEOUT);
+
+    // Client keep alive expires first, skip 95s
+    clock_update(95*1000, 0);
+    op = idler_wait(idler, 100);
+    CU_ASSERT_EQUAL(op, IDLER_OPERATION);
+    tmp = idler_get_next_stream(idler, NULL, &status);
+    CU_ASSERT_PTR_EQUAL(tmp, stream_ws_to_stream(client));
+    CU_ASSERT_EQUAL(status, STREAM_TIMER_EXPIRED);
+    tmp = idler_get_next_stream(idler, tmp, &status);
+    CU_ASSERT_PTR_NULL(tmp);
+
+    // Client sends PING
+    stream_time(stream_ws_to_stream(client));
+    op = idler_wait(idler, 100);
+    CU_ASSERT_EQUAL(op, IDLER_OPERATION);
+    tmp = idler_get_next_stream(idler, NULL, &status);
+    CU_ASSERT_PTR_EQUAL(tmp, stream_ws_to_stream(server));
+    CU_ASSERT_EQUAL(status, STREAM_INCOMING_READY);
+    tmp = idler_get_next_stream(idler, tmp, &status);
+    CU_ASSERT_PTR_NULL(tmp);
+
+    idler = idler_delete(idler);
+
+    test_stream_ws_clean(client, server);
+}
+
+
 /**
  *  Test stream ws masking
  *
@@ -457,6 +551,56 @@ void test_stream_ws_masking(void)
 }
 
 
+/**
+ *  Test stream ws apply mask
+ *
+ */
+void test_stream_ws_apply_mask(void)
+{
+    const unsigned char mask[WS_MASK_SIZE] = { 0x12, 0x34, 0x56, 0x78 };
+    unsigned char data[131];
+    unsigned char expected[sizeof(data)];
+
+    for (size_t i = 0; i < sizeof(data); i++)
+        data[i] = (unsigned char)i;
+
+    // Whole payload at once, unaligned start
+    for (size_t i = 0; i < sizeof(data); i++)
+        expected[i] = data[i] ^ mask[i%WS_MASK_SIZE];
+    size_t offset = ws_apply_mask_offset(data + 1, sizeof(data) - 1, mask, 1);
+    ws_apply_mask(data, 1, mask);
+    CU_ASSERT_EQUAL(offset, sizeof(data) % WS_MASK_SIZE);
+    CU_ASSERT_EQUAL(0, memcmp(data, expected, sizeof(data)));
+
+    // Chunks of different lengths restore original data
+    offset = 0;
+    for (size_t pos = 0, chunk = 1; pos < sizeof(data); pos += chunk, chunk += 7) {
+        if (pos + chunk > sizeof(data))
+            chunk = sizeof(data) - pos;
+        offset = ws_apply_mask_offset(data + pos, chunk, mask, offset);
+    }
+    for (size_t i = 0; i < sizeof(data); i++)
+        CU_ASSERT_EQUAL(data[i], (unsigned char)i);
+
+    // Fused copy and mask
+    unsigned char copy[sizeof(data)];
+    offset = ws_copy_mask(copy, data, sizeof(data), mask, 0);
+    CU_ASSERT_EQUAL(offset, sizeof(data) % WS_MASK_SIZE);
+    CU_ASSERT_EQUAL(0, memcmp(copy, expected, sizeof(data)));
+
+    // Scatter-gather frame matches contiguous one
+    unsigned char frame[WS_MAX_HEADER_SIZE + sizeof(data)];
+    unsigned char header[WS_MAX_HEADER_SIZE];
+    struct iovec iov[2];
+    size_t frame_len = ws_format_frame(frame, WS_FIN_FLAG | WS_OPCODE_BINARY, mask, data, sizeof(data));
+    int iovcnt = ws_format_frame_iovec(iov, header, copy, WS_FIN_FLAG | WS_OPCODE_BINARY, mask, data, sizeof(data));
+    CU_ASSERT_EQUAL(iovcnt, 2);
+    CU_ASSERT_EQUAL(frame_len, iov[0].iov_len + iov[1].iov_len);
+    CU_ASSERT_EQUAL(0, memcmp(frame, iov[0].iov_base, iov[0].iov_len));
+    CU_ASSERT_EQUAL(0, memcmp(frame + iov[0].iov_len, iov[1].iov_base, iov[1].iov_len));
+}
+
+
 /**
  *  Test stream ws extended length message
  *
@@ -498,3 +642,773 @@ void test_stream_ws_extended_length_msg(void)
 
     test_stream_ws_clean(client, server);
 }
+
+
+/**
+ *  Test stream ws incremental parser
+ *
+ */
+void test_stream_ws_parser(void)
+{
+    const unsigned char mask[WS_MASK_SIZE] = { 0x01, 0x02, 0x03, 0x04 };
+    unsigned char payload[TEST_EXT16LEN];
+    unsigned char frames[2*WS_MAX_HEADER_SIZE + sizeof(payload)];
+    unsigned char received[sizeof(payload)];
+    size_t received_len = 0;
+    int headers = 0;
+    int ends = 0;
+
+    rand_data(payload, sizeof(payload));
+    size_t frames_len = ws_format_frame(frames, WS_FIN_FLAG | WS_OPCODE_BINARY, mask, payload, sizeof(payload));
+    frames_len += ws_format_frame(frames + frames_len, WS_FIN_FLAG | WS_OPCODE_PING, NULL, NULL, 0);
+
+    struct ws_parser parser;
+    ws_parser_init(&parser);
+
+    // Feed byte by byte
+    for (size_t i = 0; i < frames_len; i++) {
+        unsigned char *data = frames + i;
+        size_t length = 1;
+        for (;;) {
+            struct ws_parser_event event;
+            size_t consumed = ws_parser_execute(&parser, data, length, &event);
+            data += consumed;
+            length -= consumed;
+            if (event.type == WS_PARSER_NONE)
+                break;
+
+            if (event.type == WS_PARSER_HEADER) {
+                headers++;
+            }
+            else if (event.type == WS_PARSER_PAYLOAD) {
+                CU_ASSERT_EQUAL(parser.frame.opcode, WS_OPCODE_BINARY);
+                memcpy(received + received_len, event.data, event.length);
+                received_len += event.length;
+            }
+            else if (event.type == WS_PARSER_FRAME_END) {
+                ends++;
+            }
+        }
+        CU_ASSERT_EQUAL(length, 0);
+    }
+
+    CU_ASSERT_EQUAL(headers, 2);
+    CU_ASSERT_EQUAL(ends, 2);
+    CU_ASSERT_EQUAL(parser.frame.opcode, WS_OPCODE_PING);
+    CU_ASSERT_EQUAL(received_len, sizeof(payload));
+    CU_ASSERT_EQUAL(0, memcmp(received, payload, sizeof(payload)));
+}
+
+
+/**
+ *  Test stream ws read chunks
+ *
+ */
+void test_stream_ws_read_chunk(void)
+{
+    struct stream_ws *client, *server;
+    test_stream_ws_init(&client, &server);
+
+    stream_ws_set_status(client, STREAM_ST_READY);
+    stream_ws_set_status(server, STREAM_ST_READY);
+
+    ssize_t bytes;
+    unsigned char fin = 0;
+    unsigned char opcode;
+    unsigned char request[TEST_EXT64LEN];
+    unsigned char response[TEST_EXT64LEN];
+    unsigned char chunk[1000];
+    size_t received = 0;
+    int chunks = 0;
+
+    rand_data(request, sizeof(request));
+    stream_ws_write_frame(client, 0, WS_OPCODE_BINARY, NULL, request, TEST_EXT16LEN);
+    stream_ws_write_frame(client, WS_FIN_FLAG, WS_OPCODE_CONTINUE, NULL, request + TEST_EXT16LEN, sizeof(request) - TEST_EXT16LEN);
+
+    do {
+        bytes = stream_ws_read_chunk(server, &fin, &opcode, chunk, sizeof(chunk));
+        if (bytes < 0) {
+            CU_ASSERT_EQUAL(errno, EAGAIN);
+            stream_flush(stream_ws_to_stream(client));
+            continue;
+        }
+        CU_ASSERT_EQUAL(opcode, chunks == 0 ? WS_OPCODE_BINARY : WS_OPCODE_CONTINUE);
+        memcpy(response + received, chunk, bytes);
+        received += bytes;
+        chunks++;
+    } while (!fin && received <= sizeof(response));
+
+    CU_ASSERT_TRUE(chunks > 1);
+    CU_ASSERT_EQUAL(received, sizeof(request));
+    CU_ASSERT_EQUAL(0, memcmp(request, response, sizeof(request)));
+
+    bytes = stream_ws_read_chunk(server, &fin, &opcode, chunk, sizeof(chunk));
+    CU_ASSERT_EQUAL(bytes, -1);
+
+    test_stream_ws_clean(client, server);
+}
+
+
+/**
+ *  Test stream ws inbound watermarks
+ *
+ */
+void test_stream_ws_inbound_watermarks(void)
+{
+    struct stream_ws *client, *server;
+    test_stream_ws_init(&client, &server);
+
+    stream_ws_set_status(client, STREAM_ST_READY);
+    stream_ws_set_status(server, STREAM_ST_READY);
+    stream_set_inbound_watermarks(stream_ws_to_stream(server), 0, 10);
+
+    ssize_t bytes;
+    unsigned char buffer[256];
+
+    stream_ws_write_frame(client, WS_FIN_FLAG, WS_OPCODE_BINARY, NULL, TEST_PAYLOAD_1, strlen(TEST_PAYLOAD_1));
+    stream_ws_write_frame(client, WS_FIN_FLAG, WS_OPCODE_BINARY, NULL, TEST_PAYLOAD_2, strlen(TEST_PAYLOAD_2));
+
+    bytes = stream_ws_peek_frame(server);
+    CU_ASSERT_EQUAL(bytes, strlen(TEST_PAYLOAD_1));
+    CU_ASSERT_TRUE(stream_is_read_paused(stream_ws_to_stream(server)));
+
+    bytes = stream_ws_read_frame(server, NULL, NULL, buffer, sizeof(buffer));
+    CU_ASSERT_EQUAL(bytes, strlen(TEST_PAYLOAD_1));
+    CU_ASSERT_TRUE(stream_is_read_paused(stream_ws_to_stream(server)));
+
+    // Cached message is still available while reading is paused
+    bytes = stream_ws_read_frame(server, NULL, NULL, buffer, sizeof(buffer));
+    CU_ASSERT_EQUAL(bytes, strlen(TEST_PAYLOAD_2));
+    CU_ASSERT_FALSE(stream_is_read_paused(stream_ws_to_stream(server)));
+
+    test_stream_ws_clean(client, server);
+}
+
+
+/**
+ *  Test stream ws paused stream hang up
+ *
+ */
+void test_stream_ws_paused_hangup(void)
+{
+    struct stream_ws *client, *server;
+    test_stream_ws_init(&client, &server);
+
+    stream_ws_set_status(client, STREAM_ST_READY);
+    stream_ws_set_status(server, STREAM_ST_READY);
+    stream_set_inbound_watermarks(stream_ws_to_stream(server), 0, 10);
+
+    struct idler *idler = idler_new();
+    idler_add_stream(idler, stream_ws_to_stream(server));
+
+    int op;
+    unsigned int status;
+    struct stream *tmp;
+    ssize_t bytes;
+    unsigned char buffer[256];
+
+    stream_ws_write_frame(client, WS_FIN_FLAG, WS_OPCODE_BINARY, NULL, TEST_PAYLOAD_1, strlen(TEST_PAYLOAD_1));
+    stream_ws_write_frame(client, WS_FIN_FLAG, WS_OPCODE_BINARY, NULL, TEST_PAYLOAD_2, strlen(TEST_PAYLOAD_2));
+
+    op = idler_wait(idler, 0);
+    CU_ASSERT_EQUAL(op, IDLER_OPERATION);
+    tmp = idler_get_next_stream(idler, NULL, &status);
+    CU_ASSERT_PTR_EQUAL(tmp, stream_ws_to_stream(server));
+    CU_ASSERT_EQUAL(status, STREAM_INCOMING_READY);
+
+    bytes = stream_ws_peek_frame(server);
+    CU_ASSERT_EQUAL(bytes, strlen(TEST_PAYLOAD_1));
+    CU_ASSERT_TRUE(stream_is_read_paused(stream_ws_to_stream(server)));
+
+    // Peer hangs up, paused stream must not be reported until it resumes
+    shutdown(stream_ws_get_fd(client), SHUT_RDWR);
+    op = idler_wait(idler, 0);
+    CU_ASSERT_EQUAL(op, IDLER_TIMEOUT);
+    op = idler_wait(idler, 10);
+    CU_ASSERT_EQUAL(op, IDLER_TIMEOUT);
+
+    bytes = stream_ws_read_frame(server, NULL, NULL, buffer, sizeof(buffer));
+    CU_ASSERT_EQUAL(bytes, strlen(TEST_PAYLOAD_1));
+    bytes = stream_ws_read_frame(server, NULL, NULL, buffer, sizeof(buffer));
+    CU_ASSERT_EQUAL(bytes, strlen(TEST_PAYLOAD_2));
+    CU_ASSERT_FALSE(stream_is_read_paused(stream_ws_to_stream(server)));
+
+    // Hang up is reported once reading resumed
+    op = idler_wait(idler, 0);
+    CU_ASSERT_EQUAL(op, IDLER_OPERATION);
+    tmp = idler_get_next_stream(idler, NULL, &status);
+    CU_ASSERT_PTR_EQUAL(tmp, stream_ws_to_stream(server));
+    CU_ASSERT_TRUE(status & STREAM_INCOMING_READY);
+
+    idler = idler_delete(idler);
+
+    test_stream_ws_clean(client, server);
+}
+
+
+/**
+ *  Test stream ws deflate parameters
+ *
+ */
+void test_stream_ws_deflate_params(void)
+{
+    struct ws_deflate_params params;
+    char buffer[256];
+
+    CU_ASSERT_TRUE(ws_deflate_parse_params(&params, "permessage-deflate"));
+    CU_ASSERT_FALSE(params.server_no_context_takeover);
+    CU_ASSERT_FALSE(params.client_no_context_takeover);
+    CU_ASSERT_EQUAL(params.server_max_window_bits, 0);
+    CU_ASSERT_EQUAL(params.client_max_window_bits, 0);
+
+    CU_ASSERT_TRUE(ws_deflate_parse_params(&params, "x-webkit-deflate-frame, permessage-deflate; "
+                                                    "client_max_window_bits; server_no_context_takeover"));
+    CU_ASSERT_TRUE(params.server_no_context_takeover);
+    CU_ASSERT_EQUAL(params.client_max_window_bits, 15);
+
+    // First offer has unknown parameter, second one is accepted
+    CU_ASSERT_TRUE(ws_deflate_parse_params(&params, "permessage-deflate; unknown, "
+                                                    "permessage-deflate; server_max_window_bits=\"10\""));
+    CU_ASSERT_EQUAL(params.server_max_window_bits, 10);
+
+    CU_ASSERT_FALSE(ws_deflate_parse_params(&params, "permessage-deflate; server_max_window_bits"));
+    CU_ASSERT_FALSE(ws_deflate_parse_params(&params, "permessage-deflate; server_max_window_bits=16"));
+    CU_ASSERT_FALSE(ws_deflate_parse_params(&params, "permessage-deflate; client_max_window_bits=x"));
+    CU_ASSERT_FALSE(ws_deflate_parse_params(&params, "deflate-frame"));
+
+    ws_deflate_params_init(&params);
+    params.client_no_context_takeover = true;
+    params.server_max_window_bits = 12;
+    ws_deflate_format_params(&params, buffer, sizeof(buffer));
+    CU_ASSERT_STRING_EQUAL(buffer, "permessage-deflate; client_no_context_takeover; server_max_window_bits=12");
+}
+
+
+/**
+ *  Test stream ws permessage-deflate
+ *
+ */
+void test_stream_ws_deflate(void)
+{
+#if STREAM_WS_DEFLATE
+    struct stream_ws *client, *server;
+    ssize_t bytes;
+    unsigned char fin;
+    unsigned char opcode;
+
+    static char request[TEST_EXT64LEN];
+    static char buffer[TEST_EXT64LEN];
+    for (size_t i = 0; i < sizeof(request); i++)
+        request[i] = 'a' + (i / 100) % 26;
+
+    // Compression negotiated
+    test_stream_ws_init(&client, &server);
+
+    struct ws_deflate_params params;
+    ws_deflate_params_init(&params);
+    params.client_no_context_takeover = true;
+    params.client_max_window_bits = 10;
+    stream_ws_set_deflate(client, &params);
+    ws_deflate_params_init(&params);
+    params.server_max_window_bits = 11;
+    stream_ws_set_deflate(server, &params);
+
+    stream_ws_connect(client, "/", NULL, NULL);
+    stream_ws_peek_frame(server);
+    stream_ws_peek_frame(client);
+    CU_ASSERT_EQUAL(stream_ws_get_status(server), STREAM_ST_READY);
+    CU_ASSERT_EQUAL(stream_ws_get_status(client), STREAM_ST_READY);
+
+    for (int i = 0; i < 2; i++) {
+        bytes = stream_ws_write_frame(client, WS_FIN_FLAG, WS_OPCODE_TEXT, (const unsigned char*)"mask", request, sizeof(request));
+        CU_ASSERT_TRUE(bytes > 0);
+        CU_ASSERT_TRUE(bytes < (ssize_t)sizeof(request) / 10);
+
+        bytes = stream_ws_peek_frame(server);
+        CU_ASSERT_EQUAL(bytes, sizeof(request));
+        bytes = stream_ws_read_frame(server, &fin, &opcode, buffer, sizeof(buffer));
+        CU_ASSERT_EQUAL(bytes, sizeof(request));
+        CU_ASSERT_EQUAL(opcode, WS_OPCODE_TEXT);
+        CU_ASSERT_TRUE(memcmp(buffer, request, sizeof(request)) == 0);
+    }
+
+    // Compressed message in fragments
+    bytes = stream_ws_write_frame(server, 0, WS_OPCODE_BINARY, NULL, TEST_PAYLOAD_1, strlen(TEST_PAYLOAD_1));
+    CU_ASSERT_TRUE(bytes > 0);
+    bytes = stream_ws_write_frame(server, WS_FIN_FLAG, WS_OPCODE_CONTINUE, NULL, TEST_PAYLOAD_2, strlen(TEST_PAYLOAD_2));
+    CU_ASSERT_TRUE(bytes > 0);
+
+    bytes = stream_ws_peek_frame(client);
+    CU_ASSERT_EQUAL(bytes, strlen(TEST_PAYLOAD_1 TEST_PAYLOAD_2));
+    bytes = stream_ws_read_frame(client, &fin, &opcode, buffer, sizeof(buffer));
+    CU_ASSERT_EQUAL(opcode, WS_OPCODE_BINARY);
+    CU_ASSERT_NSTRING_EQUAL(buffer, TEST_PAYLOAD_1 TEST_PAYLOAD_2, bytes);
+
+    // Control frames are not compressed
+    bytes = stream_ws_write(server, TEST_PAYLOAD_3, strlen(TEST_PAYLOAD_3));
+    CU_ASSERT_TRUE(bytes > 0);
+    stream_ws_write_frame(server, WS_FIN_FLAG, WS_OPCODE_PING, NULL, NULL, 0);
+    bytes = stream_ws_read(client, buffer, sizeof(buffer));
+    CU_ASSERT_NSTRING_EQUAL(buffer, TEST_PAYLOAD_3, bytes);
+    bytes = stream_ws_peek_frame(server);
+    CU_ASSERT_EQUAL(bytes, -1);
+    CU_ASSERT_EQUAL(stream_ws_get_status(server), STREAM_ST_READY);
+
+    test_stream_ws_clean(client, server);
+
+    // Compression declined by server
+    test_stream_ws_init(&client, &server);
+
+    ws_deflate_params_init(&params);
+    stream_ws_set_deflate(client, &params);
+
+    stream_ws_connect(client, "/", NULL, NULL);
+    stream_ws_peek_frame(server);
+    stream_ws_peek_frame(client);
+    CU_ASSERT_EQUAL(stream_ws_get_status(client), STREAM_ST_READY);
+
+    bytes = stream_ws_write_frame(client, WS_FIN_FLAG, WS_OPCODE_TEXT, (const unsigned char*)"mask", request, TEST_EXT16LEN);
+    CU_ASSERT_TRUE(bytes > TEST_EXT16LEN);
+    bytes = stream_ws_peek_frame(server);
+    CU_ASSERT_EQUAL(bytes, TEST_EXT16LEN);
+
+    test_stream_ws_clean(client, server);
+
+    // Server can not deflate with 8 bit window, offer is declined
+    test_stream_ws_init(&client, &server);
+
+    ws_deflate_params_init(&params);
+    params.server_max_window_bits = 8;
+    stream_ws_set_deflate(client, &params);
+    ws_deflate_params_init(&params);
+    stream_ws_set_deflate(server, &params);
+
+    stream_ws_connect(client, "/", NULL, NULL);
+    stream_ws_peek_frame(server);
+    stream_ws_peek_frame(client);
+    CU_ASSERT_EQUAL(stream_ws_get_status(client), STREAM_ST_READY);
+
+    bytes = stream_ws_write_frame(server, WS_FIN_FLAG, WS_OPCODE_TEXT, NULL, request, TEST_EXT16LEN);
+    CU_ASSERT_TRUE(bytes > TEST_EXT16LEN);
+    bytes = stream_ws_peek_frame(client);
+    CU_ASSERT_EQUAL(bytes, TEST_EXT16LEN);
+
+    test_stream_ws_clean(client, server);
+
+    // Client limited to 8 bit window deflates with 9 bits
+    test_stream_ws_init(&client, &server);
+
+    ws_deflate_params_init(&params);
+    params.client_max_window_bits = 8;
+    stream_ws_set_deflate(client, &params);
+    ws_deflate_params_init(&params);
+    stream_ws_set_deflate(server, &params);
+
+    stream_ws_connect(client, "/", NULL, NULL);
+    stream_ws_peek_frame(server);
+    stream_ws_peek_frame(client);
+    CU_ASSERT_EQUAL(stream_ws_get_status(client), STREAM_ST_READY);
+
+    bytes = stream_ws_write_frame(client, WS_FIN_FLAG, WS_OPCODE_TEXT, (const unsigned char*)"mask", request, sizeof(request));
+    CU_ASSERT_TRUE(bytes < (ssize_t)sizeof(request) / 10);
+    bytes = stream_ws_peek_frame(server);
+    CU_ASSERT_EQUAL(bytes, sizeof(request));
+    bytes = stream_ws_read_frame(server, &fin, &opcode, buffer, sizeof(buffer));
+    CU_ASSERT_EQUAL(bytes, sizeof(request));
+    CU_ASSERT_TRUE(memcmp(buffer, request, sizeof(request)) == 0);
+
+    test_stream_ws_clean(client, server);
+
+    // Decompressed message is limited while inflating
+    test_stream_ws_init(&client, &server);
+
+    ws_deflate_params_init(&params);
+    stream_ws_set_deflate(client, &params);
+    stream_ws_set_deflate(server, &params);
+    stream_ws_set_max_message_size(server, 1000);
+
+    stream_ws_connect(client, "/", NULL, NULL);
+    stream_ws_peek_frame(server);
+    stream_ws_peek_frame(client);
+    CU_ASSERT_EQUAL(stream_ws_get_status(server), STREAM_ST_READY);
+
+    bytes = stream_ws_write_frame(client, WS_FIN_FLAG, WS_OPCODE_TEXT, (const unsigned char*)"mask", request, sizeof(request));
+    CU_ASSERT_TRUE(bytes < 1000);
+    bytes = stream_ws_peek_frame(server);
+    CU_ASSERT_EQUAL(bytes, -1);
+    CU_ASSERT_EQUAL(stream_ws_get_status(server), STREAM_ST_CLOSING);
+    bytes = read(stream_ws_get_fd(client), buffer, sizeof(buffer));
+    CU_ASSERT_EQUAL(bytes, 4);
+    CU_ASSERT_EQUAL((unsigned char)buffer[2] << 8 | (unsigned char)buffer[3], WS_CLOSE_MESSAGE_TOO_BIG);
+
+    test_stream_ws_clean(client, server);
+
+    // Corrupt compressed message split into fragments is dropped
+    test_stream_ws_init(&client, &server);
+
+    ws_deflate_params_init(&params);
+    stream_ws_set_deflate(client, &params);
+    stream_ws_set_deflate(server, &params);
+
+    stream_ws_connect(client, "/", NULL, NULL);
+    stream_ws_peek_frame(server);
+    stream_ws_peek_frame(client);
+    CU_ASSERT_EQUAL(stream_ws_get_status(client), STREAM_ST_READY);
+
+    const unsigned char corrupt[] = {
+        WS_RSV1_FLAG | WS_OPCODE_TEXT, 10, 0x00, 0x05, 0x00, 0xFA, 0xFF, 'h', 'e', 'l', 'l', 'o',     // Stored block
+        WS_OPCODE_CONTINUE, 1, 0x07,                                                               // Invalid block type
+        WS_FIN_FLAG | WS_OPCODE_CONTINUE, 5, 'w', 'o', 'r', 'l', 'd',
+    };
+    CU_ASSERT_EQUAL(write(stream_ws_get_fd(server), corrupt, sizeof(corrupt)), sizeof(corrupt));
+    bytes = stream_ws_peek_frame(client);
+    CU_ASSERT_EQUAL(bytes, -1);
+    CU_ASSERT_EQUAL(stream_ws_get_status(client), STREAM_ST_CLOSING);
+    bytes = stream_ws_read_frame(client, &fin, &opcode, buffer, sizeof(buffer));
+    CU_ASSERT_EQUAL(bytes, -1);
+    bytes = read(stream_ws_get_fd(server), buffer, sizeof(buffer));
+    CU_ASSERT_EQUAL(bytes, 8);      // Masked close frame
+    CU_ASSERT_EQUAL((unsigned char)buffer[0], WS_FIN_FLAG | WS_OPCODE_CLOSE);
+
+    test_stream_ws_clean(client, server);
+#endif
+}
+
+
+/**
+ *  Test stream ws fragmented writer
+ *
+ */
+void test_stream_ws_fragmented_writer(void)
+{
+    struct stream_ws *client, *server;
+    test_stream_ws_init(&client, &server);
+
+    stream_ws_set_status(client, STREAM_ST_READY);
+    stream_ws_set_status(server, STREAM_ST_READY);
+
+    ssize_t bytes;
+    unsigned char request[TEST_EXT16LEN*8];
+    unsigned char buffer[sizeof(request) + 8*WS_MAX_HEADER_SIZE];
+    unsigned char fin;
+    unsigned char opcode;
+
+    rand_data(request, sizeof(request));
+
+    // Automatic fragmentation, check frames on the wire
+    stream_ws_set_fragment_size(client, TEST_EXT16LEN);
+    bytes = stream_ws_write_frame(client, WS_FIN_FLAG, WS_OPCODE_BINARY, (const unsigned char*)"mask", request, sizeof(request));
+    CU_ASSERT_TRUE(bytes > (ssize_t)sizeof(request));
+
+    bytes = read(stream_ws_get_fd(server), buffer, sizeof(buffer));
+    CU_ASSERT_TRUE(bytes > (ssize_t)sizeof(request));
+
+    struct ws_parser parser;
+    ws_parser_init(&parser);
+    unsigned char *data = buffer;
+    size_t length = bytes;
+    size_t received = 0;
+    int frames = 0;
+    for (;;) {
+        struct ws_parser_event event;
+        size_t consumed = ws_parser_execute(&parser, data, length, &event);
+        data += consumed;
+        length -= consumed;
+        if (event.type == WS_PARSER_NONE)
+            break;
+
+        if (event.type == WS_PARSER_HEADER) {
+            CU_ASSERT_EQUAL(parser.frame.opcode, frames ? WS_OPCODE_CONTINUE : WS_OPCODE_BINARY);
+            CU_ASSERT_EQUAL(parser.frame.fin_flag, (frames == 7) ? 1 : 0);
+            CU_ASSERT_EQUAL(parser.frame.payload_length, TEST_EXT16LEN);
+            frames++;
+        }
+        else if (event.type == WS_PARSER_PAYLOAD) {
+            CU_ASSERT_EQUAL(0, memcmp(event.data, request + received, event.length));
+            received += event.length;
+        }
+    }
+    CU_ASSERT_EQUAL(frames, 8);
+    CU_ASSERT_EQUAL(received, sizeof(request));
+
+    // Fragmented chain
+    struct iobuf chain;
+    iobuf_init(&chain);
+    iobuf_append(&chain, TEST_PAYLOAD_1, strlen(TEST_PAYLOAD_1));
+    iobuf_append(&chain, request, sizeof(request));
+    stream_ws_set_fragment_size(client, 100);
+    bytes = stream_ws_write_frame_iobuf(client, WS_FIN_FLAG, WS_OPCODE_BINARY, (const unsigned char*)"mask", &chain);
+    CU_ASSERT_TRUE(bytes > 0);
+    CU_ASSERT_TRUE(iobuf_is_empty(&chain));
+
+    bytes = stream_ws_peek_frame(server);
+    CU_ASSERT_EQUAL(bytes, strlen(TEST_PAYLOAD_1) + sizeof(request));
+    bytes = stream_ws_read_frame(server, &fin, &opcode, buffer, sizeof(buffer));
+    CU_ASSERT_EQUAL(opcode, WS_OPCODE_BINARY);
+    CU_ASSERT_NSTRING_EQUAL(buffer, TEST_PAYLOAD_1, strlen(TEST_PAYLOAD_1));
+    CU_ASSERT_EQUAL(0, memcmp(buffer + strlen(TEST_PAYLOAD_1), request, sizeof(request)));
+    iobuf_clean(&chain);
+
+    // Streaming writer with control frame in between
+    bytes = stream_ws_write_fragment(client, "first", strlen("first"));
+    CU_ASSERT_EQUAL(bytes, -1);     // Message not started
+    CU_ASSERT_EQUAL(stream_ws_begin_message(client, WS_OPCODE_TEXT), 0);
+    CU_ASSERT_EQUAL(stream_ws_begin_message(client, WS_OPCODE_TEXT), -1);
+
+    bytes = stream_ws_write_fragment(client, "first", strlen("first"));
+    CU_ASSERT_EQUAL(bytes, strlen("first"));
+    stream_ws_write_frame(client, WS_FIN_FLAG, WS_OPCODE_PING, NULL, NULL, 0);
+    bytes = stream_ws_write(client, TEST_PAYLOAD_1, strlen(TEST_PAYLOAD_1));
+    CU_ASSERT_EQUAL(bytes, -1);     // Other message is being sent
+    bytes = stream_ws_write_fragment(client, "_", strlen("_"));
+    CU_ASSERT_EQUAL(bytes, strlen("_"));
+
+    bytes = stream_ws_peek_frame(server);
+    CU_ASSERT_TRUE(bytes < 0);      // Message not complete
+    bytes = stream_ws_peek_frame(client);
+    CU_ASSERT_TRUE(bytes < 0);      // Pong received
+
+    bytes = stream_ws_end_message(client, "second", strlen("second"));
+    CU_ASSERT_EQUAL(bytes, strlen("second"));
+    bytes = stream_ws_peek_frame(server);
+    CU_ASSERT_EQUAL(bytes, strlen("first_second"));
+    bytes = stream_ws_read_frame(server, &fin, &opcode, buffer, sizeof(buffer));
+    CU_ASSERT_EQUAL(opcode, WS_OPCODE_TEXT);
+    CU_ASSERT_NSTRING_EQUAL(buffer, "first_second", bytes);
+
+    bytes = stream_ws_write(client, TEST_PAYLOAD_1, strlen(TEST_PAYLOAD_1));
+    CU_ASSERT_TRUE(bytes > 0);
+
+    test_stream_ws_clean(client, server);
+}
+
+
+/**
+ *  Test stream ws pong between fragments
+ *
+ */
+void test_stream_ws_pending_fragments(void)
+{
+    struct stream_ws *client, *server;
+    test_stream_ws_init(&client, &server);
+
+    stream_ws_set_status(client, STREAM_ST_READY);
+    stream_ws_set_status(server, STREAM_ST_READY);
+
+    static unsigned char request[4*1024*1024];
+    static unsigned char buffer[65536];
+    ssize_t bytes;
+
+    rand_data(request, sizeof(request));
+
+    // Socket takes only a part of the message, the rest is held back
+    stream_ws_set_fragment_size(client, 16384);
+    bytes = stream_ws_write_frame(client, WS_FIN_FLAG, WS_OPCODE_BINARY, (const unsigned char*)"mask", request, sizeof(request));
+    CU_ASSERT_TRUE(bytes > (ssize_t)sizeof(request));
+    CU_ASSERT_TRUE(stream_has_outgoing_data(stream_ws_to_stream(client)));
+    CU_ASSERT_TRUE(stream_get_outgoing_length(stream_ws_to_stream(client)) > sizeof(request) / 2);
+
+    // Ping received meanwhile is answered before the rest of the message
+    stream_ws_write_frame(server, WS_FIN_FLAG, WS_OPCODE_PING, NULL, NULL, 0);
+    bytes = stream_ws_peek_frame(client);
+    CU_ASSERT_EQUAL(bytes, -1);
+
+    struct ws_parser parser;
+    ws_parser_init(&parser);
+    size_t received = 0;
+    int frames = 0;
+    int pong_frame = -1;
+    int fin_frame = -1;
+
+    for (int loops = 0; (loops < 10000) && (received < sizeof(request)); loops++) {
+        bytes = read(stream_ws_get_fd(server), buffer, sizeof(buffer));
+        if (bytes > 0) {
+            unsigned char *data = buffer;
+            size_t length = bytes;
+            for (;;) {
+                struct ws_parser_event event;
+                size_t consumed = ws_parser_execute(&parser, data, length, &event);
+                data += consumed;
+                length -= consumed;
+                if (event.type == WS_PARSER_NONE)
+                    break;
+
+                if (event.type == WS_PARSER_HEADER) {
+                    if (parser.frame.opcode == WS_OPCODE_PONG)
+                        pong_frame = frames;
+                    else if (parser.frame.fin_flag)
+                        fin_frame = frames;
+                    frames++;
+                }
+                else if ((event.type == WS_PARSER_PAYLOAD) && (parser.frame.opcode != WS_OPCODE_PONG)) {
+                    CU_ASSERT_EQUAL(0, memcmp(event.data, request + received, event.length));
+                    received += event.length;
+                }
+            }
+        }
+        stream_handle_outgoing_data(stream_ws_to_stream(client));
+    }
+
+    CU_ASSERT_TRUE(pong_frame > 0);
+    CU_ASSERT_TRUE(pong_frame < fin_frame);
+    CU_ASSERT_EQUAL(frames, sizeof(request) / 16384 + 1);
+    CU_ASSERT_EQUAL(received, sizeof(request));
+    CU_ASSERT_FALSE(stream_has_outgoing_data(stream_ws_to_stream(client)));
+
+    test_stream_ws_clean(client, server);
+}
+
+
+/**
+ *  Test stream ws direct frames
+ *
+ */
+void test_stream_ws_direct_frames(void)
+{
+    struct stream_ws *client, *server;
+    test_stream_ws_init(&client, &server);
+
+    stream_ws_set_status(client, STREAM_ST_READY);
+    stream_ws_set_status(server, STREAM_ST_READY);
+
+    const unsigned char mask[WS_MASK_SIZE] = { 0x01, 0x02, 0x03, 0x04 };
+    unsigned char frames[6*WS_MAX_HEADER_SIZE + 256];
+    unsigned char buffer[256];
+    const void *data;
+    unsigned char fin;
+    unsigned char opcode;
+    ssize_t bytes;
+
+    // Several complete frames received at once, ping in between
+    size_t frames_len = 0;
+    frames_len += ws_format_frame(frames + frames_len, WS_FIN_FLAG | WS_OPCODE_TEXT, mask,
+                                  (const unsigned char*)TEST_PAYLOAD_1, strlen(TEST_PAYLOAD_1));
+    frames_len += ws_format_frame(frames + frames_len, WS_FIN_FLAG | WS_OPCODE_PING, mask, NULL, 0);
+    frames_len += ws_format_frame(frames + frames_len, WS_FIN_FLAG | WS_OPCODE_BINARY, mask,
+                                  (const unsigned char*)TEST_PAYLOAD_2, strlen(TEST_PAYLOAD_2));
+    frames_len += ws_format_frame(frames + frames_len, WS_FIN_FLAG | WS_OPCODE_BINARY, mask,
+                                  (const unsigned char*)TEST_PAYLOAD_3, strlen(TEST_PAYLOAD_3));
+    frames_len += ws_format_frame(frames + frames_len, WS_FIN_FLAG | WS_OPCODE_TEXT, NULL, NULL, 0);
+    // Last frame is split
+    size_t split = frames_len + 3;
+    frames_len += ws_format_frame(frames + frames_len, WS_FIN_FLAG | WS_OPCODE_TEXT, mask,
+                                  (const unsigned char*)TEST_PAYLOAD_1, strlen(TEST_PAYLOAD_1));
+    CU_ASSERT_EQUAL(write(stream_ws_get_fd(client), frames, split), split);
+
+    bytes = stream_ws_peek_frame(server);
+    CU_ASSERT_EQUAL(bytes, strlen(TEST_PAYLOAD_1));
+    bytes = stream_ws_read_chunk(server, &fin, &opcode, buffer, 5);
+    CU_ASSERT_EQUAL(bytes, 5);
+    CU_ASSERT_EQUAL(fin, 0);
+    CU_ASSERT_EQUAL(opcode, WS_OPCODE_TEXT);
+    CU_ASSERT_NSTRING_EQUAL(buffer, TEST_PAYLOAD_1, 5);
+    bytes = stream_ws_read_chunk(server, &fin, &opcode, buffer, sizeof(buffer));
+    CU_ASSERT_EQUAL(bytes, strlen(TEST_PAYLOAD_1) - 5);
+    CU_ASSERT_NOT_EQUAL(fin, 0);
+    CU_ASSERT_EQUAL(opcode, WS_OPCODE_CONTINUE);
+    CU_ASSERT_NSTRING_EQUAL(buffer, TEST_PAYLOAD_1 + 5, bytes);
+
+    // Pong was sent once ping was parsed
+    bytes = stream_ws_peek_frame(client);
+    CU_ASSERT_EQUAL(bytes, -1);
+    CU_ASSERT_EQUAL(stream_ws_get_status(client), STREAM_ST_READY);
+
+    bytes = stream_ws_borrow_frame(server, &fin, &opcode, &data);
+    CU_ASSERT_EQUAL(bytes, strlen(TEST_PAYLOAD_2));
+    CU_ASSERT_EQUAL(opcode, WS_OPCODE_BINARY);
+    CU_ASSERT_NSTRING_EQUAL(data, TEST_PAYLOAD_2, bytes);
+    stream_ws_release_frame(server);
+
+    bytes = stream_ws_read_frame(server, &fin, &opcode, buffer, 1);
+    CU_ASSERT_EQUAL(bytes, -1);     // Bigger buffer needed
+    bytes = stream_ws_read_frame(server, &fin, &opcode, buffer, sizeof(buffer));
+    CU_ASSERT_EQUAL(bytes, strlen(TEST_PAYLOAD_3));
+    CU_ASSERT_NSTRING_EQUAL(buffer, TEST_PAYLOAD_3, bytes);
+
+    bytes = stream_ws_peek_frame(server);
+    CU_ASSERT_EQUAL(bytes, 0);      // Empty message
+    bytes = stream_ws_read_frame(server, &fin, &opcode, buffer, sizeof(buffer));
+    CU_ASSERT_EQUAL(bytes, 0);
+    CU_ASSERT_EQUAL(opcode, WS_OPCODE_TEXT);
+
+    bytes = stream_ws_peek_frame(server);
+    CU_ASSERT_EQUAL(bytes, -1);     // Frame not complete
+    CU_ASSERT_EQUAL(write(stream_ws_get_fd(client), frames + split, frames_len - split), frames_len - split);
+    bytes = stream_ws_read(server, buffer, sizeof(buffer));
+    CU_ASSERT_EQUAL(bytes, strlen(TEST_PAYLOAD_1));
+    CU_ASSERT_NSTRING_EQUAL(buffer, TEST_PAYLOAD_1, bytes);
+
+    bytes = stream_ws_peek_frame(server);
+    CU_ASSERT_EQUAL(bytes, -1);
+
+    test_stream_ws_clean(client, server);
+}
+
+
+/**
+ *  Test stream ws oversized frame
+ *
+ */
+void test_stream_ws_oversized_frame(void)
+{
+    const unsigned char mask[WS_MASK_SIZE] = { 0x01, 0x02, 0x03, 0x04 };
+    unsigned char frames[2*WS_MAX_HEADER_SIZE + 1200];
+    unsigned char buffer[64];
+    struct ws_parser_event event;
+    struct ws_parser parser;
+    ssize_t bytes;
+
+    // Most significant bit of 64 bit length is refused
+    unsigned char header[WS_MAX_HEADER_SIZE] = { WS_FIN_FLAG | WS_OPCODE_BINARY, WS_EXTLEN64_MARK, 0x80 };
+    ws_parser_init(&parser);
+    ws_parser_execute(&parser, header, WS_MIN_HEADER_SIZE + WS_EXTLEN64_SIZE, &event);
+    CU_ASSERT_EQUAL(event.type, WS_PARSER_ERROR);
+    CU_ASSERT_EQUAL(event.code, WS_CLOSE_PROTOCOL_ERROR);
+    ws_parser_execute(&parser, header, sizeof(header), &event);
+    CU_ASSERT_EQUAL(event.type, WS_PARSER_NONE);
+
+    // Declared length above limit is refused at header
+    ws_parser_init(&parser);
+    parser.max_payload = 100;
+    size_t frames_len = ws_format_frame_header(frames, WS_FIN_FLAG | WS_OPCODE_BINARY, NULL, TEST_EXT16LEN);
+    ws_parser_execute(&parser, frames, frames_len, &event);
+    CU_ASSERT_EQUAL(event.type, WS_PARSER_ERROR);
+    CU_ASSERT_EQUAL(event.code, WS_CLOSE_MESSAGE_TOO_BIG);
+
+    // Stream closes with 1009 before payload of huge frame arrives
+    struct stream_ws *client, *server;
+    test_stream_ws_init(&client, &server);
+    stream_ws_set_status(client, STREAM_ST_READY);
+    stream_ws_set_status(server, STREAM_ST_READY);
+    stream_ws_set_max_message_size(server, 1000);
+
+    frames_len = ws_format_frame_header(frames, WS_FIN_FLAG | WS_OPCODE_BINARY, mask, (size_t)1 << 40);
+    CU_ASSERT_EQUAL(write(stream_ws_get_fd(client), frames, frames_len), frames_len);
+    bytes = stream_ws_peek_frame(server);
+    CU_ASSERT_EQUAL(bytes, -1);
+    CU_ASSERT_EQUAL(stream_ws_get_status(server), STREAM_ST_CLOSING);
+    bytes = read(stream_ws_get_fd(client), buffer, sizeof(buffer));
+    CU_ASSERT_EQUAL(bytes, 4);
+    CU_ASSERT_EQUAL(buffer[0], WS_FIN_FLAG | WS_OPCODE_CLOSE);
+    CU_ASSERT_EQUAL(buffer[2] << 8 | buffer[3], WS_CLOSE_MESSAGE_TOO_BIG);
+    test_stream_ws_clean(client, server);
+
+    // Fragments are limited together
+    test_stream_ws_init(&client, &server);
+    stream_ws_set_status(client, STREAM_ST_READY);
+    stream_ws_set_status(server, STREAM_ST_READY);
+    stream_ws_set_max_message_size(server, 1000);
+
+    unsigned char payload[600];
+    rand_data(payload, sizeof(payload));
+    frames_len = ws_format_frame(frames, WS_OPCODE_BINARY, mask, payload, sizeof(payload));
+    frames_len += ws_format_frame(frames + frames_len, WS_FIN_FLAG | WS_OPCODE_CONTINUE, mask, payload, sizeof(payload));
+    CU_ASSERT_EQUAL(write(stream_ws_get_fd(client), frames, frames_len), frames_len);
+    bytes = stream_ws_peek_frame(server);
+    CU_ASSERT_EQUAL(bytes, -1);
+    CU_ASSERT_EQUAL(stream_ws_get_status(server), STREAM_ST_CLOSING);
+    bytes = read(stream_ws_get_fd(client), buffer, sizeof(buffer));
+    CU_ASSERT_EQUAL(bytes, 4);
+    CU_ASSERT_EQUAL(buffer[2] << 8 | buffer[3], WS_CLOSE_MESSAGE_TOO_BIG);
+    test_stream_ws_clean(client, server);
+}